@@ -0,0 +1,430 @@
+//
+//  BootstrapServer.cpp
+//  PeerJet
+//
+//  Created by Compy on 12/18/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include "BootstrapServer.hpp"
+#include "NatTraversal.hpp"
+
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
+#include <sys/select.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/uio.h>
+#define BOOTSTRAP_MMSG
+#endif
+
+/* Longest a worker sleeps on its socket, how long stopping it may take (ms). */
+#define BOOTSTRAP_WAIT          100
+
+/* Datagrams a worker reads before it publishes its counters and looks at the clock. */
+#define BOOTSTRAP_READ_BUDGET   1024
+
+/* Datagrams read and answered with one system call each way where there is recvmmsg. */
+#define BOOTSTRAP_BATCH         64
+
+/* Responses sent to one address in the current second. */
+struct BootstrapRate {
+    uint32_t address;       /* folded to 32 bits */
+    uint32_t count;
+    uint64_t second;
+};
+
+#ifdef BOOTSTRAP_MMSG
+/* Datagrams of one recvmmsg and the responses to them, sent back to the
+ * addresses they came from.
+ */
+struct BootstrapBatch {
+    struct mmsghdr requests[BOOTSTRAP_BATCH];
+    struct iovec requestData[BOOTSTRAP_BATCH];
+    struct sockaddr_storage sources[BOOTSTRAP_BATCH];
+    uint8_t data[BOOTSTRAP_BATCH][MAX_UDP_PACKET_SIZE];
+
+    struct mmsghdr responses[BOOTSTRAP_BATCH];
+    struct iovec responseData[BOOTSTRAP_BATCH];
+    uint8_t reflections[BOOTSTRAP_BATCH][NAT_REFLECT_PACKET_SIZE];
+};
+#endif
+
+struct BootstrapWorker {
+    BootstrapWorker(const BootstrapServerConfig* config);
+    ~BootstrapWorker();
+
+    void run();
+    void refresh(uint64_t now);
+    bool allow(const IP* ip, uint64_t now);
+    const uint8_t* respond(IP_Port source, const uint8_t* data, uint32_t length, uint64_t now, uint8_t* buffer,
+                           uint16_t* responseLength);
+    bool readOne(uint64_t now);
+    uint32_t readBatch(uint64_t now);
+    void publish();
+
+    NetworkingCore *net;
+    std::thread thread;
+    std::atomic<bool> stopping;
+    struct BootstrapBatch *batch;
+
+    uint32_t version;
+    std::string motd;
+    std::string motdPath;
+    uint32_t refreshInterval;
+    uint64_t nextRefresh;
+    uint8_t info[BOOTSTRAP_INFO_MAX_SIZE];
+    uint16_t infoLength;
+
+    uint32_t rate;
+    struct BootstrapRate rates[BOOTSTRAP_RATE_SLOTS];
+
+    /* Counted in place, published after every read budget. */
+    BootstrapServerStats counts;
+    std::atomic<uint64_t> received;
+    std::atomic<uint64_t> infoAnswered;
+    std::atomic<uint64_t> reflected;
+    std::atomic<uint64_t> limited;
+    std::atomic<uint64_t> unsupported;
+};
+
+BootstrapWorker::BootstrapWorker(const BootstrapServerConfig* config)
+{
+    this->net = NULL;
+    this->stopping = false;
+    this->batch = NULL;
+    this->version = config->version;
+    this->motd = config->motd ? config->motd : "";
+    this->motdPath = config->motdPath ? config->motdPath : "";
+    this->refreshInterval = config->refreshInterval ? config->refreshInterval : BOOTSTRAP_INFO_REFRESH;
+    this->nextRefresh = 0;
+    this->infoLength = 0;
+    this->rate = config->rate ? config->rate : BOOTSTRAP_RATE;
+    memset(this->rates, 0, sizeof(this->rates));
+    memset(&this->counts, 0, sizeof(this->counts));
+    this->received = 0;
+    this->infoAnswered = 0;
+    this->reflected = 0;
+    this->limited = 0;
+    this->unsupported = 0;
+}
+
+BootstrapWorker::~BootstrapWorker()
+{
+#ifdef BOOTSTRAP_MMSG
+    delete this->batch;
+#endif
+    NetworkService::killNetworking(this->net);
+}
+
+/* Build the info response, from the file of the message of the day if there is
+ * one. A file that can't be read leaves the last message.
+ */
+void BootstrapWorker::refresh(uint64_t now)
+{
+    this->nextRefresh = now + this->refreshInterval;
+
+    if (!this->motdPath.empty()) {
+        FILE *file = fopen(this->motdPath.c_str(), "rb");
+
+        if (file) {
+            char buffer[BOOTSTRAP_MAX_MOTD_LENGTH];
+            size_t length = fread(buffer, 1, sizeof(buffer), file);
+            fclose(file);
+            this->motd.assign(buffer, length);
+        }
+    }
+
+    size_t length = std::min(this->motd.size(), (size_t)BOOTSTRAP_MAX_MOTD_LENGTH);
+    this->info[0] = BOOTSTRAP_INFO_PACKET_ID;
+    this->info[1] = (uint8_t)(this->version >> 24);
+    this->info[2] = (uint8_t)(this->version >> 16);
+    this->info[3] = (uint8_t)(this->version >> 8);
+    this->info[4] = (uint8_t)this->version;
+    memcpy(this->info + 1 + sizeof(uint32_t), this->motd.data(), length);
+    this->infoLength = (uint16_t)(1 + sizeof(uint32_t) + length);
+}
+
+/* return false if ip had its responses for this second. */
+bool BootstrapWorker::allow(const IP* ip, uint64_t now)
+{
+    uint32_t address = ip->family == AF_INET ? ip->ip4.uint32
+                       : ip->ip6.uint32[0] ^ ip->ip6.uint32[1] ^ ip->ip6.uint32[2] ^ ip->ip6.uint32[3];
+    struct BootstrapRate *slot = &this->rates[(address * 2654435761u) % BOOTSTRAP_RATE_SLOTS];
+    uint64_t second = now / 1000;
+
+    if (slot->address != address || slot->second != second) {
+        slot->address = address;
+        slot->count = 0;
+        slot->second = second;
+    }
+
+    if (slot->count >= this->rate)
+        return false;
+
+    ++slot->count;
+    return true;
+}
+
+/* return the response to a datagram, in buffer or the info response, NULL for none. */
+const uint8_t* BootstrapWorker::respond(IP_Port source, const uint8_t* data, uint32_t length, uint64_t now,
+                                       uint8_t* buffer, uint16_t* responseLength)
+{
+    ++this->counts.received;
+
+    if (data[0] == BOOTSTRAP_INFO_PACKET_ID && length == BOOTSTRAP_INFO_REQUEST_SIZE) {
+        if (!allow(&source.ip, now)) {
+            ++this->counts.limited;
+            return NULL;
+        }
+
+        ++this->counts.info;
+        *responseLength = this->infoLength;
+        return this->info;
+    }
+
+    if (data[0] == NET_PACKET_REFLECT_REQUEST && NatTraversal::reflect(data, (uint16_t)length, source, buffer)) {
+        if (!allow(&source.ip, now)) {
+            ++this->counts.limited;
+            return NULL;
+        }
+
+        ++this->counts.reflected;
+        *responseLength = NAT_REFLECT_PACKET_SIZE;
+        return buffer;
+    }
+
+    ++this->counts.unsupported;
+    return NULL;
+}
+
+/* return false if there was nothing to read. */
+bool BootstrapWorker::readOne(uint64_t now)
+{
+    IP_Port source;
+    uint8_t data[MAX_UDP_PACKET_SIZE];
+    uint8_t buffer[NAT_REFLECT_PACKET_SIZE];
+    uint32_t length;
+    uint16_t responseLength;
+
+    if (NetworkService::receivePacket(this->net, &source, data, &length) == -1)
+        return false;
+
+    const uint8_t *response = length ? respond(source, data, length, now, buffer, &responseLength) : NULL;
+
+    if (response)
+        NetworkService::sendPacket(this->net, source, response, responseLength);
+
+    return true;
+}
+
+/* return the datagrams read, 0 if there was nothing to read. */
+uint32_t BootstrapWorker::readBatch(uint64_t now)
+{
+#ifdef BOOTSTRAP_MMSG
+    struct BootstrapBatch *b = this->batch;
+
+    for (uint32_t i = 0; i < BOOTSTRAP_BATCH; ++i)
+        b->requests[i].msg_hdr.msg_namelen = sizeof(b->sources[i]);
+
+    int count = recvmmsg(this->net->sock, b->requests, BOOTSTRAP_BATCH, MSG_DONTWAIT, NULL);
+
+    if (count <= 0)
+        return 0;
+
+    uint32_t responses = 0;
+
+    for (int i = 0; i < count; ++i) {
+        IP_Port source;
+        uint16_t responseLength;
+
+        if (b->requests[i].msg_len == 0 || !NetworkService::sockaddrToIpport(&b->sources[i], &source))
+            continue;
+
+        const uint8_t *response = respond(source, b->data[i], b->requests[i].msg_len, now, b->reflections[responses],
+                                          &responseLength);
+
+        if (!response)
+            continue;
+
+        b->responseData[responses].iov_base = (void *)response;
+        b->responseData[responses].iov_len = responseLength;
+        b->responses[responses].msg_hdr.msg_name = &b->sources[i];
+        b->responses[responses].msg_hdr.msg_namelen = b->requests[i].msg_hdr.msg_namelen;
+        ++responses;
+    }
+
+    /* What doesn't fit in the send buffer is dropped, as a sendto would. */
+    for (uint32_t sent = 0; sent < responses;) {
+        int n = sendmmsg(this->net->sock, b->responses + sent, responses - sent, MSG_DONTWAIT);
+
+        if (n <= 0)
+            break;
+
+        sent += n;
+    }
+
+    return (uint32_t)count;
+#else
+    return readOne(now) ? 1 : 0;
+#endif
+}
+
+void BootstrapWorker::publish()
+{
+    this->received.fetch_add(this->counts.received, std::memory_order_relaxed);
+    this->infoAnswered.fetch_add(this->counts.info, std::memory_order_relaxed);
+    this->reflected.fetch_add(this->counts.reflected, std::memory_order_relaxed);
+    this->limited.fetch_add(this->counts.limited, std::memory_order_relaxed);
+    this->unsupported.fetch_add(this->counts.unsupported, std::memory_order_relaxed);
+    memset(&this->counts, 0, sizeof(this->counts));
+}
+
+/* Sleep on the socket, then read it dry. Datagrams are handled as they are
+ * read, not through the handlers of the core: there is nothing to look up.
+ */
+void BootstrapWorker::run()
+{
+#ifdef BOOTSTRAP_MMSG
+    this->batch = new BootstrapBatch();
+    memset(this->batch, 0, sizeof(*this->batch));
+
+    for (uint32_t i = 0; i < BOOTSTRAP_BATCH; ++i) {
+        this->batch->requestData[i].iov_base = this->batch->data[i];
+        this->batch->requestData[i].iov_len = MAX_UDP_PACKET_SIZE;
+        this->batch->requests[i].msg_hdr.msg_iov = &this->batch->requestData[i];
+        this->batch->requests[i].msg_hdr.msg_iovlen = 1;
+        this->batch->requests[i].msg_hdr.msg_name = &this->batch->sources[i];
+        this->batch->responses[i].msg_hdr.msg_iov = &this->batch->responseData[i];
+        this->batch->responses[i].msg_hdr.msg_iovlen = 1;
+    }
+#endif
+
+    while (!this->stopping) {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(this->net->sock, &readable);
+        struct timeval timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_usec = BOOTSTRAP_WAIT * 1000;
+        select((int)this->net->sock + 1, &readable, NULL, NULL, &timeout);
+
+        bool more = true;
+
+        while (more && !this->stopping) {
+            uint64_t now = NetworkService::getCurrentTimeMonotonic();
+
+            if (now >= this->nextRefresh)
+                refresh(now);
+
+            uint32_t read = 0, count;
+
+            while (read < BOOTSTRAP_READ_BUDGET && (count = readBatch(now)) != 0)
+                read += count;
+
+            more = read >= BOOTSTRAP_READ_BUDGET;
+            publish();
+        }
+    }
+}
+
+BootstrapServer::BootstrapServer()
+    : port(0)
+{
+}
+
+BootstrapServer* BootstrapServer::create(IP ip, uint16_t port, const BootstrapServerConfig* config)
+{
+    unsigned int workers = std::max(1u, std::min(config->workers, (unsigned int)BOOTSTRAP_MAX_WORKERS));
+    BootstrapServer *server = new BootstrapServer();
+    NetworkingOptions options;
+    memset(&options, 0, sizeof(options));
+
+    for (unsigned int i = 0; i < (config->activated ? BOOTSTRAP_MAX_WORKERS : workers); ++i) {
+        options.pinIncomingCpu = config->pinWorkers;
+        options.incomingCpu = i;
+
+        if (config->activated) {
+            options.inheritSocket = true;
+            options.socket = NetworkService::activatedSocket(i);
+
+            if (!NetworkService::sockIsValid(options.socket))
+                break;
+        } else {
+            options.reusePort = workers > 1;
+        }
+
+        BootstrapWorker *worker = new BootstrapWorker(config);
+
+        if (config->activated || i == 0)
+            worker->net = NetworkService::newNetworkingWithOptions(ip, port, port, &options, NULL);
+        else
+            worker->net = NetworkService::newNetworkingWithOptions(ip, server->port, server->port, &options, NULL);
+
+        /* No port sharing: one worker serves it all. */
+        if (!worker->net && i == 0 && options.reusePort) {
+            options.reusePort = false;
+            workers = 1;
+            worker->net = NetworkService::newNetworkingWithOptions(ip, port, port, &options, NULL);
+        }
+
+        if (!worker->net) {
+            delete worker;
+            break;
+        }
+
+        if (i == 0)
+            server->port = ntohs(worker->net->port);
+
+        server->workers.push_back(worker);
+    }
+
+    if (server->workers.empty()) {
+        delete server;
+        return NULL;
+    }
+
+    for (size_t i = 0; i < server->workers.size(); ++i)
+        server->workers[i]->thread = std::thread(&BootstrapWorker::run, server->workers[i]);
+
+    return server;
+}
+
+BootstrapServer::~BootstrapServer()
+{
+    for (size_t i = 0; i < this->workers.size(); ++i)
+        this->workers[i]->stopping = true;
+
+    for (size_t i = 0; i < this->workers.size(); ++i) {
+        if (this->workers[i]->thread.joinable())
+            this->workers[i]->thread.join();
+
+        delete this->workers[i];
+    }
+}
+
+uint16_t BootstrapServer::getPort()
+{
+    return this->port;
+}
+
+BootstrapServerStats BootstrapServer::getStats()
+{
+    BootstrapServerStats stats;
+    memset(&stats, 0, sizeof(stats));
+
+    for (size_t i = 0; i < this->workers.size(); ++i) {
+        BootstrapWorker *worker = this->workers[i];
+        stats.received += worker->received.load(std::memory_order_relaxed);
+        stats.info += worker->infoAnswered.load(std::memory_order_relaxed);
+        stats.reflected += worker->reflected.load(std::memory_order_relaxed);
+        stats.limited += worker->limited.load(std::memory_order_relaxed);
+        stats.unsupported += worker->unsupported.load(std::memory_order_relaxed);
+    }
+
+    return stats;
+}
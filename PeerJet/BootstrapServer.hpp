@@ -0,0 +1,98 @@
+//
+//  BootstrapServer.hpp
+//  PeerJet
+//
+//  Created by Compy on 12/18/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef BootstrapServer_hpp
+#define BootstrapServer_hpp
+
+#include <cstdint>
+#include <stdio.h>
+#include <vector>
+#include "NetworkService.hpp"
+
+/* BOOTSTRAP_INFO_PACKET_ID request: [id][padding], exactly BOOTSTRAP_INFO_REQUEST_SIZE
+ * bytes so the response is never much larger than it.
+ * Response: [id][version (big endian uint32)][message of the day, up to BOOTSTRAP_MAX_MOTD_LENGTH].
+ * Both as in toxcore.
+ */
+#define BOOTSTRAP_INFO_REQUEST_SIZE     78
+#define BOOTSTRAP_MAX_MOTD_LENGTH       256
+#define BOOTSTRAP_INFO_MAX_SIZE         (1 + sizeof(uint32_t) + BOOTSTRAP_MAX_MOTD_LENGTH)
+
+/* Defaults of BootstrapServerConfig. */
+#define BOOTSTRAP_INFO_REFRESH          60000   /* ms */
+#define BOOTSTRAP_RATE                  16      /* responses per second to one address */
+
+#define BOOTSTRAP_MAX_WORKERS           64
+
+/* Addresses every worker counts responses for. Addresses sharing a slot share
+ * their limit, a slot costs 16 bytes.
+ */
+#define BOOTSTRAP_RATE_SLOTS            4096
+
+typedef struct {
+    uint32_t version;
+    const char *motd;           /* NULL for none */
+    const char *motdPath;       /* a file read again every refreshInterval, in place of motd */
+    uint32_t refreshInterval;   /* ms, 0 for BOOTSTRAP_INFO_REFRESH */
+    uint32_t rate;              /* 0 for BOOTSTRAP_RATE */
+    unsigned int workers;       /* threads, each with its own socket */
+
+    /* Use the sockets passed by systemd socket activation (NetworkService::activatedSocket),
+     * a worker for each, instead of binding ip:port.
+     */
+    bool activated;
+
+    /* Steer the datagrams of worker n to CPU n (NetworkingOptions::incomingCpu),
+     * for as many workers as there are CPUs.
+     */
+    bool pinWorkers;
+} BootstrapServerConfig;
+
+typedef struct {
+    uint64_t received;      /* datagrams */
+    uint64_t info;          /* info requests answered */
+    uint64_t reflected;     /* reflection requests answered */
+    uint64_t limited;       /* requests not answered, their address was over its rate */
+    uint64_t unsupported;   /* anything else, DHT requests included */
+} BootstrapServerStats;
+
+struct BootstrapWorker;
+
+/* Public node new nodes start from, without an identity of its own.
+ *
+ * It answers info requests from a response built once per refresh, and
+ * reflection requests (NatTraversal) so nodes learn the address their packets
+ * come from. There is no DHT, GET_NODES and pings are only counted.
+ *
+ * Every worker thread reads its own socket, the kernel spreads the datagrams
+ * over them (SO_REUSEPORT). Workers share nothing: each one keeps its own copy
+ * of the info response and its own rate limits, so an address talking to
+ * several workers gets the rate of each.
+ */
+class BootstrapServer {
+public:
+    /* Listen on ip:port (host byte order, 0 for the default range), config
+     * isn't used after this returns.
+     *
+     * return NULL if no socket can be bound.
+     */
+    static BootstrapServer* create(IP ip, uint16_t port, const BootstrapServerConfig* config);
+    ~BootstrapServer();
+
+    /* return the port we listen on, in host byte order. */
+    uint16_t getPort();
+    BootstrapServerStats getStats();
+
+private:
+    BootstrapServer();
+
+    uint16_t port;
+    std::vector<BootstrapWorker*> workers;
+};
+
+#endif /* BootstrapServer_hpp */
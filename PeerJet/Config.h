@@ -11,6 +11,7 @@
 
 #define MAX_NAME_LENGTH             64
 #define MAX_STATUSMESSAGE_LENGTH    128
+#define MAX_MESSAGE_LENGTH          1365
 #define MAX_CONCURRENT_FILE_PIPES   8
 #define MAX_FRIEND_REQUEST_DATA_SIZE    32
 #define PACKET_LOSSY_AV_RESERVED    8
@@ -0,0 +1,80 @@
+//
+//  Congestion.cpp
+//  PeerJet
+//
+//  Created by Compy on 12/18/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include "Congestion.hpp"
+
+void Congestion::reset(struct CongestionWindow *cc, const CongestionLimits *limits)
+{
+    cc->limits = limits;
+    cc->window = limits->initialWindow;
+    cc->threshold = limits->maximumWindow;
+    cc->smoothedRtt = 0;
+    cc->rttVariance = 0;
+    cc->rto = limits->initialRto;
+    cc->recoveryEnd = 0;
+}
+
+/* RFC 6298 */
+void Congestion::onRttSample(struct CongestionWindow *cc, uint64_t rtt)
+{
+    const CongestionLimits *limits = cc->limits;
+
+    if (cc->smoothedRtt == 0) {
+        cc->smoothedRtt = rtt > 0 ? rtt : 1;
+        cc->rttVariance = rtt / 2;
+    } else {
+        uint64_t delta = cc->smoothedRtt > rtt ? cc->smoothedRtt - rtt : rtt - cc->smoothedRtt;
+        cc->rttVariance = (3 * cc->rttVariance + delta) / 4;
+        cc->smoothedRtt = (7 * cc->smoothedRtt + rtt) / 8;
+
+        /* 0 stands for no sample yet. */
+        if (cc->smoothedRtt == 0)
+            cc->smoothedRtt = 1;
+    }
+
+    /* Like Linux the minimum applies to the variance term, queueing delay alone must not fire the timer. */
+    cc->rto = cc->smoothedRtt + (4 * cc->rttVariance > limits->minimumRto ? 4 * cc->rttVariance : limits->minimumRto);
+
+    if (cc->rto > limits->maximumRto)
+        cc->rto = limits->maximumRto;
+}
+
+void Congestion::onAcked(struct CongestionWindow *cc, uint32_t packets)
+{
+    if (cc->window < cc->threshold) {
+        cc->window += packets;
+    } else {
+        cc->window += (double)packets / cc->window;
+    }
+
+    if (cc->window > cc->limits->maximumWindow)
+        cc->window = cc->limits->maximumWindow;
+}
+
+void Congestion::onLoss(struct CongestionWindow *cc, uint64_t now, bool timeout)
+{
+    const CongestionLimits *limits = cc->limits;
+
+    /* One reduction per round trip, every loss of the same flight counts as one event. */
+    if (!timeout && now < cc->recoveryEnd)
+        return;
+
+    cc->threshold = cc->window / 2;
+
+    if (cc->threshold < limits->minimumWindow)
+        cc->threshold = limits->minimumWindow;
+
+    if (timeout) {
+        cc->window = limits->minimumWindow;
+        cc->rto = cc->rto * 2 > limits->maximumRto ? limits->maximumRto : cc->rto * 2;
+    } else {
+        cc->window = cc->threshold;
+    }
+
+    cc->recoveryEnd = now + (cc->smoothedRtt ? cc->smoothedRtt : cc->rto);
+}
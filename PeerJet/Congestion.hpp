@@ -0,0 +1,49 @@
+//
+//  Congestion.hpp
+//  PeerJet
+//
+//  Created by Compy on 12/18/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef Congestion_hpp
+#define Congestion_hpp
+
+#include <cstdint>
+
+/* Bounds of a congestion window, fixed by its user. Windows count its packets
+ * (chunks for file transfers), times are in ms.
+ */
+typedef struct {
+    double initialWindow;
+    double minimumWindow;
+    double maximumWindow;
+    uint64_t initialRto;
+    uint64_t minimumRto;    /* added to the smoothed RTT */
+    uint64_t maximumRto;
+} CongestionLimits;
+
+/* Congestion state of a flow (Reno style AIMD) and its retransmission timeout (RFC 6298). */
+struct CongestionWindow {
+    const CongestionLimits *limits;
+    double window;          /* packets allowed in flight */
+    double threshold;       /* slow start threshold */
+    uint64_t smoothedRtt;   /* ms, 0 until the first sample */
+    uint64_t rttVariance;   /* ms */
+    uint64_t rto;           /* ms */
+    uint64_t recoveryEnd;   /* no further window reduction before this time */
+};
+
+class Congestion {
+public:
+    /* Start cc over in slow start, with no RTT measured. */
+    static void reset(struct CongestionWindow *cc, const CongestionLimits *limits);
+
+    static void onRttSample(struct CongestionWindow *cc, uint64_t rtt);
+    static void onAcked(struct CongestionWindow *cc, uint32_t packets);
+
+    /* A loss detected at now, by the retransmission timer if timeout. */
+    static void onLoss(struct CongestionWindow *cc, uint64_t now, bool timeout);
+};
+
+#endif /* Congestion_hpp */
@@ -6,30 +6,232 @@
 //  Copyright © 2018 peerjet. All rights reserved.
 //
 
+#include <algorithm>
+#include <atomic>
 #include "Crypto.hpp"
 #include "NetworkService.hpp"
 
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined(WIN32)
+#include <pthread.h>
+#define CRYPTO_RANDOM_ATFORK
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CRYPTO_KEYS_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CRYPTO_KEYS_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CRYPTO_KEYS_NEON
+#endif
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CRYPTO_LITTLE_ENDIAN_BSWAP
+#endif
+
+/* Keys compared between two checks for a match. */
+#define CRYPTO_KEYS_BATCH 4
+
+#ifdef VANILLA_NACL
+#include <crypto_stream_salsa20.h>
+/* NaCl has no ChaCha20, Salsa20 does the same job here. */
+#define crypto_stream_chacha20 crypto_stream_salsa20
+#endif
+
+/* The generator of one thread. Static storage starts it zeroed: empty and unseeded. */
+struct RandomState {
+    uint8_t key[CRYPTO_RANDOM_KEY_SIZE];
+    uint8_t buffer[CRYPTO_RANDOM_BUFFER_SIZE];
+    size_t available;           /* bytes left at the end of buffer */
+    uint32_t blocks;            /* generated since the last seed */
+    uint32_t forks;             /* randomForks when seeded */
+    bool seeded;
+
+    uint8_t nonce[crypto_box_NONCEBYTES]; /* last one handed out by newNonce */
+    bool nonceSet;
+};
+
+/* Bumped in every forked child so it doesn't repeat the output of its parent. */
+static std::atomic<uint32_t> randomForks(0);
+static thread_local RandomState randomState;
+
+#ifdef CRYPTO_RANDOM_ATFORK
+static void randomForked(void)
+{
+    randomForks.fetch_add(1, std::memory_order_relaxed);
+}
+
+static int randomAtFork = pthread_atfork(NULL, NULL, &randomForked);
+#endif
+
+static void randomRefill(RandomState *state)
+{
+    if (!state->seeded || state->blocks >= CRYPTO_RANDOM_RESEED_BLOCKS) {
+        randombytes(state->key, sizeof(state->key));
+        state->blocks = 0;
+        state->seeded = true;
+    }
+
+    /* Every key is used for one block only, the nonce can stay zero. */
+    static const uint8_t zero[8] = {0};
+    uint8_t block[CRYPTO_RANDOM_KEY_SIZE + CRYPTO_RANDOM_BUFFER_SIZE];
+    crypto_stream_chacha20(block, sizeof(block), zero, state->key);
+    memcpy(state->key, block, CRYPTO_RANDOM_KEY_SIZE);
+    memcpy(state->buffer, block + CRYPTO_RANDOM_KEY_SIZE, CRYPTO_RANDOM_BUFFER_SIZE);
+    sodium_memzero(block, sizeof(block));
+
+    state->available = CRYPTO_RANDOM_BUFFER_SIZE;
+    ++state->blocks;
+}
+
+static RandomState *randomCurrent(void)
+{
+    RandomState *state = &randomState;
+    uint32_t forks = randomForks.load(std::memory_order_relaxed);
+
+    if (state->forks != forks) {
+        state->forks = forks;
+        state->seeded = false;
+        state->available = 0;
+        state->nonceSet = false;
+    }
+
+    return state;
+}
+
 uint8_t Crypto::comparePublicKeys(const uint8_t *pk1, const uint8_t *pk2)
 {
     return crypto_verify_32(pk1, pk2);
 }
 
+/* Bit i of the result is set if key i of the batch at keys equals publicKey. */
+static uint32_t matchKeys(const uint8_t *keys, const uint8_t *publicKey)
+{
+    uint32_t hits = 0;
+
+#if defined(CRYPTO_KEYS_AVX2)
+    const __m256i target = _mm256_loadu_si256((const __m256i *)publicKey);
+
+    for (uint32_t i = 0; i < CRYPTO_KEYS_BATCH; ++i) {
+        __m256i key = _mm256_loadu_si256((const __m256i *)(keys + i * crypto_box_PUBLICKEYBYTES));
+        uint32_t equal = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(key, target));
+        hits |= (uint32_t)(equal == 0xFFFFFFFF) << i;
+    }
+#elif defined(CRYPTO_KEYS_SSE2)
+    const __m128i low = _mm_loadu_si128((const __m128i *)publicKey);
+    const __m128i high = _mm_loadu_si128((const __m128i *)(publicKey + 16));
+
+    for (uint32_t i = 0; i < CRYPTO_KEYS_BATCH; ++i) {
+        const uint8_t *key = keys + i * crypto_box_PUBLICKEYBYTES;
+        __m128i equal = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)key), low),
+                                      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(key + 16)), high));
+        hits |= (uint32_t)(_mm_movemask_epi8(equal) == 0xFFFF) << i;
+    }
+#elif defined(CRYPTO_KEYS_NEON)
+    const uint8x16_t low = vld1q_u8(publicKey);
+    const uint8x16_t high = vld1q_u8(publicKey + 16);
+
+    for (uint32_t i = 0; i < CRYPTO_KEYS_BATCH; ++i) {
+        const uint8_t *key = keys + i * crypto_box_PUBLICKEYBYTES;
+        uint64x2_t equal = vreinterpretq_u64_u8(vandq_u8(vceqq_u8(vld1q_u8(key), low), vceqq_u8(vld1q_u8(key + 16), high)));
+        hits |= (uint32_t)((vgetq_lane_u64(equal, 0) & vgetq_lane_u64(equal, 1)) == UINT64_MAX) << i;
+    }
+#else
+    uint64_t target[4];
+    memcpy(target, publicKey, sizeof(target));
+
+    for (uint32_t i = 0; i < CRYPTO_KEYS_BATCH; ++i) {
+        uint64_t key[4];
+        memcpy(key, keys + i * crypto_box_PUBLICKEYBYTES, sizeof(key));
+        uint64_t difference = (key[0] ^ target[0]) | (key[1] ^ target[1]) | (key[2] ^ target[2]) | (key[3] ^ target[3]);
+        hits |= (uint32_t)(difference == 0) << i;
+    }
+#endif
+
+    return hits;
+}
+
+int64_t Crypto::findPublicKey(const uint8_t *keys, size_t count, const uint8_t *publicKey)
+{
+    size_t i = 0;
+
+    for (; i + CRYPTO_KEYS_BATCH <= count; i += CRYPTO_KEYS_BATCH) {
+        uint32_t hits = matchKeys(keys + i * crypto_box_PUBLICKEYBYTES, publicKey);
+
+        if (hits == 0)
+            continue;
+
+        size_t first = 0;
+
+        while (!(hits & 1)) {
+            hits >>= 1;
+            ++first;
+        }
+
+        return (int64_t)(i + first);
+    }
+
+    /* The last keys go through a batch padded with a copy of the one looked for. */
+    if (i < count) {
+        uint8_t batch[CRYPTO_KEYS_BATCH * crypto_box_PUBLICKEYBYTES];
+
+        for (size_t j = 0; j < CRYPTO_KEYS_BATCH; ++j)
+            memcpy(batch + j * crypto_box_PUBLICKEYBYTES, i + j < count ? keys + (i + j) * crypto_box_PUBLICKEYBYTES : publicKey,
+                   crypto_box_PUBLICKEYBYTES);
+
+        uint32_t hits = matchKeys(batch, publicKey);
+        size_t first = 0;
+
+        while (!(hits & 1)) {
+            hits >>= 1;
+            ++first;
+        }
+
+        if (i + first < count)
+            return (int64_t)(i + first);
+    }
+
+    return -1;
+}
+
 /*  return a random number.
  */
 uint32_t Crypto::randomInt(void)
 {
     uint32_t randnum;
-    randombytes((uint8_t *)&randnum , sizeof(randnum));
+    randomBytes((uint8_t *)&randnum , sizeof(randnum));
     return randnum;
 }
 
 uint64_t Crypto::random64b(void)
 {
     uint64_t randnum;
-    randombytes((uint8_t *)&randnum, sizeof(randnum));
+    randomBytes((uint8_t *)&randnum, sizeof(randnum));
     return randnum;
 }
 
+/* Bytes handed out are wiped from the buffer, they can't be read back later. */
+void Crypto::randomBytes(uint8_t *bytes, size_t length)
+{
+    RandomState *state = randomCurrent();
+
+    while (length > 0) {
+        if (state->available == 0)
+            randomRefill(state);
+
+        size_t take = std::min(length, state->available);
+        uint8_t *from = state->buffer + CRYPTO_RANDOM_BUFFER_SIZE - state->available;
+        memcpy(bytes, from, take);
+        memset(from, 0, take);
+
+        state->available -= take;
+        bytes += take;
+        length -= take;
+    }
+}
+
 /* Check if a Tox public key crypto_box_PUBLICKEYBYTES is valid or not.
  * This should only be used for input validation.
  *
@@ -92,6 +294,29 @@ int Crypto::decryptDataSymmetric(const uint8_t *secretKey, const uint8_t *nonce,
     return length - crypto_box_MACBYTES;
 }
 
+int Crypto::encryptInPlace(const uint8_t *secretKey, const uint8_t *nonce, uint8_t *data, uint32_t length)
+{
+    if (length == 0 || !secretKey || !nonce || !data)
+        return -1;
+    
+    /* The cipher text lands exactly on the plain text, the MAC just before it. */
+    if (crypto_box_easy_afternm(data, data + crypto_box_MACBYTES, length, nonce, secretKey) != 0)
+        return -1;
+    
+    return length + crypto_box_MACBYTES;
+}
+
+int Crypto::decryptInPlace(const uint8_t *secretKey, const uint8_t *nonce, uint8_t *data, uint32_t length)
+{
+    if (length <= crypto_box_MACBYTES || !secretKey || !nonce || !data)
+        return -1;
+    
+    if (crypto_box_open_easy_afternm(data + crypto_box_MACBYTES, data, length, nonce, secretKey) != 0)
+        return -1;
+    
+    return length - crypto_box_MACBYTES;
+}
+
 int Crypto::encryptData(const uint8_t *publicKey, const uint8_t *secretKey, const uint8_t *nonce,
                  const uint8_t *plain, uint32_t length, uint8_t *encrypted)
 {
@@ -119,66 +344,139 @@ int Crypto::decryptData(const uint8_t *publicKey, const uint8_t *secretKey, cons
 }
 
 
+/* The limbs of a nonce, limb 2 the least significant. */
+static uint64_t loadNonceLimb(const uint8_t *nonce, uint32_t limb)
+{
+    const uint8_t *bytes = nonce + limb * 8;
+#ifdef CRYPTO_LITTLE_ENDIAN_BSWAP
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return __builtin_bswap64(value);
+#else
+    return ((uint64_t)bytes[0] << 56) | ((uint64_t)bytes[1] << 48) | ((uint64_t)bytes[2] << 40) | ((uint64_t)bytes[3] << 32)
+        | ((uint64_t)bytes[4] << 24) | ((uint64_t)bytes[5] << 16) | ((uint64_t)bytes[6] << 8) | (uint64_t)bytes[7];
+#endif
+}
+
+static void storeNonceLimb(uint8_t *nonce, uint32_t limb, uint64_t value)
+{
+    uint8_t *bytes = nonce + limb * 8;
+#ifdef CRYPTO_LITTLE_ENDIAN_BSWAP
+    value = __builtin_bswap64(value);
+    memcpy(bytes, &value, sizeof(value));
+#else
+    for (uint32_t i = 0; i < 8; ++i)
+        bytes[i] = (uint8_t)(value >> (56 - 8 * i));
+#endif
+}
+
+/* Add to the nonce, the carry goes through every limb whatever its value. */
+static void addNonce(uint8_t *nonce, uint64_t number)
+{
+    uint64_t low = loadNonceLimb(nonce, 2);
+    uint64_t sum = low + number;
+    uint64_t carry = sum < low;
+    uint64_t middle = loadNonceLimb(nonce, 1) + carry;
+    carry &= middle == 0;
+    uint64_t high = loadNonceLimb(nonce, 0) + carry;
+
+    storeNonceLimb(nonce, 0, high);
+    storeNonceLimb(nonce, 1, middle);
+    storeNonceLimb(nonce, 2, sum);
+}
+
 /* Increment the given nonce by 1. */
 void Crypto::incrementNonce(uint8_t *nonce)
 {
-    /* FIXME use increment_nonce_number(nonce, 1) or sodium_increment (change to little endian)
-     * NOTE don't use breaks inside this loop
-     * In particular, make sure, as far as possible,
-     * that loop bounds and their potential underflow or overflow
-     * are independent of user-controlled input (you may have heard of the Heartbleed bug).
-     */
-    uint32_t i = crypto_box_NONCEBYTES;
-    uint_fast16_t carry = 1U;
-    
-    for (; i != 0; --i) {
-        carry += (uint_fast16_t) nonce[i - 1];
-        nonce[i - 1] = (uint8_t) carry;
-        carry >>= 8;
-    }
+    addNonce(nonce, 1);
 }
+
 /* increment the given nonce by num */
 void Crypto::incrementNonceNumber(uint8_t *nonce, uint32_t hostOrderNum)
 {
-    /* NOTE don't use breaks inside this loop
-     * In particular, make sure, as far as possible,
-     * that loop bounds and their potential underflow or overflow
-     * are independent of user-controlled input (you may have heard of the Heartbleed bug).
-     */
-    const uint32_t big_endian_num = htonl(hostOrderNum);
-    const uint8_t *const num_vec = (const uint8_t *) &big_endian_num;
-    uint8_t num_as_nonce[crypto_box_NONCEBYTES] = {0};
-    num_as_nonce[crypto_box_NONCEBYTES - 4] = num_vec[0];
-    num_as_nonce[crypto_box_NONCEBYTES - 3] = num_vec[1];
-    num_as_nonce[crypto_box_NONCEBYTES - 2] = num_vec[2];
-    num_as_nonce[crypto_box_NONCEBYTES - 1] = num_vec[3];
-    
-    uint32_t i = crypto_box_NONCEBYTES;
-    uint_fast16_t carry = 0U;
-    
-    for (; i != 0; --i) {
-        carry += (uint_fast16_t) nonce[i - 1] + (uint_fast16_t) num_as_nonce[i - 1];
-        nonce[i - 1] = (unsigned char) carry;
-        carry >>= 8;
-    }
+    addNonce(nonce, hostOrderNum);
 }
 
 /* Fill the given nonce with random bytes. */
 void Crypto::randomNonce(uint8_t *nonce)
 {
-    randombytes(nonce, crypto_box_NONCEBYTES);
+    randomBytes(nonce, crypto_box_NONCEBYTES);
 }
 
 /* Fill a key crypto_box_KEYBYTES big with random bytes */
 void Crypto::newSymmetricKey(uint8_t *key)
 {
-    randombytes(key, crypto_box_KEYBYTES);
+    randomBytes(key, crypto_box_KEYBYTES);
 }
 
 /* Gives a nonce guaranteed to be different from previous ones.*/
 void Crypto::newNonce(uint8_t *nonce)
 {
-    randomNonce(nonce);
+    RandomState *state = randomCurrent();
+
+    if (!state->nonceSet) {
+        randomBytes(state->nonce, crypto_box_NONCEBYTES);
+        state->nonceSet = true;
+    }
+
+    incrementNonce(state->nonce);
+    memcpy(nonce, state->nonce, crypto_box_NONCEBYTES);
+}
+
+void Crypto::sessionInit(CryptoSessionNonces *session, const uint8_t *sendBase, const uint8_t *recvBase)
+{
+    memcpy(session->sendBase, sendBase, crypto_box_NONCEBYTES);
+    memcpy(session->recvBase, recvBase, crypto_box_NONCEBYTES);
+    session->sendNumber = 0;
+    session->recvHighest = 0;
+    session->recvWindow = 0;
+}
+
+void Crypto::sessionRekeySend(CryptoSessionNonces *session, const uint8_t *sendBase)
+{
+    memcpy(session->sendBase, sendBase, crypto_box_NONCEBYTES);
+    session->sendNumber = 0;
+}
+
+void Crypto::sessionRekeyReceive(CryptoSessionNonces *session, const uint8_t *recvBase)
+{
+    memcpy(session->recvBase, recvBase, crypto_box_NONCEBYTES);
+    session->recvHighest = 0;
+    session->recvWindow = 0;
+}
+
+uint32_t Crypto::sessionNextNonce(CryptoSessionNonces *session, uint8_t *nonce)
+{
+    memcpy(nonce, session->sendBase, crypto_box_NONCEBYTES);
+    incrementNonceNumber(nonce, session->sendNumber);
+    return session->sendNumber++;
+}
+
+bool Crypto::sessionReceiveNonce(const CryptoSessionNonces *session, uint32_t number, uint8_t *nonce)
+{
+    if (number < session->recvHighest) {
+        uint64_t age = session->recvHighest - 1 - number;
+
+        if (age >= CRYPTO_REPLAY_WINDOW || (session->recvWindow >> age) & 1)
+            return false;
+    }
+
+    memcpy(nonce, session->recvBase, crypto_box_NONCEBYTES);
+    incrementNonceNumber(nonce, number);
+    return true;
+}
+
+void Crypto::sessionAccept(CryptoSessionNonces *session, uint32_t number)
+{
+    if (number < session->recvHighest) {
+        session->recvWindow |= (uint64_t)1 << (session->recvHighest - 1 - number);
+        return;
+    }
+
+    uint64_t shift = (uint64_t)number + 1 - session->recvHighest;
+    session->recvWindow = shift >= CRYPTO_REPLAY_WINDOW ? 0 : session->recvWindow << shift;
+    session->recvWindow |= 1;
+    session->recvHighest = (uint64_t)number + 1;
 }
 
 /* Create a request to peer.
@@ -39,11 +39,48 @@
 #define CRYPTO_PACKET_DHTPK         156
 #define CRYPTO_PACKET_NAT_PING      254 /* NAT ping crypto packet ID. */
 
+/* Random bytes come from a per-thread ChaCha20 keystream, CRYPTO_RANDOM_BUFFER_SIZE
+ * bytes generated at a time. The first CRYPTO_RANDOM_KEY_SIZE bytes of every block
+ * rekey the stream right away so earlier output can't be recovered from the state,
+ * the OS generator reseeds it every CRYPTO_RANDOM_RESEED_BLOCKS blocks and in a
+ * forked child.
+ */
+#define CRYPTO_RANDOM_KEY_SIZE          32
+#define CRYPTO_RANDOM_BUFFER_SIZE       512
+#define CRYPTO_RANDOM_RESEED_BLOCKS     2048
+
+/* Packets received with a session number this far below the highest one are dropped as replays. */
+#define CRYPTO_REPLAY_WINDOW            64
+
+/* The nonces of one session. Packet n is sent with the nonce sendBase + n and
+ * carries n, the receiver rebuilds the nonce from recvBase and refuses the
+ * numbers it accepted already or that fell behind the window.
+ */
+typedef struct {
+    uint8_t sendBase[crypto_box_NONCEBYTES];
+    uint32_t sendNumber;                        /* number of the next packet sent */
+
+    uint8_t recvBase[crypto_box_NONCEBYTES];
+    uint64_t recvHighest;                       /* highest number accepted + 1, 0 if none */
+    uint64_t recvWindow;                        /* bit i set if recvHighest - 1 - i was accepted */
+} CryptoSessionNonces;
+
 class Crypto {
 public:
     static uint8_t comparePublicKeys(const uint8_t *pk1, const uint8_t *pk2);
+
+    /* Look for publicKey in count keys stored back to back. Every key is compared
+     * in constant time, several at once with SSE2, AVX2 or NEON when the target has
+     * them, and the scan stops at the first batch holding a match.
+     *
+     * return the index of the first key equal to publicKey, -1 if none.
+     */
+    static int64_t findPublicKey(const uint8_t *keys, size_t count, const uint8_t *publicKey);
     static uint32_t randomInt(void);
     static uint64_t random64b(void);
+
+    /* Fill bytes with length random bytes from the buffered generator of this thread. */
+    static void randomBytes(uint8_t *bytes, size_t length);
     static bool isPublicKeyValid(const uint8_t *publicKey);
     static int encryptData(const uint8_t *publicKey, const uint8_t *secretKey, const uint8_t *nonce,
                             const uint8_t *plain, uint32_t length, uint8_t *encrypted);
@@ -72,7 +109,20 @@ public:
     static int decryptDataSymmetric(const uint8_t *secretKey, const uint8_t *nonce, const uint8_t *encrypted, uint32_t length,
                                uint8_t *plain);
     
-    /* Increment the given nonce by 1. */
+    /* The same without copies: encrypt the length bytes of plain data at
+     * data + crypto_box_MACBYTES where they are, with the MAC written in front of
+     * them; decrypt the length bytes at data where they are, leaving the plain
+     * data at data + crypto_box_MACBYTES. Same wire format as above.
+     *
+     *  return -1 if there was a problem.
+     *  return length of encrypted data, or of plain data, if everything was fine.
+     */
+    static int encryptInPlace(const uint8_t *secretKey, const uint8_t *nonce, uint8_t *data, uint32_t length);
+    static int decryptInPlace(const uint8_t *secretKey, const uint8_t *nonce, uint8_t *data, uint32_t length);
+    
+    /* Increment the given nonce by 1. The nonce is a big endian number added to
+     * three 64 bit limbs at a time, without branches on its value.
+     */
     static void incrementNonce(uint8_t *nonce);
     
     /* increment the given nonce by num */
@@ -84,9 +134,36 @@ public:
     /* Fill a key crypto_box_KEYBYTES big with random bytes */
     static void newSymmetricKey(uint8_t *key);
     
-    /*Gives a nonce guaranteed to be different from previous ones.*/
+    /* Gives a nonce guaranteed to be different from previous ones: a per-thread
+     * counter started at a random value.
+     */
     static void newNonce(uint8_t *nonce);
     
+    /* Start the nonces of a session from the base nonces both ends picked. */
+    static void sessionInit(CryptoSessionNonces *session, const uint8_t *sendBase, const uint8_t *recvBase);
+    
+    /* Start the numbers of one direction over from a new base nonce, once its
+     * key changed. The other direction goes on.
+     */
+    static void sessionRekeySend(CryptoSessionNonces *session, const uint8_t *sendBase);
+    static void sessionRekeyReceive(CryptoSessionNonces *session, const uint8_t *recvBase);
+    
+    /* Put the nonce of the next packet sent in nonce. The session has to be
+     * rekeyed before 2^32 packets, the nonces would come round again.
+     *
+     * return the number the packet has to carry.
+     */
+    static uint32_t sessionNextNonce(CryptoSessionNonces *session, uint8_t *nonce);
+    
+    /* Put the nonce of the received packet with number in nonce.
+     *
+     * return false if number was accepted already or is too old, the packet is a replay.
+     */
+    static bool sessionReceiveNonce(const CryptoSessionNonces *session, uint32_t number, uint8_t *nonce);
+    
+    /* Mark number as received, only once the packet decrypted so forged ones don't move the window. */
+    static void sessionAccept(CryptoSessionNonces *session, uint32_t number);
+    
     
     /* Create a request to peer.
      * send_public_key and send_secret_key are the pub/secret keys of the sender.
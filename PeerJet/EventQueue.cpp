@@ -0,0 +1,306 @@
+//
+//  EventQueue.cpp
+//  PeerJet
+//
+//  Created by Compy on 12/18/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "EventQueue.hpp"
+
+EventQueue::EventQueue(uint32_t capacity)
+    : head(0), tail(0), released(EVENT_QUEUE_NO_BUFFER), delivered(0)
+{
+    uint32_t size = 1;
+
+    while (size < capacity && size < (1u << 30))
+        size <<= 1;
+
+    this->ring.resize(size);
+    this->mask = size - 1;
+    memset(&this->stats, 0, sizeof(this->stats));
+}
+
+EventQueue::~EventQueue()
+{
+    for (size_t i = 0; i < this->pool.size(); ++i)
+        free(this->pool[i]);
+}
+
+size_t EventQueue::poll(NodeEvent* events, size_t count)
+{
+    uint32_t head = this->head.load(std::memory_order_relaxed);
+    uint32_t available = this->tail.load(std::memory_order_acquire) - head;
+
+    if (count > available)
+        count = available;
+
+    for (size_t i = 0; i < count; ++i)
+        events[i] = this->ring[(head + i) & this->mask];
+
+    this->head.store(head + (uint32_t)count, std::memory_order_release);
+    this->delivered.fetch_add(count, std::memory_order_relaxed);
+    return count;
+}
+
+void EventQueue::release(const NodeEvent* event)
+{
+    if (event->buffer == EVENT_QUEUE_NO_BUFFER)
+        return;
+
+    /* The buffer is ours until it is on the list, link it to the current first one. */
+    uint8_t *buffer = const_cast<uint8_t *>(event->data);
+    uint32_t first = this->released.load(std::memory_order_relaxed);
+
+    do {
+        memcpy(buffer, &first, sizeof(first));
+    } while (!this->released.compare_exchange_weak(first, event->buffer, std::memory_order_release,
+                                                   std::memory_order_relaxed));
+}
+
+void EventQueue::release(const NodeEvent* events, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        this->release(&events[i]);
+}
+
+uint32_t EventQueue::takeBuffer()
+{
+    if (this->freeBuffers.empty()) {
+        uint32_t buffer = this->released.exchange(EVENT_QUEUE_NO_BUFFER, std::memory_order_acquire);
+
+        while (buffer != EVENT_QUEUE_NO_BUFFER) {
+            this->freeBuffers.push_back(buffer);
+            memcpy(&buffer, this->getBuffer(buffer), sizeof(buffer));
+        }
+    }
+
+    if (this->freeBuffers.empty()) {
+        uint8_t *chunk = (uint8_t *)malloc((size_t)EVENT_QUEUE_POOL_CHUNK * EVENT_QUEUE_BUFFER_SIZE);
+
+        if (!chunk)
+            return EVENT_QUEUE_NO_BUFFER;
+
+        uint32_t first = (uint32_t)(this->pool.size() * EVENT_QUEUE_POOL_CHUNK);
+        this->pool.push_back(chunk);
+
+        for (uint32_t i = EVENT_QUEUE_POOL_CHUNK; i > 0; --i)
+            this->freeBuffers.push_back(first + i - 1);
+    }
+
+    uint32_t buffer = this->freeBuffers.back();
+    this->freeBuffers.pop_back();
+    return buffer;
+}
+
+uint8_t* EventQueue::getBuffer(uint32_t buffer)
+{
+    return this->pool[buffer / EVENT_QUEUE_POOL_CHUNK] + (size_t)(buffer % EVENT_QUEUE_POOL_CHUNK) * EVENT_QUEUE_BUFFER_SIZE;
+}
+
+/* return false if the ring is full. */
+bool EventQueue::push(const NodeEvent* event)
+{
+    uint32_t tail = this->tail.load(std::memory_order_relaxed);
+
+    if (tail - this->head.load(std::memory_order_acquire) > this->mask)
+        return false;
+
+    this->ring[tail & this->mask] = *event;
+    this->tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+void EventQueue::post(NodeEvent* event, const uint8_t* prefix, size_t prefixLength, const uint8_t* data, size_t length)
+{
+    event->buffer = EVENT_QUEUE_NO_BUFFER;
+    event->data = NULL;
+    event->length = 0;
+
+    if (prefixLength + length > EVENT_QUEUE_BUFFER_SIZE)
+        length = EVENT_QUEUE_BUFFER_SIZE - prefixLength;
+
+    if (prefixLength + length) {
+        event->buffer = this->takeBuffer();
+
+        if (event->buffer == EVENT_QUEUE_NO_BUFFER)
+            return;
+
+        uint8_t *buffer = this->getBuffer(event->buffer);
+        memcpy(buffer, prefix, prefixLength);
+        memcpy(buffer + prefixLength, data, length);
+        event->data = buffer;
+        event->length = (uint16_t)(prefixLength + length);
+    }
+
+    ++this->stats.posted;
+    this->flush();
+
+    /* Behind older events, or in the ring right away. */
+    if (!this->backlog.empty() || !this->push(event)) {
+        this->backlog.push_back(*event);
+
+        if (this->backlog.size() > this->stats.maxBacklog)
+            this->stats.maxBacklog = (uint32_t)this->backlog.size();
+    }
+}
+
+void EventQueue::flush()
+{
+    while (!this->backlog.empty() && this->push(&this->backlog.front()))
+        this->backlog.pop_front();
+}
+
+EventQueueStats EventQueue::getStats()
+{
+    EventQueueStats stats = this->stats;
+    stats.delivered = this->delivered.load(std::memory_order_relaxed);
+    stats.backlog = (uint32_t)this->backlog.size();
+    stats.buffers = (uint32_t)(this->pool.size() * EVENT_QUEUE_POOL_CHUNK);
+    return stats;
+}
+
+static NodeEvent newEvent(NodeEventType type, uint32_t friendNumber)
+{
+    NodeEvent event;
+    memset(&event, 0, sizeof(event));
+    event.type = (uint8_t)type;
+    event.friendNumber = friendNumber;
+    return event;
+}
+
+static void onConnectionStatus(Node* node, ConnectionType connectionStatus, void* userData)
+{
+    NodeEvent event = newEvent(NODE_EVENT_CONNECTION_STATUS, 0);
+    event.value = (uint8_t)connectionStatus;
+    node->getEventQueue()->post(&event, NULL, 0, NULL, 0);
+}
+
+static void onFriendName(Node* node, uint32_t friendNumber, const std::string& name, size_t length, void* userData)
+{
+    NodeEvent event = newEvent(NODE_EVENT_FRIEND_NAME, friendNumber);
+    node->getEventQueue()->post(&event, NULL, 0, (const uint8_t *)name.data(), name.size());
+}
+
+static void onFriendStatusMessage(Node* node, uint32_t friendNumber, const std::string& message, size_t length,
+                                  void* userData)
+{
+    NodeEvent event = newEvent(NODE_EVENT_FRIEND_STATUS_MESSAGE, friendNumber);
+    node->getEventQueue()->post(&event, NULL, 0, (const uint8_t *)message.data(), message.size());
+}
+
+static void onFriendStatus(Node* node, uint32_t friendNumber, UserStatusType userStatus, void* userData)
+{
+    NodeEvent event = newEvent(NODE_EVENT_FRIEND_STATUS, friendNumber);
+    event.value = (uint8_t)userStatus;
+    node->getEventQueue()->post(&event, NULL, 0, NULL, 0);
+}
+
+static void onFriendConnectionStatus(Node* node, uint32_t friendNumber, ConnectionType connectionStatus, void* userData)
+{
+    NodeEvent event = newEvent(NODE_EVENT_FRIEND_CONNECTION_STATUS, friendNumber);
+    event.value = (uint8_t)connectionStatus;
+    node->getEventQueue()->post(&event, NULL, 0, NULL, 0);
+}
+
+static void onFriendTyping(Node* node, uint32_t friendNumber, bool isTyping, void *userData)
+{
+    NodeEvent event = newEvent(NODE_EVENT_FRIEND_TYPING, friendNumber);
+    event.value = isTyping;
+    node->getEventQueue()->post(&event, NULL, 0, NULL, 0);
+}
+
+static void onFriendReadReceipt(Node* node, uint32_t friendNumber, uint32_t messageId, void* userData)
+{
+    NodeEvent event = newEvent(NODE_EVENT_FRIEND_READ_RECEIPT, friendNumber);
+    event.number = messageId;
+    node->getEventQueue()->post(&event, NULL, 0, NULL, 0);
+}
+
+static void onFriendRequest(Node* node, const uint8_t* publicKey, const uint8_t* message, size_t length, void* userData)
+{
+    NodeEvent event = newEvent(NODE_EVENT_FRIEND_REQUEST, 0);
+    node->getEventQueue()->post(&event, publicKey, PEERJET_KEY_LENGTH, message, length);
+}
+
+static void onFriendMessage(Node* node, uint32_t friendNumber, MessageType type, const uint8_t* message, size_t length,
+                            void* userData)
+{
+    NodeEvent event = newEvent(NODE_EVENT_FRIEND_MESSAGE, friendNumber);
+    event.value = (uint8_t)type;
+    node->getEventQueue()->post(&event, NULL, 0, message, length);
+}
+
+static void onFileReceiveControl(Node* node, uint32_t friendNumber, uint32_t fileNumber, FileControlType fileControl,
+                                 void* userData)
+{
+    NodeEvent event = newEvent(NODE_EVENT_FILE_RECEIVE_CONTROL, friendNumber);
+    event.number = fileNumber;
+    event.value = (uint8_t)fileControl;
+    node->getEventQueue()->post(&event, NULL, 0, NULL, 0);
+}
+
+static void onFileChunkRequest(Node* node, uint32_t friendNumber, uint32_t fileNumber, uint64_t position, size_t length,
+                               void* userData)
+{
+    NodeEvent event = newEvent(NODE_EVENT_FILE_CHUNK_REQUEST, friendNumber);
+    event.number = fileNumber;
+    event.position = position;
+    event.size = length;
+    node->getEventQueue()->post(&event, NULL, 0, NULL, 0);
+}
+
+static void onFileReceive(Node* node, uint32_t friendNumber, uint32_t fileNumber, uint32_t fileKind, uint64_t fileSize,
+                          const uint8_t *filename, size_t filenameLength, void* userData)
+{
+    NodeEvent event = newEvent(NODE_EVENT_FILE_RECEIVE, friendNumber);
+    event.number = fileNumber;
+    event.kind = fileKind;
+    event.size = fileSize;
+    node->getEventQueue()->post(&event, NULL, 0, filename, filenameLength);
+}
+
+static void onFileReceiveChunk(Node* node, uint32_t friendNumber, uint32_t fileNumber, uint64_t position,
+                               const uint8_t *data, size_t length, void* userData)
+{
+    NodeEvent event = newEvent(NODE_EVENT_FILE_RECEIVE_CHUNK, friendNumber);
+    event.number = fileNumber;
+    event.position = position;
+    node->getEventQueue()->post(&event, NULL, 0, data, length);
+}
+
+void EventQueue::attach(Node* node)
+{
+    node->setConnectionStatusCallback(&onConnectionStatus);
+    node->setFriendNameCallback(&onFriendName);
+    node->setFriendStatusMessageCallback(&onFriendStatusMessage);
+    node->setFriendStatusCallback(&onFriendStatus);
+    node->setFriendConnectionStatusCallback(&onFriendConnectionStatus);
+    node->setFriendTypingCallback(&onFriendTyping);
+    node->setFriendReadReceiptCallback(&onFriendReadReceipt);
+    node->setFriendRequestCallback(&onFriendRequest);
+    node->setFriendMessageCallback(&onFriendMessage);
+    node->setFileReceiveControlCallback(&onFileReceiveControl);
+    node->setFileChunkRequestCallback(&onFileChunkRequest);
+    node->setFileReceiveCallback(&onFileReceive);
+    node->setFileReceiveChunkCallback(&onFileReceiveChunk);
+}
+
+void EventQueue::detach(Node* node)
+{
+    node->setConnectionStatusCallback(NULL);
+    node->setFriendNameCallback(NULL);
+    node->setFriendStatusMessageCallback(NULL);
+    node->setFriendStatusCallback(NULL);
+    node->setFriendConnectionStatusCallback(NULL);
+    node->setFriendTypingCallback(NULL);
+    node->setFriendReadReceiptCallback(NULL);
+    node->setFriendRequestCallback(NULL);
+    node->setFriendMessageCallback(NULL);
+    node->setFileReceiveControlCallback(NULL);
+    node->setFileChunkRequestCallback(NULL);
+    node->setFileReceiveCallback(NULL);
+    node->setFileReceiveChunkCallback(NULL);
+}
@@ -0,0 +1,135 @@
+//
+//  EventQueue.hpp
+//  PeerJet
+//
+//  Created by Compy on 12/18/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef EventQueue_hpp
+#define EventQueue_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include "Node.hpp"
+
+/* Events in the ring by default, rounded up to a power of two. */
+#define EVENT_QUEUE_DEFAULT_CAPACITY    4096
+
+/* Payloads are copied to buffers of this size, allocated EVENT_QUEUE_POOL_CHUNK at a time. */
+#define EVENT_QUEUE_BUFFER_SIZE         (PEERJET_KEY_LENGTH + MAX_MESSAGE_LENGTH)
+#define EVENT_QUEUE_POOL_CHUNK          256
+
+#define EVENT_QUEUE_NO_BUFFER           UINT32_MAX
+
+/* One kind of event for every callback of Node but the log callback. */
+typedef enum {
+    NODE_EVENT_CONNECTION_STATUS,       /* value: ConnectionType */
+    NODE_EVENT_FRIEND_NAME,             /* data: the name */
+    NODE_EVENT_FRIEND_STATUS_MESSAGE,   /* data: the status message */
+    NODE_EVENT_FRIEND_STATUS,           /* value: UserStatusType */
+    NODE_EVENT_FRIEND_CONNECTION_STATUS, /* value: ConnectionType */
+    NODE_EVENT_FRIEND_TYPING,           /* value: 1 if typing */
+    NODE_EVENT_FRIEND_READ_RECEIPT,     /* number: the message id */
+    NODE_EVENT_FRIEND_REQUEST,          /* data: the public key then the message, friendNumber unused */
+    NODE_EVENT_FRIEND_MESSAGE,          /* value: MessageType, data: the message */
+    NODE_EVENT_FILE_RECEIVE_CONTROL,    /* number: file, value: FileControlType */
+    NODE_EVENT_FILE_CHUNK_REQUEST,      /* number: file, position and size of the chunk */
+    NODE_EVENT_FILE_RECEIVE,            /* number: file, kind, size: file size, data: file name */
+    NODE_EVENT_FILE_RECEIVE_CHUNK       /* number: file, position, data: the chunk, empty at the end */
+} NodeEventType;
+
+typedef struct {
+    uint8_t type;           /* NodeEventType */
+    uint8_t value;
+    uint16_t length;        /* of data */
+    uint32_t friendNumber;
+    uint32_t number;
+    uint32_t kind;
+    uint32_t buffer;        /* pool buffer holding data, EVENT_QUEUE_NO_BUFFER for none */
+    uint64_t position;
+    uint64_t size;
+    const uint8_t *data;
+} NodeEvent;
+
+typedef struct {
+    uint64_t posted;
+    uint64_t delivered;
+    uint32_t backlog;       /* events waiting for room in the ring */
+    uint32_t maxBacklog;
+    uint32_t buffers;       /* pool buffers allocated */
+} EventQueueStats;
+
+/* Node events for an application thread (Node::setEventQueue).
+ *
+ * The thread ticking the node posts the events to a single producer single
+ * consumer ring, the application drains them with poll() from one thread of its
+ * own and never holds up the network. Payloads are copied once to buffers of a
+ * pool the events borrow until release().
+ *
+ * When the application falls behind and the ring is full, events wait in a
+ * backlog of the producer instead of being lost, moved to the ring as room
+ * frees up on the next post or tick. Buffers come back through a lock-free free
+ * list, only the producer takes from it.
+ *
+ * The node is not thread safe: calls made in reaction to events (fileSendChunk
+ * for NODE_EVENT_FILE_CHUNK_REQUEST...) must be made on the thread ticking it,
+ * or go through its NodeActor.
+ */
+class EventQueue {
+public:
+    explicit EventQueue(uint32_t capacity = EVENT_QUEUE_DEFAULT_CAPACITY);
+    ~EventQueue();
+
+    /* Consumer side. Copy up to count events to events, oldest first.
+     *
+     * return the number of events copied.
+     */
+    size_t poll(NodeEvent* events, size_t count);
+
+    /* Give the buffer of an event back once its data isn't used anymore. */
+    void release(const NodeEvent* event);
+    void release(const NodeEvent* events, size_t count);
+
+    /* Producer side, called through the callbacks set by attach(). The payload is
+     * the length bytes at data, after the prefixLength bytes at prefix.
+     */
+    void post(NodeEvent* event, const uint8_t* prefix, size_t prefixLength, const uint8_t* data, size_t length);
+
+    /* Move the backlog to the ring as far as it goes. */
+    void flush();
+
+    /* Have node post its events here instead of calling its callbacks. */
+    void attach(Node* node);
+    static void detach(Node* node);
+
+    /* Producer side. */
+    EventQueueStats getStats();
+
+private:
+    uint32_t takeBuffer();
+    uint8_t* getBuffer(uint32_t buffer);
+    bool push(const NodeEvent* event);
+
+    /* Ring: written by the producer at tail, read by the consumer at head. */
+    std::vector<NodeEvent> ring;
+    uint32_t mask;
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+
+    std::deque<NodeEvent> backlog;  /* producer only */
+
+    /* Buffers released by the consumer, linked through their first bytes. The
+     * producer takes the whole list at once when it runs out of its own.
+     */
+    std::atomic<uint32_t> released;
+    std::vector<uint32_t> freeBuffers;  /* producer only */
+    std::vector<uint8_t*> pool;         /* producer only, EVENT_QUEUE_POOL_CHUNK buffers each */
+
+    std::atomic<uint64_t> delivered;
+    EventQueueStats stats;
+};
+
+#endif /* EventQueue_hpp */
@@ -0,0 +1,435 @@
+//
+//  FileSink.cpp
+//  PeerJet
+//
+//  Created by Compy on 12/8/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <stdlib.h>
+#include <string.h>
+#include "FileSink.hpp"
+
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined(WIN32)
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#define FILE_SINK_SUPPORTED
+#endif
+
+/* Bitmap file: magic, FileTransfers::id, size of the file (big endian), one bit per chunk. */
+#define FILE_SINK_MAGIC         "PJPART01"
+#define FILE_SINK_MAGIC_LENGTH  8
+#define FILE_SINK_HEADER_SIZE   (FILE_SINK_MAGIC_LENGTH + FILE_ID_LENGTH + sizeof(uint64_t))
+
+#ifdef FILE_SINK_SUPPORTED
+#if defined(IOV_MAX)
+#define FILE_SINK_IOV_MAX IOV_MAX
+#else
+#define FILE_SINK_IOV_MAX 64
+#endif
+#endif
+
+static uint64_t steadyTime()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#ifdef FILE_SINK_SUPPORTED
+static bool readFully(int fd, uint8_t *data, size_t length, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t n = pread(fd, data + done, length - done, offset + (off_t)done);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            return false;
+
+        done += (size_t)n;
+    }
+
+    return true;
+}
+
+static bool writeFully(int fd, const uint8_t *data, size_t length, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t n = pwrite(fd, data + done, length - done, offset + (off_t)done);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            return false;
+
+        done += (size_t)n;
+    }
+
+    return true;
+}
+
+static void syncData(int fd)
+{
+#if defined(__APPLE__)
+    fsync(fd);
+#else
+    fdatasync(fd);
+#endif
+}
+#endif
+
+FileWriter::FileWriter()
+{
+    this->stopping = false;
+    this->thread = std::thread(&FileWriter::run, this);
+}
+
+FileWriter::~FileWriter()
+{
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->stopping = true;
+    }
+
+    this->wake.notify_one();
+    this->thread.join();
+}
+
+struct FileSink* FileWriter::open(const char* path, const uint8_t* id, uint64_t size, bool overwrite)
+{
+#ifdef FILE_SINK_SUPPORTED
+    std::string bitmapPath = std::string(path) + FILE_SINK_SUFFIX;
+    bool created = true;
+    int fd = ::open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+
+    if (fd == -1 && errno == EEXIST) {
+        created = false;
+        fd = ::open(path, O_RDWR);
+    }
+
+    if (fd == -1)
+        return NULL;
+
+    /* A file that was there before us is only written to if it is the one the bitmap is for. */
+    int bitmapFd = ::open(bitmapPath.c_str(), O_RDWR | (created || overwrite ? O_CREAT : 0), 0644);
+
+    if (bitmapFd == -1) {
+        ::close(fd);
+
+        if (created)
+            unlink(path);
+
+        return NULL;
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(bitmapFd, F_SETFD, FD_CLOEXEC);
+
+    struct FileSink *sink = new FileSink();
+    sink->fd = fd;
+    sink->bitmapFd = bitmapFd;
+    sink->size = size;
+    sink->chunkCount = (uint32_t)((size + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE);
+    sink->bitmapLength = (sink->chunkCount + 7) / 8;
+    sink->path = path;
+    sink->received = (uint8_t *)calloc(1, sink->bitmapLength + 1);
+    sink->written = (uint8_t *)calloc(1, sink->bitmapLength + 1);
+    sink->receivedBytes = 0;
+    sink->dirty = false;
+    sink->savedTime = steadyTime();
+    sink->queued = 0;
+    sink->busy = false;
+    sink->failed = false;
+
+    uint8_t header[FILE_SINK_HEADER_SIZE];
+    uint8_t expected[FILE_SINK_HEADER_SIZE];
+    memcpy(expected, FILE_SINK_MAGIC, FILE_SINK_MAGIC_LENGTH);
+    memcpy(expected + FILE_SINK_MAGIC_LENGTH, id, FILE_ID_LENGTH);
+
+    for (int i = 0; i < 8; ++i)
+        expected[FILE_SINK_MAGIC_LENGTH + FILE_ID_LENGTH + i] = (uint8_t)(size >> (56 - 8 * i));
+
+    struct stat st;
+    bool resume = sink->received && sink->written && fstat(fd, &st) == 0 && (uint64_t)st.st_size == size
+                  && readFully(bitmapFd, header, sizeof(header), 0) && memcmp(header, expected, sizeof(header)) == 0
+                  && readFully(bitmapFd, sink->written, sink->bitmapLength, FILE_SINK_HEADER_SIZE);
+
+    if (resume) {
+        memcpy(sink->received, sink->written, sink->bitmapLength);
+
+        for (uint32_t chunk = 0; chunk < sink->chunkCount; ++chunk) {
+            if (isReceived(sink, chunk)) {
+                uint64_t position = (uint64_t)chunk * FILE_CHUNK_SIZE;
+                sink->receivedBytes += size - position < FILE_CHUNK_SIZE ? size - position : FILE_CHUNK_SIZE;
+            }
+        }
+    } else if (sink->received && sink->written && (created || overwrite)) {
+        /* A different file or no bitmap: start over. */
+        memset(sink->written, 0, sink->bitmapLength);
+        resume = ftruncate(fd, 0) == 0 && ftruncate(fd, (off_t)size) == 0
+                 && ftruncate(bitmapFd, 0) == 0 && writeFully(bitmapFd, expected, sizeof(expected), 0)
+                 && (sink->bitmapLength == 0 || writeFully(bitmapFd, sink->written, sink->bitmapLength, FILE_SINK_HEADER_SIZE));
+
+#if defined(__linux__)
+        /* Reserve the blocks up front so the disk can't fill up halfway. */
+        if (resume && size > 0)
+            resume = posix_fallocate(fd, 0, (off_t)size) == 0;
+#endif
+    }
+
+    if (!resume) {
+        ::close(fd);
+        ::close(bitmapFd);
+
+        if (created) {
+            unlink(path);
+            unlink(bitmapPath.c_str());
+        }
+
+        free(sink->received);
+        free(sink->written);
+        delete sink;
+        return NULL;
+    }
+
+    return sink;
+#else
+    return NULL;
+#endif
+}
+
+bool FileWriter::isReceived(const struct FileSink* sink, uint32_t chunk)
+{
+    return sink->received[chunk / 8] & (1 << (chunk % 8));
+}
+
+bool FileWriter::write(struct FileSink* sink, uint32_t chunk, const uint8_t* data, uint16_t length)
+{
+    if (length > FILE_CHUNK_SIZE || chunk >= sink->chunkCount)
+        return false;
+
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+
+        if (this->queue.size() >= FILE_SINK_QUEUE_LIMIT || sink->failed)
+            return false;
+
+        if (std::find(this->sinks.begin(), this->sinks.end(), sink) == this->sinks.end())
+            this->sinks.push_back(sink);
+
+        this->queue.push_back(WriteRequest());
+        WriteRequest& request = this->queue.back();
+        request.sink = sink;
+        request.chunk = chunk;
+        request.length = length;
+        memcpy(request.data, data, length);
+        ++sink->queued;
+    }
+
+    sink->received[chunk / 8] |= 1 << (chunk % 8);
+    sink->receivedBytes += length;
+    this->wake.notify_one();
+    return true;
+}
+
+bool FileWriter::isIdle(struct FileSink* sink)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    return sink->queued == 0 && !sink->busy;
+}
+
+bool FileWriter::hasFailed(struct FileSink* sink)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    return sink->failed;
+}
+
+void FileWriter::close(struct FileSink* sink, bool complete)
+{
+#ifdef FILE_SINK_SUPPORTED
+    {
+        std::unique_lock<std::mutex> guard(this->lock);
+        this->sinks.erase(std::remove(this->sinks.begin(), this->sinks.end(), sink), this->sinks.end());
+
+        while (sink->queued > 0 || sink->busy)
+            this->done.wait(guard);
+    }
+
+    if (complete && !sink->failed) {
+        syncData(sink->fd);
+        ::close(sink->bitmapFd);
+        unlink((sink->path + FILE_SINK_SUFFIX).c_str());
+    } else {
+        save(sink);
+        ::close(sink->bitmapFd);
+    }
+
+    ::close(sink->fd);
+    free(sink->received);
+    free(sink->written);
+    delete sink;
+#endif
+}
+
+void FileWriter::run()
+{
+    std::vector<WriteRequest> batch;
+    std::unique_lock<std::mutex> guard(this->lock);
+
+    while (!this->stopping) {
+        if (this->queue.empty())
+            this->wake.wait_for(guard, std::chrono::milliseconds(FILE_SINK_SAVE_INTERVAL));
+
+        batch.swap(this->queue);
+        std::vector<struct FileSink*> saving;
+        uint64_t now = steadyTime();
+
+        for (size_t i = 0; i < batch.size(); ++i)
+            batch[i].sink->busy = true;
+
+        for (size_t i = 0; i < this->sinks.size(); ++i) {
+            struct FileSink *sink = this->sinks[i];
+
+            if (sink->dirty && now - sink->savedTime >= FILE_SINK_SAVE_INTERVAL) {
+                sink->busy = true;
+                saving.push_back(sink);
+            }
+        }
+
+        guard.unlock();
+        this->writeBatch(batch);
+
+        for (size_t i = 0; i < saving.size(); ++i)
+            save(saving[i]);
+
+        guard.lock();
+
+        for (size_t i = 0; i < batch.size(); ++i) {
+            batch[i].sink->busy = false;
+            --batch[i].sink->queued;
+        }
+
+        for (size_t i = 0; i < saving.size(); ++i)
+            saving[i]->busy = false;
+
+        batch.clear();
+        this->done.notify_all();
+    }
+}
+
+/* Runs on the writer thread without the lock, the sinks in the batch are busy. */
+void FileWriter::writeBatch(std::vector<WriteRequest>& batch)
+{
+#ifdef FILE_SINK_SUPPORTED
+    if (batch.empty())
+        return;
+
+    std::vector<size_t> order(batch.size());
+
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+
+    std::sort(order.begin(), order.end(), [&batch](size_t a, size_t b) {
+        if (batch[a].sink != batch[b].sink)
+            return batch[a].sink < batch[b].sink;
+        return batch[a].chunk < batch[b].chunk;
+    });
+
+    struct iovec iov[FILE_SINK_IOV_MAX];
+
+    for (size_t i = 0; i < order.size(); ) {
+        WriteRequest& first = batch[order[i]];
+        struct FileSink *sink = first.sink;
+        size_t count = 0;
+        size_t bytes = 0;
+
+        /* Adjacent chunks of the same file, duplicates are skipped. */
+        while (i < order.size() && count < FILE_SINK_IOV_MAX) {
+            WriteRequest& request = batch[order[i]];
+
+            if (request.sink != sink || request.chunk != first.chunk + count)
+                break;
+
+            iov[count].iov_base = request.data;
+            iov[count].iov_len = request.length;
+            bytes += request.length;
+            ++count;
+            ++i;
+
+            while (i < order.size() && batch[order[i]].sink == sink && batch[order[i]].chunk == request.chunk)
+                ++i;
+        }
+
+        if (sink->failed)
+            continue;
+
+        off_t offset = (off_t)first.chunk * FILE_CHUNK_SIZE;
+        bool ok;
+
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+        ssize_t n;
+
+        do {
+            n = pwritev(sink->fd, iov, (int)count, offset);
+        } while (n == -1 && errno == EINTR);
+
+        ok = n == (ssize_t)bytes;
+
+        /* Short write, finish chunk by chunk. */
+        if (!ok && n >= 0) {
+            ok = true;
+
+            for (size_t j = 0; j < count && ok; ++j)
+                ok = writeFully(sink->fd, (const uint8_t *)iov[j].iov_base, iov[j].iov_len, offset + (off_t)(j * FILE_CHUNK_SIZE));
+        }
+#else
+        ok = true;
+
+        for (size_t j = 0; j < count && ok; ++j)
+            ok = writeFully(sink->fd, (const uint8_t *)iov[j].iov_base, iov[j].iov_len, offset + (off_t)(j * FILE_CHUNK_SIZE));
+#endif
+
+        if (!ok) {
+            std::lock_guard<std::mutex> guard(this->lock);
+            sink->failed = true;
+            continue;
+        }
+
+        for (size_t j = 0; j < count; ++j) {
+            uint32_t chunk = first.chunk + (uint32_t)j;
+            sink->written[chunk / 8] |= 1 << (chunk % 8);
+        }
+
+        sink->dirty = true;
+    }
+#endif
+}
+
+/* Data first, then the bitmap that claims it is there. */
+void FileWriter::save(struct FileSink* sink)
+{
+#ifdef FILE_SINK_SUPPORTED
+    if (!sink->dirty)
+        return;
+
+    syncData(sink->fd);
+
+    if (writeFully(sink->bitmapFd, sink->written, sink->bitmapLength, FILE_SINK_HEADER_SIZE))
+        syncData(sink->bitmapFd);
+
+    sink->dirty = false;
+    sink->savedTime = steadyTime();
+#endif
+}
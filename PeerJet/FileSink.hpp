@@ -0,0 +1,111 @@
+//
+//  FileSink.hpp
+//  PeerJet
+//
+//  Created by Compy on 12/8/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef FileSink_hpp
+#define FileSink_hpp
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FileTransfer.hpp"
+
+/* Chunks waiting for the writer before incoming data is dropped, the sender retransmits it. */
+#define FILE_SINK_QUEUE_LIMIT       4096
+
+/* The bitmap next to the file is saved at most this often (ms), and when the transfer ends. */
+#define FILE_SINK_SAVE_INTERVAL     1000
+
+/* Name of the bitmap file: path of the file + suffix. */
+#define FILE_SINK_SUFFIX            ".pjpart"
+
+/* A file being received straight to disk (Node::fileReceiveToPath).
+ *
+ * The file is preallocated, chunks are written in place by the writer thread and
+ * every chunk on disk is marked in a bitmap kept in FILE_SINK_SUFFIX next to it,
+ * together with the FileTransfers::id and the size of the file. Receiving a file
+ * with the same id and size to the same path again only asks for the missing chunks.
+ */
+struct FileSink {
+    int fd;
+    int bitmapFd;
+    uint64_t size;
+    uint32_t chunkCount;
+    size_t bitmapLength;
+    std::string path;
+
+    uint8_t *received;      /* chunks handed to the writer, used by the engine */
+    uint64_t receivedBytes;
+
+    uint8_t *written;       /* chunks on disk, used by the writer */
+    bool dirty;             /* written changed since it was saved */
+    uint64_t savedTime;
+
+    uint32_t queued;        /* guarded by the writer lock */
+    bool busy;              /* the writer works on the sink, guarded by the writer lock */
+    bool failed;            /* guarded by the writer lock */
+};
+
+/* Writes the chunks of every FileSink of a node on one thread, so the network
+ * thread never waits for the disk. Writes that arrive together are sorted and
+ * adjacent chunks go out in a single call.
+ */
+class FileWriter {
+public:
+    FileWriter();
+    ~FileWriter();
+
+    /* Open or resume the file at path. A file already at path is only resumed, if
+     * its bitmap is for id and size, unless overwrite is set.
+     *
+     * return NULL if the file or its bitmap can't be opened, or path is taken.
+     */
+    static struct FileSink* open(const char* path, const uint8_t* id, uint64_t size, bool overwrite);
+
+    static bool isReceived(const struct FileSink* sink, uint32_t chunk);
+
+    /* Queue a chunk for writing, it counts as received from now on.
+     *
+     * return false if the queue is full.
+     */
+    bool write(struct FileSink* sink, uint32_t chunk, const uint8_t* data, uint16_t length);
+
+    /* return true once every queued chunk of the sink was written. */
+    bool isIdle(struct FileSink* sink);
+    bool hasFailed(struct FileSink* sink);
+
+    /* Wait for the queued chunks of the sink, then close it. A complete file loses
+     * its bitmap, otherwise the bitmap is saved for a later resume.
+     */
+    void close(struct FileSink* sink, bool complete);
+
+private:
+    struct WriteRequest {
+        struct FileSink* sink;
+        uint32_t chunk;
+        uint16_t length;
+        uint8_t data[FILE_CHUNK_SIZE];
+    };
+
+    void run();
+    void writeBatch(std::vector<WriteRequest>& batch);
+    static void save(struct FileSink* sink);
+
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::vector<WriteRequest> queue;
+    std::vector<struct FileSink*> sinks; /* open sinks, for the periodic bitmap saves */
+    bool stopping;
+};
+
+#endif /* FileSink_hpp */
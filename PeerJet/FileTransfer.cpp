@@ -0,0 +1,1335 @@
+//
+//  FileTransfer.cpp
+//  PeerJet
+//
+//  Created by Compy on 12/6/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include "FileSink.hpp"
+#include "FileTransfer.hpp"
+#include "NetworkService.hpp"
+#include "Utils.hpp"
+
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined(WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define FILE_SOURCE_SUPPORTED
+#endif
+
+#define FILE_SLOT(chunk) ((chunk) & (FILE_WINDOW_SIZE - 1))
+
+/* Upper bound of the congestion window, every pipe with a full window. */
+#define FILE_MAXIMUM_WINDOW ((double)FILE_WINDOW_SIZE * MAX_CONCURRENT_FILE_PIPES)
+
+static const CongestionLimits fileLimits = {
+    FILE_INITIAL_WINDOW, FILE_MINIMUM_WINDOW, FILE_MAXIMUM_WINDOW, FILE_INITIAL_RTO, FILE_MINIMUM_RTO, FILE_MAXIMUM_RTO
+};
+
+/* Receiver: did chunk arrive, in this window or in an earlier run of the sink? */
+static bool isChunkReceived(const struct FileTransfers *ft, uint32_t chunk)
+{
+    if (ft->window->state[chunk & (FILE_WINDOW_SIZE - 1)] == FILE_CHUNK_ACKED)
+        return true;
+
+    return ft->sink && FileWriter::isReceived(ft->sink, chunk);
+}
+
+static uint32_t chunkLength(const struct FileTransfers *ft, uint32_t chunk)
+{
+    uint64_t position = (uint64_t)chunk * FILE_CHUNK_SIZE;
+    uint64_t remaining = ft->size - position;
+    return remaining < FILE_CHUNK_SIZE ? (uint32_t)remaining : FILE_CHUNK_SIZE;
+}
+
+static struct FileWindow *newWindow(const struct FileTransfers *ft, bool sending)
+{
+    struct FileWindow *window = (struct FileWindow *)calloc(1, sizeof(struct FileWindow));
+
+    if (!window)
+        return NULL;
+
+    /* Mapped files are sent from the mapping. */
+    if (sending && !(ft->source && ft->source->map)) {
+        window->buffer = (uint8_t *)malloc((size_t)FILE_WINDOW_SIZE * FILE_CHUNK_SIZE);
+
+        if (!window->buffer) {
+            free(window);
+            return NULL;
+        }
+    }
+
+    window->chunkCount = (uint32_t)((ft->size + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE);
+
+    /* Seeked transfers start further in. */
+    window->base = (uint32_t)(ft->transferred / FILE_CHUNK_SIZE);
+    window->nextRequest = window->base;
+    window->sendCursor = window->base;
+    window->sendHighest = window->base;
+    return window;
+}
+
+static struct CongestionWindow *newCongestion()
+{
+    struct CongestionWindow *cc = (struct CongestionWindow *)calloc(1, sizeof(struct CongestionWindow));
+
+    if (!cc)
+        return NULL;
+
+    Congestion::reset(cc, &fileLimits);
+    return cc;
+}
+
+static void freeWindow(struct FileTransfers *ft)
+{
+    if (ft->window) {
+        free(ft->window->buffer);
+        free(ft->window);
+        ft->window = NULL;
+    }
+}
+
+static void freeSource(struct FileTransfers *ft)
+{
+    struct FileSource *source = ft->source;
+
+    if (!source)
+        return;
+
+#ifdef FILE_SOURCE_SUPPORTED
+    if (source->map)
+        munmap((void *)source->map, source->mapLength);
+
+    if (source->ownsFd)
+        close(source->fd);
+#endif
+
+    free(source);
+    ft->source = NULL;
+}
+
+static void clearTransfer(struct FileTransfers *ft)
+{
+    freeWindow(ft);
+    freeSource(ft);
+    ft->status = 0;
+    ft->paused = 0;
+    ft->transferred = 0;
+    ft->requested = 0;
+    ft->last_packet_number = 0;
+    ft->slots_allocated = 0;
+}
+
+FileTransferEngine::FileTransferEngine(Node* node)
+{
+    this->node = node;
+    this->writer = NULL;
+}
+
+FileTransferEngine::~FileTransferEngine()
+{
+    delete this->writer;
+}
+
+int32_t FileTransferEngine::send(uint32_t friendNumber, uint32_t fileKind, uint64_t fileSize, const uint8_t* fileId,
+                                 const uint8_t* filename, size_t filenameLength)
+{
+    Friend *f = this->node->getFriend(friendNumber);
+
+    if (!f || f->status != 4)
+        return -1;
+
+    if (filenameLength > MAX_FILENAME_LENGTH)
+        return -1;
+
+    /* Chunk numbers are 32 bit. */
+    if (fileSize / FILE_CHUNK_SIZE >= UINT32_MAX)
+        return -1;
+
+    uint32_t i;
+
+    for (i = 0; i < MAX_CONCURRENT_FILE_PIPES; ++i) {
+        if (f->file_sending[i].status == 0)
+            break;
+    }
+
+    if (i == MAX_CONCURRENT_FILE_PIPES)
+        return -1;
+
+    uint8_t packet[1 + 1 + sizeof(uint32_t) + sizeof(uint64_t) + FILE_ID_LENGTH + MAX_FILENAME_LENGTH];
+    packet[0] = PACKET_ID_FILE_SENDREQUEST;
+    packet[1] = (uint8_t)i;
+    Utils::writeUint32(packet + 2, fileKind);
+    Utils::writeUint64(packet + 6, fileSize);
+    memcpy(packet + 14, fileId, FILE_ID_LENGTH);
+    memcpy(packet + 14 + FILE_ID_LENGTH, filename, filenameLength);
+
+    int64_t packetNumber = this->node->sendFriendPacket(friendNumber, packet, (uint16_t)(14 + FILE_ID_LENGTH + filenameLength), true);
+
+    if (packetNumber == -1)
+        return -1;
+
+    struct FileTransfers *ft = &f->file_sending[i];
+    clearTransfer(ft);
+    ft->size = fileSize;
+    ft->status = 1;
+    ft->last_packet_number = (uint32_t)packetNumber;
+    memcpy(ft->id, fileId, FILE_ID_LENGTH);
+    ++f->num_sending_files;
+    return (int32_t)i;
+}
+
+int32_t FileTransferEngine::sendPath(uint32_t friendNumber, uint32_t fileKind, const char* path, const uint8_t* fileId,
+                                     const uint8_t* filename, size_t filenameLength)
+{
+#ifdef FILE_SOURCE_SUPPORTED
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1)
+        return -1;
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    int32_t fileNumber = this->sendFd(friendNumber, fileKind, fd, true, fileId, filename, filenameLength);
+
+    if (fileNumber == -1)
+        close(fd);
+
+    return fileNumber;
+#else
+    return -1;
+#endif
+}
+
+int32_t FileTransferEngine::sendFd(uint32_t friendNumber, uint32_t fileKind, int fd, bool ownsFd, const uint8_t* fileId,
+                                   const uint8_t* filename, size_t filenameLength)
+{
+#ifdef FILE_SOURCE_SUPPORTED
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return -1;
+
+    struct FileSource *source = (struct FileSource *)calloc(1, sizeof(struct FileSource));
+
+    if (!source)
+        return -1;
+
+    source->fd = fd;
+    uint64_t size = (uint64_t)st.st_size;
+
+    if (size >= FILE_SOURCE_MMAP_MINIMUM && (uint64_t)(size_t)size == size) {
+        void *map = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        /* Address space is the only thing that should run out, pread works anyway. */
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)size, MADV_SEQUENTIAL);
+            source->map = (const uint8_t *)map;
+            source->mapLength = size;
+        }
+    }
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+    if (!source->map)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    int32_t fileNumber = this->send(friendNumber, fileKind, size, fileId, filename, filenameLength);
+
+    if (fileNumber == -1) {
+        if (source->map)
+            munmap((void *)source->map, source->mapLength);
+
+        free(source);
+        return -1;
+    }
+
+    source->ownsFd = ownsFd;
+    this->node->getFriend(friendNumber)->file_sending[fileNumber].source = source;
+    return fileNumber;
+#else
+    return -1;
+#endif
+}
+
+/* Files we receive are numbered (n + 1) << 16, files we send n.
+ *
+ * return the pipe or NULL if the number is invalid.
+ */
+static struct FileTransfers *getTransfer(Friend *f, uint32_t fileNumber, bool *sending, uint8_t *pipe)
+{
+    uint32_t index = fileNumber;
+    *sending = true;
+
+    if (fileNumber >= (1 << 16)) {
+        index = (fileNumber >> 16) - 1;
+        *sending = false;
+    }
+
+    if (index >= MAX_CONCURRENT_FILE_PIPES)
+        return NULL;
+
+    *pipe = (uint8_t)index;
+    return *sending ? &f->file_sending[index] : &f->file_receiving[index];
+}
+
+bool FileTransferEngine::control(uint32_t friendNumber, uint32_t fileNumber, FileControlType control)
+{
+    Friend *f = this->node->getFriend(friendNumber);
+
+    if (!f || f->status != 4)
+        return false;
+
+    bool sending;
+    uint8_t pipe;
+    struct FileTransfers *ft = getTransfer(f, fileNumber, &sending, &pipe);
+
+    if (!ft || ft->status == 0 || ft->status == 5)
+        return false;
+
+    switch (control) {
+        case FILE_CONTROL_RESUME:
+            if (ft->status == 1) {
+                /* Only the receiver can accept a file. */
+                if (sending)
+                    return false;
+            } else if (!(ft->paused & 1)) {
+                return false;
+            }
+            break;
+
+        case FILE_CONTROL_PAUSE:
+            if (ft->status != 3 || (ft->paused & 1))
+                return false;
+            break;
+
+        case FILE_CONTROL_CANCEL:
+            break;
+
+        default:
+            return false;
+    }
+
+    if (!this->sendControl(friendNumber, sending, pipe, control))
+        return false;
+
+    switch (control) {
+        case FILE_CONTROL_RESUME:
+            if (ft->status == 1) {
+                ft->window = newWindow(ft, false);
+
+                if (!ft->window) {
+                    this->sendControl(friendNumber, sending, pipe, FILE_CONTROL_CANCEL);
+                    this->finishTransfer(f, ft, sending);
+                    return false;
+                }
+
+                ft->status = 3;
+
+                /* Chunks a sink already has on disk. */
+                if (ft->sink) {
+                    while (ft->window->base < ft->window->chunkCount && isChunkReceived(ft, ft->window->base))
+                        ++ft->window->base;
+
+                    ft->transferred = ft->sink->receivedBytes;
+                }
+
+                /* Nothing left to receive, complete as soon as it is accepted. The sender frees the pipe. */
+                if (ft->window->base == ft->window->chunkCount) {
+                    ft->status = 5;
+
+                    /* Sinks complete once the writer is done (checkSinks). */
+                    if (!ft->sink && this->node->fileReceiveChunkCallback) {
+                        this->node->fileReceiveChunkCallback(this->node, friendNumber, fileNumber, 0, NULL, 0,
+                                                             this->node->userData);
+                    }
+                }
+            } else {
+                ft->paused &= ~1;
+            }
+            break;
+
+        case FILE_CONTROL_PAUSE:
+            ft->paused |= 1;
+            break;
+
+        case FILE_CONTROL_CANCEL:
+            this->finishTransfer(f, ft, sending);
+            break;
+
+        default:
+            break;
+    }
+
+    return true;
+}
+
+bool FileTransferEngine::seek(uint32_t friendNumber, uint32_t fileNumber, uint64_t position)
+{
+    Friend *f = this->node->getFriend(friendNumber);
+
+    if (!f || f->status != 4)
+        return false;
+
+    bool sending;
+    uint8_t pipe;
+    struct FileTransfers *ft = getTransfer(f, fileNumber, &sending, &pipe);
+
+    /* Only a file that was not accepted yet can be seeked, by its receiver. */
+    if (!ft || sending || ft->status != 1 || position > ft->size || position % FILE_CHUNK_SIZE != 0)
+        return false;
+
+    uint8_t packet[4 + sizeof(uint64_t)];
+    packet[0] = PACKET_ID_FILE_CONTROL;
+    packet[1] = 1;
+    packet[2] = pipe;
+    packet[3] = FILE_CONTROL_SEEK;
+    Utils::writeUint64(packet + 4, position);
+
+    if (this->node->sendFriendPacket(friendNumber, packet, sizeof(packet), true) == -1)
+        return false;
+
+    ft->transferred = position;
+    return true;
+}
+
+bool FileTransferEngine::getFileId(uint32_t friendNumber, uint32_t fileNumber, uint8_t* fileId)
+{
+    Friend *f = this->node->getFriend(friendNumber);
+
+    if (!f)
+        return false;
+
+    bool sending;
+    uint8_t pipe;
+    struct FileTransfers *ft = getTransfer(f, fileNumber, &sending, &pipe);
+
+    if (!ft || ft->status == 0)
+        return false;
+
+    memcpy(fileId, ft->id, FILE_ID_LENGTH);
+    return true;
+}
+
+bool FileTransferEngine::receiveToPath(uint32_t friendNumber, uint32_t fileNumber, const char* path, bool overwrite)
+{
+    Friend *f = this->node->getFriend(friendNumber);
+
+    if (!f || f->status != 4)
+        return false;
+
+    bool sending;
+    uint8_t pipe;
+    struct FileTransfers *ft = getTransfer(f, fileNumber, &sending, &pipe);
+
+    if (!ft || sending || ft->status != 1 || ft->sink)
+        return false;
+
+    struct FileSink *sink = FileWriter::open(path, ft->id, ft->size, overwrite);
+
+    if (!sink)
+        return false;
+
+    if (!this->writer)
+        this->writer = new FileWriter();
+
+    ft->sink = sink;
+
+    /* Skip the chunks a previous run already wrote, the bitmap covers any holes further in. */
+    uint32_t first = 0;
+
+    while (first < sink->chunkCount && FileWriter::isReceived(sink, first))
+        ++first;
+
+    uint64_t position = std::min((uint64_t)first * FILE_CHUNK_SIZE, ft->size);
+
+    if ((position > 0 && !this->seek(friendNumber, fileNumber, position))
+        || !this->control(friendNumber, fileNumber, FILE_CONTROL_RESUME)) {
+        this->closeSink(ft, false);
+        return false;
+    }
+
+    return true;
+}
+
+bool FileTransferEngine::sendChunk(uint32_t friendNumber, uint32_t fileNumber, uint64_t position, const uint8_t* data, size_t length)
+{
+    Friend *f = this->node->getFriend(friendNumber);
+
+    if (!f || fileNumber >= MAX_CONCURRENT_FILE_PIPES)
+        return false;
+
+    struct FileTransfers *ft = &f->file_sending[fileNumber];
+    struct FileWindow *window = ft->window;
+
+    if (ft->status != 3 || !window || position % FILE_CHUNK_SIZE != 0 || position >= ft->size)
+        return false;
+
+    uint32_t chunk = (uint32_t)(position / FILE_CHUNK_SIZE);
+
+    if (chunk < window->base || chunk >= window->nextRequest)
+        return false;
+
+    uint32_t slot = FILE_SLOT(chunk);
+
+    if (window->state[slot] != FILE_CHUNK_REQUESTED || length != chunkLength(ft, chunk))
+        return false;
+
+    memcpy(window->buffer + (size_t)slot * FILE_CHUNK_SIZE, data, length);
+    window->length[slot] = (uint16_t)length;
+    window->state[slot] = FILE_CHUNK_READY;
+
+    if (chunk < window->sendCursor)
+        window->sendCursor = chunk;
+
+    return true;
+}
+
+void FileTransferEngine::handlePacket(uint32_t friendNumber, const uint8_t* data, uint16_t length)
+{
+    Friend *f = this->node->getFriend(friendNumber);
+
+    if (!f || length < 2)
+        return;
+
+    switch (data[0]) {
+        case PACKET_ID_FILE_SENDREQUEST:
+            this->handleSendRequest(friendNumber, f, data, length);
+            break;
+
+        case PACKET_ID_FILE_CONTROL:
+            this->handleControl(friendNumber, f, data, length);
+            break;
+
+        case PACKET_ID_FILE_DATA:
+            this->handleData(friendNumber, f, data, length);
+            break;
+
+        case PACKET_ID_FILE_ACK:
+            this->handleAck(friendNumber, f, data, length);
+            break;
+    }
+}
+
+void FileTransferEngine::handleSendRequest(uint32_t friendNumber, Friend* f, const uint8_t* data, uint16_t length)
+{
+    if (length < 14 + FILE_ID_LENGTH || length > 14 + FILE_ID_LENGTH + MAX_FILENAME_LENGTH)
+        return;
+
+    uint8_t pipe = data[1];
+
+    if (pipe >= MAX_CONCURRENT_FILE_PIPES)
+        return;
+
+    struct FileTransfers *ft = &f->file_receiving[pipe];
+
+    /* The sender only reuses a pipe after telling us it is done with it. */
+    if (ft->status != 0)
+        return;
+
+    uint32_t fileKind = Utils::readUint32(data + 2);
+    uint64_t fileSize = Utils::readUint64(data + 6);
+
+    if (fileSize / FILE_CHUNK_SIZE >= UINT32_MAX)
+        return;
+
+    clearTransfer(ft);
+    ft->size = fileSize;
+    ft->status = 1;
+    memcpy(ft->id, data + 14, FILE_ID_LENGTH);
+    ++f->num_receiving_files;
+
+    if (this->node->fileReceiveCallback) {
+        this->node->fileReceiveCallback(this->node, friendNumber, ((uint32_t)pipe + 1) << 16, fileKind, fileSize,
+                                        data + 14 + FILE_ID_LENGTH, length - (14 + FILE_ID_LENGTH), this->node->userData);
+    }
+}
+
+void FileTransferEngine::handleControl(uint32_t friendNumber, Friend* f, const uint8_t* data, uint16_t length)
+{
+    if (length != 4 && !(length == 4 + sizeof(uint64_t) && data[3] == FILE_CONTROL_SEEK))
+        return;
+
+    /* data[1] is 0 if the sender of the packet is sending the file, 1 if it is receiving it. */
+    bool sending = data[1] == 1;
+    uint8_t pipe = data[2];
+    uint8_t control = data[3];
+
+    if (data[1] > 1 || pipe >= MAX_CONCURRENT_FILE_PIPES)
+        return;
+
+    struct FileTransfers *ft = sending ? &f->file_sending[pipe] : &f->file_receiving[pipe];
+    uint32_t fileNumber = sending ? pipe : ((uint32_t)pipe + 1) << 16;
+
+    if (ft->status == 0)
+        return;
+
+    switch (control) {
+        case FILE_CONTROL_RESUME:
+            if (sending && ft->status == 1) {
+                ft->window = newWindow(ft, true);
+
+                if (!f->file_congestion)
+                    f->file_congestion = newCongestion();
+
+                if (!ft->window || !f->file_congestion) {
+                    this->sendControl(friendNumber, true, pipe, FILE_CONTROL_CANCEL);
+                    this->finishTransfer(f, ft, true);
+                    return;
+                }
+
+                ft->status = 3;
+            } else if (ft->paused & 2) {
+                ft->paused &= ~2;
+            } else {
+                return;
+            }
+            break;
+
+        case FILE_CONTROL_PAUSE:
+            if (ft->status != 3 || (ft->paused & 2))
+                return;
+
+            ft->paused |= 2;
+            break;
+
+        case FILE_CONTROL_SEEK: {
+            /* The receiver resumes a file before accepting it. */
+            uint64_t position = Utils::readUint64(data + 4);
+
+            if (!sending || ft->status != 1 || position > ft->size || position % FILE_CHUNK_SIZE != 0)
+                return;
+
+            ft->transferred = position;
+            ft->requested = position;
+            return;
+        }
+
+        case FILE_CONTROL_CANCEL:
+            /* Cancelling a file we received completely only frees the pipe. */
+            if (ft->status == 5) {
+                if (ft->sink)
+                    this->completeSink(friendNumber, pipe, ft);
+
+                this->finishTransfer(f, ft, sending);
+                return;
+            }
+
+            this->finishTransfer(f, ft, sending);
+            break;
+
+        default:
+            return;
+    }
+
+    if (this->node->fileReceiveControlCallback) {
+        this->node->fileReceiveControlCallback(this->node, friendNumber, fileNumber, (FileControlType)control,
+                                               this->node->userData);
+    }
+
+    if (sending && ft->status == 3 && ft->window->base == ft->window->chunkCount) {
+        this->completeSend(friendNumber, f, pipe);
+    } else if (sending && ft->status == 3) {
+        this->requestChunks(friendNumber, pipe, ft);
+        this->sendChunks(friendNumber, f);
+    }
+}
+
+void FileTransferEngine::handleData(uint32_t friendNumber, Friend* f, const uint8_t* data, uint16_t length)
+{
+    if (length < FILE_DATA_HEADER_SIZE)
+        return;
+
+    uint8_t pipe = data[1];
+
+    if (pipe >= MAX_CONCURRENT_FILE_PIPES)
+        return;
+
+    struct FileTransfers *ft = &f->file_receiving[pipe];
+    struct FileWindow *window = ft->window;
+
+    if ((ft->status != 3 && ft->status != 5) || !window)
+        return;
+
+    uint32_t chunk = Utils::readUint32(data + 2);
+
+    if (chunk >= window->chunkCount || (chunk >= window->base && chunk - window->base >= FILE_WINDOW_SIZE))
+        return;
+
+    /* Duplicate, our acknowledgement got lost. */
+    if (chunk < window->base || isChunkReceived(ft, chunk)) {
+        this->sendAck(friendNumber, pipe, ft);
+        return;
+    }
+
+    uint16_t dataLength = length - FILE_DATA_HEADER_SIZE;
+
+    if (dataLength != chunkLength(ft, chunk))
+        return;
+
+    /* Disk behind the network: drop it, the sender will repeat it. */
+    if (ft->sink && !this->writer->write(ft->sink, chunk, data + FILE_DATA_HEADER_SIZE, dataLength))
+        return;
+
+    bool inOrder = chunk == window->base;
+    window->state[FILE_SLOT(chunk)] = FILE_CHUNK_ACKED;
+    ft->transferred += dataLength;
+
+    if (!ft->sink && this->node->fileReceiveChunkCallback) {
+        this->node->fileReceiveChunkCallback(this->node, friendNumber, ((uint32_t)pipe + 1) << 16,
+                                             (uint64_t)chunk * FILE_CHUNK_SIZE, data + FILE_DATA_HEADER_SIZE,
+                                             dataLength, this->node->userData);
+    }
+
+    /* The callback may have cancelled the transfer. */
+    if (ft->window != window)
+        return;
+
+    while (window->base < window->chunkCount && isChunkReceived(ft, window->base)) {
+        window->state[FILE_SLOT(window->base)] = FILE_CHUNK_FREE;
+        ++window->base;
+    }
+
+    ++window->unacked;
+
+    /* Out of order data means loss or reordering, the sender wants to know right away. */
+    if (!inOrder || window->unacked >= FILE_ACK_EVERY || window->base == window->chunkCount)
+        this->sendAck(friendNumber, pipe, ft);
+
+    if (window->base == window->chunkCount && ft->status == 3) {
+        /* Keep the window until the sender frees the pipe so lost acknowledgements are repeated. */
+        ft->status = 5;
+
+        if (!ft->sink && this->node->fileReceiveChunkCallback) {
+            this->node->fileReceiveChunkCallback(this->node, friendNumber, ((uint32_t)pipe + 1) << 16, ft->size,
+                                                 NULL, 0, this->node->userData);
+        }
+    }
+}
+
+void FileTransferEngine::handleAck(uint32_t friendNumber, Friend* f, const uint8_t* data, uint16_t length)
+{
+    if (length < FILE_ACK_HEADER_SIZE || length > FILE_ACK_HEADER_SIZE + FILE_ACK_BITMAP_SIZE)
+        return;
+
+    uint8_t pipe = data[1];
+
+    if (pipe >= MAX_CONCURRENT_FILE_PIPES)
+        return;
+
+    struct FileTransfers *ft = &f->file_sending[pipe];
+    struct FileWindow *window = ft->window;
+    struct CongestionWindow *cc = f->file_congestion;
+
+    if (ft->status != 3 || !window || !cc)
+        return;
+
+    uint32_t cumulative = Utils::readUint32(data + 2);
+
+    /* Stale or past the end. A receiver resuming from its sink can acknowledge chunks we never sent. */
+    if (cumulative < window->base || cumulative > window->chunkCount)
+        return;
+
+    uint64_t now = NetworkService::getCurrentTimeMonotonic();
+    uint32_t acked = 0;
+    uint64_t rttSample = 0;
+    bool haveSample = false;
+
+    for (uint32_t chunk = window->base; chunk < cumulative; ++chunk) {
+        uint32_t slot = FILE_SLOT(chunk);
+
+        switch (window->state[slot]) {
+            case FILE_CHUNK_SENT:
+                --window->inFlight;
+                ++acked;
+                break;
+
+            case FILE_CHUNK_LOST:
+                --window->lost;
+                ++acked;
+                break;
+
+            case FILE_CHUNK_REQUESTED:
+            case FILE_CHUNK_READY:
+                --window->pending;
+                break;
+
+            default:
+                break;
+        }
+
+        if (window->serial[slot] > window->ackedSerial)
+            window->ackedSerial = window->serial[slot];
+
+        /* Karn: retransmitted chunks give ambiguous samples. */
+        if (window->retransmissions[slot] == 0 && window->state[slot] == FILE_CHUNK_SENT) {
+            rttSample = now - window->sentTime[slot];
+            haveSample = true;
+        }
+
+        window->state[slot] = FILE_CHUNK_FREE;
+        ft->transferred += chunkLength(ft, chunk);
+    }
+
+    window->base = cumulative;
+
+    if (window->nextRequest < cumulative)
+        window->nextRequest = cumulative;
+
+    if (window->sendCursor < cumulative)
+        window->sendCursor = cumulative;
+
+    if (window->sendHighest < cumulative)
+        window->sendHighest = cumulative;
+
+    /* Bit i of the bitmap is chunk cumulative + 1 + i. */
+    const uint8_t *bitmap = data + FILE_ACK_HEADER_SIZE;
+    uint32_t bits = (uint32_t)(length - FILE_ACK_HEADER_SIZE) * 8;
+
+    for (uint32_t i = 0; i < bits; ++i) {
+        if (!(bitmap[i / 8] & (1 << (i % 8))))
+            continue;
+
+        uint32_t chunk = cumulative + 1 + i;
+
+        if (chunk >= window->sendHighest)
+            break;
+
+        uint32_t slot = FILE_SLOT(chunk);
+
+        if (window->state[slot] == FILE_CHUNK_SENT) {
+            --window->inFlight;
+        } else if (window->state[slot] == FILE_CHUNK_LOST) {
+            --window->lost;
+        } else {
+            continue;
+        }
+
+        if (window->serial[slot] > window->ackedSerial)
+            window->ackedSerial = window->serial[slot];
+
+        if (window->retransmissions[slot] == 0 && window->state[slot] == FILE_CHUNK_SENT) {
+            rttSample = now - window->sentTime[slot];
+            haveSample = true;
+        }
+
+        window->state[slot] = FILE_CHUNK_ACKED;
+        ++acked;
+    }
+
+    if (haveSample)
+        Congestion::onRttSample(cc, rttSample);
+
+    if (this->detectLosses(window, cc, now)) {
+        Congestion::onLoss(cc, now, false);
+    } else if (acked > 0) {
+        Congestion::onAcked(cc, acked);
+    }
+
+    if (window->base == window->chunkCount) {
+        this->completeSend(friendNumber, f, pipe);
+        return;
+    }
+
+    this->requestChunks(friendNumber, pipe, ft);
+    this->sendChunks(friendNumber, f);
+}
+
+/* Every chunk arrived: tell the receiver it can free the pipe, then the application (a request of length 0). */
+void FileTransferEngine::completeSend(uint32_t friendNumber, Friend* f, uint8_t fileNumber)
+{
+    struct FileTransfers *ft = &f->file_sending[fileNumber];
+    uint64_t size = ft->size;
+
+    this->sendControl(friendNumber, true, fileNumber, FILE_CONTROL_CANCEL);
+    this->finishTransfer(f, ft, true);
+
+    if (this->node->fileChunkRequestCallback)
+        this->node->fileChunkRequestCallback(this->node, friendNumber, fileNumber, size, 0, this->node->userData);
+}
+
+bool FileTransferEngine::sendControl(uint32_t friendNumber, bool sending, uint8_t fileNumber, FileControlType control)
+{
+    uint8_t packet[4];
+    packet[0] = PACKET_ID_FILE_CONTROL;
+    packet[1] = sending ? 0 : 1;
+    packet[2] = fileNumber;
+    packet[3] = (uint8_t)control;
+    return this->node->sendFriendPacket(friendNumber, packet, sizeof(packet), true) != -1;
+}
+
+void FileTransferEngine::sendAck(uint32_t friendNumber, uint8_t fileNumber, struct FileTransfers* ft)
+{
+    struct FileWindow *window = ft->window;
+    uint8_t packet[FILE_ACK_HEADER_SIZE + FILE_ACK_BITMAP_SIZE];
+    uint8_t *bitmap = packet + FILE_ACK_HEADER_SIZE;
+    uint32_t bitmapLength = 0;
+
+    packet[0] = PACKET_ID_FILE_ACK;
+    packet[1] = fileNumber;
+    Utils::writeUint32(packet + 2, window->base);
+    memset(bitmap, 0, FILE_ACK_BITMAP_SIZE);
+
+    for (uint32_t i = 0; i < FILE_WINDOW_SIZE - 1; ++i) {
+        uint32_t chunk = window->base + 1 + i;
+
+        if (chunk >= window->chunkCount)
+            break;
+
+        if (isChunkReceived(ft, chunk)) {
+            bitmap[i / 8] |= 1 << (i % 8);
+            bitmapLength = i / 8 + 1;
+        }
+    }
+
+    window->unacked = 0;
+    this->node->sendFriendPacket(friendNumber, packet, (uint16_t)(FILE_ACK_HEADER_SIZE + bitmapLength), false);
+}
+
+/* Ask the application for data far enough ahead that the pipe never waits for it. */
+void FileTransferEngine::requestChunks(uint32_t friendNumber, uint8_t fileNumber, struct FileTransfers* ft)
+{
+    struct FileWindow *window = ft->window;
+
+    if (ft->paused || !window)
+        return;
+
+    uint32_t target = ft->slots_allocated < FILE_INITIAL_WINDOW ? FILE_INITIAL_WINDOW : ft->slots_allocated;
+
+    if (ft->source) {
+        this->readChunks(friendNumber, fileNumber, ft, target);
+        return;
+    }
+
+    while (window->nextRequest < window->chunkCount && window->nextRequest - window->base < FILE_WINDOW_SIZE
+           && window->pending < target) {
+        uint32_t chunk = window->nextRequest++;
+        uint32_t slot = FILE_SLOT(chunk);
+        uint32_t length = chunkLength(ft, chunk);
+
+        window->state[slot] = FILE_CHUNK_REQUESTED;
+        window->retransmissions[slot] = 0;
+        window->length[slot] = (uint16_t)length;
+        ++window->pending;
+        ft->requested += length;
+
+        if (this->node->fileChunkRequestCallback) {
+            this->node->fileChunkRequestCallback(this->node, friendNumber, fileNumber, (uint64_t)chunk * FILE_CHUNK_SIZE,
+                                                 length, this->node->userData);
+        }
+
+        /* The callback may have cancelled the transfer. */
+        if (ft->window != window)
+            return;
+    }
+}
+
+/* requestChunks for transfers with a FileSource. */
+void FileTransferEngine::readChunks(uint32_t friendNumber, uint8_t fileNumber, struct FileTransfers* ft, uint32_t target)
+{
+#ifdef FILE_SOURCE_SUPPORTED
+    struct FileWindow *window = ft->window;
+    struct FileSource *source = ft->source;
+
+    while (window->nextRequest < window->chunkCount && window->nextRequest - window->base < FILE_WINDOW_SIZE
+           && window->pending < target) {
+        uint32_t first = window->nextRequest;
+        uint32_t count = target - window->pending;
+        uint32_t room = FILE_WINDOW_SIZE - (first - window->base);
+
+        if (count > room)
+            count = room;
+
+        if (count > window->chunkCount - first)
+            count = window->chunkCount - first;
+
+        if (!source->map) {
+            /* One read per run of slots, the ring wraps at the end of the buffer. */
+            if (count > FILE_WINDOW_SIZE - FILE_SLOT(first))
+                count = FILE_WINDOW_SIZE - FILE_SLOT(first);
+
+            uint64_t position = (uint64_t)first * FILE_CHUNK_SIZE;
+            uint64_t bytes = (uint64_t)(count - 1) * FILE_CHUNK_SIZE + chunkLength(ft, first + count - 1);
+            uint8_t *buffer = window->buffer + (size_t)FILE_SLOT(first) * FILE_CHUNK_SIZE;
+            uint64_t done = 0;
+
+            while (done < bytes) {
+                ssize_t n = pread(source->fd, buffer + done, (size_t)(bytes - done), (off_t)(position + done));
+
+                if (n <= 0) {
+                    if (n == -1 && errno == EINTR)
+                        continue;
+
+                    /* Unreadable or truncated file, the transfer can't go on. */
+                    Friend *f = this->node->getFriend(friendNumber);
+                    this->sendControl(friendNumber, true, fileNumber, FILE_CONTROL_CANCEL);
+                    this->finishTransfer(f, ft, true);
+
+                    if (this->node->fileReceiveControlCallback) {
+                        this->node->fileReceiveControlCallback(this->node, friendNumber, fileNumber, FILE_CONTROL_CANCEL,
+                                                               this->node->userData);
+                    }
+
+                    return;
+                }
+
+                done += (uint64_t)n;
+            }
+        }
+
+        for (uint32_t chunk = first; chunk < first + count; ++chunk) {
+            uint32_t slot = FILE_SLOT(chunk);
+            uint32_t length = chunkLength(ft, chunk);
+
+            window->state[slot] = FILE_CHUNK_READY;
+            window->retransmissions[slot] = 0;
+            window->length[slot] = (uint16_t)length;
+            ft->requested += length;
+        }
+
+        window->nextRequest += count;
+        window->pending += count;
+    }
+
+    /* Keep the kernel reading a window ahead of what we send. */
+    if (source->map && window->nextRequest + FILE_WINDOW_SIZE / 2 > source->prefetched
+        && source->prefetched < window->chunkCount) {
+        static const uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+        uint64_t from = (uint64_t)window->nextRequest * FILE_CHUNK_SIZE;
+        uint64_t to = ((uint64_t)window->nextRequest + FILE_WINDOW_SIZE) * FILE_CHUNK_SIZE;
+
+        if (to > source->mapLength)
+            to = source->mapLength;
+
+        from -= from % pageSize;
+        madvise((void *)(source->map + from), (size_t)(to - from), MADV_WILLNEED);
+        source->prefetched = window->nextRequest + FILE_WINDOW_SIZE;
+    }
+#endif
+}
+
+/* Share the congestion window between the pipes sending to a friend (max-min fair). */
+void FileTransferEngine::allocateSlots(Friend* f)
+{
+    uint32_t demand[MAX_CONCURRENT_FILE_PIPES];
+    uint32_t active = 0;
+
+    for (uint32_t i = 0; i < MAX_CONCURRENT_FILE_PIPES; ++i) {
+        struct FileTransfers *ft = &f->file_sending[i];
+        ft->slots_allocated = 0;
+        demand[i] = 0;
+
+        if (ft->status != 3 || ft->paused || !ft->window)
+            continue;
+
+        uint32_t remaining = ft->window->chunkCount - ft->window->base;
+        demand[i] = remaining < FILE_WINDOW_SIZE ? remaining : FILE_WINDOW_SIZE;
+
+        if (demand[i] > 0)
+            ++active;
+    }
+
+    uint32_t available = (uint32_t)f->file_congestion->window;
+
+    while (active > 0 && available > 0) {
+        uint32_t share = available / active;
+
+        if (share == 0)
+            share = 1;
+
+        for (uint32_t i = 0; i < MAX_CONCURRENT_FILE_PIPES && available > 0; ++i) {
+            struct FileTransfers *ft = &f->file_sending[i];
+            uint32_t want = demand[i] - ft->slots_allocated;
+
+            if (want == 0)
+                continue;
+
+            uint32_t given = want < share ? want : share;
+
+            if (given > available)
+                given = available;
+
+            ft->slots_allocated += given;
+            available -= given;
+
+            if (ft->slots_allocated == demand[i])
+                --active;
+        }
+    }
+}
+
+bool FileTransferEngine::sendChunkPacket(uint32_t friendNumber, uint8_t fileNumber, struct FileTransfers* ft, uint32_t chunk, uint64_t now)
+{
+    struct FileWindow *window = ft->window;
+    uint32_t slot = FILE_SLOT(chunk);
+    uint8_t header[FILE_DATA_HEADER_SIZE];
+    const uint8_t *data;
+
+    header[0] = PACKET_ID_FILE_DATA;
+    header[1] = fileNumber;
+    Utils::writeUint32(header + 2, chunk);
+
+    /* Handed over where it is, the transport copies it once into its packet and encrypts it there. */
+    if (ft->source && ft->source->map) {
+        data = ft->source->map + (uint64_t)chunk * FILE_CHUNK_SIZE;
+    } else {
+        data = window->buffer + (size_t)slot * FILE_CHUNK_SIZE;
+    }
+
+    if (this->node->sendFriendPacketParts(friendNumber, header, sizeof(header), data, window->length[slot]) == -1)
+        return false;
+
+    window->state[slot] = FILE_CHUNK_SENT;
+    window->serial[slot] = ++window->nextSerial;
+    window->sentTime[slot] = now;
+    ++window->inFlight;
+
+    if (window->sendHighest <= chunk)
+        window->sendHighest = chunk + 1;
+
+    return true;
+}
+
+void FileTransferEngine::sendChunks(uint32_t friendNumber, Friend* f)
+{
+    if (!f->file_congestion)
+        return;
+
+    this->allocateSlots(f);
+    uint64_t now = NetworkService::getCurrentTimeMonotonic();
+
+    for (uint32_t i = 0; i < MAX_CONCURRENT_FILE_PIPES; ++i) {
+        struct FileTransfers *ft = &f->file_sending[i];
+        struct FileWindow *window = ft->window;
+
+        if (ft->status != 3 || ft->paused || !window)
+            continue;
+
+        /* Retransmissions first, they hold back the window. */
+        for (uint32_t chunk = window->base; window->lost > 0 && window->inFlight < ft->slots_allocated
+             && chunk < window->nextRequest; ++chunk) {
+            uint32_t slot = FILE_SLOT(chunk);
+
+            if (window->state[slot] != FILE_CHUNK_LOST)
+                continue;
+
+            if (window->retransmissions[slot] < UINT8_MAX)
+                ++window->retransmissions[slot];
+
+            if (!this->sendChunkPacket(friendNumber, (uint8_t)i, ft, chunk, now))
+                return;
+
+            --window->lost;
+        }
+
+        while (window->inFlight < ft->slots_allocated && window->sendCursor < window->nextRequest) {
+            uint32_t chunk = window->sendCursor;
+            uint32_t slot = FILE_SLOT(chunk);
+
+            /* Chunks the application hasn't handed over yet keep the cursor. */
+            if (window->state[slot] == FILE_CHUNK_REQUESTED)
+                break;
+
+            if (window->state[slot] != FILE_CHUNK_READY) {
+                ++window->sendCursor;
+                continue;
+            }
+
+            if (!this->sendChunkPacket(friendNumber, (uint8_t)i, ft, chunk, now))
+                return;
+
+            --window->pending;
+            ++window->sendCursor;
+        }
+    }
+}
+
+/* A chunk is lost once a transmission sent FILE_DUPLICATE_THRESHOLD after it was
+ * acknowledged and it is overdue by a quarter round trip, which tolerates some
+ * reordering.
+ *
+ * return true if chunks were marked lost.
+ */
+bool FileTransferEngine::detectLosses(struct FileWindow* window, struct CongestionWindow* cc, uint64_t now)
+{
+    if (window->inFlight == 0 || window->ackedSerial < FILE_DUPLICATE_THRESHOLD || cc->smoothedRtt == 0)
+        return false;
+
+    uint32_t limit = window->ackedSerial - FILE_DUPLICATE_THRESHOLD;
+    uint64_t overdue = cc->smoothedRtt + cc->smoothedRtt / 4;
+    bool loss = false;
+
+    for (uint32_t chunk = window->base; chunk < window->sendHighest; ++chunk) {
+        uint32_t slot = FILE_SLOT(chunk);
+
+        if (window->state[slot] == FILE_CHUNK_SENT && window->serial[slot] <= limit
+            && now - window->sentTime[slot] >= overdue) {
+            window->state[slot] = FILE_CHUNK_LOST;
+            --window->inFlight;
+            ++window->lost;
+            loss = true;
+        }
+    }
+
+    return loss;
+}
+
+void FileTransferEngine::checkTimeouts(Friend* f, uint64_t now)
+{
+    struct CongestionWindow *cc = f->file_congestion;
+
+    if (!cc)
+        return;
+
+    bool loss = false;
+    bool timeout = false;
+
+    for (uint32_t i = 0; i < MAX_CONCURRENT_FILE_PIPES; ++i) {
+        struct FileWindow *window = f->file_sending[i].window;
+
+        if (f->file_sending[i].status != 3 || !window || window->inFlight == 0)
+            continue;
+
+        /* Chunks that were still within the reordering allowance when the last acknowledgement came. */
+        if (this->detectLosses(window, cc, now))
+            loss = true;
+
+        for (uint32_t chunk = window->base; chunk < window->sendHighest; ++chunk) {
+            uint32_t slot = FILE_SLOT(chunk);
+
+            if (window->state[slot] == FILE_CHUNK_SENT && now - window->sentTime[slot] >= cc->rto) {
+                window->state[slot] = FILE_CHUNK_LOST;
+                --window->inFlight;
+                ++window->lost;
+                timeout = true;
+            }
+        }
+    }
+
+    if (timeout || loss)
+        Congestion::onLoss(cc, now, timeout);
+}
+
+void FileTransferEngine::checkSinks(uint32_t friendNumber, Friend* f)
+{
+    for (uint32_t i = 0; i < MAX_CONCURRENT_FILE_PIPES; ++i) {
+        struct FileTransfers *ft = &f->file_receiving[i];
+
+        if (!ft->sink)
+            continue;
+
+        uint32_t fileNumber = (i + 1) << 16;
+
+        /* The disk gave up, the bitmap keeps what made it for a later resume. */
+        if (this->writer->hasFailed(ft->sink)) {
+            this->sendControl(friendNumber, false, (uint8_t)i, FILE_CONTROL_CANCEL);
+            this->finishTransfer(f, ft, false);
+
+            if (this->node->fileReceiveControlCallback) {
+                this->node->fileReceiveControlCallback(this->node, friendNumber, fileNumber, FILE_CONTROL_CANCEL,
+                                                       this->node->userData);
+            }
+        } else if (ft->status == 5 && this->writer->isIdle(ft->sink)) {
+            this->completeSink(friendNumber, (uint8_t)i, ft);
+        }
+    }
+}
+
+/* Every chunk of a received file is on disk: close it and tell the application. */
+void FileTransferEngine::completeSink(uint32_t friendNumber, uint8_t fileNumber, struct FileTransfers* ft)
+{
+    this->closeSink(ft, true);
+
+    if (this->node->fileReceiveChunkCallback) {
+        this->node->fileReceiveChunkCallback(this->node, friendNumber, ((uint32_t)fileNumber + 1) << 16, ft->size,
+                                             NULL, 0, this->node->userData);
+    }
+}
+
+void FileTransferEngine::closeSink(struct FileTransfers* ft, bool complete)
+{
+    if (ft->sink) {
+        this->writer->close(ft->sink, complete);
+        ft->sink = NULL;
+    }
+}
+
+void FileTransferEngine::finishTransfer(Friend* f, struct FileTransfers* ft, bool sending)
+{
+    if (ft->status == 0)
+        return;
+
+    this->closeSink(ft, false);
+    clearTransfer(ft);
+
+    if (sending) {
+        --f->num_sending_files;
+    } else {
+        --f->num_receiving_files;
+    }
+
+    if (f->num_sending_files == 0 && f->file_congestion) {
+        free(f->file_congestion);
+        f->file_congestion = NULL;
+    }
+}
+
+void FileTransferEngine::friendOffline(uint32_t friendNumber)
+{
+    Friend *f = this->node->getFriend(friendNumber);
+
+    if (f)
+        this->release(f);
+}
+
+void FileTransferEngine::release(Friend* f)
+{
+    for (uint32_t i = 0; i < MAX_CONCURRENT_FILE_PIPES; ++i) {
+        this->closeSink(&f->file_receiving[i], false);
+        clearTransfer(&f->file_sending[i]);
+        clearTransfer(&f->file_receiving[i]);
+    }
+
+    f->num_sending_files = 0;
+    f->num_receiving_files = 0;
+    free(f->file_congestion);
+    f->file_congestion = NULL;
+}
+
+void FileTransferEngine::tick()
+{
+    uint64_t now = NetworkService::getCurrentTimeMonotonic();
+
+    for (uint32_t friendNumber = 0; friendNumber < this->node->friends.size(); ++friendNumber) {
+        Friend *f = this->node->friends[friendNumber];
+
+        if (!f || f->status != 4)
+            continue;
+
+        for (uint32_t i = 0; i < MAX_CONCURRENT_FILE_PIPES && f->num_receiving_files > 0; ++i) {
+            struct FileTransfers *ft = &f->file_receiving[i];
+
+            if (ft->window && ft->window->unacked > 0)
+                this->sendAck(friendNumber, (uint8_t)i, ft);
+        }
+
+        if (f->num_receiving_files > 0 && this->writer)
+            this->checkSinks(friendNumber, f);
+
+        if (f->num_sending_files == 0)
+            continue;
+
+        this->checkTimeouts(f, now);
+
+        for (uint32_t i = 0; i < MAX_CONCURRENT_FILE_PIPES; ++i) {
+            if (f->file_sending[i].status == 3)
+                this->requestChunks(friendNumber, (uint8_t)i, &f->file_sending[i]);
+        }
+
+        this->sendChunks(friendNumber, f);
+    }
+}
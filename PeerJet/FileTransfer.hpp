@@ -0,0 +1,155 @@
+//
+//  FileTransfer.hpp
+//  PeerJet
+//
+//  Created by Compy on 12/6/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef FileTransfer_hpp
+#define FileTransfer_hpp
+
+#include <cstdint>
+#include <stdio.h>
+#include "Congestion.hpp"
+#include "Node.hpp"
+
+/* File data travels in fixed size chunks, chunk n starts at byte n * FILE_CHUNK_SIZE. */
+#define FILE_CHUNK_SIZE             1024
+
+/* Chunks a pipe can have between the oldest unacknowledged one and the newest
+ * one sent. Must be a power of two.
+ */
+#define FILE_WINDOW_SIZE            1024
+#define FILE_ACK_BITMAP_SIZE        (FILE_WINDOW_SIZE / 8)
+
+/* Receivers acknowledge after this many in order chunks, out of order chunks are acknowledged at once. */
+#define FILE_ACK_EVERY              8
+
+/* A chunk can be declared lost once a packet sent this many transmissions after it was acknowledged. */
+#define FILE_DUPLICATE_THRESHOLD    3
+
+#define FILE_INITIAL_WINDOW         8   /* chunks */
+#define FILE_MINIMUM_WINDOW         2   /* chunks */
+#define FILE_INITIAL_RTO            1000 /* ms */
+#define FILE_MINIMUM_RTO            200  /* ms, added to the smoothed RTT */
+#define FILE_MAXIMUM_RTO            10000 /* ms */
+
+/* Header of a PACKET_ID_FILE_DATA packet: id, file number, chunk number. */
+#define FILE_DATA_HEADER_SIZE       (1 + 1 + sizeof(uint32_t))
+
+/* Header of a PACKET_ID_FILE_ACK packet: id, file number, next expected chunk. */
+#define FILE_ACK_HEADER_SIZE        (1 + 1 + sizeof(uint32_t))
+
+typedef enum {
+    FILE_CHUNK_FREE,        /* not requested from the application yet */
+    FILE_CHUNK_REQUESTED,   /* asked the application for the data */
+    FILE_CHUNK_READY,       /* data buffered, not sent yet */
+    FILE_CHUNK_SENT,        /* in flight */
+    FILE_CHUNK_LOST,        /* waiting for a retransmission */
+    FILE_CHUNK_ACKED        /* selectively acknowledged, kept until the cumulative ack passes it */
+} FileChunkState;
+
+/* Sliding window of one pipe.
+ *
+ * Chunk n lives in slot n & (FILE_WINDOW_SIZE - 1). Senders keep every chunk
+ * from base up to nextRequest buffered until it is acknowledged, receivers
+ * only mark the chunks past base that already arrived (FILE_CHUNK_ACKED).
+ */
+struct FileWindow {
+    uint32_t base;          /* oldest chunk not acknowledged (sender) / next chunk expected (receiver) */
+    uint32_t nextRequest;   /* next chunk to ask the application for */
+    uint32_t chunkCount;    /* chunks in the file */
+    uint32_t inFlight;      /* chunks in FILE_CHUNK_SENT state */
+    uint32_t lost;          /* chunks in FILE_CHUNK_LOST state */
+    uint32_t pending;       /* chunks requested or ready but not sent yet */
+    uint32_t sendCursor;    /* no chunk before this one is FILE_CHUNK_READY */
+    uint32_t sendHighest;   /* one past the highest chunk sent, no chunk from it on is in flight */
+    uint32_t nextSerial;    /* transmissions of the pipe so far, numbers every packet sent */
+    uint32_t ackedSerial;   /* highest transmission acknowledged */
+    uint32_t unacked;       /* receiver: chunks received since the last acknowledgement */
+
+    uint8_t *buffer;        /* sender: FILE_WINDOW_SIZE chunks */
+    uint8_t state[FILE_WINDOW_SIZE];
+    uint8_t retransmissions[FILE_WINDOW_SIZE];
+    uint16_t length[FILE_WINDOW_SIZE];
+    uint32_t serial[FILE_WINDOW_SIZE];
+    uint64_t sentTime[FILE_WINDOW_SIZE];
+};
+
+/* Files below this size are read with pread, mapping them costs more than the copy. */
+#define FILE_SOURCE_MMAP_MINIMUM    (64 * 1024)
+
+/* File the library reads a transfer from (Node::fileSendPath, Node::fileSendFd).
+ *
+ * Large files are mapped and packets are built straight from the mapping, the
+ * kernel is asked to read ahead of the window. Otherwise chunks are read with
+ * pread into the window buffer, a run of free slots per call.
+ */
+struct FileSource {
+    int fd;
+    bool ownsFd;
+    const uint8_t *map;     /* NULL if pread is used */
+    uint64_t mapLength;
+    uint32_t prefetched;    /* chunks before this one were advised to the kernel */
+};
+
+class FileWriter;
+
+class FileTransferEngine {
+public:
+    FileTransferEngine(Node* node);
+    ~FileTransferEngine();
+
+    int32_t send(uint32_t friendNumber, uint32_t fileKind, uint64_t fileSize, const uint8_t* fileId,
+                 const uint8_t* filename, size_t filenameLength);
+    bool control(uint32_t friendNumber, uint32_t fileNumber, FileControlType control);
+    bool sendChunk(uint32_t friendNumber, uint32_t fileNumber, uint64_t position, const uint8_t* data, size_t length);
+
+    int32_t sendPath(uint32_t friendNumber, uint32_t fileKind, const char* path, const uint8_t* fileId,
+                     const uint8_t* filename, size_t filenameLength);
+    int32_t sendFd(uint32_t friendNumber, uint32_t fileKind, int fd, bool ownsFd, const uint8_t* fileId,
+                   const uint8_t* filename, size_t filenameLength);
+
+    bool seek(uint32_t friendNumber, uint32_t fileNumber, uint64_t position);
+    bool getFileId(uint32_t friendNumber, uint32_t fileNumber, uint8_t* fileId);
+    bool receiveToPath(uint32_t friendNumber, uint32_t fileNumber, const char* path, bool overwrite);
+
+    /* Handle a PACKET_ID_FILE_* packet from a friend. */
+    void handlePacket(uint32_t friendNumber, const uint8_t* data, uint16_t length);
+
+    /* Friend went offline, every transfer with it is broken. */
+    void friendOffline(uint32_t friendNumber);
+
+    /* Free everything held by the transfers of a friend that is being removed. */
+    void release(Friend* f);
+
+    void tick();
+
+private:
+    void handleSendRequest(uint32_t friendNumber, Friend* f, const uint8_t* data, uint16_t length);
+    void handleControl(uint32_t friendNumber, Friend* f, const uint8_t* data, uint16_t length);
+    void handleData(uint32_t friendNumber, Friend* f, const uint8_t* data, uint16_t length);
+    void handleAck(uint32_t friendNumber, Friend* f, const uint8_t* data, uint16_t length);
+
+    bool sendControl(uint32_t friendNumber, bool sending, uint8_t fileNumber, FileControlType control);
+    void sendAck(uint32_t friendNumber, uint8_t fileNumber, struct FileTransfers* ft);
+
+    void requestChunks(uint32_t friendNumber, uint8_t fileNumber, struct FileTransfers* ft);
+    void readChunks(uint32_t friendNumber, uint8_t fileNumber, struct FileTransfers* ft, uint32_t target);
+    void sendChunks(uint32_t friendNumber, Friend* f);
+    bool sendChunkPacket(uint32_t friendNumber, uint8_t fileNumber, struct FileTransfers* ft, uint32_t chunk, uint64_t now);
+    bool detectLosses(struct FileWindow* window, struct CongestionWindow* cc, uint64_t now);
+    void checkTimeouts(Friend* f, uint64_t now);
+    void allocateSlots(Friend* f);
+    void completeSend(uint32_t friendNumber, Friend* f, uint8_t fileNumber);
+    void finishTransfer(Friend* f, struct FileTransfers* ft, bool sending);
+    void checkSinks(uint32_t friendNumber, Friend* f);
+    void completeSink(uint32_t friendNumber, uint8_t fileNumber, struct FileTransfers* ft);
+    void closeSink(struct FileTransfers* ft, bool complete);
+
+    Node* node;
+    FileWriter* writer; /* started with the first FileSink */
+};
+
+#endif /* FileTransfer_hpp */
@@ -0,0 +1,281 @@
+//
+//  LanDiscovery.cpp
+//  PeerJet
+//
+//  Created by Compy on 12/15/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <algorithm>
+#include <string.h>
+#include "Crypto.hpp"
+#include "LanDiscovery.hpp"
+
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined(WIN32)
+#include <ifaddrs.h>
+#include <net/if.h>
+#define LAN_DISCOVERY_INTERFACES
+#endif
+
+LanDiscovery::LanDiscovery(Node* node, NetworkingCore* net)
+    : node(node), net(net), interfacesChecked(0), interfacesFailed(false), backoff(LAN_DISCOVERY_INTERVAL_MIN),
+      heardNew(false)
+{
+    /* Nodes started together don't all announce at once. */
+    this->nextAnnounce = NetworkService::getCurrentTimeMonotonic() + Crypto::randomInt() % LAN_DISCOVERY_INTERVAL_MIN;
+    NetworkService::registerHandler(net, NET_PACKET_LAN_DISCOVERY, &LanDiscovery::handlePacket, this);
+}
+
+LanDiscovery::~LanDiscovery()
+{
+    NetworkService::registerHandler(this->net, NET_PACKET_LAN_DISCOVERY, NULL, NULL);
+}
+
+bool LanDiscovery::isLanAddress(const IP *ip)
+{
+    if (ip->family == AF_INET) {
+        const uint8_t *a = ip->ip4.uint8;
+
+        return a[0] == 127                                  /* loopback */
+            || a[0] == 10                                   /* 10.0.0.0/8 */
+            || (a[0] == 172 && (a[1] & 0xF0) == 16)         /* 172.16.0.0/12 */
+            || (a[0] == 192 && a[1] == 168)                 /* 192.168.0.0/16 */
+            || (a[0] == 169 && a[1] == 254)                 /* link local */
+            || (a[0] == 100 && (a[1] & 0xC0) == 64);        /* carrier grade NAT, 100.64.0.0/10 */
+    }
+
+    if (ip->family == AF_INET6) {
+        if (IPV6_IPV4_IN_V6(ip->ip6)) {
+            IP ip4;
+            ip4.family = AF_INET;
+            ip4.ip4.uint32 = ip->ip6.uint32[3];
+            return LanDiscovery::isLanAddress(&ip4);
+        }
+
+        const uint8_t *a = ip->ip6.uint8;
+
+        return (a[0] == 0xFE && (a[1] & 0xC0) == 0x80)      /* link local, fe80::/10 */
+            || (a[0] & 0xFE) == 0xFC                        /* unique local, fc00::/7 */
+            || (ip->ip6.uint64[0] == 0 && ip->ip6.uint32[2] == 0 && ip->ip6.uint32[3] == htonl(1)); /* ::1 */
+    }
+
+    return false;
+}
+
+/* Enumerate the broadcast address of every interface that is up. Virtual
+ * transports have no interfaces, they get the limited broadcast address only.
+ */
+void LanDiscovery::refreshInterfaces(uint64_t now)
+{
+    std::vector<IP> broadcasts;
+
+#ifdef LAN_DISCOVERY_INTERFACES
+    struct ifaddrs *interfaces = NULL;
+
+    if (!this->net->transport.send && getifaddrs(&interfaces) == 0) {
+        for (struct ifaddrs *i = interfaces; i && broadcasts.size() < LAN_DISCOVERY_MAX_INTERFACES; i = i->ifa_next) {
+            if (!i->ifa_addr || i->ifa_addr->sa_family != AF_INET || !(i->ifa_flags & IFF_UP)
+                || !(i->ifa_flags & IFF_BROADCAST) || (i->ifa_flags & IFF_LOOPBACK) || !i->ifa_broadaddr)
+                continue;
+
+            IP ip;
+            NetworkService::ipReset(&ip);
+            ip.family = AF_INET;
+            ip.ip4.in_addr = ((struct sockaddr_in *)i->ifa_broadaddr)->sin_addr;
+
+            bool known = false;
+
+            for (size_t j = 0; j < broadcasts.size() && !known; ++j)
+                known = broadcasts[j].ip4.uint32 == ip.ip4.uint32;
+
+            if (!known && ip.ip4.uint32 != 0)
+                broadcasts.push_back(ip);
+        }
+
+        freeifaddrs(interfaces);
+    }
+#endif
+
+    if (broadcasts.empty()) {
+        IP ip;
+        NetworkService::ipReset(&ip);
+        ip.family = AF_INET;
+        ip.ip4.uint32 = INADDR_BROADCAST;
+        broadcasts.push_back(ip);
+    }
+
+    /* All nodes on every link, the IPv6 socket joined the group when it was created. */
+    if (this->net->family == AF_INET6 && !this->net->transport.send) {
+        IP ip;
+        NetworkService::ipReset(&ip);
+        ip.family = AF_INET6;
+        ip.ip6.uint8[0] = 0xFF;
+        ip.ip6.uint8[1] = 0x02;
+        ip.ip6.uint8[15] = 0x01;
+        broadcasts.push_back(ip);
+    }
+
+    this->interfacesChecked = now;
+    this->interfacesFailed = false;
+
+    bool changed = broadcasts.size() != this->broadcasts.size();
+
+    for (size_t i = 0; i < broadcasts.size() && !changed; ++i)
+        changed = !NetworkService::ipEqual(&broadcasts[i], &this->broadcasts[i]);
+
+    if (!changed)
+        return;
+
+    /* A new network means new nodes to find, start over. The first
+     * enumeration keeps the random start picked in the constructor.
+     */
+    bool first = this->broadcasts.empty();
+    this->broadcasts.swap(broadcasts);
+    this->backoff = LAN_DISCOVERY_INTERVAL_MIN;
+
+    if (!first)
+        this->nextAnnounce = std::min(this->nextAnnounce, now);
+}
+
+bool LanDiscovery::hasOfflineFriends()
+{
+    for (size_t i = 0; i < this->node->friends.size(); ++i) {
+        if (!this->node->friends[i] || this->node->friends[i]->status != 4)
+            return true;
+    }
+
+    return false;
+}
+
+void LanDiscovery::tick()
+{
+    uint64_t now = NetworkService::getCurrentTimeMonotonic();
+
+    if (this->interfacesFailed || this->interfacesChecked == 0
+        || now - this->interfacesChecked >= LAN_DISCOVERY_INTERFACE_REFRESH)
+        this->refreshInterfaces(now);
+
+    if (now < this->nextAnnounce)
+        return;
+
+    /* Quiet LAN, wait longer. */
+    if (!this->heardNew)
+        this->backoff = std::min<uint32_t>(this->backoff * 2, LAN_DISCOVERY_INTERVAL_MAX);
+
+    this->heardNew = false;
+
+    for (std::unordered_map<uint64_t, uint64_t>::iterator it = this->nodes.begin(); it != this->nodes.end(); ) {
+        if (now - it->second >= LAN_DISCOVERY_NODE_TIMEOUT) {
+            it = this->nodes.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    /* Nobody to look for: others looking for us still get our replies. */
+    if (this->hasOfflineFriends())
+        this->announce();
+
+    /* Spread over 0.5 to 1.5 times the interval so the announces of a segment don't line up. */
+    uint32_t interval = this->getInterval();
+    this->nextAnnounce = now + interval / 2 + Crypto::randomInt() % (interval + 1);
+}
+
+uint32_t LanDiscovery::getInterval()
+{
+    uint64_t segment = (uint64_t)this->nodes.size() * 1000 / LAN_DISCOVERY_SEGMENT_RATE;
+    return (uint32_t)std::max<uint64_t>(this->backoff, segment);
+}
+
+void LanDiscovery::friendAdded()
+{
+    this->backoff = LAN_DISCOVERY_INTERVAL_MIN;
+    this->nextAnnounce = std::min(this->nextAnnounce, NetworkService::getCurrentTimeMonotonic() + LAN_DISCOVERY_INTERVAL_MIN);
+}
+
+void LanDiscovery::announce()
+{
+    uint8_t packet[LAN_DISCOVERY_PACKET_SIZE];
+    packet[0] = NET_PACKET_LAN_DISCOVERY;
+    packet[1] = LAN_DISCOVERY_ANNOUNCE;
+    memcpy(packet + 2, this->node->address, PEERJET_KEY_LENGTH);
+
+    IP_Port target;
+    target.port = htons(TOX_PORT_DEFAULT);
+
+    for (size_t i = 0; i < this->broadcasts.size(); ++i) {
+        target.ip = this->broadcasts[i];
+
+        if (NetworkService::sendPacket(this->net, target, packet, sizeof(packet)) == -1)
+            this->interfacesFailed = true;
+
+        /* Nodes that didn't get the default port are found by their own announces. */
+        if (this->net->port != target.port) {
+            IP_Port ours = target;
+            ours.port = this->net->port;
+            NetworkService::sendPacket(this->net, ours, packet, sizeof(packet));
+        }
+    }
+}
+
+void LanDiscovery::heard(const uint8_t *publicKey, uint64_t now)
+{
+    uint64_t key;
+    memcpy(&key, publicKey, sizeof(key));
+    std::unordered_map<uint64_t, uint64_t>::iterator it = this->nodes.find(key);
+
+    if (it != this->nodes.end()) {
+        it->second = now;
+    } else if (this->nodes.size() < LAN_DISCOVERY_MAX_NODES) {
+        this->nodes[key] = now;
+        this->heardNew = true;
+    }
+}
+
+int LanDiscovery::handlePacket(void *object, IP_Port source, const uint8_t *data, uint16_t length)
+{
+    LanDiscovery *lan = (LanDiscovery *)object;
+    Node *node = lan->node;
+
+    if (length != LAN_DISCOVERY_PACKET_SIZE || data[1] > LAN_DISCOVERY_REPLY || !LanDiscovery::isLanAddress(&source.ip))
+        return -1;
+
+    const uint8_t *publicKey = data + 2;
+
+    /* Our own broadcast looping back. */
+    if (Crypto::comparePublicKeys(publicKey, node->address) == 0)
+        return 0;
+
+    uint64_t now = NetworkService::getCurrentTimeMonotonic();
+
+    if (data[1] == LAN_DISCOVERY_ANNOUNCE)
+        lan->heard(publicKey, now);
+
+    int friendNumber = node->getFriendByPublicKey(publicKey);
+
+    if (friendNumber == -1)
+        return 0;
+
+    Friend *f = node->getFriend((uint32_t)friendNumber);
+
+    /* Every announce of a friend we already found there is answered only once in a while. */
+    if (f->lan_found && now - f->lan_found < LAN_DISCOVERY_FRIEND_INTERVAL
+        && NetworkService::ipportEqual(&f->lan_address, &source))
+        return 0;
+
+    f->lan_address = source;
+    f->lan_found = now;
+
+    if (data[1] == LAN_DISCOVERY_ANNOUNCE) {
+        uint8_t reply[LAN_DISCOVERY_PACKET_SIZE];
+        reply[0] = NET_PACKET_LAN_DISCOVERY;
+        reply[1] = LAN_DISCOVERY_REPLY;
+        memcpy(reply + 2, node->address, PEERJET_KEY_LENGTH);
+        NetworkService::sendPacket(lan->net, source, reply, sizeof(reply));
+    }
+
+    if (node->transport.friendFoundOnLan)
+        node->transport.friendFoundOnLan(node->transport.object, friendNumber, source);
+
+    return 0;
+}
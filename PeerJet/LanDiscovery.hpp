@@ -0,0 +1,92 @@
+//
+//  LanDiscovery.hpp
+//  PeerJet
+//
+//  Created by Compy on 12/15/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef LanDiscovery_hpp
+#define LanDiscovery_hpp
+
+#include <cstdint>
+#include <stdio.h>
+#include <unordered_map>
+#include <vector>
+#include "Node.hpp"
+
+/* NET_PACKET_LAN_DISCOVERY packet: [id][kind][public key of the sender]. */
+#define LAN_DISCOVERY_PACKET_SIZE       (2 + PEERJET_KEY_LENGTH)
+#define LAN_DISCOVERY_ANNOUNCE          0   /* broadcast to the LAN */
+#define LAN_DISCOVERY_REPLY             1   /* sent back to a friend whose announce we heard */
+
+/* Announces go out every LAN_DISCOVERY_INTERVAL_MIN ms at first, the interval
+ * doubles up to LAN_DISCOVERY_INTERVAL_MAX each time no new node was heard since
+ * the last announce. It is also never below the number of nodes heard divided by
+ * LAN_DISCOVERY_SEGMENT_RATE per second, so the announces of a whole segment stay
+ * around that rate however many nodes share it.
+ */
+#define LAN_DISCOVERY_INTERVAL_MIN      1000
+#define LAN_DISCOVERY_INTERVAL_MAX      60000
+#define LAN_DISCOVERY_SEGMENT_RATE      4
+
+/* Nodes heard are forgotten after this long (ms), at most LAN_DISCOVERY_MAX_NODES are counted. */
+#define LAN_DISCOVERY_NODE_TIMEOUT      (3 * LAN_DISCOVERY_INTERVAL_MAX)
+#define LAN_DISCOVERY_MAX_NODES         4096
+
+/* A friend found again at the same address within this long (ms) is neither replied to nor reported again. */
+#define LAN_DISCOVERY_FRIEND_INTERVAL   5000
+
+/* Interfaces are enumerated again this often (ms), or as soon as sending to one fails. */
+#define LAN_DISCOVERY_INTERFACE_REFRESH 30000
+#define LAN_DISCOVERY_MAX_INTERFACES    16
+
+/* Finds friends on the same LAN, see NodeConfiguration::localDiscoveryEnabled.
+ *
+ * While some friend isn't online we broadcast our public key to every
+ * interface (ff02::1 too on an IPv6 socket). A node that has us as a friend
+ * answers with a reply sent straight back, and both ends hand the address of
+ * the other to the connection layer (FriendTransport::friendFoundOnLan), which
+ * can connect there directly.
+ */
+class LanDiscovery {
+public:
+    LanDiscovery(Node* node, NetworkingCore* net);
+    ~LanDiscovery();
+
+    /* Send our announce when it is due. */
+    void tick();
+
+    /* A friend was added, look for it right away. */
+    void friendAdded();
+
+    /* return the current interval between our announces in ms. */
+    uint32_t getInterval();
+
+    /* return true if ip is a loopback, link local or private address. */
+    static bool isLanAddress(const IP* ip);
+
+private:
+    static int handlePacket(void* object, IP_Port source, const uint8_t* data, uint16_t length);
+
+    void refreshInterfaces(uint64_t now);
+    void announce();
+    void heard(const uint8_t* publicKey, uint64_t now);
+    bool hasOfflineFriends();
+
+    Node* node;
+    NetworkingCore* net;
+
+    std::vector<IP> broadcasts;     /* broadcast address of every interface, cached */
+    uint64_t interfacesChecked;
+    bool interfacesFailed;          /* a send failed, enumerate again before the next announce */
+
+    uint64_t nextAnnounce;
+    uint32_t backoff;
+    bool heardNew;                  /* a node we didn't know was heard since our last announce */
+
+    /* Nodes heard, by the first 8 bytes of their key, with when they were last heard. */
+    std::unordered_map<uint64_t, uint64_t> nodes;
+};
+
+#endif /* LanDiscovery_hpp */
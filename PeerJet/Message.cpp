@@ -0,0 +1,341 @@
+//
+//  Message.cpp
+//  PeerJet
+//
+//  Created by Compy on 12/12/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "Message.hpp"
+#include "NetworkService.hpp"
+#include "Utils.hpp"
+
+#define MESSAGE_SLOT(packet) ((packet) & (MESSAGE_RECEIPT_RING - 1))
+
+MessageEngine::MessageEngine(Node* node) : node(node)
+{
+}
+
+MessageEngine::~MessageEngine()
+{
+}
+
+struct MessageQueue* MessageEngine::getQueue(Friend* f)
+{
+    if (!f->messages) {
+        f->messages = (struct MessageQueue *)calloc(1, sizeof(struct MessageQueue));
+
+        if (!f->messages)
+            return NULL;
+
+        f->messages->receiptedMessage = f->message_id;
+    }
+
+    return f->messages;
+}
+
+/* Make room for a record of size bytes at the end of the packet being filled.
+ *
+ * return where to write it, NULL if it doesn't fit and the packet has to be sent first.
+ */
+static uint8_t* reserve(struct MessageQueue *queue, size_t size)
+{
+    if (queue->pendingLength + size > MESSAGE_PACKET_SIZE)
+        return NULL;
+
+    if (queue->pendingLength == 0)
+        queue->pendingLength = MESSAGE_HEADER_SIZE;
+
+    uint8_t *record = queue->pending + queue->pendingLength;
+    queue->pendingLength += size;
+    return record;
+}
+
+/* return the length of the record of message written to record. */
+static size_t encode(MessageType type, const uint8_t *message, size_t length, uint8_t *record)
+{
+    uint16_t size = htons((uint16_t)length);
+    record[0] = (uint8_t)type;
+    memcpy(record + 1, &size, sizeof(size));
+    memcpy(record + MESSAGE_RECORD_HEADER_SIZE, message, length);
+    return MESSAGE_RECORD_HEADER_SIZE + length;
+}
+
+int64_t MessageEngine::send(uint32_t friendNumber, MessageType type, const uint8_t *message, size_t length)
+{
+    Friend *f = this->node->getFriend(friendNumber);
+
+    if (!f || f->status != 4 || length == 0 || length > MAX_MESSAGE_LENGTH)
+        return -1;
+
+    struct MessageQueue *queue = this->getQueue(f);
+
+    if (!queue)
+        return -1;
+
+    size_t size = MESSAGE_RECORD_HEADER_SIZE + length;
+    uint8_t *record = reserve(queue, size);
+
+    /* The packet being filled can't take it, send it and start another one. */
+    if (!record && (!this->flush(friendNumber, queue) || !(record = reserve(queue, size))))
+        return -1;
+
+    encode(type, message, length, record);
+
+    queue->pendingMessage = ++f->message_id;
+
+    /* Nothing in flight, no reason to wait: later messages are packed together
+     * until this packet is acknowledged or the next tick, whichever comes first.
+     */
+    if (queue->nextPacket == queue->ackedPacket)
+        this->flush(friendNumber, queue);
+
+    return queue->pendingMessage;
+}
+
+size_t MessageEngine::broadcast(const uint32_t *friendNumbers, size_t count, MessageType type, const uint8_t *message,
+                                size_t length, int64_t *messageIds)
+{
+    uint8_t record[MESSAGE_RECORD_HEADER_SIZE + MAX_MESSAGE_LENGTH];
+    size_t size = 0;
+    size_t queued = 0;
+
+    if (length > 0 && length <= MAX_MESSAGE_LENGTH)
+        size = encode(type, message, length, record);
+
+    for (size_t i = 0; i < count; ++i) {
+        Friend *f = this->node->getFriend(friendNumbers[i]);
+        struct MessageQueue *queue = size > 0 && f && f->status == 4 ? this->getQueue(f) : NULL;
+
+        if (messageIds)
+            messageIds[i] = -1;
+
+        uint8_t *p = queue ? reserve(queue, size) : NULL;
+
+        if (!queue || (!p && (!this->flush(friendNumbers[i], queue) || !(p = reserve(queue, size)))))
+            continue;
+
+        memcpy(p, record, size);
+
+        queue->pendingMessage = ++f->message_id;
+        ++queued;
+
+        if (messageIds)
+            messageIds[i] = queue->pendingMessage;
+
+        if (queue->nextPacket == queue->ackedPacket)
+            this->addToBatch(friendNumbers[i], queue);
+    }
+
+    this->sendBatch();
+    return queued;
+}
+
+/* Write the header of the packet being filled.
+ *
+ * return false if there is nothing to send or no room in the receipt ring.
+ */
+bool MessageEngine::prepare(struct MessageQueue *queue)
+{
+    if (queue->pendingLength == 0 || queue->nextPacket - queue->ackedPacket >= MESSAGE_RECEIPT_RING)
+        return false;
+
+    queue->pending[0] = PACKET_ID_MESSAGE;
+    Utils::writeUint32(queue->pending + 1, queue->nextPacket);
+    return true;
+}
+
+/* The packet being filled was sent. */
+void MessageEngine::commit(struct MessageQueue *queue)
+{
+    queue->receipts[MESSAGE_SLOT(queue->nextPacket)] = queue->pendingMessage;
+    ++queue->nextPacket;
+    queue->pendingLength = 0;
+}
+
+/* return false if the queued messages couldn't be sent, they stay queued. */
+bool MessageEngine::flush(uint32_t friendNumber, struct MessageQueue *queue)
+{
+    if (queue->pendingLength == 0)
+        return true;
+
+    if (!this->prepare(queue)
+        || this->node->sendFriendPacket(friendNumber, queue->pending, queue->pendingLength, true) == -1)
+        return false;
+
+    this->commit(queue);
+    return true;
+}
+
+void MessageEngine::addToBatch(uint32_t friendNumber, struct MessageQueue *queue)
+{
+    if (queue->batched)
+        return;
+
+    queue->batched = true;
+    this->batch.push_back(std::make_pair(friendNumber, queue));
+}
+
+/* Hand the queued messages and receipts of every friend in the batch to the connection layer at once. */
+void MessageEngine::sendBatch()
+{
+    this->packets.clear();
+
+    for (size_t i = 0; i < this->batch.size(); ++i) {
+        uint32_t friendNumber = this->batch[i].first;
+        struct MessageQueue *queue = this->batch[i].second;
+        queue->batched = false;
+
+        if (this->prepare(queue)) {
+            FriendPacket packet = {friendNumber, queue->pending, queue->pendingLength, -1};
+            this->packets.push_back(packet);
+        }
+
+        if (queue->receiptDue) {
+            queue->receipt[0] = PACKET_ID_MESSAGE_RECEIPT;
+            Utils::writeUint32(queue->receipt + 1, queue->receivedPacket);
+            FriendPacket packet = {friendNumber, queue->receipt, MESSAGE_RECEIPT_SIZE, -1};
+            this->packets.push_back(packet);
+        }
+    }
+
+    this->node->sendFriendPackets(this->packets.data(), this->packets.size());
+
+    for (size_t i = 0, j = 0; i < this->packets.size(); ++i) {
+        while (this->packets[i].friendNumber != this->batch[j].first)
+            ++j;
+
+        struct MessageQueue *queue = this->batch[j].second;
+
+        if (this->packets[i].result == -1)
+            continue;
+
+        if (this->packets[i].data == queue->pending) {
+            this->commit(queue);
+        } else {
+            queue->receiptDue = false;
+        }
+    }
+
+    this->batch.clear();
+}
+
+void MessageEngine::handlePacket(uint32_t friendNumber, const uint8_t *data, uint16_t length)
+{
+    Friend *f = this->node->getFriend(friendNumber);
+
+    if (!f)
+        return;
+
+    switch (data[0]) {
+        case PACKET_ID_MESSAGE:
+            this->handleMessages(friendNumber, f, data, length);
+            break;
+
+        case PACKET_ID_MESSAGE_RECEIPT:
+            this->handleReceipt(friendNumber, f, data, length);
+            break;
+    }
+}
+
+void MessageEngine::handleMessages(uint32_t friendNumber, Friend* f, const uint8_t *data, uint16_t length)
+{
+    if (length <= MESSAGE_HEADER_SIZE)
+        return;
+
+    struct MessageQueue *queue = this->getQueue(f);
+
+    if (!queue)
+        return;
+
+    /* A packet with a bad record is dropped whole, none of its messages is delivered or receipted. */
+    for (size_t offset = MESSAGE_HEADER_SIZE; offset < length; ) {
+        if (offset + MESSAGE_RECORD_HEADER_SIZE > length)
+            return;
+
+        uint16_t size = Utils::readUint16(data + offset + 1);
+
+        if (size == 0 || offset + MESSAGE_RECORD_HEADER_SIZE + size > length || data[offset] > MESSAGE_TYPE_ACTION)
+            return;
+
+        offset += MESSAGE_RECORD_HEADER_SIZE + size;
+    }
+
+    /* Lossless packets arrive in order, the one receipt covers this one and every one before. */
+    queue->receivedPacket = Utils::readUint32(data + 1) + 1;
+    queue->receiptDue = true;
+
+    for (size_t offset = MESSAGE_HEADER_SIZE; offset < length; ) {
+        uint8_t type = data[offset];
+        uint16_t size = Utils::readUint16(data + offset + 1);
+        offset += MESSAGE_RECORD_HEADER_SIZE;
+
+        if (this->node->friendMessageCallback)
+            this->node->friendMessageCallback(this->node, friendNumber, (MessageType)type, data + offset, size,
+                                              this->node->userData);
+
+        /* The callback may have removed the friend. */
+        if (this->node->getFriend(friendNumber) != f)
+            return;
+
+        offset += size;
+    }
+}
+
+void MessageEngine::handleReceipt(uint32_t friendNumber, Friend* f, const uint8_t *data, uint16_t length)
+{
+    struct MessageQueue *queue = f->messages;
+
+    if (!queue || length != MESSAGE_RECEIPT_SIZE)
+        return;
+
+    uint32_t received = Utils::readUint32(data + 1);
+
+    if (received == queue->ackedPacket || received - queue->ackedPacket > queue->nextPacket - queue->ackedPacket)
+        return;
+
+    uint32_t last = queue->receipts[MESSAGE_SLOT(received - 1)];
+    queue->ackedPacket = received;
+
+    /* Whatever was waiting for this receipt goes out before the callbacks run. */
+    this->flush(friendNumber, queue);
+
+    while (queue->receiptedMessage != last) {
+        uint32_t messageId = ++queue->receiptedMessage;
+
+        if (this->node->friendReadReceiptCallback)
+            this->node->friendReadReceiptCallback(this->node, friendNumber, messageId, this->node->userData);
+
+        if (this->node->getFriend(friendNumber) != f || f->messages != queue)
+            return;
+    }
+}
+
+void MessageEngine::friendOffline(uint32_t friendNumber)
+{
+    Friend *f = this->node->getFriend(friendNumber);
+
+    if (f)
+        this->release(f);
+}
+
+void MessageEngine::release(Friend* f)
+{
+    free(f->messages);
+    f->messages = NULL;
+}
+
+void MessageEngine::tick()
+{
+    for (uint32_t friendNumber = 0; friendNumber < this->node->friends.size(); ++friendNumber) {
+        Friend *f = this->node->friends[friendNumber];
+        struct MessageQueue *queue = f ? f->messages : NULL;
+
+        if (queue && f->status == 4 && (queue->pendingLength > 0 || queue->receiptDue))
+            this->addToBatch(friendNumber, queue);
+    }
+
+    this->sendBatch();
+}
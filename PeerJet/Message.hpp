@@ -0,0 +1,106 @@
+//
+//  Message.hpp
+//  PeerJet
+//
+//  Created by Compy on 12/12/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef Message_hpp
+#define Message_hpp
+
+#include <cstdint>
+#include <stdio.h>
+#include <utility>
+#include <vector>
+#include "Node.hpp"
+
+/* Largest PACKET_ID_MESSAGE packet, what fits in one encrypted friend packet. */
+#define MESSAGE_PACKET_SIZE         1373
+
+/* Header of a PACKET_ID_MESSAGE packet: id, packet number. */
+#define MESSAGE_HEADER_SIZE         (1 + sizeof(uint32_t))
+
+/* Header of every message inside a PACKET_ID_MESSAGE packet: type, length. */
+#define MESSAGE_RECORD_HEADER_SIZE  (1 + sizeof(uint16_t))
+
+/* Size of a PACKET_ID_MESSAGE_RECEIPT packet: id, packets received so far. */
+#define MESSAGE_RECEIPT_SIZE        (1 + sizeof(uint32_t))
+
+/* Message packets a friend can have unacknowledged, must be a power of two. */
+#define MESSAGE_RECEIPT_RING        1024
+
+/* Messages of one friend, allocated with the first message sent or received.
+ *
+ * Messages queued in the same tick are packed into one packet, numbered by
+ * the sender from 0 each time the friend comes online. The last message id
+ * of packet n is kept in receipts[n & (MESSAGE_RECEIPT_RING - 1)] until the
+ * friend's cumulative receipt passes it, message ids of a friend being
+ * consecutive that is all a receipt needs.
+ */
+struct MessageQueue {
+    uint32_t nextPacket;        /* number of the next packet we send */
+    uint32_t ackedPacket;       /* packets before this one were received by the friend */
+    uint32_t receiptedMessage;  /* last message id passed to the read receipt callback */
+    uint32_t pendingMessage;    /* last message id in pending */
+    uint16_t pendingLength;     /* bytes in pending, 0 if nothing is queued */
+    uint8_t pending[MESSAGE_PACKET_SIZE];
+    uint32_t receipts[MESSAGE_RECEIPT_RING];
+
+    uint32_t receivedPacket;    /* packets received from the friend */
+    bool receiptDue;            /* receivedPacket changed since our last receipt */
+    uint8_t receipt[MESSAGE_RECEIPT_SIZE];
+
+    bool batched;               /* in the batch being put together */
+};
+
+class MessageEngine {
+public:
+    MessageEngine(Node* node);
+    ~MessageEngine();
+
+    /* Queue a message to a friend.
+     *
+     * return the message id, -1 if the friend is offline, the message is empty
+     * or too long, or MESSAGE_RECEIPT_RING packets are waiting for a receipt.
+     */
+    int64_t send(uint32_t friendNumber, MessageType type, const uint8_t* message, size_t length);
+
+    /* Queue the same message to every friend in friendNumbers, see Node::broadcastMessage.
+     *
+     * return the number of friends it was queued for.
+     */
+    size_t broadcast(const uint32_t* friendNumbers, size_t count, MessageType type, const uint8_t* message,
+                     size_t length, int64_t* messageIds);
+
+    /* Handle a PACKET_ID_MESSAGE* packet from a friend. */
+    void handlePacket(uint32_t friendNumber, const uint8_t* data, uint16_t length);
+
+    /* Friend went offline, queued messages are dropped and will never get a receipt. */
+    void friendOffline(uint32_t friendNumber);
+
+    /* Free the queue of a friend that is being removed. */
+    void release(Friend* f);
+
+    /* Send the queued messages and our receipts. */
+    void tick();
+
+private:
+    void handleMessages(uint32_t friendNumber, Friend* f, const uint8_t* data, uint16_t length);
+    void handleReceipt(uint32_t friendNumber, Friend* f, const uint8_t* data, uint16_t length);
+
+    bool prepare(struct MessageQueue* queue);
+    void commit(struct MessageQueue* queue);
+    bool flush(uint32_t friendNumber, struct MessageQueue* queue);
+    void addToBatch(uint32_t friendNumber, struct MessageQueue* queue);
+    void sendBatch();
+    struct MessageQueue* getQueue(Friend* f);
+
+    Node* node;
+
+    /* Friends whose queued messages and receipts go out in the next sendBatch(). */
+    std::vector<std::pair<uint32_t, struct MessageQueue*> > batch;
+    std::vector<FriendPacket> packets;
+};
+
+#endif /* Message_hpp */
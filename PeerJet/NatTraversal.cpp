@@ -0,0 +1,550 @@
+//
+//  NatTraversal.cpp
+//  PeerJet
+//
+//  Created by Compy on 12/16/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <algorithm>
+#include <string.h>
+#include "NatTraversal.hpp"
+
+#define NAT_PUNCH_IDLE          0
+#define NAT_PUNCH_REFLECTING    1   /* waiting for fresh reflections before sending our addresses */
+#define NAT_PUNCH_OFFERED       2   /* waiting for the friend's answer */
+#define NAT_PUNCH_PUNCHING      3
+
+NatTraversal::NatTraversal(Node* node, NetworkingCore* net)
+    : node(node), net(net), nextReflector(0), reflectStarted(0), reflected(0), natType(NAT_TYPE_UNKNOWN), stride(0),
+      nextFriend(0)
+{
+    memset(&this->stats, 0, sizeof(this->stats));
+    NetworkService::registerHandler(net, NET_PACKET_REFLECT_REQUEST, &NatTraversal::handleReflectRequest, this);
+    NetworkService::registerHandler(net, NET_PACKET_REFLECT_RESPONSE, &NatTraversal::handleReflectResponse, this);
+    NetworkService::registerHandler(net, NET_PACKET_CRYPTO, &NatTraversal::handleCryptoPacket, this);
+}
+
+NatTraversal::~NatTraversal()
+{
+    NetworkService::registerHandler(this->net, NET_PACKET_REFLECT_REQUEST, NULL, NULL);
+    NetworkService::registerHandler(this->net, NET_PACKET_REFLECT_RESPONSE, NULL, NULL);
+    NetworkService::registerHandler(this->net, NET_PACKET_CRYPTO, NULL, NULL);
+}
+
+bool NatTraversal::addReflector(IP_Port ipPort)
+{
+    if (this->reflectors.size() >= NAT_MAX_REFLECTORS)
+        return false;
+
+    for (size_t i = 0; i < this->reflectors.size(); ++i) {
+        if (NetworkService::ipportEqual(&this->reflectors[i].address, &ipPort))
+            return false;
+    }
+
+    Reflector reflector;
+    memset(&reflector, 0, sizeof(reflector));
+    reflector.address = ipPort;
+    this->reflectors.push_back(reflector);
+    return true;
+}
+
+uint8_t NatTraversal::getNatType()
+{
+    return this->natType;
+}
+
+NatTraversalStats NatTraversal::getStats()
+{
+    return this->stats;
+}
+
+void NatTraversal::release(Friend* f)
+{
+    delete f->nat_punch;
+    f->nat_punch = NULL;
+}
+
+/* Ask the next reflectors in turn, one request right after the other so a
+ * symmetric NAT maps them to consecutive ports.
+ */
+void NatTraversal::reflect(uint64_t now)
+{
+    if (this->reflectors.empty())
+        return;
+
+    size_t count = std::min<size_t>(NAT_REFLECTORS_ASKED, this->reflectors.size());
+    this->asked.clear();
+
+    for (size_t i = 0; i < count; ++i) {
+        size_t index = (this->nextReflector + i) % this->reflectors.size();
+        Reflector& reflector = this->reflectors[index];
+        reflector.echoId = Crypto::random64b();
+        reflector.answered = false;
+
+        uint8_t packet[NAT_REFLECT_PACKET_SIZE];
+        memset(packet, 0, sizeof(packet));
+        packet[0] = NET_PACKET_REFLECT_REQUEST;
+        memcpy(packet + 1, &reflector.echoId, sizeof(reflector.echoId));
+        NetworkService::sendPacket(this->net, reflector.address, packet, sizeof(packet));
+        this->asked.push_back(index);
+    }
+
+    this->nextReflector = (this->nextReflector + 1) % this->reflectors.size();
+    this->reflectStarted = now;
+}
+
+void NatTraversal::finishReflection(uint64_t now)
+{
+    std::vector<IP_Port> seen;
+
+    for (size_t i = 0; i < this->asked.size(); ++i) {
+        const Reflector& reflector = this->reflectors[this->asked[i]];
+
+        if (reflector.answered)
+            seen.push_back(reflector.seen);
+    }
+
+    this->asked.clear();
+    this->reflectStarted = 0;
+    this->reflected = now;
+
+    /* Nobody answered, what we knew is all we have. */
+    if (seen.empty())
+        return;
+
+    this->external.clear();
+
+    for (size_t i = 0; i < seen.size(); ++i) {
+        bool known = false;
+
+        for (size_t j = 0; j < this->external.size() && !known; ++j)
+            known = NetworkService::ipportEqual(&this->external[j], &seen[i]) != 0;
+
+        if (!known)
+            this->external.push_back(seen[i]);
+    }
+
+    /* A single answer can't tell the kind of NAT. */
+    if (seen.size() < 2)
+        return;
+
+    if (this->external.size() == 1) {
+        this->natType = NAT_TYPE_CONE;
+        this->stride = 0;
+        return;
+    }
+
+    const IP_Port& last = this->external[this->external.size() - 1];
+    const IP_Port& previous = this->external[this->external.size() - 2];
+    int32_t delta = (int32_t)ntohs(last.port) - (int32_t)ntohs(previous.port);
+
+    this->natType = NAT_TYPE_SYMMETRIC;
+    this->stride = 0;
+
+    if (NetworkService::ipEqual(&last.ip, &previous.ip) && delta != 0 && delta >= -NAT_MAX_STRIDE
+        && delta <= NAT_MAX_STRIDE)
+        this->stride = (int8_t)delta;
+}
+
+bool NatTraversal::reflectionFresh(uint64_t now)
+{
+    return this->reflected != 0 && now - this->reflected < NAT_REFLECT_FRESH;
+}
+
+bool NatTraversal::sendAddresses(uint32_t friendNumber, uint8_t kind)
+{
+    uint8_t packet[NAT_ADDRESSES_MAX_SIZE];
+    size_t count = std::min<size_t>(this->external.size(), NAT_MAX_CANDIDATES);
+    size_t first = this->external.size() - count;
+
+    packet[0] = PACKET_ID_NAT_ADDRESSES;
+    packet[1] = kind;
+    packet[2] = this->natType;
+    packet[3] = (uint8_t)this->stride;
+    packet[4] = (uint8_t)count;
+
+    for (size_t i = 0; i < count; ++i)
+        NetworkService::packIpPort(packet + 5 + i * SIZE_IPPORT, &this->external[first + i]);
+
+    return this->node->sendFriendPacket(friendNumber, packet, (uint16_t)(5 + count * SIZE_IPPORT), true) != -1;
+}
+
+bool NatTraversal::addCandidate(struct NatPunch* punch, IP_Port ipPort)
+{
+    for (uint8_t i = 0; i < punch->candidateCount; ++i) {
+        if (NetworkService::ipportEqual(&punch->candidates[i], &ipPort))
+            return false;
+    }
+
+    /* The newest replaces the last one when there is no room left. */
+    if (punch->candidateCount < NAT_MAX_CANDIDATES)
+        ++punch->candidateCount;
+
+    punch->candidates[punch->candidateCount - 1] = ipPort;
+    return true;
+}
+
+void NatTraversal::fail(struct NatPunch* punch, uint64_t now)
+{
+    punch->state = NAT_PUNCH_IDLE;
+    punch->targets.clear();
+    punch->backoff = punch->backoff ? std::min<uint32_t>(punch->backoff * 2, NAT_RETRY_MAXIMUM) : NAT_RETRY_MINIMUM;
+    punch->retry = now + punch->backoff;
+}
+
+void NatTraversal::startPunch(Friend* f, uint64_t now)
+{
+    struct NatPunch *punch = f->nat_punch;
+    punch->state = NAT_PUNCH_PUNCHING;
+    punch->started = now;
+    punch->round = 0;
+    punch->nextRound = now;
+    punch->targets.clear();
+    punch->sent = 0;
+
+    /* Neither mapping can be predicted from the other side. */
+    if (this->natType == NAT_TYPE_SYMMETRIC && punch->natType == NAT_TYPE_SYMMETRIC) {
+        ++this->stats.skipped;
+        this->fail(punch, now);
+        return;
+    }
+
+    uint8_t data[NAT_PING_SIZE];
+    punch->pingId = Crypto::random64b();
+    data[0] = NAT_PING_REQUEST;
+    memcpy(data + 1, &punch->pingId, sizeof(punch->pingId));
+
+    int length = Crypto::createRequest(this->node->address, this->node->secretKey, punch->ping, f->real_pk, data,
+                                       sizeof(data), CRYPTO_PACKET_NAT_PING);
+
+    if (length <= 0 || (size_t)length > NAT_PING_PACKET_SIZE) {
+        this->fail(punch, now);
+        return;
+    }
+
+    punch->pingLength = (uint16_t)length;
+}
+
+void NatTraversal::queueRound(struct NatPunch* punch)
+{
+    punch->targets.assign(punch->candidates, punch->candidates + punch->candidateCount);
+    punch->sent = 0;
+
+    if (punch->natType != NAT_TYPE_SYMMETRIC || punch->stride == 0 || !NetworkService::ipportIsset(&punch->mapping))
+        return;
+
+    /* Its NAT opened a port for us after the mapping it told us about, a few
+     * further if it talked to others in between.
+     */
+    int32_t base = ntohs(punch->mapping.port);
+    uint32_t first = punch->round * NAT_SPRAY_STEP + 1;
+
+    for (uint32_t k = first; k < first + NAT_SPRAY_WINDOW; ++k) {
+        int32_t port = base + punch->stride * (int32_t)k;
+
+        if (port <= 0 || port > 65535)
+            break;
+
+        IP_Port target = punch->mapping;
+        target.port = htons((uint16_t)port);
+        punch->targets.push_back(target);
+    }
+}
+
+void NatTraversal::step(uint32_t friendNumber, Friend* f, uint64_t now)
+{
+    struct NatPunch *punch = f->nat_punch;
+
+    /* Only friends reached through a relay are punched to. */
+    if (f->status != FRIEND_ONLINE || f->last_connection_udp_tcp != CONNECTION_TYPE_TCP) {
+        if (punch && punch->state != NAT_PUNCH_IDLE) {
+            punch->state = NAT_PUNCH_IDLE;
+            punch->targets.clear();
+        }
+
+        return;
+    }
+
+    bool offerer = memcmp(this->node->address, f->real_pk, PEERJET_KEY_LENGTH) < 0;
+
+    if (!punch) {
+        if (!offerer)
+            return;
+
+        punch = f->nat_punch = new NatPunch();
+    }
+
+    switch (punch->state) {
+        case NAT_PUNCH_IDLE:
+            if (!offerer || now < punch->retry)
+                break;
+
+            ++this->stats.punches;
+            punch->offered = true;
+            punch->state = NAT_PUNCH_REFLECTING;
+            punch->started = now;
+
+            if (!this->reflectStarted && !this->reflectionFresh(now))
+                this->reflect(now);
+
+            break;
+
+        case NAT_PUNCH_REFLECTING:
+            if (this->reflectStarted)
+                break;
+
+            if (!this->sendAddresses(friendNumber, punch->offered ? NAT_ADDRESSES_OFFER : NAT_ADDRESSES_ANSWER)) {
+                this->fail(punch, now);
+            } else if (punch->offered) {
+                punch->state = NAT_PUNCH_OFFERED;
+                punch->started = now;
+                punch->candidateCount = 0;
+            } else {
+                this->startPunch(f, now);
+            }
+
+            break;
+
+        case NAT_PUNCH_OFFERED:
+            if (now - punch->started >= NAT_ANSWER_TIMEOUT)
+                this->fail(punch, now);
+
+            break;
+
+        case NAT_PUNCH_PUNCHING:
+            if (now < punch->nextRound)
+                break;
+
+            if (punch->round >= NAT_PUNCH_ROUNDS) {
+                this->fail(punch, now);
+                break;
+            }
+
+            this->queueRound(punch);
+            ++punch->round;
+            punch->nextRound = now + NAT_PUNCH_INTERVAL;
+            break;
+    }
+}
+
+void NatTraversal::tick()
+{
+    uint64_t now = NetworkService::getCurrentTimeMonotonic();
+
+    if (this->reflectStarted) {
+        bool answered = true;
+
+        for (size_t i = 0; i < this->asked.size() && answered; ++i)
+            answered = this->reflectors[this->asked[i]].answered;
+
+        if (answered || now - this->reflectStarted >= NAT_REFLECT_TIMEOUT)
+            this->finishReflection(now);
+    } else if (!this->reflectors.empty() && (this->reflected == 0 || now - this->reflected >= NAT_REFLECT_INTERVAL)) {
+        this->reflect(now);
+    }
+
+    std::vector<Friend*>& friends = this->node->friends;
+
+    /* Friends not decoded yet are offline and never punched to. */
+    for (uint32_t friendNumber = 0; friendNumber < friends.size(); ++friendNumber) {
+        if (friends[friendNumber])
+            this->step(friendNumber, friends[friendNumber], now);
+    }
+
+    if (friends.empty())
+        return;
+
+    /* The pings of every punch share one budget, starting with a different friend every tick. */
+    uint32_t budget = NAT_PINGS_PER_TICK;
+
+    for (size_t i = 0; i < friends.size() && budget > 0; ++i) {
+        Friend *f = friends[(this->nextFriend + i) % friends.size()];
+        struct NatPunch *punch = f ? f->nat_punch : NULL;
+
+        if (!punch || punch->state != NAT_PUNCH_PUNCHING)
+            continue;
+
+        for (; punch->sent < punch->targets.size() && budget > 0; ++punch->sent, --budget) {
+            NetworkService::sendPacket(this->net, punch->targets[punch->sent], punch->ping, punch->pingLength);
+            ++this->stats.pings;
+        }
+    }
+
+    this->nextFriend = (this->nextFriend + 1) % friends.size();
+}
+
+void NatTraversal::handlePacket(uint32_t friendNumber, const uint8_t* data, uint16_t length)
+{
+    Friend *f = this->node->getFriend(friendNumber);
+
+    if (!f || length < 5)
+        return;
+
+    uint8_t kind = data[1];
+    uint8_t count = data[4];
+
+    if (kind > NAT_ADDRESSES_ANSWER || data[2] > NAT_TYPE_SYMMETRIC || count > NAT_MAX_CANDIDATES
+        || length != 5 + count * SIZE_IPPORT)
+        return;
+
+    struct NatPunch *punch = f->nat_punch;
+
+    if (kind == NAT_ADDRESSES_ANSWER && (!punch || punch->state != NAT_PUNCH_OFFERED))
+        return;
+
+    if (!punch)
+        punch = f->nat_punch = new NatPunch();
+
+    uint64_t now = NetworkService::getCurrentTimeMonotonic();
+    punch->natType = data[2];
+    punch->stride = (int8_t)data[3];
+
+    /* Pings that beat the answer over the relay left their sources as candidates already. */
+    if (kind == NAT_ADDRESSES_OFFER)
+        punch->candidateCount = 0;
+
+    memset(&punch->mapping, 0, sizeof(punch->mapping));
+
+    for (uint8_t i = 0; i < count; ++i) {
+        IP_Port ipPort;
+
+        if (NetworkService::unpackIpPort(data + 5 + i * SIZE_IPPORT, &ipPort)) {
+            this->addCandidate(punch, ipPort);
+            punch->mapping = ipPort;
+        }
+    }
+
+    if (kind == NAT_ADDRESSES_ANSWER) {
+        this->startPunch(f, now);
+        return;
+    }
+
+    /* The friend starts over, whatever we were doing. Our answer waits for fresh reflections. */
+    punch->offered = false;
+    punch->state = NAT_PUNCH_REFLECTING;
+    punch->started = now;
+    punch->targets.clear();
+
+    if (!this->reflectStarted && !this->reflectionFresh(now))
+        this->reflect(now);
+}
+
+void NatTraversal::handlePing(IP_Port source, const uint8_t* publicKey, const uint8_t* data, uint16_t length)
+{
+    if (length != NAT_PING_SIZE || data[0] > NAT_PING_RESPONSE)
+        return;
+
+    int friendNumber = this->node->getFriendByPublicKey(publicKey);
+    Friend *f = friendNumber == -1 ? NULL : this->node->getFriend((uint32_t)friendNumber);
+
+    if (!f || f->status != FRIEND_ONLINE)
+        return;
+
+    struct NatPunch *punch = f->nat_punch;
+
+    if (data[0] == NAT_PING_REQUEST) {
+        uint8_t response[NAT_PING_SIZE];
+        uint8_t packet[NAT_PING_PACKET_SIZE];
+        response[0] = NAT_PING_RESPONSE;
+        memcpy(response + 1, data + 1, sizeof(uint64_t));
+
+        int packetLength = Crypto::createRequest(this->node->address, this->node->secretKey, packet, f->real_pk,
+                                                 response, sizeof(response), CRYPTO_PACKET_NAT_PING);
+
+        if (packetLength > 0)
+            NetworkService::sendPacket(this->net, source, packet, (uint16_t)packetLength);
+
+        /* Its packets get in from there, ours might not yet: ping it back right away,
+         * or with our first round if its pings beat its answer.
+         */
+        if (punch && (punch->state == NAT_PUNCH_PUNCHING || punch->state == NAT_PUNCH_OFFERED)
+            && this->addCandidate(punch, source) && punch->state == NAT_PUNCH_PUNCHING)
+            punch->targets.push_back(source);
+
+        return;
+    }
+
+    uint64_t pingId;
+    memcpy(&pingId, data + 1, sizeof(pingId));
+
+    if (!punch || punch->state != NAT_PUNCH_PUNCHING || pingId != punch->pingId)
+        return;
+
+    /* Counted by the offerer only, like the punches, the answerer often gets through too. */
+    if (punch->offered)
+        ++this->stats.succeeded;
+
+    punch->state = NAT_PUNCH_IDLE;
+    punch->targets.clear();
+    punch->backoff = 0;
+    punch->retry = 0;
+
+    if (this->node->transport.friendHolePunched)
+        this->node->transport.friendHolePunched(this->node->transport.object, friendNumber, source);
+}
+
+int NatTraversal::handleReflectRequest(void *object, IP_Port source, const uint8_t *data, uint16_t length)
+{
+    NatTraversal *nat = (NatTraversal *)object;
+    uint8_t packet[NAT_REFLECT_PACKET_SIZE];
+
+    if (!reflect(data, length, source, packet))
+        return -1;
+
+    NetworkService::sendPacket(nat->net, source, packet, sizeof(packet));
+    return 0;
+}
+
+bool NatTraversal::reflect(const uint8_t* request, uint16_t length, IP_Port source, uint8_t* response)
+{
+    if (length != NAT_REFLECT_PACKET_SIZE)
+        return false;
+
+    response[0] = NET_PACKET_REFLECT_RESPONSE;
+    memcpy(response + 1, request + 1, sizeof(uint64_t));
+    NetworkService::packIpPort(response + 1 + sizeof(uint64_t), &source);
+    return true;
+}
+
+int NatTraversal::handleReflectResponse(void *object, IP_Port source, const uint8_t *data, uint16_t length)
+{
+    NatTraversal *nat = (NatTraversal *)object;
+
+    if (length != NAT_REFLECT_PACKET_SIZE || !nat->reflectStarted)
+        return -1;
+
+    uint64_t echoId;
+    memcpy(&echoId, data + 1, sizeof(echoId));
+
+    for (size_t i = 0; i < nat->asked.size(); ++i) {
+        Reflector& reflector = nat->reflectors[nat->asked[i]];
+
+        if (reflector.answered || reflector.echoId != echoId
+            || !NetworkService::ipportEqual(&reflector.address, &source))
+            continue;
+
+        reflector.answered = NetworkService::unpackIpPort(data + 1 + sizeof(uint64_t), &reflector.seen);
+        return 0;
+    }
+
+    return -1;
+}
+
+int NatTraversal::handleCryptoPacket(void *object, IP_Port source, const uint8_t *data, uint16_t length)
+{
+    NatTraversal *nat = (NatTraversal *)object;
+    uint8_t publicKey[crypto_box_PUBLICKEYBYTES];
+    uint8_t plain[MAX_CRYPTO_REQUEST_SIZE];
+    uint8_t requestId;
+
+    int plainLength = Crypto::handleRequest(nat->node->address, nat->node->secretKey, publicKey, plain, &requestId,
+                                            data, length);
+
+    /* NAT pings are the only crypto requests handled so far. */
+    if (plainLength == -1 || requestId != CRYPTO_PACKET_NAT_PING)
+        return -1;
+
+    nat->handlePing(source, publicKey, plain, (uint16_t)plainLength);
+    return 0;
+}
@@ -0,0 +1,196 @@
+//
+//  NatTraversal.hpp
+//  PeerJet
+//
+//  Created by Compy on 12/16/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef NatTraversal_hpp
+#define NatTraversal_hpp
+
+#include <cstdint>
+#include <stdio.h>
+#include <vector>
+#include "Crypto.hpp"
+#include "Node.hpp"
+
+/* NET_PACKET_REFLECT_REQUEST and NET_PACKET_REFLECT_RESPONSE: [id][echo id (8)][address].
+ * The address is where the request came from, left empty in the request so it
+ * is as large as the response and can't be used for amplification.
+ */
+#define NAT_REFLECT_PACKET_SIZE     (1 + sizeof(uint64_t) + SIZE_IPPORT)
+
+/* CRYPTO_PACKET_NAT_PING request: [kind][ping id (8)], a response echoes the ping id. */
+#define NAT_PING_REQUEST            0
+#define NAT_PING_RESPONSE           1
+#define NAT_PING_SIZE               (1 + sizeof(uint64_t))
+#define NAT_PING_PACKET_SIZE        (1 + crypto_box_PUBLICKEYBYTES * 2 + crypto_box_NONCEBYTES + 1 + NAT_PING_SIZE \
+                                     + crypto_box_MACBYTES)
+
+/* PACKET_ID_NAT_ADDRESSES packet: [id][kind][nat type][port stride (signed)][count][count addresses]. */
+#define NAT_ADDRESSES_OFFER         0
+#define NAT_ADDRESSES_ANSWER        1
+#define NAT_MAX_CANDIDATES          4
+#define NAT_ADDRESSES_MAX_SIZE      (5 + NAT_MAX_CANDIDATES * SIZE_IPPORT)
+
+/* How our NAT maps us, as told by the reflectors. A cone NAT keeps the same
+ * external port whatever we send to, a symmetric one opens a new port for every
+ * destination, with a stride between consecutive ports if they are predictable.
+ */
+#define NAT_TYPE_UNKNOWN            0
+#define NAT_TYPE_CONE               1
+#define NAT_TYPE_SYMMETRIC          2
+
+/* Reflectors kept (Node::bootstrap), the ones asked in one go, how long we wait for them (ms). */
+#define NAT_MAX_REFLECTORS          8
+#define NAT_REFLECTORS_ASKED        2
+#define NAT_REFLECT_TIMEOUT         1000
+
+/* Our addresses are reflected again this often (ms), and before a punch if older than NAT_REFLECT_FRESH. */
+#define NAT_REFLECT_INTERVAL        60000
+#define NAT_REFLECT_FRESH           5000
+
+/* Ports further apart than this between two reflections are taken as randomly allocated. */
+#define NAT_MAX_STRIDE              16
+
+/* A punch lasts NAT_PUNCH_ROUNDS rounds NAT_PUNCH_INTERVAL ms apart. Every round
+ * pings the candidate addresses of the friend and, if it is behind a symmetric
+ * NAT, NAT_SPRAY_WINDOW predicted ports past its last mapping, the window moving
+ * NAT_SPRAY_STEP ports further every round.
+ */
+#define NAT_PUNCH_INTERVAL          500
+#define NAT_PUNCH_ROUNDS            10
+#define NAT_SPRAY_WINDOW            48
+#define NAT_SPRAY_STEP              (NAT_SPRAY_WINDOW / 2)
+
+/* Pings sent per tick over all friends, the rest wait in the queue of their punch. */
+#define NAT_PINGS_PER_TICK          64
+
+/* An offer not answered within this long (ms) fails. */
+#define NAT_ANSWER_TIMEOUT          5000
+
+/* Backoff between the punches of a friend, doubled on every failure. */
+#define NAT_RETRY_MINIMUM           10000
+#define NAT_RETRY_MAXIMUM           (10 * 60 * 1000)
+
+/* Hole punching with one friend, allocated with its first punch. */
+struct NatPunch {
+    uint8_t state;
+    bool offered;               /* we made the offer, the friend answers it */
+    uint64_t started;           /* when state was entered */
+    uint64_t retry;             /* when the offerer punches again */
+    uint32_t backoff;
+
+    /* The friend's side, from its PACKET_ID_NAT_ADDRESSES packet and the pings we got. */
+    uint8_t natType;
+    int8_t stride;
+    IP_Port candidates[NAT_MAX_CANDIDATES];
+    uint8_t candidateCount;
+    IP_Port mapping;            /* its newest mapping, the ports sprayed are predicted from it */
+
+    uint32_t round;
+    uint64_t nextRound;
+    uint64_t pingId;
+    uint8_t ping[NAT_PING_PACKET_SIZE]; /* encrypted once per punch, sent to every target */
+    uint16_t pingLength;
+    std::vector<IP_Port> targets; /* pings of the round not sent yet */
+    size_t sent;
+};
+
+typedef struct {
+    uint64_t punches;       /* punches we offered */
+    uint64_t succeeded;     /* of those, the ones that got a response to our ping */
+    uint64_t skipped;       /* both ends behind symmetric NATs, left on the relay */
+    uint64_t pings;         /* pings sent */
+} NatTraversalStats;
+
+/* Moves friends connected through a relay to direct UDP (FriendTransport::friendHolePunched).
+ *
+ * The reflectors tell us where our packets come from and whether our NAT is a
+ * cone or a symmetric one. The friend with the lower public key offers its
+ * addresses over the relayed connection (PACKET_ID_NAT_ADDRESSES), the other
+ * answers with its own, then both ping each other's addresses with
+ * CRYPTO_PACKET_NAT_PING requests so each NAT lets the other one's packets in.
+ * Whoever gets a response knows the path works both ways.
+ *
+ * A symmetric NAT maps us anew for the friend, so the friend of a node behind
+ * one sprays its pings over the ports predicted from the stride between its
+ * last mappings. Two symmetric NATs are left on the relay.
+ *
+ * Every node answers reflection requests, so do the bootstrap nodes
+ * (BootstrapServer).
+ */
+class NatTraversal {
+public:
+    NatTraversal(Node* node, NetworkingCore* net);
+    ~NatTraversal();
+
+    /* Ask ipPort where our packets come from.
+     *
+     * return false if it is known already or there are NAT_MAX_REFLECTORS.
+     */
+    bool addReflector(IP_Port ipPort);
+
+    /* Run the reflections and punches that are due. */
+    void tick();
+
+    /* A PACKET_ID_NAT_ADDRESSES packet from a friend. */
+    void handlePacket(uint32_t friendNumber, const uint8_t* data, uint16_t length);
+
+    /* Free the punch of a friend that is being removed. */
+    void release(Friend* f);
+
+    /* return NAT_TYPE_UNKNOWN, NAT_TYPE_CONE or NAT_TYPE_SYMMETRIC. */
+    uint8_t getNatType();
+
+    NatTraversalStats getStats();
+
+    /* Write the NAT_REFLECT_PACKET_SIZE response to a reflection request from source.
+     *
+     * return false if request isn't one.
+     */
+    static bool reflect(const uint8_t* request, uint16_t length, IP_Port source, uint8_t* response);
+
+private:
+    struct Reflector {
+        IP_Port address;
+        uint64_t echoId;        /* of our last request */
+        bool answered;
+        IP_Port seen;           /* our address as it saw it */
+    };
+
+    static int handleReflectRequest(void* object, IP_Port source, const uint8_t* data, uint16_t length);
+    static int handleReflectResponse(void* object, IP_Port source, const uint8_t* data, uint16_t length);
+    static int handleCryptoPacket(void* object, IP_Port source, const uint8_t* data, uint16_t length);
+
+    void reflect(uint64_t now);
+    void finishReflection(uint64_t now);
+    bool reflectionFresh(uint64_t now);
+
+    void step(uint32_t friendNumber, Friend* f, uint64_t now);
+    bool sendAddresses(uint32_t friendNumber, uint8_t kind);
+    void startPunch(Friend* f, uint64_t now);
+    void queueRound(struct NatPunch* punch);
+    bool addCandidate(struct NatPunch* punch, IP_Port ipPort);
+    void fail(struct NatPunch* punch, uint64_t now);
+    void handlePing(IP_Port source, const uint8_t* publicKey, const uint8_t* data, uint16_t length);
+
+    Node* node;
+    NetworkingCore* net;
+
+    std::vector<Reflector> reflectors;
+    std::vector<size_t> asked;  /* reflectors of the running reflection, in the order asked */
+    size_t nextReflector;       /* first one asked in the next reflection */
+    uint64_t reflectStarted;    /* 0 if no reflection is running */
+    uint64_t reflected;         /* when the last one finished, 0 if never */
+
+    uint8_t natType;
+    int8_t stride;
+    std::vector<IP_Port> external; /* our addresses seen by the reflectors, the newest mapping last */
+
+    uint32_t nextFriend;        /* first friend sent pings in the next tick */
+    NatTraversalStats stats;
+};
+
+#endif /* NatTraversal_hpp */
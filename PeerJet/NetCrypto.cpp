@@ -0,0 +1,1613 @@
+//
+//  NetCrypto.cpp
+//  PeerJet
+//
+//  Created by Compy on 12/17/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include "NetCrypto.hpp"
+#include "Utils.hpp"
+
+#define NET_CRYPTO_COOKIE_REQUESTING    0   /* asking the peer for a cookie */
+#define NET_CRYPTO_HANDSHAKE_SENT       1   /* waiting for the peer's handshake */
+#define NET_CRYPTO_NOT_CONFIRMED        2   /* both handshakes done, waiting for the first data packet */
+#define NET_CRYPTO_ESTABLISHED          3
+
+/* States of the slots of a send ring. */
+#define NET_CRYPTO_SLOT_QUEUED          0   /* not sent yet, or free */
+#define NET_CRYPTO_SLOT_SENT            1
+#define NET_CRYPTO_SLOT_LOST            2   /* to be sent again */
+#define NET_CRYPTO_SLOT_ACKED           3   /* acknowledged out of order, its buffer is back in the pool */
+
+#define NET_CRYPTO_WINDOW_MASK          (NET_CRYPTO_WINDOW - 1)
+#define NET_CRYPTO_NO_BUFFER            UINT32_MAX
+
+/* Where the plain data of a data packet goes, so it is encrypted and decrypted in place. */
+#define NET_CRYPTO_DATA_PLAIN_OFFSET    (NET_CRYPTO_DATA_HEADER_SIZE + crypto_box_MACBYTES)
+
+static const CongestionLimits netCryptoLimits = {
+    NET_CRYPTO_INITIAL_WINDOW, NET_CRYPTO_MINIMUM_WINDOW, NET_CRYPTO_WINDOW, NET_CRYPTO_INITIAL_RTO,
+    NET_CRYPTO_MINIMUM_RTO, NET_CRYPTO_MAXIMUM_RTO
+};
+
+struct NetCryptoConnection {
+    uint8_t publicKey[crypto_box_PUBLICKEYBYTES];
+    uint8_t sharedKey[crypto_box_BEFORENMBYTES];    /* with the peer's long-term key, for handshakes */
+    IP_Port ipPort;
+    bool incoming;          /* opened by a handshake of the peer, released instead of retried when it fails */
+    uint8_t status;
+    uint64_t statusTime;    /* when status was entered */
+    uint64_t lastSent;      /* 0 to send at the next tick */
+    uint64_t lastReceived;
+    uint64_t echoId;        /* of our last cookie request */
+
+    /* Our side of the session, new for every handshake started over. */
+    uint8_t sessionPublicKey[crypto_box_PUBLICKEYBYTES];
+    uint8_t sessionSecretKey[crypto_box_SECRETKEYBYTES];
+    uint8_t baseNonce[crypto_box_NONCEBYTES];
+    uint8_t handshake[NET_CRYPTO_HANDSHAKE_SIZE];   /* our last handshake, resent until confirmed */
+
+    /* The peer's side, from its handshake. */
+    uint8_t peerSessionPublicKey[crypto_box_PUBLICKEYBYTES];
+    uint32_t peerId;        /* its number for the connection, put in front of our data packets */
+    uint8_t sendKey[crypto_box_BEFORENMBYTES];
+    uint8_t recvKey[crypto_box_BEFORENMBYTES];
+    CryptoSessionNonces nonces;
+
+    /* New keys of a direction (NET_CRYPTO_PACKET_REKEY), agreed with the other
+     * end's session key pair. The receiving end keeps the key it had, packets
+     * sent with it can still be on their way.
+     */
+    bool rekeying;          /* our offer wasn't taken yet */
+    uint64_t rekeySent;
+    uint8_t rekeyPublicKey[crypto_box_PUBLICKEYBYTES];
+    uint8_t rekeySecretKey[crypto_box_SECRETKEYBYTES];
+    uint8_t rekeyNonce[crypto_box_NONCEBYTES];
+    uint8_t peerRekeyPublicKey[crypto_box_PUBLICKEYBYTES];  /* of the last offer we took */
+    bool previousSet;
+    uint8_t previousKey[crypto_box_BEFORENMBYTES];
+    CryptoSessionNonces previousNonces;     /* the receiving part of the previous key */
+
+    /* Lossless packets we send, packet n in slot n % NET_CRYPTO_WINDOW. Times are
+     * the low 32 bits of the clock, only ever compared to each other.
+     */
+    uint32_t sendStart;     /* oldest packet not acknowledged */
+    uint32_t sendNext;      /* next packet sent for the first time */
+    uint32_t sendEnd;       /* number the next packet queued gets */
+    uint32_t inFlight;      /* packets in NET_CRYPTO_SLOT_SENT state */
+    uint32_t lost;          /* packets in NET_CRYPTO_SLOT_LOST state */
+    uint32_t highestAcked;  /* one past the highest packet acknowledged */
+    uint32_t highestAckedSent;  /* when that packet was last sent */
+    uint32_t sendBuffer[NET_CRYPTO_WINDOW];
+    uint16_t sendLength[NET_CRYPTO_WINDOW];
+    uint8_t sendState[NET_CRYPTO_WINDOW];
+    uint8_t transmissions[NET_CRYPTO_WINDOW];
+    uint32_t sentTime[NET_CRYPTO_WINDOW];
+
+    /* Lossless packets we receive, NET_CRYPTO_NO_BUFFER in the slots not received. */
+    uint32_t recvStart;     /* next packet delivered */
+    uint32_t recvEnd;       /* one past the highest packet received */
+    uint32_t unacked;       /* packets received since our last acknowledgement */
+    uint32_t recvBuffer[NET_CRYPTO_WINDOW];
+    uint16_t recvLength[NET_CRYPTO_WINDOW];
+
+    /* Congestion control of the send ring, paced over the RTT. */
+    struct CongestionWindow congestion;
+    double credit;          /* packets the pacing lets us send now */
+    uint64_t paced;         /* when credit was last topped up */
+
+    bool batched;           /* in NetCryptoBatch::connections */
+};
+
+/* A data packet of a batch, encrypted in place in its buffer. */
+struct NetCryptoBatchPacket {
+    IP_Port ipPort;
+    uint8_t key[crypto_box_BEFORENMBYTES];
+    uint8_t nonce[crypto_box_NONCEBYTES];
+    uint16_t length;        /* of the plain data, then of the packet once encrypted, 0 if that failed */
+};
+
+/* Data packets sendData holds while sendPackets flushes, sealed and written out
+ * together by sendBatch.
+ */
+struct NetCryptoBatch {
+    bool open;              /* sendData adds to the batch instead of sending */
+    uint32_t count;
+    std::atomic<uint32_t> next;     /* next packet to seal */
+    struct NetCryptoBatchPacket packets[NET_CRYPTO_SEND_BATCH];
+    uint8_t buffers[NET_CRYPTO_SEND_BATCH][NET_CRYPTO_MAX_PACKET_SIZE];
+    NetworkPacket out[NET_CRYPTO_SEND_BATCH];
+    std::vector<uint32_t> connections;  /* queued to by sendPackets, flushed at its end */
+};
+
+/* Threads sealing batches alongside their caller, one set for the process
+ * however many NetCrypto there are, none on a single core. A batch is handed
+ * to them by bumping generation, they take packets from its next and the caller
+ * waits for running to drop to 0. One batch at a time: a caller finding busy
+ * taken seals its batch alone.
+ */
+struct NetCryptoSealers {
+    NetCryptoSealers();
+    ~NetCryptoSealers();
+    void run();
+
+    std::vector<std::thread> threads;
+    std::mutex busy;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    struct NetCryptoBatch *batch;
+    uint64_t generation;
+    uint32_t running;
+    bool stopping;
+};
+
+static void sealPacket(struct NetCryptoBatch *batch, uint32_t i)
+{
+    struct NetCryptoBatchPacket *packet = &batch->packets[i];
+    int encrypted = Crypto::encryptInPlace(packet->key, packet->nonce, batch->buffers[i] + NET_CRYPTO_DATA_HEADER_SIZE,
+                                           packet->length);
+    packet->length = encrypted == -1 ? 0 : (uint16_t)(NET_CRYPTO_DATA_HEADER_SIZE + encrypted);
+}
+
+static void sealPackets(struct NetCryptoBatch *batch)
+{
+    for (uint32_t i; (i = batch->next.fetch_add(1, std::memory_order_relaxed)) < batch->count; )
+        sealPacket(batch, i);
+}
+
+NetCryptoSealers::NetCryptoSealers() : batch(NULL), generation(0), running(0), stopping(false)
+{
+    unsigned int count = std::min(std::thread::hardware_concurrency(), (unsigned int)NET_CRYPTO_MAX_SEALERS);
+
+    for (unsigned int i = 1; i < count; ++i)
+        this->threads.push_back(std::thread(&NetCryptoSealers::run, this));
+}
+
+NetCryptoSealers::~NetCryptoSealers()
+{
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->stopping = true;
+    }
+
+    this->wake.notify_all();
+
+    for (size_t i = 0; i < this->threads.size(); ++i)
+        this->threads[i].join();
+}
+
+void NetCryptoSealers::run()
+{
+    uint64_t seen = 0;
+
+    while (true) {
+        struct NetCryptoBatch *batch;
+
+        {
+            std::unique_lock<std::mutex> guard(this->lock);
+            this->wake.wait(guard, [&]() { return this->stopping || this->generation != seen; });
+
+            if (this->stopping)
+                return;
+
+            seen = this->generation;
+            batch = this->batch;
+        }
+
+        sealPackets(batch);
+        std::lock_guard<std::mutex> guard(this->lock);
+
+        if (--this->running == 0)
+            this->done.notify_one();
+    }
+}
+
+/* Started with the first batch large enough to share. */
+static NetCryptoSealers *sharedSealers()
+{
+    static NetCryptoSealers sealers;
+    return &sealers;
+}
+
+/* Decrypt data packet data into buffer with key, if nonces hasn't seen its number.
+ *
+ * return the length of the plain data.
+ * return -1 if it doesn't decrypt.
+ * return -2 if it is a replay.
+ */
+static int openData(const uint8_t *key, CryptoSessionNonces *nonces, uint32_t number, const uint8_t *data,
+                    uint16_t length, uint8_t *buffer)
+{
+    uint8_t nonce[crypto_box_NONCEBYTES];
+
+    if (!Crypto::sessionReceiveNonce(nonces, number, nonce))
+        return -2;
+
+    memcpy(buffer, data + NET_CRYPTO_DATA_HEADER_SIZE, length - NET_CRYPTO_DATA_HEADER_SIZE);
+    int plainLength = Crypto::decryptInPlace(key, nonce, buffer, length - NET_CRYPTO_DATA_HEADER_SIZE);
+
+    if (plainLength < 1)
+        return -1;
+
+    Crypto::sessionAccept(nonces, number);
+    return plainLength;
+}
+
+NetCrypto::NetCrypto(NetworkingCore* net, const uint8_t* publicKey, const uint8_t* secretKey)
+    : net(net), routeTag(0), cookieEpoch(0), connectionCount(0), burst(0), frameBuffersUsed(0), batch(NULL), dataCallback(NULL),
+      dataObject(NULL), framesCallback(NULL), framesObject(NULL), statusCallback(NULL), statusObject(NULL),
+      acceptCallback(NULL), acceptObject(NULL)
+{
+    memcpy(this->publicKey, publicKey, crypto_box_PUBLICKEYBYTES);
+    memcpy(this->secretKey, secretKey, crypto_box_SECRETKEYBYTES);
+    Crypto::newSymmetricKey(this->cookieKeys[0]);
+    Crypto::newSymmetricKey(this->cookieKeys[1]);
+    this->cookieRotated = NetworkService::getCurrentTimeMonotonic();
+
+    /* The handshake queue and frame buffers are allocated with the first packet
+     * that needs them, an identity of a NodeHost that never gets one pays nothing.
+     */
+    memset(&this->stats, 0, sizeof(this->stats));
+
+    NetworkService::registerHandler(net, NET_PACKET_COOKIE_REQUEST, &NetCrypto::handleCookieRequest, this);
+    NetworkService::registerHandler(net, NET_PACKET_COOKIE_RESPONSE, &NetCrypto::handleCookieResponse, this);
+    NetworkService::registerHandler(net, NET_PACKET_CRYPTO_HS, &NetCrypto::handleHandshake, this);
+    NetworkService::registerHandler(net, NET_PACKET_CRYPTO_DATA, &NetCrypto::handleData, this);
+}
+
+NetCrypto::~NetCrypto()
+{
+    NetworkService::registerHandler(this->net, NET_PACKET_COOKIE_REQUEST, NULL, NULL);
+    NetworkService::registerHandler(this->net, NET_PACKET_COOKIE_RESPONSE, NULL, NULL);
+    NetworkService::registerHandler(this->net, NET_PACKET_CRYPTO_HS, NULL, NULL);
+    NetworkService::registerHandler(this->net, NET_PACKET_CRYPTO_DATA, NULL, NULL);
+
+    if (this->batch) {
+        sodium_memzero(this->batch->packets, sizeof(this->batch->packets));
+        delete this->batch;
+    }
+
+    for (size_t i = 0; i < this->connections.size(); ++i) {
+        if (this->connections[i])
+            this->release((uint32_t)i);
+    }
+
+    for (size_t i = 0; i < this->slabs.size(); ++i)
+        delete[] this->slabs[i];
+
+    for (size_t i = 0; i < this->pool.size(); ++i)
+        free(this->pool[i]);
+
+    sodium_memzero(this->cookieKeys, sizeof(this->cookieKeys));
+    sodium_memzero(this->secretKey, sizeof(this->secretKey));
+}
+
+int NetCrypto::addConnection(const uint8_t* publicKey, IP_Port ipPort)
+{
+    int64_t found = Crypto::findPublicKey(this->connectionKeys.data(), this->connections.size(), publicKey);
+
+    if (found != -1) {
+        struct NetCryptoConnection *connection = this->connections[found];
+
+        /* The peer got there first, the connection is ours from now on. */
+        connection->incoming = false;
+
+        /* A new address to try, the handshake starts over there. */
+        if (connection->status != NET_CRYPTO_ESTABLISHED && !NetworkService::ipportEqual(&connection->ipPort, &ipPort)) {
+            connection->ipPort = ipPort;
+            this->newSession(connection);
+            connection->status = NET_CRYPTO_COOKIE_REQUESTING;
+            connection->statusTime = NetworkService::getCurrentTimeMonotonic();
+            connection->lastSent = 0;
+        }
+
+        return (int)found;
+    }
+
+    int connection = this->allocate(publicKey, ipPort);
+
+    if (connection == -1)
+        return -1;
+
+    Crypto::encryptPrecompute(publicKey, this->secretKey, this->connections[connection]->sharedKey);
+    return connection;
+}
+
+bool NetCrypto::removeConnection(uint32_t connection)
+{
+    if (connection >= this->connections.size() || !this->connections[connection])
+        return false;
+
+    this->release(connection);
+    return true;
+}
+
+bool NetCrypto::isOnline(uint32_t connection)
+{
+    return connection < this->connections.size() && this->connections[connection]
+        && this->connections[connection]->status == NET_CRYPTO_ESTABLISHED;
+}
+
+bool NetCrypto::getPublicKey(uint32_t connection, uint8_t* publicKey)
+{
+    if (connection >= this->connections.size() || !this->connections[connection])
+        return false;
+
+    memcpy(publicKey, this->connections[connection]->publicKey, crypto_box_PUBLICKEYBYTES);
+    return true;
+}
+
+int64_t NetCrypto::sendPacket(uint32_t connection, const uint8_t* data, uint16_t length, bool lossless)
+{
+    if (!this->isOnline(connection) || length == 0 || length > NET_CRYPTO_MAX_DATA_SIZE)
+        return -1;
+
+    struct NetCryptoConnection *c = this->connections[connection];
+    uint64_t now = NetworkService::getCurrentTimeMonotonic();
+
+    if (!lossless)
+        return this->sendLossy(connection, NULL, 0, data, length);
+
+    int64_t number = this->queueLossless(c, data, length);
+
+    if (number != -1)
+        this->flush(connection, now);
+
+    return number;
+}
+
+int64_t NetCrypto::sendLossy(uint32_t connection, const uint8_t* header, uint16_t headerLength, const uint8_t* data, uint16_t length)
+{
+    uint32_t total = (uint32_t)headerLength + length;
+
+    if (!this->isOnline(connection) || total == 0 || total > NET_CRYPTO_MAX_DATA_SIZE)
+        return -1;
+
+    uint8_t packet[NET_CRYPTO_MAX_PACKET_SIZE];
+    uint8_t *plain = packet + NET_CRYPTO_DATA_PLAIN_OFFSET;
+    plain[0] = NET_CRYPTO_PACKET_LOSSY;
+
+    if (headerLength)
+        memcpy(plain + 1, header, headerLength);
+
+    memcpy(plain + 1 + headerLength, data, length);
+    return this->sendData(connection, packet, (uint16_t)(1 + total), NetworkService::getCurrentTimeMonotonic()) ? 0 : -1;
+}
+
+void NetCrypto::sendPackets(NetCryptoPacket* packets, size_t count)
+{
+    if (!this->batch) {
+        this->batch = new NetCryptoBatch();
+        this->batch->open = false;
+        this->batch->count = 0;
+        this->batch->next = 0;
+    }
+
+    uint64_t now = NetworkService::getCurrentTimeMonotonic();
+
+    for (size_t i = 0; i < count; ++i) {
+        NetCryptoPacket *packet = &packets[i];
+        packet->result = -1;
+
+        if (!this->isOnline(packet->connection) || packet->length == 0 || packet->length > NET_CRYPTO_MAX_DATA_SIZE)
+            continue;
+
+        struct NetCryptoConnection *c = this->connections[packet->connection];
+        packet->result = this->queueLossless(c, packet->data, packet->length);
+
+        if (packet->result != -1 && !c->batched) {
+            c->batched = true;
+            this->batch->connections.push_back(packet->connection);
+        }
+    }
+
+    this->batch->open = true;
+
+    for (size_t i = 0; i < this->batch->connections.size(); ++i) {
+        this->connections[this->batch->connections[i]]->batched = false;
+        this->flush(this->batch->connections[i], now);
+    }
+
+    this->batch->connections.clear();
+    this->sendBatch();
+    this->batch->open = false;
+}
+
+void NetCrypto::setDataCallback(NetCryptoDataCallback callback, void* object)
+{
+    this->dataCallback = callback;
+    this->dataObject = object;
+}
+
+void NetCrypto::setFramesCallback(NetCryptoFramesCallback callback, void* object)
+{
+    this->deliverFrames();
+    this->framesCallback = callback;
+    this->framesObject = object;
+}
+
+void NetCrypto::deliverFrames()
+{
+    if (!this->frames.empty()) {
+        ++this->stats.frameBatches;
+        this->stats.frames += this->frames.size();
+        this->framesCallback(this->framesObject, this->frames.data(), this->frames.size());
+    }
+
+    this->frames.clear();
+    this->frameBuffersUsed = 0;
+}
+
+void NetCrypto::setStatusCallback(NetCryptoStatusCallback callback, void* object)
+{
+    this->statusCallback = callback;
+    this->statusObject = object;
+}
+
+void NetCrypto::setAcceptCallback(NetCryptoAcceptCallback callback, void* object)
+{
+    this->acceptCallback = callback;
+    this->acceptObject = object;
+}
+
+void NetCrypto::setRouteTag(uint16_t tag)
+{
+    this->routeTag = tag;
+}
+
+bool NetCrypto::getRouteTag(const uint8_t* packet, uint16_t length, uint16_t* tag)
+{
+    if (packet[0] == NET_PACKET_COOKIE_RESPONSE && length == NET_CRYPTO_COOKIE_RESPONSE_SIZE)
+        packet += 1 + NET_CRYPTO_COOKIE_SIZE + sizeof(uint32_t);
+    else if (packet[0] == NET_PACKET_CRYPTO_HS && length == NET_CRYPTO_HANDSHAKE_SIZE)
+        packet += 1 + 1;
+    else if (packet[0] == NET_PACKET_CRYPTO_DATA && length >= NET_CRYPTO_DATA_HEADER_SIZE)
+        packet += 1;
+    else
+        return false;
+
+    *tag = (uint16_t)((packet[0] << 8) | packet[1]);
+    return true;
+}
+
+const uint8_t* NetCrypto::getReceiver(const uint8_t* packet, uint16_t length)
+{
+    if (packet[0] != NET_PACKET_COOKIE_REQUEST || length != NET_CRYPTO_COOKIE_REQUEST_SIZE)
+        return NULL;
+
+    return packet + NET_CRYPTO_COOKIE_REQUEST_RECEIVER;
+}
+
+NetCryptoStats NetCrypto::getStats()
+{
+    NetCryptoStats stats = this->stats;
+    stats.connections = this->connectionCount;
+    stats.pending = (uint32_t)this->pending.size();
+    stats.buffers = (uint32_t)(this->pool.size() * NET_CRYPTO_POOL_CHUNK);
+    stats.buffersUsed = stats.buffers - (uint32_t)this->poolFree.size();
+    stats.memory = (uint64_t)this->slabs.size() * NET_CRYPTO_SLAB * sizeof(struct NetCryptoConnection)
+        + (uint64_t)stats.buffers * NET_CRYPTO_MAX_DATA_SIZE;
+
+    for (size_t i = 0; i < this->connections.size(); ++i) {
+        if (this->connections[i] && this->connections[i]->status == NET_CRYPTO_ESTABLISHED)
+            ++stats.established;
+    }
+
+    return stats;
+}
+
+void NetCrypto::createCookie(uint8_t* cookie, const uint8_t* publicKey, IP_Port ipPort, uint64_t now)
+{
+    uint8_t plain[NET_CRYPTO_COOKIE_PLAIN_SIZE];
+    Utils::writeUint64(plain, now);
+    memcpy(plain + sizeof(uint64_t), publicKey, crypto_box_PUBLICKEYBYTES);
+    NetworkService::packIpPort(plain + sizeof(uint64_t) + crypto_box_PUBLICKEYBYTES, &ipPort);
+
+    cookie[0] = this->cookieEpoch;
+    Crypto::newNonce(cookie + 1);
+    cookie[1] = (uint8_t)(this->routeTag >> 8);
+    cookie[2] = (uint8_t)this->routeTag;
+    Crypto::encryptDataSymmetric(this->cookieKeys[this->cookieEpoch & 1], cookie + 1, plain, sizeof(plain),
+                                 cookie + 1 + crypto_box_NONCEBYTES);
+}
+
+/* return false if the cookie wasn't made by us for source in the last NET_CRYPTO_COOKIE_TIMEOUT. */
+bool NetCrypto::openCookie(const uint8_t* cookie, IP_Port source, uint64_t now, uint8_t* publicKey)
+{
+    uint8_t epoch = cookie[0];
+
+    if (epoch != this->cookieEpoch && epoch != (uint8_t)(this->cookieEpoch - 1))
+        return false;
+
+    uint8_t plain[NET_CRYPTO_COOKIE_PLAIN_SIZE];
+
+    if (Crypto::decryptDataSymmetric(this->cookieKeys[epoch & 1], cookie + 1, cookie + 1 + crypto_box_NONCEBYTES,
+                                     NET_CRYPTO_COOKIE_PLAIN_SIZE + crypto_box_MACBYTES, plain) != sizeof(plain))
+        return false;
+
+    uint64_t issued = Utils::readUint64(plain);
+
+    if (issued > now || now - issued > NET_CRYPTO_COOKIE_TIMEOUT)
+        return false;
+
+    uint8_t address[SIZE_IPPORT];
+    NetworkService::packIpPort(address, &source);
+
+    if (sodium_memcmp(address, plain + sizeof(uint64_t) + crypto_box_PUBLICKEYBYTES, SIZE_IPPORT) != 0)
+        return false;
+
+    memcpy(publicKey, plain + sizeof(uint64_t), crypto_box_PUBLICKEYBYTES);
+    return true;
+}
+
+int NetCrypto::handleCookieRequest(void* object, IP_Port source, const uint8_t* data, uint16_t length)
+{
+    NetCrypto *netCrypto = (NetCrypto *)object;
+
+    if (length != NET_CRYPTO_COOKIE_REQUEST_SIZE
+        || Crypto::comparePublicKeys(data + NET_CRYPTO_COOKIE_REQUEST_RECEIVER, netCrypto->publicKey) != 0)
+        return 1;
+
+    /* Nothing is kept, everything we need later comes back in the cookie. */
+    uint8_t response[NET_CRYPTO_COOKIE_RESPONSE_SIZE];
+    response[0] = NET_PACKET_COOKIE_RESPONSE;
+    netCrypto->createCookie(response + 1, data + 1, source, NetworkService::getCurrentTimeMonotonic());
+    memcpy(response + 1 + NET_CRYPTO_COOKIE_SIZE, data + 1 + crypto_box_PUBLICKEYBYTES, sizeof(uint64_t));
+    ++netCrypto->stats.cookies;
+    return NetworkService::sendPacket(netCrypto->net, source, response, sizeof(response)) == -1 ? 1 : 0;
+}
+
+int NetCrypto::handleCookieResponse(void* object, IP_Port source, const uint8_t* data, uint16_t length)
+{
+    NetCrypto *netCrypto = (NetCrypto *)object;
+
+    if (length != NET_CRYPTO_COOKIE_RESPONSE_SIZE)
+        return 1;
+
+    /* The echo id carries the connection number in its low half. */
+    uint64_t echoId = Utils::readUint64(data + 1 + NET_CRYPTO_COOKIE_SIZE);
+    uint32_t number = (uint32_t)echoId - ((uint32_t)netCrypto->routeTag << NET_CRYPTO_ROUTE_SHIFT);
+
+    if (number >= netCrypto->connections.size() || !netCrypto->connections[number])
+        return 1;
+
+    struct NetCryptoConnection *connection = netCrypto->connections[number];
+
+    if (connection->status != NET_CRYPTO_COOKIE_REQUESTING || connection->echoId != echoId
+        || !NetworkService::ipportEqual(&connection->ipPort, &source))
+        return 1;
+
+    uint64_t now = NetworkService::getCurrentTimeMonotonic();
+
+    if (!netCrypto->sendHandshake(number, data + 1, now))
+        return 1;
+
+    connection->status = NET_CRYPTO_HANDSHAKE_SENT;
+    connection->statusTime = now;
+    return 0;
+}
+
+/* Only the cookie is checked here, symmetrically. Handshakes that pass wait for
+ * the next tick, the newest one of a peer and address replacing the one before it, and
+ * once the queue is full every handshake of the burst keeps the same chance of
+ * being in it (reservoir sampling).
+ */
+int NetCrypto::handleHandshake(void* object, IP_Port source, const uint8_t* data, uint16_t length)
+{
+    NetCrypto *netCrypto = (NetCrypto *)object;
+
+    if (length != NET_CRYPTO_HANDSHAKE_SIZE)
+        return 1;
+
+    uint8_t publicKey[crypto_box_PUBLICKEYBYTES];
+
+    if (!netCrypto->openCookie(data + 1, source, NetworkService::getCurrentTimeMonotonic(), publicKey)) {
+        ++netCrypto->stats.badCookies;
+        return 1;
+    }
+
+    ++netCrypto->stats.handshakesQueued;
+
+    std::vector<PendingHandshake>& pending = netCrypto->pending;
+    int64_t slot = -1;
+
+    /* Someone else asking a cookie in the peer's name doesn't push the peer out. */
+    for (size_t from = 0; from < pending.size(); ) {
+        int64_t found = Crypto::findPublicKey(&netCrypto->pendingKeys[from * crypto_box_PUBLICKEYBYTES],
+                                              pending.size() - from, publicKey);
+
+        if (found == -1)
+            break;
+
+        found += (int64_t)from;
+
+        if (NetworkService::ipportEqual(&pending[found].source, &source)) {
+            slot = found;
+            break;
+        }
+
+        from = (size_t)found + 1;
+    }
+
+    if (slot != -1) {
+        ++netCrypto->stats.handshakesCoalesced;
+    } else if (pending.size() < NET_CRYPTO_HANDSHAKES_PER_TICK) {
+        /* Allocated once, a flood only ever replaces entries. */
+        if (pending.capacity() < NET_CRYPTO_HANDSHAKES_PER_TICK) {
+            pending.reserve(NET_CRYPTO_HANDSHAKES_PER_TICK);
+            netCrypto->pendingKeys.reserve(NET_CRYPTO_HANDSHAKES_PER_TICK * crypto_box_PUBLICKEYBYTES);
+        }
+
+        slot = (int64_t)pending.size();
+        pending.push_back(PendingHandshake());
+        netCrypto->pendingKeys.insert(netCrypto->pendingKeys.end(), publicKey, publicKey + crypto_box_PUBLICKEYBYTES);
+        ++netCrypto->burst;
+    } else {
+        ++netCrypto->stats.handshakesDropped;
+        uint64_t pick = Crypto::random64b() % ++netCrypto->burst;
+
+        if (pick >= NET_CRYPTO_HANDSHAKES_PER_TICK)
+            return 1;
+
+        slot = (int64_t)pick;
+        memcpy(&netCrypto->pendingKeys[slot * crypto_box_PUBLICKEYBYTES], publicKey, crypto_box_PUBLICKEYBYTES);
+    }
+
+    pending[slot].source = source;
+    memcpy(pending[slot].packet, data, NET_CRYPTO_HANDSHAKE_SIZE);
+    return 0;
+}
+
+void NetCrypto::processHandshake(const struct PendingHandshake* pending, const uint8_t* publicKey, uint32_t* agreements,
+                                 uint64_t now)
+{
+    int64_t found = Crypto::findPublicKey(this->connectionKeys.data(), this->connections.size(), publicKey);
+    struct NetCryptoConnection *connection = found == -1 ? NULL : this->connections[found];
+    uint8_t sharedKey[crypto_box_BEFORENMBYTES];
+
+    if (connection) {
+        memcpy(sharedKey, connection->sharedKey, sizeof(sharedKey));
+    } else {
+        if (!this->acceptCallback || this->connectionCount >= NET_CRYPTO_MAX_CONNECTIONS
+            || !this->acceptCallback(this->acceptObject, publicKey, pending->source)) {
+            ++this->stats.handshakesRejected;
+            return;
+        }
+
+        if (*agreements >= NET_CRYPTO_KEY_AGREEMENTS_PER_TICK) {
+            ++this->stats.handshakesDropped;
+            return;
+        }
+
+        ++*agreements;
+        Crypto::encryptPrecompute(publicKey, this->secretKey, sharedKey);
+        ++this->stats.keyAgreements;
+    }
+
+    const uint8_t *cookie = pending->packet + 1;
+    const uint8_t *nonce = cookie + NET_CRYPTO_COOKIE_SIZE;
+    uint8_t plain[NET_CRYPTO_HANDSHAKE_PLAIN_SIZE];
+    uint8_t hash[crypto_hash_sha256_BYTES];
+
+    if (Crypto::decryptDataSymmetric(sharedKey, nonce, nonce + crypto_box_NONCEBYTES,
+                                     NET_CRYPTO_HANDSHAKE_PLAIN_SIZE + crypto_box_MACBYTES, plain) != sizeof(plain)) {
+        ++this->stats.handshakesRejected;
+        return;
+    }
+
+    const uint8_t *peerBase = plain;
+    const uint8_t *peerSession = peerBase + crypto_box_NONCEBYTES;
+    const uint8_t *peerId = peerSession + crypto_box_PUBLICKEYBYTES;
+    const uint8_t *cookieHash = peerId + sizeof(uint32_t);
+    const uint8_t *peerCookie = cookieHash + crypto_hash_sha256_BYTES;
+
+    /* The cookie in front is the one sealed in, not one cut from another handshake. */
+    crypto_hash_sha256(hash, cookie, NET_CRYPTO_COOKIE_SIZE);
+
+    if (sodium_memcmp(hash, cookieHash, sizeof(hash)) != 0) {
+        ++this->stats.handshakesRejected;
+        return;
+    }
+
+    bool wentOffline = false;
+    bool reply = true;
+    uint32_t number;
+
+    if (!connection) {
+        int allocated = this->allocate(publicKey, pending->source);
+
+        if (allocated == -1)
+            return;
+
+        number = (uint32_t)allocated;
+        connection = this->connections[number];
+        connection->incoming = true;
+        memcpy(connection->sharedKey, sharedKey, sizeof(sharedKey));
+    } else {
+        number = (uint32_t)found;
+
+        if (connection->status >= NET_CRYPTO_NOT_CONFIRMED) {
+            /* A late copy, or one resent while our handshake is on its way: the
+             * resend timer of NOT_CONFIRMED answers it, answering here would
+             * have both ends bounce their handshakes off each other.
+             */
+            if (sodium_memcmp(peerSession, connection->peerSessionPublicKey, crypto_box_PUBLICKEYBYTES) == 0)
+                return;
+
+            /* The peer started over, so do we. */
+            wentOffline = connection->status == NET_CRYPTO_ESTABLISHED;
+            this->newSession(connection);
+        } else if (connection->status == NET_CRYPTO_HANDSHAKE_SENT) {
+            /* It answers ours, or both ends started together: either way the peer has it or resends until it does. */
+            reply = false;
+        }
+    }
+
+    connection->ipPort = pending->source;
+    connection->peerId = Utils::readUint32(peerId);
+    memcpy(connection->peerSessionPublicKey, peerSession, crypto_box_PUBLICKEYBYTES);
+    Crypto::sessionInit(&connection->nonces, connection->baseNonce, peerBase);
+    Crypto::encryptPrecompute(peerSession, connection->sessionSecretKey, connection->sendKey);
+    memcpy(connection->recvKey, connection->sendKey, sizeof(connection->recvKey));
+
+    if (reply)
+        this->sendHandshake(number, peerCookie, now);
+
+    connection->status = NET_CRYPTO_NOT_CONFIRMED;
+    connection->statusTime = now;
+    connection->lastReceived = now;
+
+    /* Confirms the session to the peer if it has our handshake already. */
+    this->sendKeepalive(number, now);
+
+    if (wentOffline && this->statusCallback)
+        this->statusCallback(this->statusObject, number, false);
+}
+
+int NetCrypto::handleData(void* object, IP_Port source, const uint8_t* data, uint16_t length)
+{
+    NetCrypto *netCrypto = (NetCrypto *)object;
+
+    if (length < NET_CRYPTO_DATA_HEADER_SIZE + 1 + crypto_box_MACBYTES || length > NET_CRYPTO_MAX_PACKET_SIZE)
+        return 1;
+
+    uint32_t number = Utils::readUint32(data + 1) - ((uint32_t)netCrypto->routeTag << NET_CRYPTO_ROUTE_SHIFT);
+
+    if (number >= netCrypto->connections.size() || !netCrypto->connections[number])
+        return 1;
+
+    struct NetCryptoConnection *connection = netCrypto->connections[number];
+
+    if (connection->status < NET_CRYPTO_NOT_CONFIRMED)
+        return 1;
+
+    uint32_t packetNumber = Utils::readUint32(data + 5);
+
+    /* Decrypted where it stays until delivered: the next free frame buffer, only
+     * taken for good by a lossy packet going to the frames callback.
+     */
+    if (netCrypto->frameBuffers.empty()) {
+        netCrypto->frameBuffers.resize(NET_CRYPTO_FRAME_BATCH * NET_CRYPTO_MAX_PACKET_SIZE);
+        netCrypto->frames.reserve(NET_CRYPTO_FRAME_BATCH);
+    }
+
+    uint8_t *buffer = &netCrypto->frameBuffers[netCrypto->frameBuffersUsed * NET_CRYPTO_MAX_PACKET_SIZE];
+    int plainLength = openData(connection->recvKey, &connection->nonces, packetNumber, data, length, buffer);
+
+    /* Sent with the key the peer had before its last rekey. */
+    if (plainLength < 0 && connection->previousSet) {
+        int previous = openData(connection->previousKey, &connection->previousNonces, packetNumber, data, length, buffer);
+        plainLength = previous > 0 || plainLength == -1 ? previous : plainLength;
+    }
+
+    const uint8_t *plain = buffer + crypto_box_MACBYTES;
+
+    if (plainLength < 1) {
+        if (plainLength == -2)
+            ++netCrypto->stats.replays;
+
+        return 1;
+    }
+
+    uint64_t now = NetworkService::getCurrentTimeMonotonic();
+    connection->lastReceived = now;
+
+    /* Only the peer can encrypt to the session, follow it to a new address. */
+    connection->ipPort = source;
+
+    if (connection->status == NET_CRYPTO_NOT_CONFIRMED) {
+        connection->status = NET_CRYPTO_ESTABLISHED;
+        connection->statusTime = now;
+
+        /* The peer may have had our first packet before our handshake, confirm it now
+         * rather than on the next keepalive.
+         */
+        netCrypto->sendKeepalive(number, now);
+
+        if (netCrypto->statusCallback)
+            netCrypto->statusCallback(netCrypto->statusObject, number, true);
+
+        /* The status callback may have removed it. */
+        if (!netCrypto->isOnline(number))
+            return 0;
+    }
+
+    switch (plain[0]) {
+        case NET_CRYPTO_PACKET_LOSSY:
+            if (plainLength < 2)
+                break;
+
+            if (netCrypto->framesCallback) {
+                NetCryptoFrame frame;
+                frame.connection = number;
+                frame.data = plain + 1;
+                frame.length = (uint16_t)(plainLength - 1);
+                frame.received = now;
+                netCrypto->frames.push_back(frame);
+
+                if (++netCrypto->frameBuffersUsed == NET_CRYPTO_FRAME_BATCH)
+                    netCrypto->deliverFrames();
+            } else if (netCrypto->dataCallback) {
+                netCrypto->dataCallback(netCrypto->dataObject, number, plain + 1, (uint16_t)(plainLength - 1));
+            }
+
+            break;
+
+        case NET_CRYPTO_PACKET_LOSSLESS:
+            netCrypto->handleLossless(number, plain, (uint16_t)plainLength, now);
+            break;
+
+        case NET_CRYPTO_PACKET_ACK:
+            if (plainLength >= 1 + (int)sizeof(uint32_t))
+                netCrypto->handleAck(number, Utils::readUint32(plain + 1), plain + 1 + sizeof(uint32_t),
+                                     (uint32_t)(plainLength - 1 - sizeof(uint32_t)) * 8, now);
+
+            break;
+
+        case NET_CRYPTO_PACKET_REKEY:
+            if (plainLength == NET_CRYPTO_REKEY_SIZE)
+                netCrypto->handleRekey(number, plain + 1, plain + 1 + crypto_box_PUBLICKEYBYTES, now);
+
+            break;
+
+        case NET_CRYPTO_PACKET_REKEY_ACK:
+            if (plainLength == NET_CRYPTO_REKEY_ACK_SIZE)
+                netCrypto->handleRekeyAck(number, plain + 1);
+
+            break;
+    }
+
+    return 0;
+}
+
+int NetCrypto::allocate(const uint8_t* publicKey, IP_Port ipPort)
+{
+    if (this->connectionCount >= NET_CRYPTO_MAX_CONNECTIONS)
+        return -1;
+
+    size_t number = 0;
+
+    while (number < this->connections.size() && this->connections[number])
+        ++number;
+
+    if (number == this->connections.size()) {
+        this->connections.push_back(NULL);
+        this->connectionKeys.resize(this->connections.size() * crypto_box_PUBLICKEYBYTES);
+    }
+
+    if (this->spare.empty()) {
+        struct NetCryptoConnection *slab = new NetCryptoConnection[NET_CRYPTO_SLAB];
+        this->slabs.push_back(slab);
+
+        for (uint32_t i = NET_CRYPTO_SLAB; i > 0; --i)
+            this->spare.push_back(&slab[i - 1]);
+    }
+
+    struct NetCryptoConnection *connection = this->spare.back();
+    this->spare.pop_back();
+    memset(connection, 0, sizeof(*connection));
+    memset(connection->sendBuffer, 0xFF, sizeof(connection->sendBuffer));
+    memset(connection->recvBuffer, 0xFF, sizeof(connection->recvBuffer));
+    memcpy(connection->publicKey, publicKey, crypto_box_PUBLICKEYBYTES);
+    connection->ipPort = ipPort;
+    connection->status = NET_CRYPTO_COOKIE_REQUESTING;
+    connection->statusTime = NetworkService::getCurrentTimeMonotonic();
+    this->newSession(connection);
+
+    this->connections[number] = connection;
+    memcpy(&this->connectionKeys[number * crypto_box_PUBLICKEYBYTES], publicKey, crypto_box_PUBLICKEYBYTES);
+    ++this->connectionCount;
+    return (int)number;
+}
+
+void NetCrypto::release(uint32_t connection)
+{
+    struct NetCryptoConnection *c = this->connections[connection];
+    this->resetChannel(c);
+    sodium_memzero(c, sizeof(*c));
+
+    /* Its number may be given to another peer before the batch goes out. */
+    size_t kept = 0;
+
+    for (size_t i = 0; i < this->frames.size(); ++i) {
+        if (this->frames[i].connection != connection)
+            this->frames[kept++] = this->frames[i];
+    }
+
+    this->frames.resize(kept);
+    this->spare.push_back(c);
+
+    this->connections[connection] = NULL;
+    memset(&this->connectionKeys[connection * crypto_box_PUBLICKEYBYTES], 0, crypto_box_PUBLICKEYBYTES);
+    --this->connectionCount;
+}
+
+void NetCrypto::newSession(struct NetCryptoConnection* connection)
+{
+    crypto_box_keypair(connection->sessionPublicKey, connection->sessionSecretKey);
+    Crypto::randomNonce(connection->baseNonce);
+    memset(connection->peerSessionPublicKey, 0, sizeof(connection->peerSessionPublicKey));
+    sodium_memzero(connection->sendKey, sizeof(connection->sendKey));
+    sodium_memzero(connection->recvKey, sizeof(connection->recvKey));
+    connection->rekeying = false;
+    sodium_memzero(connection->rekeySecretKey, sizeof(connection->rekeySecretKey));
+    memset(connection->peerRekeyPublicKey, 0, sizeof(connection->peerRekeyPublicKey));
+    connection->previousSet = false;
+    sodium_memzero(connection->previousKey, sizeof(connection->previousKey));
+    this->resetChannel(connection);
+}
+
+/* Drop the lossless packets of the session, both ends number them from 0 again. */
+void NetCrypto::resetChannel(struct NetCryptoConnection* connection)
+{
+    for (uint32_t i = 0; i < NET_CRYPTO_WINDOW; ++i) {
+        if (connection->sendBuffer[i] != NET_CRYPTO_NO_BUFFER)
+            this->giveBuffer(connection->sendBuffer[i]);
+
+        if (connection->recvBuffer[i] != NET_CRYPTO_NO_BUFFER)
+            this->giveBuffer(connection->recvBuffer[i]);
+    }
+
+    memset(connection->sendBuffer, 0xFF, sizeof(connection->sendBuffer));
+    memset(connection->recvBuffer, 0xFF, sizeof(connection->recvBuffer));
+    memset(connection->sendState, NET_CRYPTO_SLOT_QUEUED, sizeof(connection->sendState));
+    connection->sendStart = 0;
+    connection->sendNext = 0;
+    connection->sendEnd = 0;
+    connection->inFlight = 0;
+    connection->lost = 0;
+    connection->highestAcked = 0;
+    connection->highestAckedSent = 0;
+    connection->recvStart = 0;
+    connection->recvEnd = 0;
+    connection->unacked = 0;
+
+    Congestion::reset(&connection->congestion, &netCryptoLimits);
+    connection->credit = 0;
+    connection->paced = 0;
+}
+
+/* The handshake or the session timed out: incoming connections go, ours start over. */
+void NetCrypto::fail(uint32_t connection, uint64_t now)
+{
+    struct NetCryptoConnection *c = this->connections[connection];
+
+    /* Told first, while the connection still has its key. */
+    if (c->status == NET_CRYPTO_ESTABLISHED && this->statusCallback) {
+        c->status = NET_CRYPTO_NOT_CONFIRMED;
+        this->statusCallback(this->statusObject, connection, false);
+
+        if (this->connections[connection] != c)
+            return;
+    }
+
+    if (c->incoming) {
+        this->release(connection);
+    } else {
+        this->newSession(c);
+        c->status = NET_CRYPTO_COOKIE_REQUESTING;
+        c->statusTime = now;
+        this->sendCookieRequest(connection, now);
+    }
+}
+
+uint32_t NetCrypto::takeBuffer()
+{
+    if (this->poolFree.empty()) {
+        if (this->pool.size() * NET_CRYPTO_POOL_CHUNK >= NET_CRYPTO_POOL_BUFFERS)
+            return NET_CRYPTO_NO_BUFFER;
+
+        uint8_t *chunk = (uint8_t *)malloc(NET_CRYPTO_POOL_CHUNK * NET_CRYPTO_MAX_DATA_SIZE);
+
+        if (!chunk)
+            return NET_CRYPTO_NO_BUFFER;
+
+        uint32_t first = (uint32_t)(this->pool.size() * NET_CRYPTO_POOL_CHUNK);
+        this->pool.push_back(chunk);
+
+        for (uint32_t i = NET_CRYPTO_POOL_CHUNK; i > 0; --i)
+            this->poolFree.push_back(first + i - 1);
+    }
+
+    uint32_t buffer = this->poolFree.back();
+    this->poolFree.pop_back();
+    return buffer;
+}
+
+uint8_t* NetCrypto::getBuffer(uint32_t buffer)
+{
+    return this->pool[buffer / NET_CRYPTO_POOL_CHUNK] + (size_t)(buffer % NET_CRYPTO_POOL_CHUNK) * NET_CRYPTO_MAX_DATA_SIZE;
+}
+
+void NetCrypto::giveBuffer(uint32_t buffer)
+{
+    this->poolFree.push_back(buffer);
+}
+
+void NetCrypto::handleLossless(uint32_t connection, const uint8_t* data, uint16_t length, uint64_t now)
+{
+    struct NetCryptoConnection *c = this->connections[connection];
+
+    if (length <= NET_CRYPTO_LOSSLESS_HEADER_SIZE)
+        return;
+
+    uint32_t number = Utils::readUint32(data + 1);
+    this->handleAck(connection, Utils::readUint32(data + 5), NULL, 0, now);
+    ++c->unacked;
+
+    bool duplicate = number - c->recvStart >= NET_CRYPTO_WINDOW
+        || c->recvBuffer[number & NET_CRYPTO_WINDOW_MASK] != NET_CRYPTO_NO_BUFFER;
+
+    if (!duplicate) {
+        uint32_t buffer = this->takeBuffer();
+
+        /* Out of buffers, the sender tries again. */
+        if (buffer == NET_CRYPTO_NO_BUFFER)
+            return;
+
+        uint32_t slot = number & NET_CRYPTO_WINDOW_MASK;
+        uint16_t dataLength = (uint16_t)(length - NET_CRYPTO_LOSSLESS_HEADER_SIZE);
+        memcpy(this->getBuffer(buffer), data + NET_CRYPTO_LOSSLESS_HEADER_SIZE, dataLength);
+        c->recvBuffer[slot] = buffer;
+        c->recvLength[slot] = dataLength;
+
+        if ((int32_t)(number + 1 - c->recvEnd) > 0)
+            c->recvEnd = number + 1;
+
+        /* Everything in order goes up, the callback may remove the connection. */
+        while (c->recvBuffer[c->recvStart & NET_CRYPTO_WINDOW_MASK] != NET_CRYPTO_NO_BUFFER) {
+            slot = c->recvStart & NET_CRYPTO_WINDOW_MASK;
+            buffer = c->recvBuffer[slot];
+            c->recvBuffer[slot] = NET_CRYPTO_NO_BUFFER;
+            ++c->recvStart;
+
+            if (this->dataCallback)
+                this->dataCallback(this->dataObject, connection, this->getBuffer(buffer), c->recvLength[slot]);
+
+            this->giveBuffer(buffer);
+
+            if (this->connections[connection] != c)
+                return;
+        }
+    }
+
+    /* A gap or a duplicate is told at once so the sender resends early, in order packets are acknowledged in batches. */
+    if (c->unacked >= NET_CRYPTO_ACK_EVERY || c->recvEnd != c->recvStart || duplicate)
+        this->sendAck(connection, now);
+}
+
+void NetCrypto::handleAck(uint32_t connection, uint32_t ack, const uint8_t* bitmap, uint32_t bits, uint64_t now)
+{
+    struct NetCryptoConnection *c = this->connections[connection];
+
+    /* Old, or acknowledging what we never sent. */
+    if ((int32_t)(ack - c->sendStart) < 0 || (int32_t)(ack - c->sendNext) > 0)
+        return;
+
+    uint32_t acked = 0;
+    uint32_t highestAcked = c->highestAcked;
+
+    while (c->sendStart != ack) {
+        acked += this->ackPacket(c, c->sendStart, now);
+        c->sendState[c->sendStart & NET_CRYPTO_WINDOW_MASK] = NET_CRYPTO_SLOT_QUEUED;
+        ++c->sendStart;
+    }
+
+    for (uint32_t i = 0; i < bits; ++i) {
+        uint32_t number = ack + 1 + i;
+
+        if ((int32_t)(number - c->sendNext) >= 0)
+            break;
+
+        if (bitmap[i / 8] & (1 << (i % 8)))
+            acked += this->ackPacket(c, number, now);
+    }
+
+    if (acked == 0)
+        return;
+
+    Congestion::onAcked(&c->congestion, acked);
+
+    if (c->highestAcked != highestAcked)
+        this->detectLosses(c, now);
+
+    this->flush(connection, now);
+}
+
+/* return true if number wasn't acknowledged before. */
+bool NetCrypto::ackPacket(struct NetCryptoConnection* connection, uint32_t number, uint64_t now)
+{
+    uint32_t slot = number & NET_CRYPTO_WINDOW_MASK;
+    uint8_t state = connection->sendState[slot];
+
+    if (state != NET_CRYPTO_SLOT_SENT && state != NET_CRYPTO_SLOT_LOST)
+        return false;
+
+    if (state == NET_CRYPTO_SLOT_SENT) {
+        --connection->inFlight;
+    } else {
+        --connection->lost;
+    }
+
+    /* Only packets sent once say which transmission the acknowledgement is for. */
+    if (connection->transmissions[slot] == 1)
+        Congestion::onRttSample(&connection->congestion, (uint32_t)now - connection->sentTime[slot]);
+
+    if ((int32_t)(number + 1 - connection->highestAcked) > 0) {
+        connection->highestAcked = number + 1;
+        connection->highestAckedSent = connection->sentTime[slot];
+    }
+
+    this->giveBuffer(connection->sendBuffer[slot]);
+    connection->sendBuffer[slot] = NET_CRYPTO_NO_BUFFER;
+    connection->sendState[slot] = NET_CRYPTO_SLOT_ACKED;
+    return true;
+}
+
+/* A packet is lost once NET_CRYPTO_DUPLICATE_THRESHOLD packets after it, sent no
+ * earlier than its last transmission, were acknowledged.
+ */
+void NetCrypto::detectLosses(struct NetCryptoConnection* connection, uint64_t now)
+{
+    uint32_t lost = 0;
+
+    for (uint32_t number = connection->sendStart;
+         (int32_t)(number + NET_CRYPTO_DUPLICATE_THRESHOLD - connection->highestAcked) < 0; ++number) {
+        uint32_t slot = number & NET_CRYPTO_WINDOW_MASK;
+
+        if (connection->sendState[slot] == NET_CRYPTO_SLOT_SENT
+            && (int32_t)(connection->sentTime[slot] - connection->highestAckedSent) <= 0) {
+            connection->sendState[slot] = NET_CRYPTO_SLOT_LOST;
+            --connection->inFlight;
+            ++connection->lost;
+            ++lost;
+        }
+    }
+
+    if (lost)
+        Congestion::onLoss(&connection->congestion, now, false);
+}
+
+/* Nothing came back for the oldest packet in flight within the RTO: the whole flight is resent. */
+void NetCrypto::checkTimeout(struct NetCryptoConnection* connection, uint64_t now)
+{
+    if (connection->inFlight == 0)
+        return;
+
+    uint32_t number = connection->sendStart;
+
+    while (connection->sendState[number & NET_CRYPTO_WINDOW_MASK] != NET_CRYPTO_SLOT_SENT)
+        ++number;
+
+    if ((uint32_t)now - connection->sentTime[number & NET_CRYPTO_WINDOW_MASK] < connection->congestion.rto)
+        return;
+
+    for (; number != connection->sendNext; ++number) {
+        uint32_t slot = number & NET_CRYPTO_WINDOW_MASK;
+
+        if (connection->sendState[slot] == NET_CRYPTO_SLOT_SENT) {
+            connection->sendState[slot] = NET_CRYPTO_SLOT_LOST;
+            ++connection->lost;
+        }
+    }
+
+    connection->inFlight = 0;
+    Congestion::onLoss(&connection->congestion, now, true);
+}
+
+/* return the number of the packet put in the send ring, -1 if the ring or the pool is full. */
+int64_t NetCrypto::queueLossless(struct NetCryptoConnection* connection, const uint8_t* data, uint16_t length)
+{
+    if (connection->sendEnd - connection->sendStart >= NET_CRYPTO_WINDOW)
+        return -1;
+
+    uint32_t buffer = this->takeBuffer();
+
+    if (buffer == NET_CRYPTO_NO_BUFFER)
+        return -1;
+
+    uint32_t number = connection->sendEnd++;
+    uint32_t slot = number & NET_CRYPTO_WINDOW_MASK;
+    memcpy(this->getBuffer(buffer), data, length);
+    connection->sendBuffer[slot] = buffer;
+    connection->sendLength[slot] = length;
+    connection->sendState[slot] = NET_CRYPTO_SLOT_QUEUED;
+    connection->transmissions[slot] = 0;
+    return number;
+}
+
+/* Send lost packets then new ones, as far as the congestion window and the pacing allow. */
+void NetCrypto::flush(uint32_t connection, uint64_t now)
+{
+    struct NetCryptoConnection *c = this->connections[connection];
+
+    if (c->status != NET_CRYPTO_ESTABLISHED || (c->lost == 0 && c->sendNext == c->sendEnd))
+        return;
+
+    /* Half the window can go at once, the rest follows at a window per round trip. */
+    struct CongestionWindow *cc = &c->congestion;
+    double burst = cc->window / 2 > NET_CRYPTO_PACING_BURST ? cc->window / 2 : NET_CRYPTO_PACING_BURST;
+
+    if (cc->smoothedRtt == 0) {
+        c->credit = burst;
+    } else {
+        c->credit += (double)(now - c->paced) * cc->window / cc->smoothedRtt;
+
+        if (c->credit > burst)
+            c->credit = burst;
+    }
+
+    c->paced = now;
+
+    uint8_t packet[NET_CRYPTO_MAX_PACKET_SIZE];
+    uint8_t *plain = packet + NET_CRYPTO_DATA_PLAIN_OFFSET;
+    uint32_t cursor = c->sendStart;
+
+    while (c->credit >= 1 && c->inFlight < (uint32_t)cc->window) {
+        uint32_t number;
+
+        if (c->lost) {
+            while (c->sendState[cursor & NET_CRYPTO_WINDOW_MASK] != NET_CRYPTO_SLOT_LOST)
+                ++cursor;
+
+            number = cursor++;
+            --c->lost;
+            ++this->stats.retransmissions;
+        } else if (c->sendNext != c->sendEnd) {
+            number = c->sendNext++;
+        } else {
+            break;
+        }
+
+        uint32_t slot = number & NET_CRYPTO_WINDOW_MASK;
+        plain[0] = NET_CRYPTO_PACKET_LOSSLESS;
+        Utils::writeUint32(plain + 1, number);
+        Utils::writeUint32(plain + 5, c->recvStart);
+        memcpy(plain + NET_CRYPTO_LOSSLESS_HEADER_SIZE, this->getBuffer(c->sendBuffer[slot]), c->sendLength[slot]);
+
+        c->sendState[slot] = NET_CRYPTO_SLOT_SENT;
+        c->sentTime[slot] = (uint32_t)now;
+
+        if (c->transmissions[slot] < UINT8_MAX)
+            ++c->transmissions[slot];
+
+        ++c->inFlight;
+        c->credit -= 1;
+        this->sendData(connection, packet, (uint16_t)(NET_CRYPTO_LOSSLESS_HEADER_SIZE + c->sendLength[slot]), now);
+
+        /* With nothing missing the number we expect, carried along, is the whole acknowledgement. */
+        if (c->recvEnd == c->recvStart)
+            c->unacked = 0;
+    }
+}
+
+void NetCrypto::sendAck(uint32_t connection, uint64_t now)
+{
+    struct NetCryptoConnection *c = this->connections[connection];
+    uint8_t packet[NET_CRYPTO_DATA_PLAIN_OFFSET + 1 + sizeof(uint32_t) + NET_CRYPTO_ACK_BITMAP_SIZE];
+    uint8_t *plain = packet + NET_CRYPTO_DATA_PLAIN_OFFSET;
+    plain[0] = NET_CRYPTO_PACKET_ACK;
+    Utils::writeUint32(plain + 1, c->recvStart);
+
+    /* Bit i for packet recvStart + 1 + i, up to the highest received. */
+    uint32_t bits = c->recvEnd != c->recvStart ? c->recvEnd - c->recvStart - 1 : 0;
+    uint8_t *bitmap = plain + 1 + sizeof(uint32_t);
+    memset(bitmap, 0, (bits + 7) / 8);
+
+    for (uint32_t i = 0; i < bits; ++i) {
+        if (c->recvBuffer[(c->recvStart + 1 + i) & NET_CRYPTO_WINDOW_MASK] != NET_CRYPTO_NO_BUFFER)
+            bitmap[i / 8] |= (uint8_t)(1 << (i % 8));
+    }
+
+    c->unacked = 0;
+    ++this->stats.acks;
+    this->sendData(connection, packet, (uint16_t)(1 + sizeof(uint32_t) + (bits + 7) / 8), now);
+}
+
+void NetCrypto::sendCookieRequest(uint32_t connection, uint64_t now)
+{
+    struct NetCryptoConnection *c = this->connections[connection];
+    c->echoId = ((uint64_t)Crypto::randomInt() << 32) | ((uint32_t)this->routeTag << NET_CRYPTO_ROUTE_SHIFT) | connection;
+    c->lastSent = now;
+
+    uint8_t packet[NET_CRYPTO_COOKIE_REQUEST_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = NET_PACKET_COOKIE_REQUEST;
+    memcpy(packet + 1, this->publicKey, crypto_box_PUBLICKEYBYTES);
+    Utils::writeUint64(packet + 1 + crypto_box_PUBLICKEYBYTES, c->echoId);
+    memcpy(packet + NET_CRYPTO_COOKIE_REQUEST_RECEIVER, c->publicKey, crypto_box_PUBLICKEYBYTES);
+    NetworkService::sendPacket(this->net, c->ipPort, packet, sizeof(packet));
+}
+
+bool NetCrypto::sendHandshake(uint32_t connection, const uint8_t* cookie, uint64_t now)
+{
+    struct NetCryptoConnection *c = this->connections[connection];
+    uint8_t plain[NET_CRYPTO_HANDSHAKE_PLAIN_SIZE];
+    uint8_t *p = plain;
+
+    memcpy(p, c->baseNonce, crypto_box_NONCEBYTES);
+    p += crypto_box_NONCEBYTES;
+    memcpy(p, c->sessionPublicKey, crypto_box_PUBLICKEYBYTES);
+    p += crypto_box_PUBLICKEYBYTES;
+    Utils::writeUint32(p, ((uint32_t)this->routeTag << NET_CRYPTO_ROUTE_SHIFT) | connection);
+    p += sizeof(uint32_t);
+    crypto_hash_sha256(p, cookie, NET_CRYPTO_COOKIE_SIZE);
+    p += crypto_hash_sha256_BYTES;
+    this->createCookie(p, c->publicKey, c->ipPort, now);
+
+    uint8_t *packet = c->handshake;
+    packet[0] = NET_PACKET_CRYPTO_HS;
+    memcpy(packet + 1, cookie, NET_CRYPTO_COOKIE_SIZE);
+    uint8_t *nonce = packet + 1 + NET_CRYPTO_COOKIE_SIZE;
+    Crypto::newNonce(nonce);
+
+    if (Crypto::encryptDataSymmetric(c->sharedKey, nonce, plain, sizeof(plain), nonce + crypto_box_NONCEBYTES) == -1)
+        return false;
+
+    c->lastSent = now;
+    return NetworkService::sendPacket(this->net, c->ipPort, packet, NET_CRYPTO_HANDSHAKE_SIZE) != -1;
+}
+
+/* The plain data, length bytes, was written at packet + NET_CRYPTO_DATA_PLAIN_OFFSET
+ * and is encrypted where it is.
+ */
+bool NetCrypto::sendData(uint32_t connection, uint8_t* packet, uint16_t length, uint64_t now)
+{
+    struct NetCryptoConnection *c = this->connections[connection];
+    uint8_t nonce[crypto_box_NONCEBYTES];
+
+    /* The numbers left are kept for the rekey offer, tick() makes it. */
+    if (c->nonces.sendNumber == UINT32_MAX
+        || (c->nonces.sendNumber >= NET_CRYPTO_MAX_PACKETS && packet[NET_CRYPTO_DATA_PLAIN_OFFSET] != NET_CRYPTO_PACKET_REKEY))
+        return false;
+
+    packet[0] = NET_PACKET_CRYPTO_DATA;
+    Utils::writeUint32(packet + 1, c->peerId);
+    Utils::writeUint32(packet + 5, Crypto::sessionNextNonce(&c->nonces, nonce));
+
+    /* Numbered here in the order of the session, encrypted later with the rest of the batch. */
+    if (this->batch && this->batch->open) {
+        if (this->batch->count == NET_CRYPTO_SEND_BATCH)
+            this->sendBatch();
+
+        uint32_t i = this->batch->count++;
+        struct NetCryptoBatchPacket *batched = &this->batch->packets[i];
+        memcpy(this->batch->buffers[i], packet, NET_CRYPTO_DATA_PLAIN_OFFSET + length);
+        memcpy(batched->key, c->sendKey, sizeof(batched->key));
+        memcpy(batched->nonce, nonce, sizeof(batched->nonce));
+        batched->ipPort = c->ipPort;
+        batched->length = length;
+        c->lastSent = now;
+        return true;
+    }
+
+    int encrypted = Crypto::encryptInPlace(c->sendKey, nonce, packet + NET_CRYPTO_DATA_HEADER_SIZE, length);
+
+    if (encrypted == -1)
+        return false;
+
+    c->lastSent = now;
+    return NetworkService::sendPacket(this->net, c->ipPort, packet,
+                                      (uint16_t)(NET_CRYPTO_DATA_HEADER_SIZE + encrypted)) != -1;
+}
+
+/* Encrypt the packets of the batch, on the sealers too if it is large enough, and write them out. */
+void NetCrypto::sendBatch()
+{
+    struct NetCryptoBatch *b = this->batch;
+
+    if (b->count == 0)
+        return;
+
+    b->next = 0;
+
+    NetCryptoSealers *sealers = b->count < NET_CRYPTO_PARALLEL_MINIMUM ? NULL : sharedSealers();
+
+    if (!sealers || sealers->threads.empty() || !sealers->busy.try_lock()) {
+        sealPackets(b);
+    } else {
+        {
+            std::lock_guard<std::mutex> guard(sealers->lock);
+            sealers->batch = b;
+            sealers->running = (uint32_t)sealers->threads.size();
+            ++sealers->generation;
+        }
+
+        sealers->wake.notify_all();
+        sealPackets(b);
+
+        {
+            std::unique_lock<std::mutex> guard(sealers->lock);
+            sealers->done.wait(guard, [&]() { return sealers->running == 0; });
+            sealers->batch = NULL;
+        }
+
+        sealers->busy.unlock();
+    }
+
+    uint32_t out = 0;
+
+    for (uint32_t i = 0; i < b->count; ++i) {
+        if (b->packets[i].length == 0)
+            continue;
+
+        b->out[out].ipPort = b->packets[i].ipPort;
+        b->out[out].data = b->buffers[i];
+        b->out[out].length = b->packets[i].length;
+        ++out;
+    }
+
+    NetworkService::sendPackets(this->net, b->out, out);
+    b->count = 0;
+}
+
+void NetCrypto::sendKeepalive(uint32_t connection, uint64_t now)
+{
+    uint8_t packet[NET_CRYPTO_DATA_PLAIN_OFFSET + 1];
+    packet[NET_CRYPTO_DATA_PLAIN_OFFSET] = NET_CRYPTO_PACKET_KEEPALIVE;
+    this->sendData(connection, packet, 1, now);
+}
+
+/* Offer a new key for our direction, the same one until the peer takes it. */
+void NetCrypto::sendRekey(uint32_t connection, uint64_t now)
+{
+    struct NetCryptoConnection *c = this->connections[connection];
+
+    if (!c->rekeying) {
+        crypto_box_keypair(c->rekeyPublicKey, c->rekeySecretKey);
+        Crypto::randomNonce(c->rekeyNonce);
+        c->rekeying = true;
+    }
+
+    uint8_t packet[NET_CRYPTO_DATA_PLAIN_OFFSET + NET_CRYPTO_REKEY_SIZE];
+    uint8_t *plain = packet + NET_CRYPTO_DATA_PLAIN_OFFSET;
+    plain[0] = NET_CRYPTO_PACKET_REKEY;
+    memcpy(plain + 1, c->rekeyPublicKey, crypto_box_PUBLICKEYBYTES);
+    memcpy(plain + 1 + crypto_box_PUBLICKEYBYTES, c->rekeyNonce, crypto_box_NONCEBYTES);
+    c->rekeySent = now;
+    this->sendData(connection, packet, NET_CRYPTO_REKEY_SIZE, now);
+}
+
+/* The peer offers a new key for its direction: take it, unless we did already,
+ * and tell it so. What it sent with the old one still opens with previousKey.
+ */
+void NetCrypto::handleRekey(uint32_t connection, const uint8_t* publicKey, const uint8_t* baseNonce, uint64_t now)
+{
+    struct NetCryptoConnection *c = this->connections[connection];
+
+    if (sodium_memcmp(publicKey, c->peerRekeyPublicKey, crypto_box_PUBLICKEYBYTES) != 0) {
+        memcpy(c->previousKey, c->recvKey, sizeof(c->previousKey));
+        c->previousNonces = c->nonces;
+        c->previousSet = true;
+
+        Crypto::encryptPrecompute(publicKey, c->sessionSecretKey, c->recvKey);
+        Crypto::sessionRekeyReceive(&c->nonces, baseNonce);
+        memcpy(c->peerRekeyPublicKey, publicKey, crypto_box_PUBLICKEYBYTES);
+    }
+
+    uint8_t packet[NET_CRYPTO_DATA_PLAIN_OFFSET + NET_CRYPTO_REKEY_ACK_SIZE];
+    uint8_t *plain = packet + NET_CRYPTO_DATA_PLAIN_OFFSET;
+    plain[0] = NET_CRYPTO_PACKET_REKEY_ACK;
+    memcpy(plain + 1, publicKey, crypto_box_PUBLICKEYBYTES);
+    this->sendData(connection, packet, NET_CRYPTO_REKEY_ACK_SIZE, now);
+}
+
+/* The peer took our offer, the numbers of our direction start over with the new key. */
+void NetCrypto::handleRekeyAck(uint32_t connection, const uint8_t* publicKey)
+{
+    struct NetCryptoConnection *c = this->connections[connection];
+
+    if (!c->rekeying || sodium_memcmp(publicKey, c->rekeyPublicKey, crypto_box_PUBLICKEYBYTES) != 0)
+        return;
+
+    Crypto::encryptPrecompute(c->peerSessionPublicKey, c->rekeySecretKey, c->sendKey);
+    Crypto::sessionRekeySend(&c->nonces, c->rekeyNonce);
+    sodium_memzero(c->rekeySecretKey, sizeof(c->rekeySecretKey));
+    c->rekeying = false;
+    ++this->stats.rekeys;
+}
+
+void NetCrypto::tick()
+{
+    /* What the last poll read goes up before anything else takes time. */
+    this->deliverFrames();
+
+    uint64_t now = NetworkService::getCurrentTimeMonotonic();
+
+    /* Cookies of the epoch before stay good until the next rotation, long past their timeout. */
+    if (now - this->cookieRotated >= NET_CRYPTO_COOKIE_ROTATION) {
+        ++this->cookieEpoch;
+        Crypto::newSymmetricKey(this->cookieKeys[this->cookieEpoch & 1]);
+        this->cookieRotated = now;
+    }
+
+    /* The burst read by the last poll, one handshake per peer and address. */
+    uint32_t agreements = 0;
+
+    for (size_t i = 0; i < this->pending.size(); ++i)
+        this->processHandshake(&this->pending[i], &this->pendingKeys[i * crypto_box_PUBLICKEYBYTES], &agreements, now);
+
+    this->pending.clear();
+    this->pendingKeys.clear();
+    this->burst = 0;
+
+    for (uint32_t i = 0; i < this->connections.size(); ++i) {
+        struct NetCryptoConnection *c = this->connections[i];
+
+        if (!c)
+            continue;
+
+        switch (c->status) {
+            case NET_CRYPTO_COOKIE_REQUESTING:
+                if (now - c->lastSent >= NET_CRYPTO_RETRY_INTERVAL)
+                    this->sendCookieRequest(i, now);
+
+                break;
+
+            case NET_CRYPTO_HANDSHAKE_SENT:
+            case NET_CRYPTO_NOT_CONFIRMED:
+                if (now - c->statusTime >= NET_CRYPTO_HANDSHAKE_TIMEOUT) {
+                    this->fail(i, now);
+                } else if (now - c->lastSent >= NET_CRYPTO_RETRY_INTERVAL) {
+                    c->lastSent = now;
+                    NetworkService::sendPacket(this->net, c->ipPort, c->handshake, NET_CRYPTO_HANDSHAKE_SIZE);
+
+                    if (c->status == NET_CRYPTO_NOT_CONFIRMED)
+                        this->sendKeepalive(i, now);
+                }
+
+                break;
+
+            case NET_CRYPTO_ESTABLISHED:
+                if (now - c->lastReceived >= NET_CRYPTO_TIMEOUT || c->nonces.sendNumber == UINT32_MAX) {
+                    this->fail(i, now);
+                    break;
+                }
+
+                if (c->nonces.sendNumber >= NET_CRYPTO_REKEY_PACKETS
+                    && (!c->rekeying || now - c->rekeySent >= NET_CRYPTO_RETRY_INTERVAL))
+                    this->sendRekey(i, now);
+
+                /* Acknowledgements held back for a batch go out now. */
+                if (c->unacked)
+                    this->sendAck(i, now);
+
+                this->checkTimeout(c, now);
+                this->flush(i, now);
+
+                if (now - c->lastSent >= NET_CRYPTO_KEEPALIVE_INTERVAL)
+                    this->sendKeepalive(i, now);
+
+                break;
+        }
+    }
+}
@@ -0,0 +1,393 @@
+//
+//  NetCrypto.hpp
+//  PeerJet
+//
+//  Created by Compy on 12/17/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef NetCrypto_hpp
+#define NetCrypto_hpp
+
+#include <cstdint>
+#include <stdio.h>
+#include <vector>
+#include "Congestion.hpp"
+#include "Crypto.hpp"
+#include "NetworkService.hpp"
+
+/* Cookie: [key epoch][nonce][encrypted: timestamp (8), public key, address][MAC].
+ * Only we can read it: it is encrypted with a key we rotate every
+ * NET_CRYPTO_COOKIE_ROTATION, and taken back for NET_CRYPTO_COOKIE_TIMEOUT.
+ */
+#define NET_CRYPTO_COOKIE_PLAIN_SIZE    (sizeof(uint64_t) + crypto_box_PUBLICKEYBYTES + SIZE_IPPORT)
+#define NET_CRYPTO_COOKIE_SIZE          (1 + crypto_box_NONCEBYTES + NET_CRYPTO_COOKIE_PLAIN_SIZE + crypto_box_MACBYTES)
+#define NET_CRYPTO_COOKIE_TIMEOUT       15000
+#define NET_CRYPTO_COOKIE_ROTATION      60000
+
+/* NET_PACKET_COOKIE_RESPONSE: [id][cookie][echo id (8)].
+ * NET_PACKET_COOKIE_REQUEST: [id][public key][echo id (8)][receiver's public key][zeros],
+ * as large as the response so it can't be used for amplification.
+ */
+#define NET_CRYPTO_COOKIE_RESPONSE_SIZE (1 + NET_CRYPTO_COOKIE_SIZE + sizeof(uint64_t))
+#define NET_CRYPTO_COOKIE_REQUEST_SIZE  NET_CRYPTO_COOKIE_RESPONSE_SIZE
+#define NET_CRYPTO_COOKIE_REQUEST_RECEIVER  (1 + crypto_box_PUBLICKEYBYTES + sizeof(uint64_t))
+
+/* Connection numbers on the wire, in data packets and the low half of echo ids,
+ * carry the route tag of the instance (setRouteTag) in their high 16 bits, and
+ * so do the first two bytes of the nonce of its cookies. NET_CRYPTO_MAX_CONNECTIONS
+ * fit in the low 16 bits.
+ */
+#define NET_CRYPTO_ROUTE_SHIFT          16
+
+/* NET_PACKET_CRYPTO_HS: [id][cookie we got from the receiver][nonce][encrypted with
+ * the long-term keys: base nonce, session public key, our connection id (4),
+ * sha256 of the cookie in front, a cookie of ours for the receiver][MAC].
+ */
+#define NET_CRYPTO_HANDSHAKE_PLAIN_SIZE (crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + sizeof(uint32_t) \
+                                         + crypto_hash_sha256_BYTES + NET_CRYPTO_COOKIE_SIZE)
+#define NET_CRYPTO_HANDSHAKE_SIZE       (1 + NET_CRYPTO_COOKIE_SIZE + crypto_box_NONCEBYTES \
+                                         + NET_CRYPTO_HANDSHAKE_PLAIN_SIZE + crypto_box_MACBYTES)
+
+/* NET_PACKET_CRYPTO_DATA: [id][receiver's connection id (4)][packet number (4)][encrypted: kind, data][MAC],
+ * NET_CRYPTO_MAX_PACKET_SIZE at most.
+ */
+#define NET_CRYPTO_DATA_HEADER_SIZE     (1 + sizeof(uint32_t) * 2)
+#define NET_CRYPTO_MAX_PACKET_SIZE      1400
+
+/* Kinds of data packet:
+ * NET_CRYPTO_PACKET_KEEPALIVE: [kind]
+ * NET_CRYPTO_PACKET_LOSSY: [kind][data]
+ * NET_CRYPTO_PACKET_LOSSLESS: [kind][lossless number (4)][next lossless number we expect (4)][data]
+ * NET_CRYPTO_PACKET_ACK: [kind][next lossless number we expect (4)][bitmap of the ones after it we have]
+ * NET_CRYPTO_PACKET_REKEY: [kind][new public key of the sender's direction][its new base nonce]
+ * NET_CRYPTO_PACKET_REKEY_ACK: [kind][the public key of the NET_CRYPTO_PACKET_REKEY taken]
+ */
+#define NET_CRYPTO_PACKET_KEEPALIVE     0
+#define NET_CRYPTO_PACKET_LOSSY         1
+#define NET_CRYPTO_PACKET_LOSSLESS      2
+#define NET_CRYPTO_PACKET_ACK           3
+#define NET_CRYPTO_PACKET_REKEY         4
+#define NET_CRYPTO_PACKET_REKEY_ACK     5
+#define NET_CRYPTO_REKEY_SIZE           (1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES)
+#define NET_CRYPTO_REKEY_ACK_SIZE       (1 + crypto_box_PUBLICKEYBYTES)
+#define NET_CRYPTO_LOSSLESS_HEADER_SIZE (1 + sizeof(uint32_t) * 2)
+#define NET_CRYPTO_MAX_DATA_SIZE        (NET_CRYPTO_MAX_PACKET_SIZE - NET_CRYPTO_DATA_HEADER_SIZE - crypto_box_MACBYTES \
+                                         - NET_CRYPTO_LOSSLESS_HEADER_SIZE)
+
+/* Lossless packets a session can have between the oldest one not acknowledged
+ * and the newest one, each way. The send and receive rings of every session
+ * have this many slots, it must be a power of two.
+ */
+#define NET_CRYPTO_WINDOW               512
+#define NET_CRYPTO_ACK_BITMAP_SIZE      (NET_CRYPTO_WINDOW / 8)
+
+/* Lossless packets wait in buffers of a pool shared by all sessions, allocated
+ * NET_CRYPTO_POOL_CHUNK at a time up to NET_CRYPTO_POOL_BUFFERS. Sessions are
+ * allocated NET_CRYPTO_SLAB at a time.
+ */
+#define NET_CRYPTO_POOL_BUFFERS         65536
+#define NET_CRYPTO_POOL_CHUNK           256
+#define NET_CRYPTO_SLAB                 64
+
+/* Receivers acknowledge after this many lossless packets, the rest on the next tick. */
+#define NET_CRYPTO_ACK_EVERY            16
+
+/* A packet is lost once one sent this many after it and later than it was acknowledged. */
+#define NET_CRYPTO_DUPLICATE_THRESHOLD  3
+
+#define NET_CRYPTO_INITIAL_WINDOW       16  /* packets */
+#define NET_CRYPTO_MINIMUM_WINDOW       2   /* packets */
+#define NET_CRYPTO_INITIAL_RTO          1000 /* ms */
+#define NET_CRYPTO_MINIMUM_RTO          200 /* ms, added to the smoothed RTT */
+#define NET_CRYPTO_MAXIMUM_RTO          10000 /* ms */
+
+/* Packets sent back to back at most, the rest of the window is paced over the RTT. */
+#define NET_CRYPTO_PACING_BURST         16
+
+/* Handshakes with a valid cookie taken per tick, the rest of a burst is sampled
+ * down to this many so a real peer in a flood still has its chance. Those from
+ * peers we have no connection to cost a curve operation once accepted, only
+ * NET_CRYPTO_KEY_AGREEMENTS_PER_TICK of them are done.
+ */
+#define NET_CRYPTO_HANDSHAKES_PER_TICK  128
+#define NET_CRYPTO_KEY_AGREEMENTS_PER_TICK 32
+
+/* Cookie requests and handshakes are resent this often (ms) until answered. */
+#define NET_CRYPTO_RETRY_INTERVAL       1000
+
+/* A handshake not answered within this long (ms) starts over with a fresh cookie. */
+#define NET_CRYPTO_HANDSHAKE_TIMEOUT    8000
+
+/* Established sessions send a keepalive this often (ms), and are dropped when
+ * nothing came for NET_CRYPTO_TIMEOUT.
+ */
+#define NET_CRYPTO_KEEPALIVE_INTERVAL   2000
+#define NET_CRYPTO_TIMEOUT              10000
+
+/* A direction of a session that numbered this many packets gets a new key
+ * before its 32 bit packet numbers, and so its nonces, come round again: the
+ * sender offers one (NET_CRYPTO_PACKET_REKEY, resent every
+ * NET_CRYPTO_RETRY_INTERVAL) and numbers from 0 with it once the peer took it.
+ * The session, its status and its lossless packets go on. Past
+ * NET_CRYPTO_MAX_PACKETS only the offer is still sent, a session whose peer
+ * never takes it starts over once the numbers are spent.
+ */
+#define NET_CRYPTO_REKEY_PACKETS        (UINT32_MAX - (1U << 24))
+#define NET_CRYPTO_MAX_PACKETS          (UINT32_MAX - (1U << 16))
+
+/* Lossy packets held for the frames callback at most, they go up when that many
+ * are held or on the next tick, whichever comes first.
+ */
+#define NET_CRYPTO_FRAME_BATCH          64
+
+/* Sessions a NetCrypto holds, incoming ones are refused beyond. */
+#define NET_CRYPTO_MAX_CONNECTIONS      65536
+
+/* Data packets sendPackets encrypts and writes out together at most, and the
+ * batch size from which it encrypts them on up to NET_CRYPTO_MAX_SEALERS threads,
+ * shared by every NetCrypto of the process.
+ */
+#define NET_CRYPTO_SEND_BATCH           128
+#define NET_CRYPTO_PARALLEL_MINIMUM     32
+#define NET_CRYPTO_MAX_SEALERS          8
+
+/* Called with the data packets of a session, lossless ones in the order they were sent. */
+typedef void (*NetCryptoDataCallback)(void *object, uint32_t connection, const uint8_t *data, uint16_t length);
+
+/* A lossy packet, decrypted in place in a buffer of the NetCrypto. */
+typedef struct NetCryptoFrame {
+    uint32_t connection;
+    const uint8_t *data;
+    uint16_t length;
+    uint64_t received;      /* monotonic time (ms) it was read */
+} NetCryptoFrame;
+
+/* A lossless packet of NetCrypto::sendPackets, result is set to what sendPacket would have returned. */
+typedef struct NetCryptoPacket {
+    uint32_t connection;
+    const uint8_t *data;
+    uint16_t length;
+    int64_t result;
+} NetCryptoPacket;
+
+/* Called with the lossy packets read since the last call, in the order they were
+ * read. The data stays valid until the callback returns.
+ */
+typedef void (*NetCryptoFramesCallback)(void *object, const NetCryptoFrame *frames, size_t count);
+
+/* Called when a session gets established or goes away. */
+typedef void (*NetCryptoStatusCallback)(void *object, uint32_t connection, bool online);
+
+/* Called for a handshake from a peer we have no connection to once its cookie
+ * checked, before any curve operation is spent on it.
+ *
+ * return true to open a connection to the peer if the handshake decrypts.
+ */
+typedef bool (*NetCryptoAcceptCallback)(void *object, const uint8_t *publicKey, IP_Port source);
+
+typedef struct {
+    uint32_t connections;           /* connections allocated */
+    uint32_t established;
+    uint32_t pending;               /* handshakes waiting for the next tick */
+    uint64_t cookies;               /* cookie requests answered */
+    uint64_t badCookies;            /* handshakes dropped on their cookie: forged, expired or from another address */
+    uint64_t handshakesQueued;      /* handshakes with a valid cookie */
+    uint64_t handshakesDropped;     /* sampled out of a burst, or over the key agreements of the tick */
+    uint64_t handshakesCoalesced;   /* replaced by a newer one from the same peer and address in the same burst */
+    uint64_t handshakesRejected;    /* didn't decrypt, or refused by the accept callback */
+    uint64_t keyAgreements;         /* curve operations done for handshakes of unknown peers */
+    uint64_t replays;               /* data packets refused by the replay window */
+    uint64_t rekeys;                /* new keys of our direction the peer took */
+    uint32_t buffers;               /* pool buffers allocated */
+    uint32_t buffersUsed;           /* holding lossless packets not acknowledged or not delivered yet */
+    uint64_t retransmissions;       /* lossless packets sent again */
+    uint64_t acks;                  /* NET_CRYPTO_PACKET_ACK packets sent */
+    uint64_t memory;                /* bytes of connection slabs and pool buffers allocated */
+    uint64_t frames;                /* lossy packets handed to the frames callback */
+    uint64_t frameBatches;          /* calls of the frames callback */
+} NetCryptoStats;
+
+struct NetCryptoConnection;
+struct NetCryptoBatch;
+
+/* Encrypted sessions straight over UDP.
+ *
+ * The responder keeps nothing about a peer until the peer proves it can receive
+ * at its address: a cookie request is answered with a cookie carrying the
+ * peer's key and address, encrypted with a key only we have, and only a
+ * handshake bringing it back unchanged, from that address and in time, goes
+ * further. Checking it costs one symmetric decryption, the curve operations for
+ * the peer's long-term key and the session key come after.
+ *
+ * Handshakes that pass are queued and handled together on the next tick, one
+ * per peer and address, so a burst read in one poll is paid for once: the queue
+ * has a fixed size and is sampled when a flood overflows it, nothing grows with
+ * the flood.
+ *
+ * Both ends then send from a fresh session key pair and count their nonces up
+ * from the base nonces exchanged (CryptoSessionNonces), a session is confirmed
+ * by the first data packet that decrypts.
+ *
+ * Lossless packets are numbered and kept in the send ring of the session until
+ * acknowledged, the receiver puts them back in order in its receive ring.
+ * Acknowledgements carry the next number expected and a bitmap of the packets
+ * after it received already, sent every NET_CRYPTO_ACK_EVERY packets and once
+ * per tick. The sender resends what the bitmap shows missing, and paces its
+ * congestion window (Reno style AIMD, as for files) over the round trip.
+ */
+class NetCrypto {
+public:
+    NetCrypto(NetworkingCore* net, const uint8_t* publicKey, const uint8_t* secretKey);
+    ~NetCrypto();
+
+    /* Open a session with the peer with publicKey at ipPort, retried until removed.
+     * A connection to the peer we have already is returned, moved to ipPort
+     * unless it is established.
+     *
+     * return the connection number, -1 on failure.
+     */
+    int addConnection(const uint8_t* publicKey, IP_Port ipPort);
+    bool removeConnection(uint32_t connection);
+    bool isOnline(uint32_t connection);
+    bool getPublicKey(uint32_t connection, uint8_t* publicKey);
+
+    /* Send a data packet on an established session. Lossless packets are
+     * resent until acknowledged, NET_CRYPTO_WINDOW of them can be waiting.
+     *
+     * return the packet number for lossless packets, 0 for lossy packets, -1 on failure.
+     */
+    int64_t sendPacket(uint32_t connection, const uint8_t* data, uint16_t length, bool lossless);
+
+    /* Send the lossy packet made of header and data, written once into the
+     * outgoing packet and encrypted there, data is not copied anywhere else.
+     *
+     * return 0 on success, -1 on failure.
+     */
+    int64_t sendLossy(uint32_t connection, const uint8_t* header, uint16_t headerLength, const uint8_t* data, uint16_t length);
+
+    /* Queue lossless packets on any number of sessions, then send what their
+     * windows allow in one go: the data packets are encrypted across threads
+     * with the session keys and written out together (NetworkService::sendPackets).
+     * Packets of the same session are numbered in the order given.
+     */
+    void sendPackets(NetCryptoPacket* packets, size_t count);
+
+    void setDataCallback(NetCryptoDataCallback callback, void* object);
+
+    /* With a frames callback lossy packets skip the data callback and are handed
+     * over in batches, see NetCryptoFramesCallback. tick() delivers what is held
+     * first, deliverFrames() does it right away, after a poll run by the caller.
+     */
+    void setFramesCallback(NetCryptoFramesCallback callback, void* object);
+    void deliverFrames();
+    void setStatusCallback(NetCryptoStatusCallback callback, void* object);
+
+    /* Without an accept callback handshakes from unknown peers are refused. */
+    void setAcceptCallback(NetCryptoAcceptCallback callback, void* object);
+
+    /* Tag our packets so instances sharing a socket can be told apart, 0 by default. */
+    void setRouteTag(uint16_t tag);
+
+    /* Read the route tag of the receiver from a cookie response, handshake or data packet.
+     *
+     * return false if the packet is none of these.
+     */
+    static bool getRouteTag(const uint8_t* packet, uint16_t length, uint16_t* tag);
+
+    /* return the public key a cookie request is for, NULL if the packet isn't one. */
+    static const uint8_t* getReceiver(const uint8_t* packet, uint16_t length);
+
+    NetCryptoStats getStats();
+
+    void tick();
+
+private:
+    struct PendingHandshake {
+        IP_Port source;
+        uint8_t packet[NET_CRYPTO_HANDSHAKE_SIZE];
+    };
+
+    static int handleCookieRequest(void* object, IP_Port source, const uint8_t* data, uint16_t length);
+    static int handleCookieResponse(void* object, IP_Port source, const uint8_t* data, uint16_t length);
+    static int handleHandshake(void* object, IP_Port source, const uint8_t* data, uint16_t length);
+    static int handleData(void* object, IP_Port source, const uint8_t* data, uint16_t length);
+
+    void createCookie(uint8_t* cookie, const uint8_t* publicKey, IP_Port ipPort, uint64_t now);
+    bool openCookie(const uint8_t* cookie, IP_Port source, uint64_t now, uint8_t* publicKey);
+    void processHandshake(const struct PendingHandshake* pending, const uint8_t* publicKey, uint32_t* agreements,
+                          uint64_t now);
+
+    void handleLossless(uint32_t connection, const uint8_t* data, uint16_t length, uint64_t now);
+    void handleAck(uint32_t connection, uint32_t ack, const uint8_t* bitmap, uint32_t bits, uint64_t now);
+    bool ackPacket(struct NetCryptoConnection* connection, uint32_t number, uint64_t now);
+    void detectLosses(struct NetCryptoConnection* connection, uint64_t now);
+    void checkTimeout(struct NetCryptoConnection* connection, uint64_t now);
+    int64_t queueLossless(struct NetCryptoConnection* connection, const uint8_t* data, uint16_t length);
+    void flush(uint32_t connection, uint64_t now);
+    void sendBatch();
+    void sendAck(uint32_t connection, uint64_t now);
+    void resetChannel(struct NetCryptoConnection* connection);
+
+
+    uint32_t takeBuffer();
+    uint8_t* getBuffer(uint32_t buffer);
+    void giveBuffer(uint32_t buffer);
+
+    int allocate(const uint8_t* publicKey, IP_Port ipPort);
+    void release(uint32_t connection);
+    void newSession(struct NetCryptoConnection* connection);
+    void fail(uint32_t connection, uint64_t now);
+    void sendCookieRequest(uint32_t connection, uint64_t now);
+    bool sendHandshake(uint32_t connection, const uint8_t* cookie, uint64_t now);
+    bool sendData(uint32_t connection, uint8_t* packet, uint16_t length, uint64_t now);
+    void sendKeepalive(uint32_t connection, uint64_t now);
+    void sendRekey(uint32_t connection, uint64_t now);
+    void handleRekey(uint32_t connection, const uint8_t* publicKey, const uint8_t* baseNonce, uint64_t now);
+    void handleRekeyAck(uint32_t connection, const uint8_t* publicKey);
+
+    NetworkingCore* net;
+    uint8_t publicKey[crypto_box_PUBLICKEYBYTES];
+    uint8_t secretKey[crypto_box_SECRETKEYBYTES];
+    uint16_t routeTag;
+
+    /* Cookies of epoch e are encrypted with cookieKeys[e & 1], the previous epoch is still taken. */
+    uint8_t cookieKeys[2][crypto_box_KEYBYTES];
+    uint8_t cookieEpoch;
+    uint64_t cookieRotated;
+
+    std::vector<struct NetCryptoConnection*> connections; /* NULL for free connection numbers */
+    std::vector<uint8_t> connectionKeys;    /* public key of every connection back to back, zeros if free */
+    uint32_t connectionCount;
+    std::vector<struct NetCryptoConnection*> slabs;    /* NET_CRYPTO_SLAB connections each */
+    std::vector<struct NetCryptoConnection*> spare;    /* connections of the slabs not in use */
+
+    std::vector<uint8_t*> pool;             /* NET_CRYPTO_POOL_CHUNK buffers of NET_CRYPTO_MAX_DATA_SIZE each */
+    std::vector<uint32_t> poolFree;         /* numbers of the buffers not in use */
+
+    /* Handshakes of the current burst, NET_CRYPTO_HANDSHAKES_PER_TICK at most. */
+    std::vector<PendingHandshake> pending;
+    std::vector<uint8_t> pendingKeys;       /* public key of every pending handshake back to back */
+    uint64_t burst;                         /* handshakes with a valid cookie seen in the current burst */
+
+    /* NET_CRYPTO_FRAME_BATCH buffers of NET_CRYPTO_MAX_PACKET_SIZE, the first frameBuffersUsed hold frames. */
+    std::vector<uint8_t> frameBuffers;
+    uint32_t frameBuffersUsed;
+    std::vector<NetCryptoFrame> frames;
+
+    /* Data packets of sendPackets, allocated with its first call. */
+    struct NetCryptoBatch* batch;
+
+    NetCryptoDataCallback dataCallback;
+    void* dataObject;
+    NetCryptoFramesCallback framesCallback;
+    void* framesObject;
+    NetCryptoStatusCallback statusCallback;
+    void* statusObject;
+    NetCryptoAcceptCallback acceptCallback;
+    void* acceptObject;
+
+    NetCryptoStats stats;
+};
+
+#endif /* NetCrypto_hpp */
@@ -20,11 +20,17 @@
 #include <errno.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/uio.h>
+#define NET_SENDMMSG
+#endif
+
 #ifdef __APPLE__
 #include <mach/clock.h>
 #include <mach/mach.h>
 #endif
 
+#include "Crypto.hpp"
 #include "Utils.hpp"
 
 #if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
@@ -131,7 +137,7 @@ bool NetworkService::sockIsValid(sock_t sock)
      * return 1 on success
      * return 0 on failure
      */
-    int set_socket_nonblock(sock_t sock)
+    bool NetworkService::setSocketNonblock(sock_t sock)
     {
 #if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
         u_long mode = 1;
@@ -146,7 +152,7 @@ bool NetworkService::sockIsValid(sock_t sock)
      * return 1 on success
      * return 0 on failure
      */
-    int set_socket_nosigpipe(sock_t sock)
+    bool NetworkService::setSocketNosigpipe(sock_t sock)
     {
 #if defined(__MACH__)
         int set = 1;
@@ -161,7 +167,7 @@ bool NetworkService::sockIsValid(sock_t sock)
      * return 1 on success
      * return 0 on failure
      */
-    int set_socket_reuseaddr(sock_t sock)
+    bool NetworkService::setSocketReuseaddr(sock_t sock)
     {
         int set = 1;
         return (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)&set, sizeof(set)) == 0);
@@ -172,7 +178,7 @@ bool NetworkService::sockIsValid(sock_t sock)
      * return 1 on success
      * return 0 on failure
      */
-    int set_socket_dualstack(sock_t sock)
+    bool NetworkService::setSocketDualstack(sock_t sock)
     {
         int ipv6only = 0;
         socklen_t optsize = sizeof(ipv6only);
@@ -213,9 +219,21 @@ bool NetworkService::sockIsValid(sock_t sock)
     static uint64_t add_monotime;
 #endif
     
+    static uint64_t (*time_source_function)(void *object);
+    static void *time_source_object;
+    
+    void NetworkService::setTimeSource(uint64_t (*function)(void *object), void *object)
+    {
+        time_source_function = function;
+        time_source_object = object;
+    }
+    
     /* return current monotonic time in milliseconds (ms). */
     uint64_t NetworkService::getCurrentTimeMonotonic(void)
     {
+        if (time_source_function)
+            return time_source_function(time_source_object);
+        
         uint64_t time;
 #if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
         time = (uint64_t)GetTickCount() + add_monotime;
@@ -273,25 +291,24 @@ ip_ntoa(&((__ip_port__).ip)), ntohs((__ip_port__).port), 0, "OK", data_0(__bufle
     
 #endif /* TOX_LOGGER */
     
-    /* Basic network functions:
-     * Function to send packet(data) of length length to ip_port.
+    /* Fill addr with ip_port as the socket of net sends to it, IPv4 addresses
+     * mapped into IPv6 for an IPv6 socket. Without net the socket is taken to
+     * be of the family of ip_port.
+     *
+     * return the size of the address, 0 if net can't send to ip_port.
      */
-    int NetworkService::sendPacket(NetworkingCore *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+    size_t NetworkService::ipportToSockaddr(const NetworkingCore *net, IP_Port ip_port, struct sockaddr_storage *addr)
     {
-        if (net->family == 0) /* Socket not initialized */
-            return -1;
-        
         /* socket AF_INET, but target IP NOT: can't send */
-        if ((net->family == AF_INET) && (ip_port.ip.family != AF_INET))
-            return -1;
+        if (net && (net->family == AF_INET) && (ip_port.ip.family != AF_INET))
+            return 0;
         
-        struct sockaddr_storage addr;
         size_t addrsize = 0;
         
         if (ip_port.ip.family == AF_INET) {
-            if (net->family == AF_INET6) {
+            if (net && net->family == AF_INET6) {
                 /* must convert to IPV4-in-IPV6 address */
-                struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+                struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
                 
                 addrsize = sizeof(struct sockaddr_in6);
                 addr6->sin6_family = AF_INET6;
@@ -310,15 +327,17 @@ ip_ntoa(&((__ip_port__).ip)), ntohs((__ip_port__).port), 0, "OK", data_0(__bufle
                 addr6->sin6_flowinfo = 0;
                 addr6->sin6_scope_id = 0;
             } else {
-                struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
+                struct sockaddr_in *addr4 = (struct sockaddr_in *)addr;
                 
+                /* sin_zero has to be zero to bind on some systems */
                 addrsize = sizeof(struct sockaddr_in);
+                memset(addr4, 0, addrsize);
                 addr4->sin_family = AF_INET;
                 addr4->sin_addr = ip_port.ip.ip4.in_addr;
                 addr4->sin_port = ip_port.port;
             }
         } else if (ip_port.ip.family == AF_INET6) {
-            struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+            struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
             
             addrsize = sizeof(struct sockaddr_in6);
             addr6->sin6_family = AF_INET6;
@@ -327,11 +346,63 @@ ip_ntoa(&((__ip_port__).ip)), ntohs((__ip_port__).port), 0, "OK", data_0(__bufle
             
             addr6->sin6_flowinfo = 0;
             addr6->sin6_scope_id = 0;
-        } else {
-            /* unknown address type*/
-            return -1;
         }
         
+        /* unknown address type gives 0 */
+        return addrsize;
+    }
+    
+    /* Read the sender of a datagram, an IPv4 address mapped into IPv6 as IPv4.
+     *
+     * return 0 if its family is unknown.
+     */
+    bool NetworkService::sockaddrToIpport(const struct sockaddr_storage *addr, IP_Port *ip_port)
+    {
+        memset(ip_port, 0, sizeof(IP_Port));
+        
+        if (addr->ss_family == AF_INET) {
+            struct sockaddr_in *addr_in = (struct sockaddr_in *)addr;
+            
+            ip_port->ip.family = addr_in->sin_family;
+            ip_port->ip.ip4.in_addr = addr_in->sin_addr;
+            ip_port->port = addr_in->sin_port;
+        } else if (addr->ss_family == AF_INET6) {
+            struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)addr;
+            ip_port->ip.family = addr_in6->sin6_family;
+            ip_port->ip.ip6.in6_addr = addr_in6->sin6_addr;
+            ip_port->port = addr_in6->sin6_port;
+            
+            if (IPV6_IPV4_IN_V6(ip_port->ip.ip6)) {
+                ip_port->ip.family = AF_INET;
+                ip_port->ip.ip4.uint32 = ip_port->ip.ip6.uint32[3];
+            }
+        } else
+            return 0;
+        
+        return 1;
+    }
+    
+    /* Basic network functions:
+     * Function to send packet(data) of length length to ip_port.
+     */
+    int NetworkService::sendPacket(NetworkingCore *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+    {
+        if (net->family == 0) /* Socket not initialized */
+            return -1;
+        
+        /* socket AF_INET, but target IP NOT: can't send */
+        if ((net->family == AF_INET) && (ip_port.ip.family != AF_INET))
+            return -1;
+        
+        if (net->transport.send)
+            return net->transport.send(net->transport.object, ip_port, data, length);
+        
+        struct sockaddr_storage addr;
+        size_t addrsize = ipportToSockaddr(net, ip_port, &addr);
+        
+        if (addrsize == 0)
+            return -1;
+        
         int res = sendto(net->sock, (char *) data, length, 0, (struct sockaddr *)&addr, addrsize);
         
         loglogdata("O=>", data, length, ip_port, res);
@@ -339,6 +410,61 @@ ip_ntoa(&((__ip_port__).ip)), ntohs((__ip_port__).port), 0, "OK", data_0(__bufle
         return res;
     }
     
+    uint32_t NetworkService::sendPackets(NetworkingCore *net, const NetworkPacket *packets, uint32_t count)
+    {
+        uint32_t sent = 0;
+        
+#ifdef NET_SENDMMSG
+        if (!net->transport.send && net->family != 0) {
+            struct mmsghdr messages[NET_SEND_BATCH];
+            struct iovec data[NET_SEND_BATCH];
+            struct sockaddr_storage addresses[NET_SEND_BATCH];
+            
+            for (uint32_t i = 0; i < count; ) {
+                uint32_t batch = 0;
+                
+                for (; i < count && batch < NET_SEND_BATCH; ++i) {
+                    size_t addrsize = ipportToSockaddr(net, packets[i].ipPort, &addresses[batch]);
+                    
+                    if (addrsize == 0 || ((net->family == AF_INET) && (packets[i].ipPort.ip.family != AF_INET)))
+                        continue;
+                    
+                    data[batch].iov_base = (void *)packets[i].data;
+                    data[batch].iov_len = packets[i].length;
+                    memset(&messages[batch], 0, sizeof(messages[batch]));
+                    messages[batch].msg_hdr.msg_name = &addresses[batch];
+                    messages[batch].msg_hdr.msg_namelen = (socklen_t)addrsize;
+                    messages[batch].msg_hdr.msg_iov = &data[batch];
+                    messages[batch].msg_hdr.msg_iovlen = 1;
+                    ++batch;
+                }
+                
+                /* A datagram the kernel refuses ends the call, it is dropped as a failed sendto would be. */
+                for (uint32_t done = 0; done < batch; ) {
+                    int n = sendmmsg(net->sock, messages + done, batch - done, 0);
+                    
+                    if (n <= 0) {
+                        ++done;
+                        continue;
+                    }
+                    
+                    done += (uint32_t)n;
+                    sent += (uint32_t)n;
+                }
+            }
+            
+            return sent;
+        }
+#endif
+        
+        for (uint32_t i = 0; i < count; ++i) {
+            if (sendPacket(net, packets[i].ipPort, packets[i].data, packets[i].length) != -1)
+                ++sent;
+        }
+        
+        return sent;
+    }
+    
     /* Function to receive data
      *  ip and port of sender is put into ip_port.
      *  Packet data is put into data.
@@ -363,23 +489,7 @@ ip_ntoa(&((__ip_port__).ip)), ntohs((__ip_port__).port), 0, "OK", data_0(__bufle
         
         *length = (uint32_t)fail_or_len;
         
-        if (addr.ss_family == AF_INET) {
-            struct sockaddr_in *addr_in = (struct sockaddr_in *)&addr;
-            
-            ip_port->ip.family = addr_in->sin_family;
-            ip_port->ip.ip4.in_addr = addr_in->sin_addr;
-            ip_port->port = addr_in->sin_port;
-        } else if (addr.ss_family == AF_INET6) {
-            struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)&addr;
-            ip_port->ip.family = addr_in6->sin6_family;
-            ip_port->ip.ip6.in6_addr = addr_in6->sin6_addr;
-            ip_port->port = addr_in6->sin6_port;
-            
-            if (IPV6_IPV4_IN_V6(ip_port->ip.ip6)) {
-                ip_port->ip.family = AF_INET;
-                ip_port->ip.ip4.uint32 = ip_port->ip.ip6.uint32[3];
-            }
-        } else
+        if (!NetworkService::sockaddrToIpport(&addr, ip_port))
             return -1;
         
         loglogdata("=>O", data, MAX_UDP_PACKET_SIZE, *ip_port, *length);
@@ -393,6 +503,15 @@ ip_ntoa(&((__ip_port__).ip)), ntohs((__ip_port__).port), 0, "OK", data_0(__bufle
         net->packethandlers[byte].object = object;
     }
     
+    /* One datagram from the socket or the transport, data must hold MAX_UDP_PACKET_SIZE bytes. */
+    int NetworkService::receivePacket(NetworkingCore *net, IP_Port *ipPort, uint8_t *data, uint32_t *length)
+    {
+        if (net->transport.recv)
+            return net->transport.recv(net->transport.object, ipPort, data, length);
+        
+        return receivepacket(net->sock, ipPort, data, length);
+    }
+    
     void NetworkService::poll(NetworkingCore *net)
     {
         if (net->family == 0) /* Socket not initialized */
@@ -404,7 +523,7 @@ ip_ntoa(&((__ip_port__).ip)), ntohs((__ip_port__).port), 0, "OK", data_0(__bufle
         uint8_t data[MAX_UDP_PACKET_SIZE];
         uint32_t length;
         
-        while (receivepacket(net->sock, &ip_port, data, &length) != -1) {
+        while (receivePacket(net, &ip_port, data, &length) != -1) {
             if (length < 1) continue;
             
             if (!(net->packethandlers[data[0]].function)) {
@@ -476,6 +595,131 @@ ip_ntoa(&((__ip_port__).ip)), ntohs((__ip_port__).port), 0, "OK", data_0(__bufle
      * If error is non NULL it is set to 0 if no issues, 1 if socket related error, 2 if other.
      */
     NetworkingCore * NetworkService::newNetworkingEx(IP ip, uint16_t portFrom, uint16_t portTo, unsigned int *error)
+    {
+        NetworkingOptions options;
+        memset(&options, 0, sizeof(options));
+        return newNetworkingWithOptions(ip, portFrom, portTo, &options, error);
+    }
+    
+    /* Set the options of a socket, the ones the system doesn't know are skipped.
+     *
+     * return 1 on success
+     * return 0 on failure
+     */
+    static bool setSocketOptions(NetworkingCore *net, const NetworkingOptions *options)
+    {
+        /* Functions to increase the size of the send and receive UDP buffers.
+         */
+        int n = options->receiveBuffer ? (int)options->receiveBuffer : NET_SOCKET_BUFFER_DEFAULT;
+        setsockopt(net->sock, SOL_SOCKET, SO_RCVBUF, (char *)&n, sizeof(n));
+        n = options->sendBuffer ? (int)options->sendBuffer : NET_SOCKET_BUFFER_DEFAULT;
+        setsockopt(net->sock, SOL_SOCKET, SO_SNDBUF, (char *)&n, sizeof(n));
+        
+        /* Enable broadcast on socket */
+        int broadcast = 1;
+        setsockopt(net->sock, SOL_SOCKET, SO_BROADCAST, (char *)&broadcast, sizeof(broadcast));
+        
+        /* Sockets of workers sharing a port, the kernel spreads the datagrams over them. */
+        if (options->reusePort) {
+#ifdef SO_REUSEPORT
+            int reuse = 1;
+            
+            if (setsockopt(net->sock, SOL_SOCKET, SO_REUSEPORT, (char *)&reuse, sizeof(reuse)) != 0)
+                return 0;
+#else
+            return 0;
+#endif
+        }
+        
+#ifdef SO_BUSY_POLL
+        if (options->busyPoll) {
+            int busyPoll = (int)options->busyPoll;
+            setsockopt(net->sock, SOL_SOCKET, SO_BUSY_POLL, (char *)&busyPoll, sizeof(busyPoll));
+        }
+#endif
+        
+#ifdef SO_INCOMING_CPU
+        if (options->pinIncomingCpu) {
+            int cpu = (int)options->incomingCpu;
+            setsockopt(net->sock, SOL_SOCKET, SO_INCOMING_CPU, (char *)&cpu, sizeof(cpu));
+        }
+#endif
+        
+        /* iOS UDP sockets are weird and apparently can SIGPIPE */
+        if (!NetworkService::setSocketNosigpipe(net->sock))
+            return 0;
+        
+        /* Set socket nonblocking. */
+        return NetworkService::setSocketNonblock(net->sock);
+    }
+    
+    /* Join the all nodes group of the local link. */
+    static void joinMulticast(NetworkingCore *net)
+    {
+        struct ipv6_mreq mreq;
+        memset(&mreq, 0, sizeof(mreq));
+        mreq.ipv6mr_multiaddr.s6_addr[ 0] = 0xFF;
+        mreq.ipv6mr_multiaddr.s6_addr[ 1] = 0x02;
+        mreq.ipv6mr_multiaddr.s6_addr[15] = 0x01;
+        mreq.ipv6mr_interface = 0;
+        setsockopt(net->sock, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP, (char *)&mreq, sizeof(mreq));
+    }
+    
+    /* Take over options->socket, bound already, instead of making one. It stays
+     * the caller's on failure.
+     */
+    static NetworkingCore *inheritNetworking(const NetworkingOptions *options, unsigned int *error)
+    {
+        if (error)
+            *error = 1;
+        
+        struct sockaddr_storage addr;
+        socklen_t addrsize = sizeof(addr);
+        int type = 0;
+        socklen_t typesize = sizeof(type);
+        
+        if (!NetworkService::sockIsValid(options->socket)
+            || getsockname(options->socket, (struct sockaddr *)&addr, &addrsize) != 0
+            || getsockopt(options->socket, SOL_SOCKET, SO_TYPE, (char *)&type, &typesize) != 0 || type != SOCK_DGRAM)
+            return NULL;
+        
+        if (addr.ss_family != AF_INET && addr.ss_family != AF_INET6)
+            return NULL;
+        
+        NetworkingCore *temp = (NetworkingCore*)calloc(1, sizeof(NetworkingCore));
+        
+        if (temp == NULL)
+            return NULL;
+        
+        temp->sock = options->socket;
+        
+        if (!setSocketOptions(temp, options)) {
+            free(temp);
+            return NULL;
+        }
+        
+        temp->family = addr.ss_family;
+        
+        if (temp->family == AF_INET) {
+            temp->port = ((struct sockaddr_in *)&addr)->sin_port;
+        } else {
+            temp->port = ((struct sockaddr_in6 *)&addr)->sin6_port;
+            
+            if (!options->noMulticast)
+                joinMulticast(temp);
+        }
+        
+        if (error)
+            *error = 0;
+        
+        return temp;
+    }
+    
+    /* Initialize networking.
+     * newNetworkingEx with how to bind and set up the socket.
+     */
+    NetworkingCore * NetworkService::newNetworkingWithOptions(IP ip, uint16_t portFrom, uint16_t portTo,
+                                                              const NetworkingOptions *options, unsigned int *error)
     {
         /* If both from and to are 0, use default port range
          * If one is 0 and the other is non-0, use the non-0 value as only port
@@ -497,6 +741,12 @@ ip_ntoa(&((__ip_port__).ip)), ntohs((__ip_port__).port), 0, "OK", data_0(__bufle
         if (error)
             *error = 2;
         
+        if (networkingAtStartup() != 0)
+            return NULL;
+        
+        if (options->inheritSocket)
+            return inheritNetworking(options, error);
+        
         /* maybe check for invalid IPs like 224+.x.y.z? if there is any IP set ever */
         if (ip.family != AF_INET && ip.family != AF_INET6) {
 #ifdef DEBUG
@@ -505,9 +755,6 @@ ip_ntoa(&((__ip_port__).ip)), ntohs((__ip_port__).port), 0, "OK", data_0(__bufle
             return NULL;
         }
         
-        if (networkingAtStartup() != 0)
-            return NULL;
-        
         NetworkingCore *temp = (NetworkingCore*)calloc(1, sizeof(NetworkingCore));
         
         if (temp == NULL)
@@ -533,28 +780,7 @@ ip_ntoa(&((__ip_port__).ip)), ntohs((__ip_port__).port), 0, "OK", data_0(__bufle
             return NULL;
         }
         
-        /* Functions to increase the size of the send and receive UDP buffers.
-         */
-        int n = 1024 * 1024 * 2;
-        setsockopt(temp->sock, SOL_SOCKET, SO_RCVBUF, (char *)&n, sizeof(n));
-        setsockopt(temp->sock, SOL_SOCKET, SO_SNDBUF, (char *)&n, sizeof(n));
-        
-        /* Enable broadcast on socket */
-        int broadcast = 1;
-        setsockopt(temp->sock, SOL_SOCKET, SO_BROADCAST, (char *)&broadcast, sizeof(broadcast));
-        
-        /* iOS UDP sockets are weird and apparently can SIGPIPE */
-        if (!set_socket_nosigpipe(temp->sock)) {
-            killNetworking(temp);
-            
-            if (error)
-                *error = 1;
-            
-            return NULL;
-        }
-        
-        /* Set socket nonblocking. */
-        if (!set_socket_nonblock(temp->sock)) {
+        if (!setSocketOptions(temp, options)) {
             killNetworking(temp);
             
             if (error)
@@ -595,22 +821,11 @@ ip_ntoa(&((__ip_port__).ip)), ntohs((__ip_port__).port), 0, "OK", data_0(__bufle
         }
         
         if (ip.family == AF_INET6) {
-#ifdef TOX_LOGGER
-            int is_dualstack =
-#endif /* TOX_LOGGER */
-            set_socket_dualstack(temp->sock);
-            /* multicast local nodes */
-            struct ipv6_mreq mreq;
-            memset(&mreq, 0, sizeof(mreq));
-            mreq.ipv6mr_multiaddr.s6_addr[ 0] = 0xFF;
-            mreq.ipv6mr_multiaddr.s6_addr[ 1] = 0x02;
-            mreq.ipv6mr_multiaddr.s6_addr[15] = 0x01;
-            mreq.ipv6mr_interface = 0;
-#ifdef TOX_LOGGER
-            int res =
-#endif /* TOX_LOGGER */
-            setsockopt(temp->sock, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP, (char *)&mreq, sizeof(mreq));
+            setSocketDualstack(temp->sock);
             
+            /* multicast local nodes */
+            if (!options->noMulticast)
+                joinMulticast(temp);
         }
         
         /* a hanging program or a different user might block the standard port;
@@ -628,8 +843,19 @@ ip_ntoa(&((__ip_port__).ip)), ntohs((__ip_port__).port), 0, "OK", data_0(__bufle
          * disadvantage:
          *   some clients might not test return of tox_new(), blindly assuming that
          *   it worked ok (which it did previously without a successful bind)
+         *
+         * Instances started together all walking up from portFrom try i ports
+         * before the i-th one binds, so the search may start anywhere in the range.
          */
-        uint16_t port_to_try = portFrom;
+        uint32_t range = (uint32_t)portTo - portFrom + 1;
+        uint32_t offset = 0;
+        
+        if (options->bindStrategy == NET_BIND_RANDOM)
+            offset = Crypto::randomInt() % range;
+        else if (options->bindStrategy == NET_BIND_HASHED)
+            offset = (uint32_t)(options->bindKey % range);
+        
+        uint16_t port_to_try = (uint16_t)(portFrom + offset);
         *portptr = htons(port_to_try);
         int tries;
         
@@ -651,10 +877,10 @@ ip_ntoa(&((__ip_port__).ip)), ntohs((__ip_port__).port), 0, "OK", data_0(__bufle
                 return temp;
             }
             
-            port_to_try++;
-            
-            if (port_to_try > portTo)
+            if (port_to_try == portTo)
                 port_to_try = portFrom;
+            else
+                port_to_try++;
             
             *portptr = htons(port_to_try);
         }
@@ -667,13 +893,55 @@ ip_ntoa(&((__ip_port__).ip)), ntohs((__ip_port__).port), 0, "OK", data_0(__bufle
         return NULL;
     }
     
+    /* Sockets passed by systemd socket activation start at 3, LISTEN_FDS of
+     * them, for the process LISTEN_PID names.
+     */
+    sock_t NetworkService::activatedSocket(unsigned int index)
+    {
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+        return INVALID_SOCKET;
+#else
+        const char *pid = getenv("LISTEN_PID");
+        const char *fds = getenv("LISTEN_FDS");
+        
+        if (!pid || !fds || strtol(pid, NULL, 10) != (long)getpid() || strtoul(fds, NULL, 10) <= index)
+            return -1;
+        
+        return (sock_t)(3 + index);
+#endif
+    }
+    
+    /* Initialize networking on top of a virtual transport.
+     * No socket is created, packets go through transport->send and
+     * are pulled from transport->recv in poll().
+     */
+    NetworkingCore * NetworkService::newVirtualNetworking(IP ip, uint16_t port, const NetworkTransport *transport)
+    {
+        if (ip.family != AF_INET && ip.family != AF_INET6)
+            return NULL;
+        
+        if (!transport || !transport->send || !transport->recv)
+            return NULL;
+        
+        NetworkingCore *temp = (NetworkingCore*)calloc(1, sizeof(NetworkingCore));
+        
+        if (temp == NULL)
+            return NULL;
+        
+        temp->family = ip.family;
+        temp->port = htons(port);
+        temp->sock = -1;
+        temp->transport = *transport;
+        return temp;
+    }
+    
     /* Function to cleanup networking stuff. */
     void NetworkService::killNetworking(NetworkingCore *net)
     {
         if (!net)
             return;
         
-        if (net->family != 0) /* Socket not initialized */
+        if (net->family != 0 && !net->transport.send) /* Socket not initialized */
             killSock(net->sock);
         
         free(net);
@@ -789,6 +1057,39 @@ ip_ntoa(&((__ip_port__).ip)), ntohs((__ip_port__).port), 0, "OK", data_0(__bufle
         memcpy(target, source, sizeof(IP_Port));
     }
     
+    void NetworkService::packIpPort(uint8_t *data, const IP_Port *ipPort)
+    {
+        memset(data, 0, SIZE_IPPORT);
+        
+        if (ipPort->ip.family == AF_INET) {
+            data[0] = WIRE_AF_INET;
+            memcpy(data + 1, ipPort->ip.ip4.uint8, SIZE_IP4);
+        } else if (ipPort->ip.family == AF_INET6) {
+            data[0] = WIRE_AF_INET6;
+            memcpy(data + 1, ipPort->ip.ip6.uint8, SIZE_IP6);
+        }
+        
+        memcpy(data + SIZE_IP, &ipPort->port, SIZE_PORT);
+    }
+    
+    bool NetworkService::unpackIpPort(const uint8_t *data, IP_Port *ipPort)
+    {
+        memset(ipPort, 0, sizeof(*ipPort));
+        
+        if (data[0] == WIRE_AF_INET) {
+            ipPort->ip.family = AF_INET;
+            memcpy(ipPort->ip.ip4.uint8, data + 1, SIZE_IP4);
+        } else if (data[0] == WIRE_AF_INET6) {
+            ipPort->ip.family = AF_INET6;
+            memcpy(ipPort->ip.ip6.uint8, data + 1, SIZE_IP6);
+        } else {
+            return false;
+        }
+        
+        memcpy(&ipPort->port, data + SIZE_IP, SIZE_PORT);
+        return ipPort->port != 0;
+    }
+    
     /* ip_ntoa
      *   converts ip into a string
      *   uses a static buffer, so mustn't used multiple times in the same output
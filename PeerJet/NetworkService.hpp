@@ -84,6 +84,8 @@ typedef int sock_t;
 #define NET_PACKET_CRYPTO_DATA     27  /* Crypto data packet */
 #define NET_PACKET_CRYPTO          32  /* Encrypted data packet ID. */
 #define NET_PACKET_LAN_DISCOVERY   33  /* LAN discovery packet ID. */
+#define NET_PACKET_REFLECT_REQUEST  34 /* Ask where our packets come from (NatTraversal). */
+#define NET_PACKET_REFLECT_RESPONSE 35 /* Where the request came from. */
 
 /* See:  docs/Prevent_Tracking.txt and onion.{c, h} */
 #define NET_PACKET_ONION_SEND_INITIAL 128
@@ -145,6 +147,16 @@ typedef struct {
 }
 IP_Port;
 
+/* A datagram of NetworkService::sendPackets. */
+typedef struct {
+    IP_Port ipPort;
+    const uint8_t *data;
+    uint16_t length;
+} NetworkPacket;
+
+/* Datagrams sendPackets hands to the kernel in one call, where there is sendmmsg. */
+#define NET_SEND_BATCH 64
+
 /* Function to receive data, ip and port of sender is put into ip_port.
  * Packet data is put into data.
  * Packet length is put into length.
@@ -156,6 +168,20 @@ typedef struct {
     void *object;
 } PacketHandlers;
 
+/* Functions used in place of the UDP socket by virtual (in-process) transports.
+ * The send function returns the number of bytes sent or -1 on failure.
+ * The receive function returns 0 and fills ip_port, data and length when a
+ * packet is pending, -1 when there is nothing to receive.
+ */
+typedef int (*TransportSendCallback)(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len);
+typedef int (*TransportRecvCallback)(void *object, IP_Port *ip_port, uint8_t *data, uint32_t *length);
+
+typedef struct {
+    TransportSendCallback send;
+    TransportRecvCallback recv;
+    void *object;
+} NetworkTransport;
+
 typedef struct {
     PacketHandlers packethandlers[256];
     
@@ -163,8 +189,47 @@ typedef struct {
     uint16_t port;
     /* Our UDP socket. */
     sock_t sock;
+    /* Virtual transport replacing the socket, all NULL for real networking. */
+    NetworkTransport transport;
 } NetworkingCore;
 
+/* Size of the send and receive buffers of a socket unless asked otherwise. */
+#define NET_SOCKET_BUFFER_DEFAULT (1024 * 1024 * 2)
+
+/* Where newNetworkingWithOptions starts looking for a free port of its range,
+ * going up and around from there.
+ */
+typedef enum {
+    NET_BIND_SEQUENTIAL,    /* the first port, so the first free one is taken */
+    NET_BIND_RANDOM,        /* a random port */
+    NET_BIND_HASHED         /* bindKey modulo the size of the range, the same port on every start */
+} NetworkBindStrategy;
+
+/* How to set up the socket, all zero for what newNetworkingEx does. */
+typedef struct {
+    NetworkBindStrategy bindStrategy;
+    uint64_t bindKey;       /* NET_BIND_HASHED, e.g. the number of the instance */
+    
+    /* Use socket, made and bound by our parent (NetworkService::activatedSocket),
+     * instead of making one. The address and port range are not used then.
+     */
+    bool inheritSocket;
+    sock_t socket;
+    
+    uint32_t receiveBuffer; /* bytes, 0 for NET_SOCKET_BUFFER_DEFAULT */
+    uint32_t sendBuffer;
+    bool noMulticast;       /* don't join the all nodes group of the link on IPv6 */
+    bool reusePort;         /* let other sockets bind the same port (SO_REUSEPORT), fail where there is none */
+    
+    /* Linux only, skipped elsewhere: spin this long (us) on an empty receive
+     * queue (SO_BUSY_POLL), and have the datagrams of the socket steered to the
+     * queue of incomingCpu (SO_INCOMING_CPU).
+     */
+    uint32_t busyPoll;
+    bool pinIncomingCpu;
+    uint32_t incomingCpu;
+} NetworkingOptions;
+
 /* Does the IP6 struct a contain an IPv4 address in an IPv6 one? */
 #define IPV6_IPV4_IN_V6(a) ((a.uint64[0] == 0) && (a.uint32[2] == htonl (0xffff)))
 
@@ -174,6 +239,10 @@ typedef struct {
 #define SIZE_PORT 2
 #define SIZE_IPPORT (SIZE_IP + SIZE_PORT)
 
+/* Address families on the wire, the same on every platform. */
+#define WIRE_AF_INET            2
+#define WIRE_AF_INET6           10
+
 #define TOX_ENABLE_IPV6_DEFAULT 1
 
 /* addr_resolve return values */
@@ -251,6 +320,13 @@ public:
     static void ipCopy(IP *target, const IP *source);
     /* copies an ip_port structure */
     static void ipportCopy(IP_Port *target, const IP_Port *source);
+    
+    /* Write ipPort in SIZE_IPPORT bytes as [family][address (16)][port], an IPv4
+     * address takes the first 4 bytes.
+     */
+    static void packIpPort(uint8_t *data, const IP_Port *ipPort);
+    /* return false if data holds no address. */
+    static bool unpackIpPort(const uint8_t *data, IP_Port *ipPort);
 
     /*
      * addr_resolve():
@@ -337,17 +413,47 @@ public:
     /* return current monotonic time in milliseconds (ms). */
     static uint64_t getCurrentTimeMonotonic(void);
     
+    /* Replace the monotonic clock, used by the simulator to run on virtual time.
+     * Pass NULL to go back to the system clock.
+     */
+    static void setTimeSource(uint64_t (*function)(void *object), void *object);
+    
     /* Basic network functions: */
     
+    /* Conversions between IP_Port and the addresses of the sockets API, for callers
+     * using it directly (e.g. in batches).
+     *
+     * ipportToSockaddr returns the size of the address net sends ipPort to, 0 if it can't.
+     * net can be NULL for a socket of the family of ipPort (e.g. to bind or connect).
+     * sockaddrToIpport returns false for an unknown family.
+     */
+    static size_t ipportToSockaddr(const NetworkingCore *net, IP_Port ipPort, struct sockaddr_storage *addr);
+    static bool sockaddrToIpport(const struct sockaddr_storage *addr, IP_Port *ipPort);
+    
     /* Function to send packet(data) of length length to ip_port. */
     static int sendPacket(NetworkingCore *net, IP_Port ipPort, const uint8_t *data, uint16_t length);
     
+    /* Send count datagrams, NET_SEND_BATCH per system call where the platform has
+     * sendmmsg, one sendPacket each otherwise and over virtual transports.
+     * Datagrams that can't go are skipped, as sendPacket would fail them.
+     *
+     * return the number of datagrams sent.
+     */
+    static uint32_t sendPackets(NetworkingCore *net, const NetworkPacket *packets, uint32_t count);
+    
     /* Function to call when packet beginning with byte is received. */
     static void registerHandler(NetworkingCore *net, uint8_t byte, PacketHandlerCallback cb, void *object);
     
     /* Call this several times a second. */
     static void poll(NetworkingCore *net);
     
+    /* Read one datagram into data, which holds MAX_UDP_PACKET_SIZE bytes, for
+     * callers dispatching on their own instead of through poll().
+     *
+     * return 0 if one was read, -1 if there is none.
+     */
+    static int receivePacket(NetworkingCore *net, IP_Port *ipPort, uint8_t *data, uint32_t *length);
+    
     /* Initialize networking.
      * bind to ip and port.
      * ip must be in network order EX: 127.0.0.1 = (7F000001).
@@ -360,6 +466,22 @@ public:
      */
     static NetworkingCore *newNetworking(IP ip, uint16_t port);
     static NetworkingCore *newNetworkingEx(IP ip, uint16_t portFrom, uint16_t portTo, unsigned int *error);
+    static NetworkingCore *newNetworkingWithOptions(IP ip, uint16_t portFrom, uint16_t portTo,
+                                                    const NetworkingOptions *options, unsigned int *error);
+    
+    /* return the socket number index passed by systemd socket activation
+     * (LISTEN_FDS), an invalid socket if there is none.
+     */
+    static sock_t activatedSocket(unsigned int index);
+    
+    /* Initialize networking on top of a virtual transport instead of a socket.
+     * ip and port are the address the transport delivers to us on,
+     * port is in host byte order.
+     *
+     * return Networking_Core object if no problems
+     * return NULL if there are problems.
+     */
+    static NetworkingCore *newVirtualNetworking(IP ip, uint16_t port, const NetworkTransport *transport);
     
     /* Function to cleanup networking stuff (doesn't do much right now). */
     static void killNetworking(NetworkingCore *net);
@@ -6,21 +6,210 @@
 //  Copyright © 2018 peerjet. All rights reserved.
 //
 
+#include <algorithm>
+#include <thread>
 #include "Crypto.hpp"
+#include "EventQueue.hpp"
+#include "FileTransfer.hpp"
+#include "LanDiscovery.hpp"
+#include "Message.hpp"
+#include "NatTraversal.hpp"
+#include "NetCrypto.hpp"
+#include "NodeActor.hpp"
 #include "Node.hpp"
+#include "Proxy.hpp"
+#include "Savedata.hpp"
+#include "SavedataCipher.hpp"
+#include "TCPConnections.hpp"
+#include "TCPServer.hpp"
+#include "Utils.hpp"
+
+/* return false if the configuration has no proxy or its host can't be resolved. */
+static bool resolveProxy(NodeConfiguration* config, IP_Port* proxy)
+{
+    if (config->proxyType == PROXY_TYPE_NONE || !config->proxyHost)
+        return false;
+    
+    NetworkService::ipReset(&proxy->ip);
+    
+    if (!config->ipv6Enabled)
+        proxy->ip.family = AF_INET;
+    
+    if (!NetworkService::addrResolveOrParseIp(config->proxyHost, &proxy->ip, NULL))
+        return false;
+    
+    proxy->port = htons(config->proxyPort);
+    return true;
+}
 
 Node::Node(NodeConfiguration* config) {
+    NetworkingCore* net = NULL;
+    ProxyDatagrams* datagrams = NULL;
+    IP_Port proxy;
+    IP ip;
+    NetworkService::ipInit(&ip, config->ipv6Enabled);
+    
+    if (config->udpEnabled && config->proxyType == PROXY_TYPE_NONE) {
+        net = NetworkService::newNetworkingWithOptions(ip, config->startPort, config->endPort, &config->networking, NULL);
+    } else if (config->udpEnabled && config->proxyType == PROXY_TYPE_SOCKS5 && resolveProxy(config, &proxy)) {
+        datagrams = ProxyDatagrams::create(proxy);
+        
+        if (datagrams)
+            net = NetworkService::newVirtualNetworking(ip, 0, datagrams->getTransport());
+    }
+    
+    init(config, net);
+    this->ownsNetworking = true;
+    this->proxyDatagrams = datagrams;
+}
+
+Node::Node(NodeConfiguration* config, NetworkingCore* net) {
+    init(config, net);
+}
+
+void Node::init(NodeConfiguration* config, NetworkingCore* net)
+{
     this->config = config;
+    this->net = net;
+    this->ownsNetworking = false;
+    this->nospam = Crypto::randomInt();
+    this->status = USER_STATUS_NONE;
+    this->profileVersion = 1;
+    this->nameVersion = 1;
+    this->statusMessageVersion = 1;
+    this->statusVersion = 1;
+    this->profileChangePending = false;
+    this->selfSaveDirty = false;
+    this->saveEnd = 0;
+    this->saveSnapshotSize = 0;
+    this->saveLogSize = 0;
+    this->saveKey = NULL;
+    this->saveChunks = 0;
+    this->saveProfile = NULL;
+    this->saveBlocked = false;
+    memset(&this->transport, 0, sizeof(this->transport));
+    this->fileTransfers = new FileTransferEngine(this);
+    this->messages = new MessageEngine(this);
+    this->lanDiscovery = NULL;
+    this->natTraversal = NULL;
+    this->netCrypto = NULL;
+    memset(this->lossyHandlers, 0, sizeof(this->lossyHandlers));
+    
+    this->eventQueue = NULL;
+    this->actor = NULL;
+    this->friendsVersion = 1;
+    this->userData = NULL;
+    this->logCallback = NULL;
+    this->connectionStatusCallback = NULL;
+    this->friendNameCallback = NULL;
+    this->friendStatusMessageCallback = NULL;
+    this->friendStatusCallback = NULL;
+    this->friendConnectionStatusCallback = NULL;
+    this->friendTypingCallback = NULL;
+    this->friendReadReceiptCallback = NULL;
+    this->friendRequestCallback = NULL;
+    this->friendMessageCallback = NULL;
+    this->fileReceiveControlCallback = NULL;
+    this->fileChunkRequestCallback = NULL;
+    this->fileReceiveCallback = NULL;
+    this->fileReceiveChunkCallback = NULL;
+    
+    crypto_box_keypair(this->address, this->secretKey);
+    
+    /* Before anything copies our keys. */
+    if (config->savePath && !Savedata::load(this, config->savePath) && Savedata::exists(config->savePath))
+        this->saveBlocked = true;
+    
+    this->tcpConnections = new TCPConnections(this->address, this->secretKey);
+    this->proxyDatagrams = NULL;
+    
+    IP_Port proxy;
+    
+    if (resolveProxy(config, &proxy))
+        this->tcpConnections->setProxy(config->proxyType, proxy);
+    
+    this->tcpServer = NULL;
+    
+    if (config->localDiscoveryEnabled && net)
+        this->lanDiscovery = new LanDiscovery(this, net);
+    
+    if (net && config->proxyType == PROXY_TYPE_NONE) {
+        this->natTraversal = new NatTraversal(this, net);
+        this->netCrypto = new NetCrypto(net, this->address, this->secretKey);
+        this->netCrypto->setAcceptCallback(&Node::acceptSession, this);
+        this->netCrypto->setDataCallback(&Node::sessionData, this);
+        this->netCrypto->setStatusCallback(&Node::sessionStatus, this);
+        this->netCrypto->setFramesCallback(&Node::sessionFrames, this);
+        setFriendTransport(NULL);
+    }
+    
+    if (config->tcpPort) {
+        IP ip;
+        NetworkService::ipInit(&ip, config->ipv6Enabled);
+        unsigned int workers = config->tcpWorkers ? config->tcpWorkers : std::thread::hardware_concurrency();
+        this->tcpServer = TCPServer::create(ip, config->tcpPort, this->address, this->secretKey, workers);
+    }
+    
+    /* Publishes the profile loaded above. */
+    this->actor = new NodeActor(this);
+}
+
+Node::~Node()
+{
+    for (std::vector<Friend*>::iterator it = this->friends.begin(); it != this->friends.end(); ++it) {
+        if (!*it)
+            continue;
+        
+        this->fileTransfers->release(*it);
+        this->messages->release(*it);
+        
+        if (this->natTraversal)
+            this->natTraversal->release(*it);
+        
+        delete *it;
+    }
+    
+    delete this->actor;
+    delete this->fileTransfers;
+    delete this->messages;
+    delete this->lanDiscovery;
+    delete this->natTraversal;
+    delete this->netCrypto;
+    delete this->tcpServer;
+    delete this->tcpConnections;
+    
+    if (this->ownsNetworking)
+        NetworkService::killNetworking(this->net);
+    
+    delete this->proxyDatagrams;
+    
+    sodium_memzero(this->secretKey, sizeof(this->secretKey));
+    
+    if (this->saveKey) {
+        sodium_memzero(this->saveKey, sizeof(*this->saveKey));
+        delete this->saveKey;
+    }
+    
+    Savedata::release(this);
 }
 
 NodeAddress* Node::getAddress()
 {
-    return this->address;
+    return &this->address;
+}
+
+NetworkingCore* Node::getNetworking()
+{
+    return this->net;
 }
 
 bool Node::setName(const std::string& name)
 {
+    if (name.size() > MAX_NAME_LENGTH)
+        return false;
+    
     this->name = name;
+    profileChanged(&this->nameVersion);
     return true;
 }
 
@@ -31,7 +220,11 @@ const std::string Node::getName()
 
 bool Node::setStatusMessage(const std::string& statusMessage)
 {
+    if (statusMessage.size() > MAX_STATUSMESSAGE_LENGTH)
+        return false;
+    
     this->statusMessage = statusMessage;
+    profileChanged(&this->statusMessageVersion);
     return true;
 }
 
@@ -42,7 +235,11 @@ const std::string Node::getStatusMessage()
 
 bool Node::setStatus(UserStatusType status)
 {
+    if (status > USER_STATUS_BUSY)
+        return false;
+    
     this->status = status;
+    profileChanged(&this->statusVersion);
     return true;
 }
 
@@ -51,11 +248,30 @@ UserStatusType Node::getStatus()
     return this->status;
 }
 
+bool Node::setTyping(uint32_t friendNumber, bool isTyping)
+{
+    Friend* f = getFriend(friendNumber);
+    
+    if (!f)
+        return false;
+    
+    f->user_istyping = isTyping;
+    markProfileDirty(friendNumber);
+    return true;
+}
+
 uint32_t Node::addFriend(const std::string &address, const std::string &message, size_t length)
 {
     return 0;
 }
 
+/* Add a friend without sending a friend request.
+ *
+ * return the friend number on success.
+ * return -3 if the key is our own.
+ * return -4 if the friend was already added.
+ * return -5 if the key is not a valid public key.
+ */
 int32_t Node::addFriendNoRequest(const uint8_t *pubKey)
 {
     if (getFriendByPublicKey(pubKey) != -1) {
@@ -64,31 +280,123 @@ int32_t Node::addFriendNoRequest(const uint8_t *pubKey)
     if (!Crypto::isPublicKeyValid(pubKey)) {
         return -5;
     }
-    if (Crypto::comparePublicKeys(pubKey, getAddress()))
+    if (Crypto::comparePublicKeys(pubKey, *getAddress()) == 0) {
+        return -3;
+    }
+    
+    Friend* f = new Friend();
+    memcpy(f->real_pk, pubKey, PEERJET_KEY_LENGTH);
+    f->friendcon_id = -1;
+    f->status = 3;
+    f->save_dirty = 1;
+    this->friends.push_back(f);
+    this->friendKeys.insert(this->friendKeys.end(), pubKey, pubKey + PEERJET_KEY_LENGTH);
+    ++this->friendsVersion;
+    
+    if (this->lanDiscovery)
+        this->lanDiscovery->friendAdded();
+    
+    return (int32_t)(this->friends.size() - 1);
 }
 
 int Node::getFriendByPublicKey(const uint8_t *pubKey)
 {
-    int count = 0;
-    for (std::vector<Friend*>::iterator it = this->friends.begin(); it != this->friends.end(); ++it) {
-        if (Crypto::comparePublicKeys((*it)->real_pk, pubKey)) {
-            return count;
-        }
-        count++;
-    }
-    return -1;
+    return (int)Crypto::findPublicKey(this->friendKeys.data(), this->friends.size(), pubKey);
 }
 
 bool Node::removeFriend(uint32_t friendNumber)
 {
-    if (friendNumber < 0 || friendNumber >= this->friends.size()) return false;
+    Friend* f = getFriend(friendNumber);
+    if (!f) return false;
+    this->removedSinceSave.insert(this->removedSinceSave.end(), f->real_pk, f->real_pk + PEERJET_KEY_LENGTH);
+    this->fileTransfers->release(f);
+    this->messages->release(f);
+    
+    if (this->natTraversal)
+        this->natTraversal->release(f);
+    
+    if (this->netCrypto && f->friendcon_id >= 0) {
+        uint8_t publicKey[PEERJET_KEY_LENGTH];
+        uint32_t connection = (uint32_t)f->friendcon_id;
+        
+        if (this->netCrypto->getPublicKey(connection, publicKey)
+            && Crypto::comparePublicKeys(publicKey, f->real_pk) == 0)
+            this->netCrypto->removeConnection(connection);
+    }
+    
+    for (size_t i = 0; i < this->sessionFriends.size(); ++i) {
+        if (this->sessionFriends[i] == (int32_t)friendNumber)
+            this->sessionFriends[i] = -1;
+        else if (this->sessionFriends[i] > (int32_t)friendNumber)
+            --this->sessionFriends[i];
+    }
+    
+    delete f;
     this->friends.erase(this->friends.begin() + friendNumber);
+    Savedata::friendRemoved(this, friendNumber);
+    this->friendKeys.erase(this->friendKeys.begin() + friendNumber * PEERJET_KEY_LENGTH,
+                           this->friendKeys.begin() + (friendNumber + 1) * PEERJET_KEY_LENGTH);
+    
+    /* Friends after it moved down by one. */
+    size_t kept = 0;
+    
+    for (size_t i = 0; i < this->profileDirty.size(); ++i) {
+        if (this->profileDirty[i] != friendNumber)
+            this->profileDirty[kept++] = this->profileDirty[i] - (this->profileDirty[i] > friendNumber);
+    }
+    
+    this->profileDirty.resize(kept);
+    ++this->friendsVersion;
+    return true;
+}
+
+Friend* Node::getFriend(uint32_t friendNumber)
+{
+    if (friendNumber >= this->friends.size()) return NULL;
+    
+    /* Decoded from the profile file the first time it is used. */
+    if (!this->friends[friendNumber])
+        return Savedata::loadFriend(this, friendNumber);
+    
+    return this->friends[friendNumber];
+}
+
+void Node::setNoSpam(uint32_t nospam)
+{
+    this->nospam = nospam;
+    this->selfSaveDirty = true;
+}
+
+uint32_t Node::getNoSpam()
+{
+    return this->nospam;
+}
+
+uint64_t Node::getFriendLastOnline(uint32_t friendNumber)
+{
+    Friend* f = getFriend(friendNumber);
+    if (!f) return 0;
+    return f->last_seen_time;
+}
+
+bool Node::getFriendsPublicKey(uint32_t friendNumber, uint8_t *pubKey)
+{
+    Friend* f = getFriend(friendNumber);
+    if (!f) return false;
+    memcpy(pubKey, f->real_pk, PEERJET_KEY_LENGTH);
     return true;
 }
 
+const std::string Node::getFriendName(uint32_t friendNumber)
+{
+    Friend* f = getFriend(friendNumber);
+    if (!f) return std::string();
+    return std::string((const char *)f->name, f->name_length);
+}
+
 bool Node::friendExists(uint32_t friendNumber)
 {
-    return friendNumber >= 0 && friendNumber < this->friends.size();
+    return friendNumber < this->friends.size();
 }
 
 size_t Node::friendListSize()
@@ -96,4 +404,841 @@ size_t Node::friendListSize()
     return this->friends.size();
 }
 
+bool Node::bootstrap(const std::string &address, uint16_t port, const uint8_t *pubKey)
+{
+    IP_Port ipPort;
+    NetworkService::ipReset(&ipPort.ip);
+    
+    if (!this->natTraversal || !Crypto::isPublicKeyValid(pubKey))
+        return false;
+    
+    /* Reflections have to come back over our own socket's family. */
+    if (this->net->family == AF_INET)
+        ipPort.ip.family = AF_INET;
+    
+    if (!NetworkService::addrResolveOrParseIp(address.c_str(), &ipPort.ip, NULL))
+        return false;
+    
+    ipPort.port = htons(port);
+    return this->natTraversal->addReflector(ipPort);
+}
+
+bool Node::addTcpRelay(const std::string &address, uint16_t port, const uint8_t *pubKey)
+{
+    IP_Port ipPort;
+    NetworkService::ipReset(&ipPort.ip);
+    
+    /* Unspecified family: IPv6 preferred, IPv4 accepted. */
+    if (!this->config->ipv6Enabled)
+        ipPort.ip.family = AF_INET;
+    
+    if (!NetworkService::addrResolveOrParseIp(address.c_str(), &ipPort.ip, NULL))
+        return false;
+    
+    ipPort.port = htons(port);
+    return this->tcpConnections->addRelay(ipPort, pubKey);
+}
+
+uint32_t Node::getIterationInterval()
+{
+    return 50;
+}
+
+uint16_t Node::getTcpPort()
+{
+    return this->tcpServer ? this->tcpServer->getPort() : 0;
+}
+
+TCPConnections* Node::getTcpConnections()
+{
+    return this->tcpConnections;
+}
+
+NatTraversal* Node::getNatTraversal()
+{
+    return this->natTraversal;
+}
+
+NetCrypto* Node::getNetCrypto()
+{
+    return this->netCrypto;
+}
+
+NodeActor* Node::getActor()
+{
+    return this->actor;
+}
+
+/* Sessions are opened for friends only. */
+bool Node::acceptSession(void* object, const uint8_t* publicKey, IP_Port source)
+{
+    return ((Node *)object)->getFriendByPublicKey(publicKey) != -1;
+}
+
+int64_t Node::sessionSendLossless(void* object, uint32_t friendNumber, const uint8_t* data, uint16_t length)
+{
+    Node *node = (Node *)object;
+    Friend *f = node->getFriend(friendNumber);
+    
+    if (!f || f->friendcon_id < 0)
+        return -1;
+    
+    return node->netCrypto->sendPacket((uint32_t)f->friendcon_id, data, length, true);
+}
+
+int64_t Node::sessionSendLossy(void* object, uint32_t friendNumber, const uint8_t* data, uint16_t length)
+{
+    Node *node = (Node *)object;
+    Friend *f = node->getFriend(friendNumber);
+    
+    if (!f || f->friendcon_id < 0)
+        return -1;
+    
+    return node->netCrypto->sendPacket((uint32_t)f->friendcon_id, data, length, false);
+}
+
+int64_t Node::sessionSendLossyParts(void* object, uint32_t friendNumber, const uint8_t* header, uint16_t headerLength,
+                                    const uint8_t* data, uint16_t length)
+{
+    Node *node = (Node *)object;
+    Friend *f = node->getFriend(friendNumber);
+    
+    if (!f || f->friendcon_id < 0)
+        return -1;
+    
+    return node->netCrypto->sendLossy((uint32_t)f->friendcon_id, header, headerLength, data, length);
+}
+
+/* The whole batch goes to NetCrypto, which encrypts it across threads and writes it out together. */
+void Node::sessionSendLosslessBatch(void* object, FriendPacket* packets, size_t count)
+{
+    Node *node = (Node *)object;
+    node->sessionPackets.resize(count);
+    
+    for (size_t i = 0; i < count; ++i) {
+        Friend *f = node->getFriend(packets[i].friendNumber);
+        NetCryptoPacket *packet = &node->sessionPackets[i];
+        packet->connection = f && f->friendcon_id >= 0 ? (uint32_t)f->friendcon_id : UINT32_MAX;
+        packet->data = packets[i].data;
+        packet->length = packets[i].length;
+    }
+    
+    node->netCrypto->sendPackets(node->sessionPackets.data(), count);
+    
+    for (size_t i = 0; i < count; ++i)
+        packets[i].result = node->sessionPackets[i].result;
+}
+
+/* Found on the LAN or punched through: open the session there, or move it there if it isn't up yet. */
+void Node::sessionReachable(void* object, uint32_t friendNumber, IP_Port ipPort)
+{
+    Node *node = (Node *)object;
+    Friend *f = node->getFriend(friendNumber);
+    
+    if (!f)
+        return;
+    
+    int connection = node->netCrypto->addConnection(f->real_pk, ipPort);
+    
+    if (connection != -1)
+        f->friendcon_id = connection;
+}
+
+void Node::sessionData(void* object, uint32_t connection, const uint8_t* data, uint16_t length)
+{
+    Node *node = (Node *)object;
+    int friendNumber = node->sessionFriend(connection);
+    
+    if (friendNumber != -1)
+        node->handleFriendPacket((uint32_t)friendNumber, data, length);
+}
+
+/* Lossy packets of the last poll: those of the application go to their handlers a
+ * packet ID at a time, the others (file data) the usual way.
+ */
+void Node::sessionFrames(void* object, const struct NetCryptoFrame* frames, size_t count)
+{
+    Node *node = (Node *)object;
+    node->lossyFrames.clear();
+    
+    for (size_t i = 0; i < count; ++i) {
+        int friendNumber = node->sessionFriend(frames[i].connection);
+        
+        if (friendNumber == -1)
+            continue;
+        
+        uint8_t id = frames[i].data[0];
+        
+        if (id < PACKET_ID_RANGE_LOSSY_START || id > PACKET_ID_RANGE_LOSSY_END) {
+            node->handleFriendPacket((uint32_t)friendNumber, frames[i].data, frames[i].length);
+        } else if (node->lossyHandlers[id - PACKET_ID_RANGE_LOSSY_START].function) {
+            LossyFrame frame;
+            frame.friendNumber = (uint32_t)friendNumber;
+            frame.data = frames[i].data;
+            frame.length = frames[i].length;
+            frame.received = frames[i].received;
+            node->lossyFrames.push_back(frame);
+        }
+    }
+    
+    node->deliverLossy(node->lossyFrames.data(), node->lossyFrames.size());
+}
+
+static bool lossyFrameBefore(const LossyFrame& a, const LossyFrame& b)
+{
+    return a.data[0] < b.data[0];
+}
+
+/* Hand frames to their handlers, one call per packet ID with the frames in the order given. */
+void Node::deliverLossy(LossyFrame* frames, size_t count)
+{
+    std::stable_sort(frames, frames + count, &lossyFrameBefore);
+    
+    for (size_t start = 0, end; start < count; start = end) {
+        uint8_t id = frames[start].data[0];
+        
+        for (end = start + 1; end < count && frames[end].data[0] == id; ++end)
+            ;
+        
+        /* An earlier handler may have removed this one. */
+        if (this->lossyHandlers[id - PACKET_ID_RANGE_LOSSY_START].function)
+            this->lossyHandlers[id - PACKET_ID_RANGE_LOSSY_START].function(
+                this, frames + start, end - start, this->lossyHandlers[id - PACKET_ID_RANGE_LOSSY_START].object);
+    }
+}
+
+/* return the friend on the NetCrypto connection, -1 if none is online there. */
+int Node::sessionFriend(uint32_t connection)
+{
+    return connection < this->sessionFriends.size() ? this->sessionFriends[connection] : -1;
+}
+
+void Node::sessionStatus(void* object, uint32_t connection, bool online)
+{
+    Node *node = (Node *)object;
+    uint8_t publicKey[PEERJET_KEY_LENGTH];
+    
+    if (!node->netCrypto->getPublicKey(connection, publicKey))
+        return;
+    
+    int friendNumber = node->getFriendByPublicKey(publicKey);
+    
+    /* Removed while the session came up. */
+    if (friendNumber == -1) {
+        if (online)
+            node->netCrypto->removeConnection(connection);
+        
+        return;
+    }
+    
+    node->getFriend((uint32_t)friendNumber)->friendcon_id = (int)connection;
+    
+    if (connection >= node->sessionFriends.size())
+        node->sessionFriends.resize(connection + 1, -1);
+    
+    node->sessionFriends[connection] = online ? friendNumber : -1;
+    node->setFriendConnectionStatus((uint32_t)friendNumber, online ? CONNECTION_TYPE_UDP : CONNECTION_TYPE_NONE);
+}
+
+void Node::tick()
+{
+    /* Calls made on other threads since the last tick. */
+    this->actor->apply();
+    
+    if (this->net)
+        NetworkService::poll(this->net);
+    
+    if (this->lanDiscovery)
+        this->lanDiscovery->tick();
+    
+    if (this->natTraversal)
+        this->natTraversal->tick();
+    
+    /* After the poll, so the handshakes it read are handled as one burst. */
+    if (this->netCrypto)
+        this->netCrypto->tick();
+    
+    this->tcpConnections->tick();
+    
+    /* Every change since the last tick goes out in one update per online friend. */
+    if (this->profileChangePending) {
+        for (uint32_t i = 0; i < this->friends.size(); ++i)
+            markProfileDirty(i);
+        
+        this->profileChangePending = false;
+    }
+    
+    this->sendProfiles();
+    this->messages->tick();
+    this->fileTransfers->tick();
+    this->actor->publish();
+    
+    /* Events that waited for room in the ring. */
+    if (this->eventQueue)
+        this->eventQueue->flush();
+}
 
+bool Node::save()
+{
+    return this->config->savePath && !this->saveBlocked && Savedata::save(this, this->config->savePath);
+}
+
+bool Node::saveSnapshot()
+{
+    return this->config->savePath && !this->saveBlocked && Savedata::saveSnapshot(this, this->config->savePath);
+}
+
+/* NULL goes back to the sessions of NetCrypto, or to no transport at all without them. */
+void Node::setFriendTransport(const FriendTransport *transport)
+{
+    if (transport) {
+        this->transport = *transport;
+    } else {
+        memset(&this->transport, 0, sizeof(this->transport));
+        
+        if (this->netCrypto) {
+            this->transport.sendLossless = &Node::sessionSendLossless;
+            this->transport.sendLossy = &Node::sessionSendLossy;
+            this->transport.sendLosslessBatch = &Node::sessionSendLosslessBatch;
+            this->transport.sendLossyParts = &Node::sessionSendLossyParts;
+            this->transport.friendFoundOnLan = &Node::sessionReachable;
+            this->transport.friendHolePunched = &Node::sessionReachable;
+            this->transport.object = this;
+        }
+    }
+}
+
+/* return the packet number for lossless packets, 0 for lossy packets, -1 on failure. */
+int64_t Node::sendFriendPacket(uint32_t friendNumber, const uint8_t *data, uint16_t length, bool lossless)
+{
+    Friend* f = getFriend(friendNumber);
+    
+    if (!f || f->status != 4)
+        return -1;
+    
+    if (lossless) {
+        if (!this->transport.sendLossless) return -1;
+        return this->transport.sendLossless(this->transport.object, friendNumber, data, length);
+    }
+    
+    if (!this->transport.sendLossy) return -1;
+    return this->transport.sendLossy(this->transport.object, friendNumber, data, length);
+}
+
+/* A lossy packet of header and data, joined by the transport where it builds its packet when it can. */
+int64_t Node::sendFriendPacketParts(uint32_t friendNumber, const uint8_t *header, uint16_t headerLength,
+                                    const uint8_t *data, uint16_t length)
+{
+    Friend* f = getFriend(friendNumber);
+    
+    if (!f || f->status != 4)
+        return -1;
+    
+    if (this->transport.sendLossyParts)
+        return this->transport.sendLossyParts(this->transport.object, friendNumber, header, headerLength, data, length);
+    
+    uint8_t packet[NET_CRYPTO_MAX_PACKET_SIZE];
+    
+    if (!this->transport.sendLossy || (uint32_t)headerLength + length > sizeof(packet))
+        return -1;
+    
+    memcpy(packet, header, headerLength);
+    memcpy(packet + headerLength, data, length);
+    return this->transport.sendLossy(this->transport.object, friendNumber, packet, (uint16_t)(headerLength + length));
+}
+
+bool Node::setLossyPacketHandler(uint8_t packetId, PJLossyFramesCallback* cb, void* object)
+{
+    if (packetId < PACKET_ID_RANGE_LOSSY_START || packetId > PACKET_ID_RANGE_LOSSY_END)
+        return false;
+    
+    this->lossyHandlers[packetId - PACKET_ID_RANGE_LOSSY_START].function = cb;
+    this->lossyHandlers[packetId - PACKET_ID_RANGE_LOSSY_START].object = object;
+    return true;
+}
+
+bool Node::sendLossyPacket(uint32_t friendNumber, const uint8_t* data, size_t length)
+{
+    if (length == 0 || length > UINT16_MAX || data[0] < PACKET_ID_RANGE_LOSSY_START
+        || data[0] > PACKET_ID_RANGE_LOSSY_END)
+        return false;
+    
+    return sendFriendPacket(friendNumber, data, (uint16_t)length, false) != -1;
+}
+
+/* Send lossless packets to online friends in one go, see FriendTransport::sendLosslessBatch. */
+void Node::sendFriendPackets(FriendPacket *packets, size_t count)
+{
+    if (count == 0)
+        return;
+    
+    if (this->transport.sendLosslessBatch) {
+        this->transport.sendLosslessBatch(this->transport.object, packets, count);
+        return;
+    }
+    
+    for (size_t i = 0; i < count; ++i) {
+        packets[i].result = -1;
+        
+        if (this->transport.sendLossless)
+            packets[i].result = this->transport.sendLossless(this->transport.object, packets[i].friendNumber,
+                                                             packets[i].data, packets[i].length);
+    }
+}
+
+/* return the length of the PACKET_ID_PROFILE packet with fields written to packet. */
+static uint16_t encodeProfile(uint8_t *packet, uint8_t fields, const std::string& name, const std::string& statusMessage,
+                              UserStatusType status, uint8_t typing)
+{
+    uint16_t length = 2;
+    packet[0] = PACKET_ID_PROFILE;
+    packet[1] = fields;
+    
+    if (fields & PROFILE_FIELD_NAME) {
+        packet[length++] = (uint8_t)name.size();
+        memcpy(packet + length, name.data(), name.size());
+        length += name.size();
+    }
+    
+    if (fields & PROFILE_FIELD_STATUS_MESSAGE) {
+        packet[length++] = (uint8_t)statusMessage.size();
+        memcpy(packet + length, statusMessage.data(), statusMessage.size());
+        length += statusMessage.size();
+    }
+    
+    if (fields & PROFILE_FIELD_USER_STATUS)
+        packet[length++] = (uint8_t)status;
+    
+    if (fields & PROFILE_FIELD_TYPING)
+        packet[length++] = typing;
+    
+    return length;
+}
+
+/* A field of our profile changed, every online friend is sent it right away. */
+void Node::profileChanged(uint32_t *fieldVersion)
+{
+    *fieldVersion = ++this->profileVersion;
+    this->selfSaveDirty = true;
+    this->profileChangePending = true;
+}
+
+void Node::markProfileDirty(uint32_t friendNumber)
+{
+    Friend* f = this->friends[friendNumber];
+    
+    /* Friends not decoded yet are offline. */
+    if (!f || f->status != 4 || f->profile_dirty)
+        return;
+    
+    f->profile_dirty = 1;
+    this->profileDirty.push_back(friendNumber);
+}
+
+/* Send the friends in the dirty set what changed in our profile since the version they have.
+ *
+ * Friends needing the same fields share one encoded packet, and all packets
+ * are handed to the connection layer in one batch. A friend leaves the set once
+ * it is up to date, or when it goes offline.
+ */
+void Node::sendProfiles()
+{
+    if (this->profileDirty.empty())
+        return;
+    
+    uint64_t now = NetworkService::getCurrentTimeMonotonic();
+    int lastKey = -1;
+    uint16_t lastLength = 0;
+    size_t lastOffset = 0;
+    
+    /* Packets point into the buffer, it must not move while they are built. */
+    this->profileBuffer.resize(this->profileDirty.size() * PROFILE_MAX_PACKET_SIZE);
+    this->profilePackets.clear();
+    
+    for (size_t i = 0; i < this->profileDirty.size(); ++i) {
+        uint32_t friendNumber = this->profileDirty[i];
+        Friend* f = this->friends[friendNumber];
+        uint8_t fields = 0;
+        
+        if (f->status != 4)
+            continue;
+        
+        if (this->nameVersion > f->profile_version)
+            fields |= PROFILE_FIELD_NAME;
+        
+        if (this->statusMessageVersion > f->profile_version)
+            fields |= PROFILE_FIELD_STATUS_MESSAGE;
+        
+        if (this->statusVersion > f->profile_version)
+            fields |= PROFILE_FIELD_USER_STATUS;
+        
+        if (f->user_istyping != f->user_istyping_delivered && now - f->user_istyping_time >= PROFILE_TYPING_INTERVAL)
+            fields |= PROFILE_FIELD_TYPING;
+        
+        if (fields == 0)
+            continue;
+        
+        int key = fields | (f->user_istyping << 8);
+        
+        if (key != lastKey) {
+            lastOffset = this->profilePackets.empty() ? 0 : lastOffset + lastLength;
+            lastLength = encodeProfile(&this->profileBuffer[lastOffset], fields, this->name, this->statusMessage,
+                                       this->status, f->user_istyping);
+            lastKey = key;
+        }
+        
+        FriendPacket packet = {friendNumber, &this->profileBuffer[lastOffset], lastLength, -1};
+        this->profilePackets.push_back(packet);
+    }
+    
+    sendFriendPackets(this->profilePackets.data(), this->profilePackets.size());
+    
+    for (size_t i = 0; i < this->profilePackets.size(); ++i) {
+        const FriendPacket& packet = this->profilePackets[i];
+        Friend* f = this->friends[packet.friendNumber];
+        
+        if (packet.result == -1)
+            continue;
+        
+        f->profile_version = this->profileVersion;
+        
+        if (packet.data[1] & PROFILE_FIELD_TYPING) {
+            f->user_istyping_delivered = packet.data[packet.length - 1];
+            f->user_istyping_time = now;
+        }
+    }
+    
+    size_t kept = 0;
+    
+    for (size_t i = 0; i < this->profileDirty.size(); ++i) {
+        uint32_t friendNumber = this->profileDirty[i];
+        Friend* f = this->friends[friendNumber];
+        
+        if (f->status == 4 && (f->profile_version != this->profileVersion || f->user_istyping != f->user_istyping_delivered)) {
+            this->profileDirty[kept++] = friendNumber;
+        } else {
+            f->profile_dirty = 0;
+        }
+    }
+    
+    this->profileDirty.resize(kept);
+}
+
+/* Apply a PACKET_ID_PROFILE packet, callbacks are made once the whole packet was checked. */
+void Node::handleProfile(uint32_t friendNumber, Friend* f, const uint8_t *data, uint16_t length)
+{
+    if (length < 2)
+        return;
+    
+    uint8_t fields = data[1];
+    size_t offset = 2;
+    const uint8_t *name = NULL, *statusMessage = NULL;
+    uint8_t nameLength = 0, statusMessageLength = 0, status = 0, typing = 0;
+    
+    if (fields & PROFILE_FIELD_NAME) {
+        if (offset >= length || data[offset] > MAX_NAME_LENGTH || offset + 1 + data[offset] > length)
+            return;
+        
+        nameLength = data[offset];
+        name = data + offset + 1;
+        offset += 1 + nameLength;
+    }
+    
+    if (fields & PROFILE_FIELD_STATUS_MESSAGE) {
+        if (offset >= length || data[offset] > MAX_STATUSMESSAGE_LENGTH || offset + 1 + data[offset] > length)
+            return;
+        
+        statusMessageLength = data[offset];
+        statusMessage = data + offset + 1;
+        offset += 1 + statusMessageLength;
+    }
+    
+    if (fields & PROFILE_FIELD_USER_STATUS) {
+        if (offset >= length || data[offset] > USER_STATUS_BUSY)
+            return;
+        
+        status = data[offset++];
+    }
+    
+    if (fields & PROFILE_FIELD_TYPING) {
+        if (offset >= length)
+            return;
+        
+        typing = data[offset++] != 0;
+    }
+    
+    if (name) {
+        memcpy(f->name, name, nameLength);
+        f->name_length = nameLength;
+    }
+    
+    if (statusMessage) {
+        memcpy(f->statusmessage, statusMessage, statusMessageLength);
+        f->statusmessage_length = statusMessageLength;
+    }
+    
+    if (fields & PROFILE_FIELD_USER_STATUS)
+        f->userstatus = (UserStatusType)status;
+    
+    if (fields & (PROFILE_FIELD_NAME | PROFILE_FIELD_STATUS_MESSAGE | PROFILE_FIELD_USER_STATUS)) {
+        f->save_dirty = 1;
+        ++this->friendsVersion;
+    }
+    
+    if (fields & PROFILE_FIELD_TYPING)
+        f->is_typing = typing;
+    
+    /* A callback may remove the friend, the ones after it are skipped. */
+    if (name && this->friendNameCallback) {
+        this->friendNameCallback(this, friendNumber, std::string((const char *)name, nameLength), nameLength, this->userData);
+        
+        if (getFriend(friendNumber) != f)
+            return;
+    }
+    
+    if (statusMessage && this->friendStatusMessageCallback) {
+        this->friendStatusMessageCallback(this, friendNumber, std::string((const char *)statusMessage, statusMessageLength),
+                                          statusMessageLength, this->userData);
+        
+        if (getFriend(friendNumber) != f)
+            return;
+    }
+    
+    if ((fields & PROFILE_FIELD_USER_STATUS) && this->friendStatusCallback) {
+        this->friendStatusCallback(this, friendNumber, (UserStatusType)status, this->userData);
+        
+        if (getFriend(friendNumber) != f)
+            return;
+    }
+    
+    if ((fields & PROFILE_FIELD_TYPING) && this->friendTypingCallback)
+        this->friendTypingCallback(this, friendNumber, typing, this->userData);
+}
+
+void Node::handleFriendPacket(uint32_t friendNumber, const uint8_t *data, uint16_t length)
+{
+    Friend* f = getFriend(friendNumber);
+    
+    if (!f || f->status != 4 || length == 0)
+        return;
+    
+    switch (data[0]) {
+        case PACKET_ID_PROFILE:
+            handleProfile(friendNumber, f, data, length);
+            break;
+            
+        case PACKET_ID_NAT_ADDRESSES:
+            if (this->natTraversal)
+                this->natTraversal->handlePacket(friendNumber, data, length);
+            break;
+            
+        case PACKET_ID_MESSAGE:
+        case PACKET_ID_MESSAGE_RECEIPT:
+            this->messages->handlePacket(friendNumber, data, length);
+            break;
+            
+        case PACKET_ID_FILE_SENDREQUEST:
+        case PACKET_ID_FILE_CONTROL:
+        case PACKET_ID_FILE_DATA:
+        case PACKET_ID_FILE_ACK:
+            this->fileTransfers->handlePacket(friendNumber, data, length);
+            break;
+            
+        default:
+            /* Lossy packets of the application that didn't come in a batch of frames. */
+            if (data[0] >= PACKET_ID_RANGE_LOSSY_START && data[0] <= PACKET_ID_RANGE_LOSSY_END
+                && this->lossyHandlers[data[0] - PACKET_ID_RANGE_LOSSY_START].function) {
+                LossyFrame frame;
+                frame.friendNumber = friendNumber;
+                frame.data = data;
+                frame.length = length;
+                frame.received = NetworkService::getCurrentTimeMonotonic();
+                deliverLossy(&frame, 1);
+            }
+            
+            break;
+    }
+}
+
+void Node::setFriendConnectionStatus(uint32_t friendNumber, ConnectionType connectionStatus)
+{
+    Friend* f = getFriend(friendNumber);
+    
+    if (!f || f->status < 3)
+        return;
+    
+    bool online = connectionStatus != CONNECTION_TYPE_NONE;
+    bool wasOnline = f->status == 4;
+    
+    if (!online && wasOnline) {
+        this->fileTransfers->friendOffline(friendNumber);
+        this->messages->friendOffline(friendNumber);
+        f->last_seen_time = Utils::getUnixTime();
+        f->save_dirty = 1;
+    }
+    
+    f->status = online ? 4 : 3;
+    
+    /* The friend starts from nothing, our whole profile goes out on the next tick. */
+    if (online && !wasOnline) {
+        f->profile_version = 0;
+        f->user_istyping_delivered = 0;
+        f->user_istyping_time = 0;
+        markProfileDirty(friendNumber);
+    } else if (!online) {
+        f->is_typing = 0;
+    }
+    
+    if (f->last_connection_udp_tcp == connectionStatus)
+        return;
+    
+    f->last_connection_udp_tcp = connectionStatus;
+    ++this->friendsVersion;
+    
+    if (this->friendConnectionStatusCallback)
+        this->friendConnectionStatusCallback(this, friendNumber, connectionStatus, this->userData);
+}
+
+int64_t Node::sendMessage(uint32_t friendNumber, MessageType type, const uint8_t *message, size_t length)
+{
+    return this->messages->send(friendNumber, type, message, length);
+}
+
+size_t Node::broadcastMessage(const uint32_t *friendNumbers, size_t count, MessageType type, const uint8_t *message,
+                              size_t length, int64_t *messageIds)
+{
+    return this->messages->broadcast(friendNumbers, count, type, message, length, messageIds);
+}
+
+int32_t Node::fileSend(uint32_t friendNumber, uint32_t fileKind, uint64_t fileSize, const uint8_t *fileId,
+                       const uint8_t *filename, size_t filenameLength)
+{
+    return this->fileTransfers->send(friendNumber, fileKind, fileSize, fileId, filename, filenameLength);
+}
+
+bool Node::fileControl(uint32_t friendNumber, uint32_t fileNumber, FileControlType control)
+{
+    return this->fileTransfers->control(friendNumber, fileNumber, control);
+}
+
+bool Node::fileSendChunk(uint32_t friendNumber, uint32_t fileNumber, uint64_t position, const uint8_t *data, size_t length)
+{
+    return this->fileTransfers->sendChunk(friendNumber, fileNumber, position, data, length);
+}
+
+int32_t Node::fileSendPath(uint32_t friendNumber, uint32_t fileKind, const char *path, const uint8_t *fileId,
+                           const uint8_t *filename, size_t filenameLength)
+{
+    return this->fileTransfers->sendPath(friendNumber, fileKind, path, fileId, filename, filenameLength);
+}
+
+int32_t Node::fileSendFd(uint32_t friendNumber, uint32_t fileKind, int fd, const uint8_t *fileId,
+                         const uint8_t *filename, size_t filenameLength)
+{
+    return this->fileTransfers->sendFd(friendNumber, fileKind, fd, false, fileId, filename, filenameLength);
+}
+
+bool Node::fileSeek(uint32_t friendNumber, uint32_t fileNumber, uint64_t position)
+{
+    return this->fileTransfers->seek(friendNumber, fileNumber, position);
+}
+
+bool Node::fileGetFileId(uint32_t friendNumber, uint32_t fileNumber, uint8_t *fileId)
+{
+    return this->fileTransfers->getFileId(friendNumber, fileNumber, fileId);
+}
+
+bool Node::fileReceiveToPath(uint32_t friendNumber, uint32_t fileNumber, const char *path, bool overwrite)
+{
+    return this->fileTransfers->receiveToPath(friendNumber, fileNumber, path, overwrite);
+}
+
+void Node::setUserData(void *userData)
+{
+    this->userData = userData;
+}
+
+void Node::setLogCallback(PJLogCallback cb)
+{
+    this->logCallback = cb;
+}
+
+void Node::setConnectionStatusCallback(PJConnectionStatusCallback cb)
+{
+    this->connectionStatusCallback = cb;
+}
+
+void Node::setFriendNameCallback(PJFriendNameCallback cb)
+{
+    this->friendNameCallback = cb;
+}
+
+void Node::setFriendStatusMessageCallback(PJFriendStatusMessageCallback cb)
+{
+    this->friendStatusMessageCallback = cb;
+}
+
+void Node::setFriendStatusCallback(PJFriendStatusCallback cb)
+{
+    this->friendStatusCallback = cb;
+}
+
+void Node::setFriendConnectionStatusCallback(PJFriendConnectionStatusCallback cb)
+{
+    this->friendConnectionStatusCallback = cb;
+}
+
+void Node::setFriendTypingCallback(PJFriendTypingCallback cb)
+{
+    this->friendTypingCallback = cb;
+}
+
+void Node::setFriendReadReceiptCallback(PJFriendReadReceiptCallback cb)
+{
+    this->friendReadReceiptCallback = cb;
+}
+
+void Node::setFriendRequestCallback(PJFriendRequestCallback cb)
+{
+    this->friendRequestCallback = cb;
+}
+
+void Node::setFriendMessageCallback(PJFriendMessageCallback cb)
+{
+    this->friendMessageCallback = cb;
+}
+
+void Node::setFileReceiveControlCallback(PJFileReceiveControlCallback cb)
+{
+    this->fileReceiveControlCallback = cb;
+}
+
+void Node::setFileChunkRequestCallback(PJFileChunkRequestCallback cb)
+{
+    this->fileChunkRequestCallback = cb;
+}
+
+void Node::setFileReceiveCallback(PJFileReceiveCallback cb)
+{
+    this->fileReceiveCallback = cb;
+}
+
+void Node::setFileReceiveChunkCallback(PJFileReceiveChunkCallback cb)
+{
+    this->fileReceiveChunkCallback = cb;
+}
+
+void Node::setEventQueue(EventQueue* queue)
+{
+    this->eventQueue = queue;
+    
+    if (queue)
+        queue->attach(this);
+    else
+        EventQueue::detach(this);
+}
+
+EventQueue* Node::getEventQueue()
+{
+    return this->eventQueue;
+}
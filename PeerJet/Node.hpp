@@ -10,6 +10,7 @@
 #define Node_hpp
 
 #include "Config.h"
+#include "NetworkService.hpp"
 #include <cstdint>
 #include <stdio.h>
 #include <string>
@@ -18,6 +19,19 @@
 #define PEERJET_KEY_LENGTH      32
 
 class Node;
+class FileTransferEngine;
+class MessageEngine;
+class LanDiscovery;
+class NatTraversal;
+class NetCrypto;
+class EventQueue;
+class NodeActor;
+class TCPServer;
+class TCPConnections;
+class ProxyDatagrams;
+struct SavedataKey;
+struct NetCryptoFrame;
+struct NetCryptoPacket;
 
 typedef struct {
     unsigned char ip[4];
@@ -45,6 +59,8 @@ typedef struct {
     
     /**
      * Defines a proxy type to be used when connecting to the network.
+     * TCP relays are reached through either kind, UDP goes through a SOCKS5
+     * proxy's UDP association and is disabled behind an HTTP proxy.
      */
     ProxyType proxyType;
     
@@ -68,11 +84,44 @@ typedef struct {
      */
     uint16_t endPort;
     
+    /**
+     * How the UDP socket is bound and set up (NetworkService.hpp), all zero to
+     * take the first free port of the range. Many instances started at once
+     * bind faster with NET_BIND_RANDOM or NET_BIND_HASHED.
+     */
+    NetworkingOptions networking;
+    
     /**
      * The TCP port we will listen for TCP connections on
      */
     uint16_t tcpPort;
     
+    /**
+     * Threads of the TCP relay, each accepting on its own socket (TCPServer.hpp).
+     * 0 for one per CPU (std::thread::hardware_concurrency()).
+     */
+    unsigned int tcpWorkers;
+    
+    /**
+     * Look for friends on the local network by broadcasting our public key
+     * (LanDiscovery.hpp), friends found are passed to FriendTransport::friendFoundOnLan.
+     */
+    bool localDiscoveryEnabled;
+    
+    /**
+     * The profile file (Savedata.hpp) our keys, profile and friends are loaded
+     * from, and saved to by save(). NULL for a new identity on every start.
+     * A profile that exists but can't be loaded is never overwritten.
+     */
+    const char *savePath;
+    
+    /**
+     * Encrypt the profile with a key derived from this passphrase (SavedataCipher.hpp),
+     * NULL to keep it in clear. A profile saved in clear is encrypted by the next save.
+     */
+    const uint8_t *savePassphrase;
+    size_t savePassphraseLength;
+    
 } NodeConfiguration;
 
 typedef enum {
@@ -103,10 +152,40 @@ typedef enum {
 typedef enum {
     FILE_CONTROL_RESUME,
     FILE_CONTROL_PAUSE,
-    FILE_CONTROL_CANCEL
+    FILE_CONTROL_CANCEL,
+    FILE_CONTROL_SEEK /* only sent by Node::fileSeek, never passed to callbacks */
 } FileControlType;
 
 #define FILE_ID_LENGTH 32
+#define MAX_FILENAME_LENGTH 255
+
+/* Packet IDs of the friend protocol, first byte of every packet sent through the FriendTransport. */
+#define PACKET_ID_NAT_ADDRESSES     40  /* Lossless: our addresses as seen from outside, to punch through NATs. */
+#define PACKET_ID_PROFILE           48  /* Lossless: the fields of our profile the friend doesn't have yet. */
+#define PACKET_ID_MESSAGE           64  /* Lossless: one or more messages packed together. */
+#define PACKET_ID_MESSAGE_RECEIPT   66  /* Lossless: cumulative receipt of PACKET_ID_MESSAGE packets. */
+#define PACKET_ID_FILE_SENDREQUEST  80  /* Lossless: offer a file. */
+#define PACKET_ID_FILE_CONTROL      81  /* Lossless: accept, pause, resume or cancel a file. */
+#define PACKET_ID_FILE_DATA         82  /* Lossy: one chunk of a file, retransmitted by the file transfer engine. */
+#define PACKET_ID_FILE_ACK          83  /* Lossy: cumulative + selective acknowledgement of file chunks. */
+
+/* Lossy packets of the application (Node::setLossyPacketHandler), the first
+ * PACKET_LOSSY_AV_RESERVED of them for audio and video.
+ */
+#define PACKET_ID_RANGE_LOSSY_START 192
+#define PACKET_ID_RANGE_LOSSY_END   254
+#define PACKET_ID_RANGE_LOSSY_SIZE  (PACKET_ID_RANGE_LOSSY_END - PACKET_ID_RANGE_LOSSY_START + 1)
+
+/* Fields of a PACKET_ID_PROFILE packet: [id][fields] then each field present, in this order. */
+#define PROFILE_FIELD_NAME              0x01    /* length (1), name */
+#define PROFILE_FIELD_STATUS_MESSAGE    0x02    /* length (1), status message */
+#define PROFILE_FIELD_USER_STATUS       0x04    /* UserStatusType (1) */
+#define PROFILE_FIELD_TYPING            0x08    /* 1 if we are typing to the receiver, 0 otherwise (1) */
+
+#define PROFILE_MAX_PACKET_SIZE     (2 + 1 + MAX_NAME_LENGTH + 1 + MAX_STATUSMESSAGE_LENGTH + 1 + 1)
+
+/* A friend gets at most one typing change per interval (ms), the last state wins. */
+#define PROFILE_TYPING_INTERVAL     500
 
 struct FileTransfers {
     uint64_t size;
@@ -117,43 +196,53 @@ struct FileTransfers {
     uint64_t requested; /* total data requested by the request chunk callback */
     unsigned int slots_allocated; /* number of slots allocated to this transfer. */
     uint8_t id[FILE_ID_LENGTH];
+    struct FileWindow *window; /* chunks in flight, allocated while the transfer is active. */
+    struct FileSource *source; /* file the library reads the data from, NULL if the application supplies chunks. */
+    struct FileSink *sink; /* file the library writes the data to, NULL if chunks go to the application. */
 };
 
+/* Friend::status */
+#define FRIEND_NOFRIEND             0
+#define FRIEND_ADDED                1
+#define FRIEND_REQUESTED            2   /* friend request sent */
+#define FRIEND_CONFIRMED            3
+#define FRIEND_ONLINE               4
+
 typedef struct {
     uint8_t real_pk[PEERJET_KEY_LENGTH];
     int friendcon_id;
     
     uint64_t friendrequest_lastsent; // Time at which the last friend request was sent.
     uint32_t friendrequest_timeout; // The timeout between successful friendrequest sending attempts.
-    uint8_t status; // 0 if no friend, 1 if added, 2 if friend request sent, 3 if confirmed friend, 4 if online.
+    uint8_t status; // FRIEND_NOFRIEND, FRIEND_ADDED, FRIEND_REQUESTED, FRIEND_CONFIRMED or FRIEND_ONLINE.
     uint8_t info[MAX_FRIEND_REQUEST_DATA_SIZE]; // the data that is sent during the friend requests we do.
     uint8_t name[MAX_NAME_LENGTH];
     uint16_t name_length;
-    uint8_t name_sent; // 0 if we didn't send our name to this friend 1 if we have.
     uint8_t statusmessage[MAX_STATUSMESSAGE_LENGTH];
     uint16_t statusmessage_length;
-    uint8_t statusmessage_sent;
     UserStatusType userstatus;
-    uint8_t userstatus_sent;
-    uint8_t user_istyping;
-    uint8_t user_istyping_sent;
+    uint32_t profile_version; // version of our profile this friend has, 0 for none.
+    uint8_t profile_dirty; // 1 while in Node's set of friends to send a profile update to.
+    uint8_t user_istyping; // are we typing to this friend.
+    uint8_t user_istyping_delivered; // the typing state this friend last got from us.
+    uint64_t user_istyping_time; // when it got it.
     uint8_t is_typing;
     uint16_t info_size; // Length of the info.
     uint32_t message_id; // a semi-unique id used in read receipts.
     uint32_t friendrequest_nospam; // The nospam number used in the friend request.
     uint64_t last_seen_time;
     uint8_t last_connection_udp_tcp;
+    uint8_t save_dirty; // 1 if changed since the profile was last saved.
+    IP_Port lan_address; // where LAN discovery last found this friend.
+    uint64_t lan_found; // when, 0 if never.
+    struct NatPunch *nat_punch; // hole punching to this friend, allocated with the first punch.
     struct FileTransfers file_sending[MAX_CONCURRENT_FILE_PIPES];
     unsigned int num_sending_files;
     struct FileTransfers file_receiving[MAX_CONCURRENT_FILE_PIPES];
+    unsigned int num_receiving_files;
+    struct CongestionWindow *file_congestion; // congestion window shared by the sending pipes.
     
-    struct {
-        int (*function)(Node *node, uint32_t friendNumber, const uint8_t *data, uint16_t len, void *object);
-        void *object;
-    } lossy_rtp_packethandlers[PACKET_LOSSY_AV_RESERVED];
-    
-    struct Receipts *receipts_start;
-    struct Receipts *receipts_end;
+    struct MessageQueue *messages; // messages waiting to be sent or for a receipt, allocated with the first message.
 } Friend;
 
 // Callback type definitions
@@ -175,12 +264,76 @@ typedef void PJFileReceiveChunkCallback(Node* node, uint32_t friendNumber, uint3
 
 typedef void PJFriendLossyPacketCallback(Node* node, uint32_t friendNumber, const uint8_t *data, size_t length, void* userData);
 typedef void PJFriendLosslessPacketCallback(Node* node, uint32_t friendNumber, const uint8_t *data, size_t length, void* userData);
+
+/* A lossy packet of the application, data starts with its packet ID. */
+typedef struct {
+    uint32_t friendNumber;
+    const uint8_t *data;
+    uint16_t length;
+    uint64_t received;      /* monotonic time (ms) it was read from the socket */
+} LossyFrame;
+
+/* Called with the packets of one packet ID read since the last call, in the order
+ * they were read. The data stays valid until the callback returns.
+ */
+typedef void PJLossyFramesCallback(Node* node, const LossyFrame* frames, size_t count, void* object);
 // End callback type definitions
 
+/* One lossless packet of a batch, result is set to what sendLossless would have returned. */
+typedef struct {
+    uint32_t friendNumber;
+    const uint8_t *data;
+    uint16_t length;
+    int64_t result;
+} FriendPacket;
+
+/* Carries friend packets to a friend, implemented by the connection layer.
+ *
+ * sendLossless returns the packet number of the packet, sendLossy returns 0,
+ * both return -1 on failure. Incoming friend packets are handed to
+ * Node::handleFriendPacket. Unless the application sets its own, the sessions
+ * of NetCrypto (NetCrypto.hpp) carry them over UDP.
+ *
+ * sendLosslessBatch may be NULL. Otherwise broadcasts and the packets due on
+ * every tick are handed to it in one call, so the connection layer can encrypt
+ * them across threads with its precomputed session keys and write them out
+ * together, as the sessions of NetCrypto do (NetCrypto::sendPackets). Packets
+ * to the same friend must be sent in the order given, the data of several
+ * packets may be the same buffer.
+ *
+ * sendLossyParts may be NULL. Otherwise a lossy packet whose data sits in a
+ * buffer of its own, a file chunk in the mapping of the file or the window
+ * buffer, is handed to it as a header and that data, so the connection layer
+ * can write both once into its outgoing packet and encrypt them there, as the
+ * sessions of NetCrypto do (NetCrypto::sendLossy).
+ *
+ * friendFoundOnLan may be NULL, it is called when LAN discovery finds a friend
+ * at ipPort so the connection can be made there directly, at most once every
+ * LAN_DISCOVERY_FRIEND_INTERVAL for the same address.
+ *
+ * friendHolePunched may be NULL, it is called when a friend connected through a
+ * relay (CONNECTION_TYPE_TCP) answered a NAT ping at ipPort: the hole is open
+ * both ways and the connection can move there, to direct UDP.
+ */
+typedef struct {
+    int64_t (*sendLossless)(void *object, uint32_t friendNumber, const uint8_t *data, uint16_t length);
+    int64_t (*sendLossy)(void *object, uint32_t friendNumber, const uint8_t *data, uint16_t length);
+    void (*sendLosslessBatch)(void *object, FriendPacket *packets, size_t count);
+    int64_t (*sendLossyParts)(void *object, uint32_t friendNumber, const uint8_t *header, uint16_t headerLength,
+                              const uint8_t *data, uint16_t length);
+    void (*friendFoundOnLan)(void *object, uint32_t friendNumber, IP_Port ipPort);
+    void (*friendHolePunched)(void *object, uint32_t friendNumber, IP_Port ipPort);
+    void *object;
+} FriendTransport;
+
 class Node {
 public:
     Node(NodeConfiguration* config);
+    /* Run the node on top of networking owned by the caller (simulator, shared sockets). */
+    Node(NodeConfiguration* config, NetworkingCore* net);
+    ~Node();
     NodeAddress* getAddress();
+    NetworkingCore* getNetworking();
     
     bool setName(const std::string& name);
     const std::string getName();
@@ -191,15 +344,23 @@ public:
     bool setStatus(UserStatusType status);
     UserStatusType getStatus();
     
+    /* Tell a friend whether we are typing to it, changes are coalesced (PROFILE_TYPING_INTERVAL). */
+    bool setTyping(uint32_t friendNumber, bool isTyping);
+    
     uint32_t addFriend(const std::string& address, const std::string& message, size_t length);
-    uint32_t addFriendNoRequest(const uint8_t* pubKey);
+    int32_t addFriendNoRequest(const uint8_t* pubKey);
     bool removeFriend(uint32_t friendNumber);
     int getFriendByPublicKey(const uint8_t* pubKey);
     bool friendExists(uint32_t friendNumber);
     size_t friendListSize();
     
+    /* Add a node to bootstrap from, port is in host byte order. There is no DHT
+     * yet, bootstrap nodes tell us the address our packets come from so we can
+     * punch through NATs (NatTraversal.hpp).
+     */
     bool bootstrap(const std::string& address, uint16_t port, const uint8_t* pubKey);
     
+    /* Add a relay to reach friends through when UDP doesn't work, port is in host byte order. */
     bool addTcpRelay(const std::string& address, uint16_t port, const uint8_t* pubKey);
     
     void setNoSpam(uint32_t nospam);
@@ -214,9 +375,107 @@ public:
     
     uint32_t getIterationInterval();
     
+    /* return the port of our TCP relay (NodeConfiguration::tcpPort), 0 if we don't run one. */
+    uint16_t getTcpPort();
+    
+    /* return the pool of relay connections of the connection layer (addTcpRelay). */
+    TCPConnections* getTcpConnections();
+    
+    /* return the NAT traversal of the node, NULL without UDP or behind a proxy. */
+    NatTraversal* getNatTraversal();
+    
+    /* return the UDP crypto sessions of the node, NULL without UDP or behind a proxy. */
+    NetCrypto* getNetCrypto();
+    
+    /* return the thread safe front end of the node (NodeActor.hpp). Everything
+     * else must be called from the thread ticking the node.
+     */
+    NodeActor* getActor();
+    
     void tick();
     
+    /* Write what changed since the last load or save to NodeConfiguration::savePath,
+     * as a delta appended to the file. saveSnapshot() rewrites the whole file.
+     *
+     * return false if there is no savePath or the file couldn't be written.
+     */
+    bool save();
+    bool saveSnapshot();
+    
+    /* Connection layer entry points. */
+    void setFriendTransport(const FriendTransport* transport);
+    void handleFriendPacket(uint32_t friendNumber, const uint8_t* data, uint16_t length);
+    void setFriendConnectionStatus(uint32_t friendNumber, ConnectionType connectionStatus);
+    
+    /* Send a message to an online friend, messages sent in the same tick are packed
+     * into as few packets as possible. The read receipt callback is called with the
+     * returned id once the friend got it, receipts arrive in the order messages were sent.
+     *
+     * return the message id, or -1 on failure.
+     */
+    int64_t sendMessage(uint32_t friendNumber, MessageType type, const uint8_t* message, size_t length);
+    
+    /* Send the same message to every friend in friendNumbers, it is encoded once and
+     * the packets of all friends are handed to the connection layer together.
+     * messageIds, if not NULL, gets the id of the message for each friend (-1 if
+     * that friend couldn't be sent to).
+     *
+     * return the number of friends the message was queued for.
+     */
+    size_t broadcastMessage(const uint32_t* friendNumbers, size_t count, MessageType type, const uint8_t* message,
+                            size_t length, int64_t* messageIds);
+    
+    /* Lossy packets of the application, data[0] in the range of PACKET_ID_RANGE_LOSSY_START
+     * to PACKET_ID_RANGE_LOSSY_END. They are never resent nor acknowledged.
+     *
+     * One handler per packet ID for all friends, NULL to remove it. Packets read in
+     * the same poll are handed to it together, decrypted where they were read to.
+     *
+     * return false if the packet ID is out of the range, or the packet couldn't be sent.
+     */
+    bool setLossyPacketHandler(uint8_t packetId, PJLossyFramesCallback* cb, void* object);
+    bool sendLossyPacket(uint32_t friendNumber, const uint8_t* data, size_t length);
+    
+    /* File transfers. Files we send are numbered 0 to MAX_CONCURRENT_FILE_PIPES - 1,
+     * files we receive are numbered (n + 1) << 16.
+     *
+     * fileSend returns the file number, or -1 on failure.
+     */
+    int32_t fileSend(uint32_t friendNumber, uint32_t fileKind, uint64_t fileSize, const uint8_t* fileId,
+                     const uint8_t* filename, size_t filenameLength);
+    bool fileControl(uint32_t friendNumber, uint32_t fileNumber, FileControlType control);
+    bool fileSendChunk(uint32_t friendNumber, uint32_t fileNumber, uint64_t position, const uint8_t* data, size_t length);
+    
+    /* Send a file the library reads by itself, no chunk request callbacks are made
+     * for it except the final one of length 0. The file must not shrink while it is sent.
+     *
+     * fileSendPath opens path and closes it when the transfer ends, fileSendFd reads
+     * from fd, which stays owned by the caller and must stay open until then.
+     *
+     * return the file number, or -1 on failure.
+     */
+    int32_t fileSendPath(uint32_t friendNumber, uint32_t fileKind, const char* path, const uint8_t* fileId,
+                         const uint8_t* filename, size_t filenameLength);
+    int32_t fileSendFd(uint32_t friendNumber, uint32_t fileKind, int fd, const uint8_t* fileId,
+                       const uint8_t* filename, size_t filenameLength);
+    
+    /* Before accepting a file we receive, start it at position (a multiple of 1024)
+     * instead of 0.
+     */
+    bool fileSeek(uint32_t friendNumber, uint32_t fileNumber, uint64_t position);
+    bool fileGetFileId(uint32_t friendNumber, uint32_t fileNumber, uint8_t* fileId);
+    
+    /* Accept a file we receive and have the library write it to path, no chunk callbacks
+     * are made for it except the final one of length 0 once it is complete on disk.
+     *
+     * Progress is kept next to the file, receiving a file with the same id and size to
+     * the same path again only transfers what is missing. Any other file already at path
+     * is left alone and false returned, unless overwrite is set.
+     */
+    bool fileReceiveToPath(uint32_t friendNumber, uint32_t fileNumber, const char* path, bool overwrite);
+    
     // Callbacks
+    void setUserData(void* userData);
     void setLogCallback(PJLogCallback cb);
     void setConnectionStatusCallback(PJConnectionStatusCallback cb);
     void setFriendNameCallback(PJFriendNameCallback cb);
@@ -231,30 +490,117 @@ public:
     void setFileChunkRequestCallback(PJFileChunkRequestCallback cb);
     void setFileReceiveCallback(PJFileReceiveCallback cb);
     void setFileReceiveChunkCallback(PJFileReceiveChunkCallback cb);
+    
+    /* Post events to queue instead of making callbacks, for an application that
+     * handles them on a thread of its own. Every callback but the log callback
+     * becomes an event, setting one of them afterwards makes it a callback again.
+     * NULL goes back to callbacks, all of them unset.
+     */
+    void setEventQueue(EventQueue* queue);
+    EventQueue* getEventQueue();
 private:
-    NodeAddress* address;
+    friend class FileTransferEngine;
+    friend class MessageEngine;
+    friend class LanDiscovery;
+    friend class NatTraversal;
+    friend class NodeActor;
+    friend class Savedata;
+    
+    void init(NodeConfiguration* config, NetworkingCore* net);
+    Friend* getFriend(uint32_t friendNumber);
+    int64_t sendFriendPacket(uint32_t friendNumber, const uint8_t* data, uint16_t length, bool lossless);
+    int64_t sendFriendPacketParts(uint32_t friendNumber, const uint8_t* header, uint16_t headerLength,
+                                  const uint8_t* data, uint16_t length);
+    void sendFriendPackets(FriendPacket* packets, size_t count);
+    void profileChanged(uint32_t* fieldVersion);
+    void markProfileDirty(uint32_t friendNumber);
+    void sendProfiles();
+    void handleProfile(uint32_t friendNumber, Friend* f, const uint8_t* data, uint16_t length);
+    static bool acceptSession(void* object, const uint8_t* publicKey, IP_Port source);
+    static int64_t sessionSendLossless(void* object, uint32_t friendNumber, const uint8_t* data, uint16_t length);
+    static int64_t sessionSendLossy(void* object, uint32_t friendNumber, const uint8_t* data, uint16_t length);
+    static void sessionSendLosslessBatch(void* object, FriendPacket* packets, size_t count);
+    static int64_t sessionSendLossyParts(void* object, uint32_t friendNumber, const uint8_t* header, uint16_t headerLength,
+                                         const uint8_t* data, uint16_t length);
+    static void sessionReachable(void* object, uint32_t friendNumber, IP_Port ipPort);
+    static void sessionData(void* object, uint32_t connection, const uint8_t* data, uint16_t length);
+    static void sessionStatus(void* object, uint32_t connection, bool online);
+    static void sessionFrames(void* object, const struct NetCryptoFrame* frames, size_t count);
+    int sessionFriend(uint32_t connection);
+    void deliverLossy(LossyFrame* frames, size_t count);
+    
+    NodeAddress address;
+    uint8_t secretKey[PEERJET_KEY_LENGTH];
     NodeConfiguration* config;
+    NetworkingCore* net;
+    bool ownsNetworking;
     std::string name;
     std::string statusMessage;
-    std::vector<Friend*> friends;
+    std::vector<Friend*> friends; /* NULL for friends of the profile file not decoded yet, see getFriend */
+    std::vector<uint8_t> friendKeys; /* real_pk of every friend back to back, searched by getFriendByPublicKey */
     
     uint32_t nospam;
     UserStatusType status;
     
-    PJLogCallback logCallback;
-    PJConnectionStatusCallback connectionStatusCallback;
-    PJFriendNameCallback friendNameCallback;
-    PJFriendStatusMessageCallback friendStatusMessageCallback;
-    PJFriendStatusCallback friendStatusCallback;
-    PJFriendConnectionStatusCallback friendConnectionStatusCallback;
-    PJFriendTypingCallback friendTypingCallback;
-    PJFriendReadReceiptCallback friendReadReceiptCallback;
-    PJFriendRequestCallback friendRequestCallback;
-    PJFriendMessageCallback friendMessageCallback;
-    PJFileReceiveControlCallback fileReceiveControlCallback;
-    PJFileChunkRequestCallback fileChunkRequestCallback;
-    PJFileReceiveCallback fileReceiveCallback;
-    PJFileReceiveChunkCallback fileReceiveChunkCallback;
+    /* Every change to our profile bumps profileVersion and stamps the field with it,
+     * a friend is sent the fields stamped after its profile_version.
+     */
+    uint32_t profileVersion;
+    uint32_t nameVersion;
+    uint32_t statusMessageVersion;
+    uint32_t statusVersion;
+    bool profileChangePending;  /* changed since the last tick, the online friends are marked by tick() */
+    std::vector<uint32_t> profileDirty; /* online friends with profile_dirty set */
+    std::vector<FriendPacket> profilePackets;
+    std::vector<uint8_t> profileBuffer;
+    
+    /* Changes not in the profile file yet, friends changed have save_dirty set. */
+    bool selfSaveDirty;
+    std::vector<uint8_t> removedSinceSave; /* public keys of friends removed */
+    uint64_t saveEnd;           /* size of the file after our last load or save, 0 if none */
+    uint64_t saveSnapshotSize;
+    uint64_t saveLogSize;
+    struct SavedataKey* saveKey; /* derived once from savePassphrase, NULL for a profile in clear */
+    uint64_t saveChunks;        /* chunks of the encrypted file up to saveEnd */
+    struct SavedataProfile* saveProfile; /* records of the friends not decoded yet, NULL once all were */
+    bool saveBlocked;           /* the file at savePath couldn't be loaded */
+    
+    FriendTransport transport;
+    FileTransferEngine* fileTransfers;
+    MessageEngine* messages;
+    LanDiscovery* lanDiscovery; /* NULL unless NodeConfiguration::localDiscoveryEnabled */
+    NatTraversal* natTraversal; /* NULL without UDP or behind a proxy */
+    NetCrypto* netCrypto;       /* NULL without UDP or behind a proxy */
+    std::vector<int32_t> sessionFriends; /* friend number by NetCrypto connection, -1 for none */
+    std::vector<struct NetCryptoPacket> sessionPackets; /* a batch of sendFriendPackets, by connection */
+    
+    struct {
+        PJLossyFramesCallback* function;
+        void* object;
+    } lossyHandlers[PACKET_ID_RANGE_LOSSY_SIZE];
+    std::vector<LossyFrame> lossyFrames;
+    TCPServer* tcpServer;
+    TCPConnections* tcpConnections;
+    ProxyDatagrams* proxyDatagrams; /* UDP through a SOCKS5 proxy, NULL otherwise */
+    
+    EventQueue* eventQueue;
+    NodeActor* actor;
+    uint32_t friendsVersion; /* bumped when something NodeActor publishes of the friends changes */
+    void* userData;
+    PJLogCallback* logCallback;
+    PJConnectionStatusCallback* connectionStatusCallback;
+    PJFriendNameCallback* friendNameCallback;
+    PJFriendStatusMessageCallback* friendStatusMessageCallback;
+    PJFriendStatusCallback* friendStatusCallback;
+    PJFriendConnectionStatusCallback* friendConnectionStatusCallback;
+    PJFriendTypingCallback* friendTypingCallback;
+    PJFriendReadReceiptCallback* friendReadReceiptCallback;
+    PJFriendRequestCallback* friendRequestCallback;
+    PJFriendMessageCallback* friendMessageCallback;
+    PJFileReceiveControlCallback* fileReceiveControlCallback;
+    PJFileChunkRequestCallback* fileChunkRequestCallback;
+    PJFileReceiveCallback* fileReceiveCallback;
+    PJFileReceiveChunkCallback* fileReceiveChunkCallback;
 };
 
 
@@ -0,0 +1,405 @@
+//
+//  NodeActor.cpp
+//  PeerJet
+//
+//  Created by Compy on 12/18/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <string.h>
+#include "Crypto.hpp"
+#include "NodeActor.hpp"
+#include "Savedata.hpp"
+
+NodeActor::NodeActor(Node* node)
+    : node(node), commands(NULL), current(NULL), epoch(0)
+{
+    this->readers[0] = 0;
+    this->readers[1] = 0;
+    memset(&this->stats, 0, sizeof(this->stats));
+    publish();
+}
+
+/* Nothing may use the actor anymore. */
+NodeActor::~NodeActor()
+{
+    NodeCommand *command = this->commands.exchange(NULL);
+
+    while (command) {
+        NodeCommand *next = command->next;
+        delete command;
+        command = next;
+    }
+
+    for (size_t i = 0; i < this->retired.size(); ++i)
+        destroy(this->retired[i].snapshot);
+
+    destroy(this->current.load());
+}
+
+void NodeActor::destroy(const NodeSnapshot* snapshot)
+{
+    if (--snapshot->friendList->snapshots == 0)
+        delete snapshot->friendList;
+
+    delete snapshot;
+}
+
+NodeCommand* NodeActor::newCommand(NodeCommandType type)
+{
+    NodeCommand *command = new NodeCommand();
+    command->next = NULL;
+    command->type = (uint8_t)type;
+    command->value = 0;
+    command->function = NULL;
+    command->object = NULL;
+    return command;
+}
+
+void NodeActor::push(NodeCommand* command)
+{
+    NodeCommand *first = this->commands.load(std::memory_order_relaxed);
+
+    do {
+        command->next = first;
+    } while (!this->commands.compare_exchange_weak(first, command, std::memory_order_release,
+                                                   std::memory_order_relaxed));
+}
+
+bool NodeActor::setName(const std::string& name)
+{
+    if (name.size() > MAX_NAME_LENGTH)
+        return false;
+
+    NodeCommand *command = newCommand(NODE_COMMAND_SET_NAME);
+    command->text = name;
+    push(command);
+    return true;
+}
+
+bool NodeActor::setStatusMessage(const std::string& statusMessage)
+{
+    if (statusMessage.size() > MAX_STATUSMESSAGE_LENGTH)
+        return false;
+
+    NodeCommand *command = newCommand(NODE_COMMAND_SET_STATUS_MESSAGE);
+    command->text = statusMessage;
+    push(command);
+    return true;
+}
+
+bool NodeActor::setStatus(UserStatusType status)
+{
+    if (status > USER_STATUS_BUSY)
+        return false;
+
+    NodeCommand *command = newCommand(NODE_COMMAND_SET_STATUS);
+    command->value = (uint8_t)status;
+    push(command);
+    return true;
+}
+
+bool NodeActor::setTyping(const uint8_t* publicKey, bool isTyping)
+{
+    NodeCommand *command = newCommand(NODE_COMMAND_SET_TYPING);
+    memcpy(command->publicKey, publicKey, PEERJET_KEY_LENGTH);
+    command->value = isTyping;
+    push(command);
+    return true;
+}
+
+bool NodeActor::addFriendNoRequest(const uint8_t* publicKey)
+{
+    if (!Crypto::isPublicKeyValid(publicKey))
+        return false;
+
+    NodeCommand *command = newCommand(NODE_COMMAND_ADD_FRIEND_NO_REQUEST);
+    memcpy(command->publicKey, publicKey, PEERJET_KEY_LENGTH);
+    push(command);
+    return true;
+}
+
+bool NodeActor::removeFriend(const uint8_t* publicKey)
+{
+    NodeCommand *command = newCommand(NODE_COMMAND_REMOVE_FRIEND);
+    memcpy(command->publicKey, publicKey, PEERJET_KEY_LENGTH);
+    push(command);
+    return true;
+}
+
+bool NodeActor::run(PJNodeCommandFunction* function, void* object)
+{
+    if (!function)
+        return false;
+
+    NodeCommand *command = newCommand(NODE_COMMAND_RUN);
+    command->function = function;
+    command->object = object;
+    push(command);
+    return true;
+}
+
+/* Take every command at once, the list is newest first. */
+void NodeActor::apply()
+{
+    NodeCommand *command = this->commands.exchange(NULL, std::memory_order_acquire);
+
+    if (!command)
+        return;
+
+    this->batch.clear();
+
+    for (; command; command = command->next)
+        this->batch.push_back(command);
+
+    for (size_t i = this->batch.size(); i > 0; --i) {
+        command = this->batch[i - 1];
+        int friendNumber;
+
+        switch (command->type) {
+            case NODE_COMMAND_SET_NAME:
+                this->node->setName(command->text);
+                break;
+
+            case NODE_COMMAND_SET_STATUS_MESSAGE:
+                this->node->setStatusMessage(command->text);
+                break;
+
+            case NODE_COMMAND_SET_STATUS:
+                this->node->setStatus((UserStatusType)command->value);
+                break;
+
+            case NODE_COMMAND_SET_TYPING:
+                friendNumber = this->node->getFriendByPublicKey(command->publicKey);
+
+                if (friendNumber != -1)
+                    this->node->setTyping((uint32_t)friendNumber, command->value != 0);
+                break;
+
+            case NODE_COMMAND_ADD_FRIEND_NO_REQUEST:
+                this->node->addFriendNoRequest(command->publicKey);
+                break;
+
+            case NODE_COMMAND_REMOVE_FRIEND:
+                friendNumber = this->node->getFriendByPublicKey(command->publicKey);
+
+                if (friendNumber != -1)
+                    this->node->removeFriend((uint32_t)friendNumber);
+                break;
+
+            case NODE_COMMAND_RUN:
+                command->function(this->node, command->object);
+                break;
+        }
+
+        delete command;
+    }
+
+    this->stats.applied += this->batch.size();
+    ++this->stats.batches;
+
+    if (this->batch.size() > this->stats.maxBatch)
+        this->stats.maxBatch = (uint32_t)this->batch.size();
+}
+
+/* Copy what readers may ask for if the node changed since the last snapshot. */
+void NodeActor::publish()
+{
+    const NodeSnapshot *last = this->current.load(std::memory_order_relaxed);
+
+    if (last && last->version == this->node->profileVersion
+        && last->friendList->version == this->node->friendsVersion) {
+        reclaim();
+        return;
+    }
+
+    NodeSnapshot *snapshot = new NodeSnapshot();
+    snapshot->name = this->node->name;
+    snapshot->statusMessage = this->node->statusMessage;
+    snapshot->status = this->node->status;
+    snapshot->version = this->node->profileVersion;
+
+    if (last && last->friendList->version == this->node->friendsVersion) {
+        snapshot->friendList = last->friendList;
+        ++last->friendList->snapshots;
+    } else {
+        snapshot->friendList = newFriendList();
+    }
+
+    /* Readers that got the last one hold it until they are done. */
+    this->current.store(snapshot);
+    ++this->stats.snapshots;
+
+    if (last) {
+        Retired r;
+        r.snapshot = last;
+        r.drained[0] = r.drained[1] = false;
+        this->retired.push_back(r);
+    }
+
+    reclaim();
+}
+
+const FriendListSnapshot* NodeActor::newFriendList()
+{
+    FriendListSnapshot *friendList = new FriendListSnapshot();
+    friendList->version = this->node->friendsVersion;
+    friendList->snapshots = 1;
+    friendList->friends.resize(this->node->friends.size());
+    Friend *scratch = NULL;
+
+    for (size_t i = 0; i < this->node->friends.size(); ++i) {
+        const Friend *f = this->node->friends[i];
+
+        /* Read from the profile file, without decoding the friend for good. */
+        if (!f) {
+            if (!scratch)
+                scratch = new Friend();
+
+            f = Savedata::peekFriend(this->node, (uint32_t)i, scratch);
+        }
+
+        FriendSnapshot *s = &friendList->friends[i];
+        memcpy(s->publicKey, f->real_pk, PEERJET_KEY_LENGTH);
+        s->name.assign((const char *)f->name, f->name_length);
+        s->statusMessage.assign((const char *)f->statusmessage, f->statusmessage_length);
+        s->status = f->userstatus;
+        s->connectionStatus = f->status == 4 ? (ConnectionType)f->last_connection_udp_tcp : CONNECTION_TYPE_NONE;
+        s->lastOnline = f->last_seen_time;
+    }
+
+    delete scratch;
+
+    return friendList;
+}
+
+/* A reader that got a snapshot counted itself in before it loaded it, so once
+ * its counter is seen at zero after the snapshot was replaced it is done with it.
+ */
+void NodeActor::reclaim()
+{
+    if (this->retired.empty())
+        return;
+
+    bool drained[2] = {this->readers[0].load() == 0, this->readers[1].load() == 0};
+    size_t kept = 0;
+
+    for (size_t i = 0; i < this->retired.size(); ++i) {
+        Retired r = this->retired[i];
+        r.drained[0] = r.drained[0] || drained[0];
+        r.drained[1] = r.drained[1] || drained[1];
+
+        if (r.drained[0] && r.drained[1])
+            destroy(r.snapshot);
+        else
+            this->retired[kept++] = r;
+    }
+
+    this->retired.resize(kept);
+
+    /* New readers go to the other counter, the busy one drains. */
+    if (kept)
+        this->epoch.fetch_add(1);
+}
+
+const NodeSnapshot* NodeActor::acquire(uint32_t* counter)
+{
+    *counter = this->epoch.load() & 1;
+    this->readers[*counter].fetch_add(1);
+    return this->current.load();
+}
+
+void NodeActor::release(uint32_t counter)
+{
+    this->readers[counter].fetch_sub(1);
+}
+
+void NodeActor::read(void (*function)(const NodeSnapshot* snapshot, void* object), void* object)
+{
+    uint32_t counter;
+    function(acquire(&counter), object);
+    release(counter);
+}
+
+const std::string NodeActor::getName()
+{
+    uint32_t counter;
+    std::string name = acquire(&counter)->name;
+    release(counter);
+    return name;
+}
+
+const std::string NodeActor::getStatusMessage()
+{
+    uint32_t counter;
+    std::string statusMessage = acquire(&counter)->statusMessage;
+    release(counter);
+    return statusMessage;
+}
+
+UserStatusType NodeActor::getStatus()
+{
+    uint32_t counter;
+    UserStatusType status = acquire(&counter)->status;
+    release(counter);
+    return status;
+}
+
+size_t NodeActor::friendListSize()
+{
+    uint32_t counter;
+    size_t size = acquire(&counter)->friendList->friends.size();
+    release(counter);
+    return size;
+}
+
+/* return the friend number in the last snapshot, -1 if it isn't a friend. */
+int NodeActor::getFriendByPublicKey(const uint8_t* publicKey)
+{
+    uint32_t counter;
+    const NodeSnapshot *snapshot = acquire(&counter);
+    int friendNumber = -1;
+
+    for (size_t i = 0; i < snapshot->friendList->friends.size(); ++i) {
+        if (Crypto::comparePublicKeys(snapshot->friendList->friends[i].publicKey, publicKey) == 0) {
+            friendNumber = (int)i;
+            break;
+        }
+    }
+
+    release(counter);
+    return friendNumber;
+}
+
+const std::string NodeActor::getFriendName(uint32_t friendNumber)
+{
+    uint32_t counter;
+    const NodeSnapshot *snapshot = acquire(&counter);
+    std::string name;
+
+    if (friendNumber < snapshot->friendList->friends.size())
+        name = snapshot->friendList->friends[friendNumber].name;
+
+    release(counter);
+    return name;
+}
+
+bool NodeActor::getFriend(uint32_t friendNumber, FriendSnapshot* friendSnapshot)
+{
+    uint32_t counter;
+    const NodeSnapshot *snapshot = acquire(&counter);
+    bool found = friendNumber < snapshot->friendList->friends.size();
+
+    if (found)
+        *friendSnapshot = snapshot->friendList->friends[friendNumber];
+
+    release(counter);
+    return found;
+}
+
+NodeActorStats NodeActor::getStats()
+{
+    NodeActorStats stats = this->stats;
+    stats.retired = (uint32_t)this->retired.size();
+    return stats;
+}
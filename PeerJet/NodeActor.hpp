@@ -0,0 +1,148 @@
+//
+//  NodeActor.hpp
+//  PeerJet
+//
+//  Created by Compy on 12/18/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef NodeActor_hpp
+#define NodeActor_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Node.hpp"
+
+typedef enum {
+    NODE_COMMAND_SET_NAME,
+    NODE_COMMAND_SET_STATUS_MESSAGE,
+    NODE_COMMAND_SET_STATUS,
+    NODE_COMMAND_SET_TYPING,
+    NODE_COMMAND_ADD_FRIEND_NO_REQUEST,
+    NODE_COMMAND_REMOVE_FRIEND,
+    NODE_COMMAND_RUN
+} NodeCommandType;
+
+typedef void PJNodeCommandFunction(Node* node, void* object);
+
+/* A call made on another thread, waiting for the next tick. */
+struct NodeCommand {
+    NodeCommand *next;
+    uint8_t type;           /* NodeCommandType */
+    uint8_t value;
+    uint8_t publicKey[PEERJET_KEY_LENGTH];
+    std::string text;
+    PJNodeCommandFunction *function;
+    void *object;
+};
+
+typedef struct {
+    uint8_t publicKey[PEERJET_KEY_LENGTH];
+    std::string name;
+    std::string statusMessage;
+    UserStatusType status;
+    ConnectionType connectionStatus;
+    uint64_t lastOnline;
+} FriendSnapshot;
+
+typedef struct {
+    std::vector<FriendSnapshot> friends;    /* by friend number */
+    uint32_t version;                       /* Node::friendsVersion */
+    mutable uint32_t snapshots;             /* sharing it, network thread only */
+} FriendListSnapshot;
+
+/* The state of the node as of one tick, never changed once published. A change
+ * to our profile alone shares the friend list of the last snapshot.
+ */
+typedef struct {
+    std::string name;
+    std::string statusMessage;
+    UserStatusType status;
+    uint32_t version;                       /* Node::profileVersion */
+    const FriendListSnapshot *friendList;
+} NodeSnapshot;
+
+typedef struct {
+    uint64_t applied;       /* commands */
+    uint64_t batches;       /* ticks that applied commands */
+    uint32_t maxBatch;
+    uint64_t snapshots;     /* published */
+    uint32_t retired;       /* snapshots replaced but maybe still read */
+} NodeActorStats;
+
+/* Thread safe front end of a node (Node::getActor).
+ *
+ * Calls from any thread become commands pushed on a lock-free multiple producer
+ * list, the node applies all of them at the start of its next tick, in the order
+ * they were made. Friends are named by public key since friend numbers may move
+ * before the command is applied.
+ *
+ * Reads come from a snapshot published at the end of any tick that changed
+ * something (RCU): readers count themselves in and out of one of two counters
+ * and never wait, the network thread never waits for them either. A snapshot
+ * replaced is freed once both counters were seen at zero after it, the counter
+ * new readers use is flipped until then so the other one drains.
+ */
+class NodeActor {
+public:
+    explicit NodeActor(Node* node);
+    ~NodeActor();
+
+    /* Any thread. return false if the arguments are invalid, nothing is queued then. */
+    bool setName(const std::string& name);
+    bool setStatusMessage(const std::string& statusMessage);
+    bool setStatus(UserStatusType status);
+    bool setTyping(const uint8_t* publicKey, bool isTyping);
+    bool addFriendNoRequest(const uint8_t* publicKey);
+    bool removeFriend(const uint8_t* publicKey);
+
+    /* Any thread. Call function(node, object) on the thread ticking the node, for
+     * the rest of its API.
+     */
+    bool run(PJNodeCommandFunction* function, void* object);
+
+    /* Any thread, from the last snapshot. */
+    const std::string getName();
+    const std::string getStatusMessage();
+    UserStatusType getStatus();
+    size_t friendListSize();
+    int getFriendByPublicKey(const uint8_t* publicKey);
+    const std::string getFriendName(uint32_t friendNumber);
+    bool getFriend(uint32_t friendNumber, FriendSnapshot* snapshot);
+
+    /* Any thread. Call function with the last snapshot, valid until it returns. */
+    void read(void (*function)(const NodeSnapshot* snapshot, void* object), void* object);
+
+    /* Thread ticking the node, called by Node::tick. */
+    void apply();
+    void publish();
+    NodeActorStats getStats();
+
+private:
+    NodeCommand* newCommand(NodeCommandType type);
+    void push(NodeCommand* command);
+    const NodeSnapshot* acquire(uint32_t* counter);
+    void release(uint32_t counter);
+    void reclaim();
+    void destroy(const NodeSnapshot* snapshot);
+    const FriendListSnapshot* newFriendList();
+
+    Node* node;
+    std::atomic<NodeCommand*> commands;     /* newest first */
+    std::vector<NodeCommand*> batch;
+
+    std::atomic<const NodeSnapshot*> current;
+    std::atomic<uint32_t> epoch;            /* its low bit is the counter new readers use */
+    std::atomic<uint32_t> readers[2];
+
+    struct Retired {
+        const NodeSnapshot *snapshot;
+        bool drained[2];    /* the counter was seen at zero since it was replaced */
+    };
+    std::vector<Retired> retired;
+    NodeActorStats stats;
+};
+
+#endif /* NodeActor_hpp */
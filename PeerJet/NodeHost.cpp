@@ -0,0 +1,257 @@
+//
+//  NodeHost.cpp
+//  PeerJet
+//
+//  Created by Compy on 12/18/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <string.h>
+#include "Crypto.hpp"
+#include "NetCrypto.hpp"
+#include "NodeHost.hpp"
+
+/* The packets the host reads for its nodes. */
+static const uint8_t hostedPackets[] = {
+    NET_PACKET_COOKIE_REQUEST, NET_PACKET_COOKIE_RESPONSE, NET_PACKET_CRYPTO_HS, NET_PACKET_CRYPTO_DATA,
+    NET_PACKET_CRYPTO, NET_PACKET_LAN_DISCOVERY, NET_PACKET_REFLECT_REQUEST, NET_PACKET_REFLECT_RESPONSE
+};
+
+NodeHost::NodeHost(NetworkingCore* net)
+    : net(net), count(0)
+{
+    memset(&this->stats, 0, sizeof(this->stats));
+    this->tenants.resize(1);
+    this->tenants[0].node = NULL;
+    this->tenants[0].net = NULL;
+
+    for (size_t i = 0; i < sizeof(hostedPackets); ++i)
+        NetworkService::registerHandler(net, hostedPackets[i], &NodeHost::handlePacket, this);
+}
+
+NodeHost::~NodeHost()
+{
+    for (size_t i = 0; i < sizeof(hostedPackets); ++i)
+        NetworkService::registerHandler(this->net, hostedPackets[i], NULL, NULL);
+
+    for (size_t i = 1; i < this->tenants.size(); ++i) {
+        delete this->tenants[i].node;
+        NetworkService::killNetworking(this->tenants[i].net);
+    }
+}
+
+int NodeHost::send(void* object, IP_Port ipPort, const uint8_t* data, uint16_t length)
+{
+    NodeHost *host = (NodeHost *)object;
+    return NetworkService::sendPacket(host->net, ipPort, data, length);
+}
+
+/* Packets are handed to the nodes by the host, nothing waits in their cores. */
+int NodeHost::receive(void* object, IP_Port* ipPort, uint8_t* data, uint32_t* length)
+{
+    return -1;
+}
+
+Node* NodeHost::addNode(NodeConfiguration* config)
+{
+    if (this->count >= NODE_HOST_MAX_NODES || config->proxyType != PROXY_TYPE_NONE)
+        return NULL;
+
+    NetworkTransport transport;
+    transport.send = &NodeHost::send;
+    transport.recv = &NodeHost::receive;
+    transport.object = this;
+
+    IP ip;
+    NetworkService::ipInit(&ip, this->net->family == AF_INET6);
+    NetworkingCore *net = NetworkService::newVirtualNetworking(ip, ntohs(this->net->port), &transport);
+
+    if (!net)
+        return NULL;
+
+    Node *node = new Node(config, net);
+
+    if (findTag(*node->getAddress())) {
+        delete node;
+        NetworkService::killNetworking(net);
+        return NULL;
+    }
+
+    uint16_t tag;
+
+    if (!this->freeTags.empty()) {
+        tag = this->freeTags.back();
+        this->freeTags.pop_back();
+    } else {
+        tag = (uint16_t)this->tenants.size();
+        this->tenants.push_back(Tenant());
+    }
+
+    this->tenants[tag].node = node;
+    this->tenants[tag].net = net;
+    ++this->count;
+
+    if (node->getNetCrypto())
+        node->getNetCrypto()->setRouteTag(tag);
+
+    if (this->table.size() < (size_t)this->count * 2)
+        rebuildTable(this->table.empty() ? 64 : this->table.size() * 2);
+    else
+        insertKey(tag);
+
+    return node;
+}
+
+bool NodeHost::removeNode(Node* node)
+{
+    uint16_t tag = findTag(*node->getAddress());
+
+    if (!tag || this->tenants[tag].node != node)
+        return false;
+
+    delete node;
+    NetworkService::killNetworking(this->tenants[tag].net);
+    this->tenants[tag].node = NULL;
+    this->tenants[tag].net = NULL;
+    this->freeTags.push_back(tag);
+    --this->count;
+    rebuildTable(this->table.size());
+    return true;
+}
+
+Node* NodeHost::getNode(const uint8_t* publicKey)
+{
+    return this->tenants[findTag(publicKey)].node;
+}
+
+size_t NodeHost::size()
+{
+    return this->count;
+}
+
+/* Public keys are random, their first bytes are a hash already. */
+static size_t keySlot(const uint8_t* publicKey, size_t mask)
+{
+    uint32_t hash;
+    memcpy(&hash, publicKey, sizeof(hash));
+    return hash & mask;
+}
+
+/* return the route tag of the node with publicKey, 0 if none. */
+uint16_t NodeHost::findTag(const uint8_t* publicKey)
+{
+    if (this->table.empty())
+        return 0;
+
+    size_t mask = this->table.size() - 1;
+
+    for (size_t slot = keySlot(publicKey, mask); this->table[slot]; slot = (slot + 1) & mask) {
+        uint16_t tag = this->table[slot];
+
+        if (Crypto::comparePublicKeys(*this->tenants[tag].node->getAddress(), publicKey) == 0)
+            return tag;
+    }
+
+    return 0;
+}
+
+void NodeHost::insertKey(uint16_t tag)
+{
+    size_t mask = this->table.size() - 1;
+    size_t slot = keySlot(*this->tenants[tag].node->getAddress(), mask);
+
+    while (this->table[slot])
+        slot = (slot + 1) & mask;
+
+    this->table[slot] = tag;
+}
+
+void NodeHost::rebuildTable(size_t capacity)
+{
+    this->table.assign(capacity, 0);
+
+    for (size_t tag = 1; tag < this->tenants.size(); ++tag) {
+        if (this->tenants[tag].node)
+            insertKey((uint16_t)tag);
+    }
+}
+
+int NodeHost::deliver(uint16_t tag, IP_Port source, const uint8_t* data, uint16_t length)
+{
+    if (tag >= this->tenants.size() || !this->tenants[tag].node) {
+        ++this->stats.dropped;
+        return 1;
+    }
+
+    PacketHandlers *handler = &this->tenants[tag].net->packethandlers[data[0]];
+
+    if (!handler->function) {
+        ++this->stats.dropped;
+        return 1;
+    }
+
+    ++this->stats.routed;
+    return handler->function(handler->object, source, data, length);
+}
+
+int NodeHost::handlePacket(void* object, IP_Port source, const uint8_t* data, uint16_t length)
+{
+    NodeHost *host = (NodeHost *)object;
+    uint16_t tag;
+
+    switch (data[0]) {
+        case NET_PACKET_COOKIE_REQUEST: {
+            const uint8_t *receiver = NetCrypto::getReceiver(data, length);
+            return host->deliver(receiver ? host->findTag(receiver) : 0, source, data, length);
+        }
+
+        case NET_PACKET_COOKIE_RESPONSE:
+        case NET_PACKET_CRYPTO_HS:
+        case NET_PACKET_CRYPTO_DATA:
+            return host->deliver(NetCrypto::getRouteTag(data, length, &tag) ? tag : 0, source, data, length);
+
+        /* [id][receiver's public key][sender's public key]... */
+        case NET_PACKET_CRYPTO:
+            return host->deliver(length > 1 + crypto_box_PUBLICKEYBYTES ? host->findTag(data + 1) : 0, source, data,
+                                 length);
+
+        /* Anyone of us answers with the same address. */
+        case NET_PACKET_REFLECT_REQUEST:
+            for (size_t i = 1; i < host->tenants.size(); ++i) {
+                if (host->tenants[i].node && host->tenants[i].net->packethandlers[data[0]].function)
+                    return host->deliver((uint16_t)i, source, data, length);
+            }
+
+            ++host->stats.dropped;
+            return 1;
+
+        default:
+            ++host->stats.broadcast;
+
+            for (size_t i = 1; i < host->tenants.size(); ++i) {
+                PacketHandlers *handler = host->tenants[i].node ? &host->tenants[i].net->packethandlers[data[0]] : NULL;
+
+                if (handler && handler->function)
+                    handler->function(handler->object, source, data, length);
+            }
+
+            return 0;
+    }
+}
+
+void NodeHost::tick()
+{
+    NetworkService::poll(this->net);
+
+    for (size_t i = 1; i < this->tenants.size(); ++i) {
+        if (this->tenants[i].node)
+            this->tenants[i].node->tick();
+    }
+}
+
+NodeHostStats NodeHost::getStats()
+{
+    NodeHostStats stats = this->stats;
+    stats.nodes = this->count;
+    return stats;
+}
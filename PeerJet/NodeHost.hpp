@@ -0,0 +1,91 @@
+//
+//  NodeHost.hpp
+//  PeerJet
+//
+//  Created by Compy on 12/18/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef NodeHost_hpp
+#define NodeHost_hpp
+
+#include <cstdint>
+#include <vector>
+#include "Node.hpp"
+
+/* Identities a host can hold, one route tag each (NetCrypto::setRouteTag), 0 is not used. */
+#define NODE_HOST_MAX_NODES     UINT16_MAX
+
+typedef struct {
+    uint32_t nodes;
+    uint64_t routed;        /* packets handed to the one node they are for */
+    uint64_t broadcast;     /* packets handed to every node */
+    uint64_t dropped;       /* for no node we have */
+} NodeHostStats;
+
+/* Many identities behind one socket.
+ *
+ * Every node of the host runs on a virtual networking core sending through the
+ * shared one, nothing is read from it: the host polls the shared socket and
+ * hands each packet to the node it is for. Crypto requests (Crypto::createRequest)
+ * and cookie requests name the receiver's public key, found in a table of the
+ * nodes by key. Cookie responses, handshakes and data packets of sessions carry
+ * the route tag the host gave the node. LAN discovery and reflection responses
+ * go to every node, a reflection request to the first one.
+ *
+ * An identity costs its node: its keys, friends and what they use. Nodes are
+ * ticked one after the other by tick(), on the thread of the host.
+ */
+class NodeHost {
+public:
+    /* Host on top of net, owned by the caller. */
+    explicit NodeHost(NetworkingCore* net);
+    ~NodeHost();
+
+    /* Add an identity, a new one or the one at config->savePath. config must
+     * stay valid as long as the node and name no proxy, udpEnabled and the port
+     * range are those of the host.
+     *
+     * return the node, NULL if the host is full or has the identity already.
+     */
+    Node* addNode(NodeConfiguration* config);
+    bool removeNode(Node* node);
+
+    /* return the node with publicKey, NULL if it isn't ours. */
+    Node* getNode(const uint8_t* publicKey);
+    size_t size();
+
+    /* Read everything waiting on the shared socket and tick every node. */
+    void tick();
+
+    NodeHostStats getStats();
+
+private:
+    struct Tenant {
+        Node *node;             /* NULL for a free tag */
+        NetworkingCore *net;    /* its virtual core */
+    };
+
+    static int send(void* object, IP_Port ipPort, const uint8_t* data, uint16_t length);
+    static int receive(void* object, IP_Port* ipPort, uint8_t* data, uint32_t* length);
+    static int handlePacket(void* object, IP_Port source, const uint8_t* data, uint16_t length);
+
+    int deliver(uint16_t tag, IP_Port source, const uint8_t* data, uint16_t length);
+    uint16_t findTag(const uint8_t* publicKey);
+    void insertKey(uint16_t tag);
+    void rebuildTable(size_t capacity);
+
+    NetworkingCore* net;
+    std::vector<Tenant> tenants;            /* by route tag */
+    std::vector<uint16_t> freeTags;
+    uint32_t count;
+
+    /* Route tags by public key, open addressing with linear probing, 0 for empty
+     * slots. Never more than half full, rebuilt when a node is removed.
+     */
+    std::vector<uint16_t> table;
+
+    NodeHostStats stats;
+};
+
+#endif /* NodeHost_hpp */
@@ -0,0 +1,531 @@
+//
+//  Proxy.cpp
+//  PeerJet
+//
+//  Created by Compy on 12/11/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <algorithm>
+#include "Proxy.hpp"
+
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined(WIN32)
+#include <poll.h>
+#define PROXY_DATAGRAMS_SUPPORTED
+#endif
+
+#define SOCKS5_VERSION              5
+#define SOCKS5_AUTH_NONE            0
+#define SOCKS5_ADDRESS_IPV4         1
+#define SOCKS5_ADDRESS_DOMAIN       3
+#define SOCKS5_ADDRESS_IPV6         4
+
+/* ms an association has to come up before we start over. */
+#define PROXY_ASSOCIATE_TIMEOUT     10000
+
+/* ms between checks that the proxy still holds the association. */
+#define PROXY_CHECK_INTERVAL        1000
+
+#define PROXY_RETRY_MINIMUM         1000    /* ms */
+#define PROXY_RETRY_MAXIMUM         60000   /* ms */
+
+typedef enum {
+    PROXY_STEP_HTTP_REPLY,      /* CONNECT sent, waiting for the status line and headers */
+    PROXY_STEP_SOCKS5_METHOD,   /* greeting sent, waiting for the chosen method */
+    PROXY_STEP_SOCKS5_REPLY,    /* request sent, waiting for the reply */
+    PROXY_STEP_DONE
+} ProxyStep;
+
+typedef enum {
+    PROXY_DATAGRAMS_SLEEPING,
+    PROXY_DATAGRAMS_CONNECTING,
+    PROXY_DATAGRAMS_NEGOTIATING,
+    PROXY_DATAGRAMS_ASSOCIATED
+} ProxyDatagramsStatus;
+
+/* return the length of the SOCKS5 address (type, address, port) written to out, -1 if ipPort isn't IPv4 or IPv6. */
+static int writeSocksAddress(IP_Port ipPort, uint8_t *out)
+{
+    if (ipPort.ip.family == AF_INET) {
+        out[0] = SOCKS5_ADDRESS_IPV4;
+        memcpy(out + 1, &ipPort.ip.ip4, SIZE_IP4);
+        memcpy(out + 1 + SIZE_IP4, &ipPort.port, SIZE_PORT);
+        return 1 + SIZE_IP4 + SIZE_PORT;
+    }
+
+    if (ipPort.ip.family == AF_INET6) {
+        out[0] = SOCKS5_ADDRESS_IPV6;
+        memcpy(out + 1, &ipPort.ip.ip6, SIZE_IP6);
+        memcpy(out + 1 + SIZE_IP6, &ipPort.port, SIZE_PORT);
+        return 1 + SIZE_IP6 + SIZE_PORT;
+    }
+
+    return -1;
+}
+
+/* Parse a SOCKS5 address, domain names give an unset IP.
+ *
+ * return its length, 0 if more data is needed, -1 if it is invalid.
+ */
+static int readSocksAddress(const uint8_t *data, size_t length, IP_Port *ipPort)
+{
+    size_t size;
+
+    if (length < 2)
+        return 0;
+
+    NetworkService::ipReset(&ipPort->ip);
+
+    switch (data[0]) {
+        case SOCKS5_ADDRESS_IPV4:
+            size = 1 + SIZE_IP4 + SIZE_PORT;
+
+            if (length >= size) {
+                ipPort->ip.family = AF_INET;
+                memcpy(&ipPort->ip.ip4, data + 1, SIZE_IP4);
+            }
+            break;
+
+        case SOCKS5_ADDRESS_IPV6:
+            size = 1 + SIZE_IP6 + SIZE_PORT;
+
+            if (length >= size) {
+                ipPort->ip.family = AF_INET6;
+                memcpy(&ipPort->ip.ip6, data + 1, SIZE_IP6);
+            }
+            break;
+
+        case SOCKS5_ADDRESS_DOMAIN:
+            size = 2 + data[1] + SIZE_PORT;
+            break;
+
+        default:
+            return -1;
+    }
+
+    if (length < size)
+        return 0;
+
+    memcpy(&ipPort->port, data + size - SIZE_PORT, SIZE_PORT);
+    return (int)size;
+}
+
+int Proxy::start(struct ProxyHandshake* handshake, ProxyType type, IP_Port target, uint8_t command,
+                 uint8_t* out, size_t size)
+{
+    memset(handshake, 0, sizeof(*handshake));
+    handshake->type = type;
+    handshake->command = command;
+    handshake->target = target;
+
+    if (type == PROXY_TYPE_HTTP) {
+        char address[INET6_ADDRSTRLEN];
+
+        if (command != SOCKS5_COMMAND_CONNECT || !NetworkService::ipParseAddr(&target.ip, address, sizeof(address)))
+            return -1;
+
+        const char *format = target.ip.family == AF_INET6 ? "CONNECT [%s]:%u HTTP/1.1\r\nHost: [%s]:%u\r\n\r\n"
+                                                          : "CONNECT %s:%u HTTP/1.1\r\nHost: %s:%u\r\n\r\n";
+        int length = snprintf((char *)out, size, format, address, ntohs(target.port), address, ntohs(target.port));
+
+        if (length < 0 || (size_t)length >= size)
+            return -1;
+
+        handshake->step = PROXY_STEP_HTTP_REPLY;
+        return length;
+    }
+
+    if (type == PROXY_TYPE_SOCKS5) {
+        if (size < 3)
+            return -1;
+
+        out[0] = SOCKS5_VERSION;
+        out[1] = 1;
+        out[2] = SOCKS5_AUTH_NONE;
+        handshake->step = PROXY_STEP_SOCKS5_METHOD;
+        return 3;
+    }
+
+    return -1;
+}
+
+int Proxy::handle(struct ProxyHandshake* handshake, const uint8_t* data, size_t length, size_t* consumed,
+                  uint8_t* out, size_t size, size_t* outLength)
+{
+    *consumed = 0;
+    *outLength = 0;
+
+    for (;;) {
+        const uint8_t *reply = data + *consumed;
+        size_t available = length - *consumed;
+
+        switch (handshake->step) {
+            case PROXY_STEP_HTTP_REPLY: {
+                static const uint8_t end[] = {'\r', '\n', '\r', '\n'};
+                const uint8_t *found = std::search(reply, reply + std::min<size_t>(available, PROXY_MAX_REPLY_SIZE),
+                                                   end, end + sizeof(end));
+
+                if (found == reply + std::min<size_t>(available, PROXY_MAX_REPLY_SIZE))
+                    return available >= PROXY_MAX_REPLY_SIZE ? -1 : 0;
+
+                /* "HTTP/1.x 200 ..." */
+                if (found - reply < 12 || memcmp(reply, "HTTP/1.", 7) != 0 || reply[8] != ' '
+                    || memcmp(reply + 9, "200", 3) != 0)
+                    return -1;
+
+                *consumed += (size_t)(found - reply) + sizeof(end);
+                handshake->step = PROXY_STEP_DONE;
+                return 1;
+            }
+
+            case PROXY_STEP_SOCKS5_METHOD: {
+                if (available < 2)
+                    return 0;
+
+                if (reply[0] != SOCKS5_VERSION || reply[1] != SOCKS5_AUTH_NONE || size < 3 + 1 + SIZE_IP6 + SIZE_PORT)
+                    return -1;
+
+                out[0] = SOCKS5_VERSION;
+                out[1] = handshake->command;
+                out[2] = 0;
+                int address = writeSocksAddress(handshake->target, out + 3);
+
+                if (address == -1)
+                    return -1;
+
+                *outLength = 3 + (size_t)address;
+                *consumed += 2;
+                handshake->step = PROXY_STEP_SOCKS5_REPLY;
+                break;
+            }
+
+            case PROXY_STEP_SOCKS5_REPLY: {
+                if (available < 4)
+                    return 0;
+
+                if (reply[0] != SOCKS5_VERSION || reply[1] != 0)
+                    return -1;
+
+                int address = readSocksAddress(reply + 3, available - 3, &handshake->bound);
+
+                if (address <= 0)
+                    return address;
+
+                *consumed += 3 + (size_t)address;
+                handshake->step = PROXY_STEP_DONE;
+                return 1;
+            }
+
+            default:
+                return -1;
+        }
+    }
+}
+
+int Proxy::wrapDatagram(IP_Port target, const uint8_t* data, uint16_t length, uint8_t* out, size_t size)
+{
+    uint8_t header[SOCKS5_UDP_HEADER_MAX_SIZE] = {0, 0, 0};
+    int address = writeSocksAddress(target, header + 3);
+
+    if (address == -1 || 3 + (size_t)address + length > size)
+        return -1;
+
+    memcpy(out, header, 3 + (size_t)address);
+    memcpy(out + 3 + address, data, length);
+    return 3 + address + length;
+}
+
+int Proxy::unwrapDatagram(const uint8_t* packet, size_t length, IP_Port* source)
+{
+    if (length < 4 || packet[0] != 0 || packet[1] != 0 || packet[2] != 0)
+        return -1;
+
+    int address = readSocksAddress(packet + 3, length - 3, source);
+
+    if (address <= 0 || !NetworkService::ipIsset(&source->ip))
+        return -1;
+
+    return 3 + address;
+}
+
+ProxyDatagrams::ProxyDatagrams(IP_Port proxy)
+{
+    this->proxy = proxy;
+    memset(&this->relay, 0, sizeof(this->relay));
+    this->control = -1;
+    this->udp = -1;
+    this->status = PROXY_DATAGRAMS_SLEEPING;
+    this->failures = 0;
+    this->statusTime = 0;
+    this->nextAttempt = 0;
+    this->inputLength = 0;
+    this->outputLength = 0;
+    this->transport.send = &ProxyDatagrams::send;
+    this->transport.recv = &ProxyDatagrams::receive;
+    this->transport.object = this;
+}
+
+ProxyDatagrams* ProxyDatagrams::create(IP_Port proxy)
+{
+#ifdef PROXY_DATAGRAMS_SUPPORTED
+    struct sockaddr_storage addr;
+
+    if (proxy.ip.family != AF_INET && proxy.ip.family != AF_INET6)
+        return NULL;
+
+    ProxyDatagrams *datagrams = new ProxyDatagrams(proxy);
+    datagrams->udp = socket(proxy.ip.family, SOCK_DGRAM, IPPROTO_UDP);
+
+    /* Bound to any address and port, the association relays for whatever we send from. */
+    IP_Port any;
+    NetworkService::ipInit(&any.ip, proxy.ip.family == AF_INET6);
+    any.port = 0;
+    socklen_t addrsize = (socklen_t)NetworkService::ipportToSockaddr(NULL, any, &addr);
+
+    if (!NetworkService::sockIsValid(datagrams->udp) || !NetworkService::setSocketNonblock(datagrams->udp)
+        || bind(datagrams->udp, (struct sockaddr *)&addr, addrsize) != 0) {
+        delete datagrams;
+        return NULL;
+    }
+
+    return datagrams;
+#else
+    return NULL;
+#endif
+}
+
+ProxyDatagrams::~ProxyDatagrams()
+{
+    if (this->status != PROXY_DATAGRAMS_SLEEPING)
+        NetworkService::killSock(this->control);
+
+    if (NetworkService::sockIsValid(this->udp))
+        NetworkService::killSock(this->udp);
+}
+
+const NetworkTransport* ProxyDatagrams::getTransport()
+{
+    return &this->transport;
+}
+
+bool ProxyDatagrams::isAssociated()
+{
+    return this->status == PROXY_DATAGRAMS_ASSOCIATED;
+}
+
+int ProxyDatagrams::send(void* object, IP_Port ipPort, const uint8_t* data, uint16_t length)
+{
+#ifdef PROXY_DATAGRAMS_SUPPORTED
+    ProxyDatagrams *datagrams = (ProxyDatagrams *)object;
+    uint8_t packet[SOCKS5_UDP_HEADER_MAX_SIZE + MAX_UDP_PACKET_SIZE];
+    struct sockaddr_storage addr;
+
+    if (datagrams->status != PROXY_DATAGRAMS_ASSOCIATED)
+        return -1;
+
+    int packetLength = Proxy::wrapDatagram(ipPort, data, length, packet, sizeof(packet));
+    socklen_t addrsize = (socklen_t)NetworkService::ipportToSockaddr(NULL, datagrams->relay, &addr);
+
+    if (packetLength == -1 || addrsize == 0)
+        return -1;
+
+    if (sendto(datagrams->udp, (const char *)packet, (size_t)packetLength, 0, (struct sockaddr *)&addr, addrsize) != packetLength)
+        return -1;
+
+    return length;
+#else
+    return -1;
+#endif
+}
+
+int ProxyDatagrams::receive(void* object, IP_Port* ipPort, uint8_t* data, uint32_t* length)
+{
+#ifdef PROXY_DATAGRAMS_SUPPORTED
+    ProxyDatagrams *datagrams = (ProxyDatagrams *)object;
+    uint8_t packet[SOCKS5_UDP_HEADER_MAX_SIZE + MAX_UDP_PACKET_SIZE];
+
+    datagrams->step();
+
+    while (datagrams->status == PROXY_DATAGRAMS_ASSOCIATED) {
+        struct sockaddr_storage addr;
+        socklen_t addrsize = sizeof(addr);
+        IP_Port from;
+        ssize_t received = recvfrom(datagrams->udp, (char *)packet, sizeof(packet), 0, (struct sockaddr *)&addr, &addrsize);
+
+        if (received < 0)
+            return -1;
+
+        /* Only the relay of our association speaks for the others. */
+        if (!NetworkService::sockaddrToIpport(&addr, &from) || !NetworkService::ipportEqual(&from, &datagrams->relay))
+            continue;
+
+        int offset = Proxy::unwrapDatagram(packet, (size_t)received, ipPort);
+
+        if (offset == -1 || received - offset > MAX_UDP_PACKET_SIZE)
+            continue;
+
+        *length = (uint32_t)(received - offset);
+        memcpy(data, packet + offset, *length);
+        return 0;
+    }
+#endif
+
+    return -1;
+}
+
+/* Move the association along, called before every receive. */
+void ProxyDatagrams::step()
+{
+#ifdef PROXY_DATAGRAMS_SUPPORTED
+    uint64_t now = NetworkService::getCurrentTimeMonotonic();
+
+    switch (this->status) {
+        case PROXY_DATAGRAMS_SLEEPING: {
+            if (now < this->nextAttempt)
+                return;
+
+            struct sockaddr_storage addr;
+            socklen_t addrsize = (socklen_t)NetworkService::ipportToSockaddr(NULL, this->proxy, &addr);
+            this->control = socket(this->proxy.ip.family, SOCK_STREAM, IPPROTO_TCP);
+
+            if (!NetworkService::sockIsValid(this->control)) {
+                this->nextAttempt = now + PROXY_RETRY_MAXIMUM;
+                return;
+            }
+
+            this->status = PROXY_DATAGRAMS_CONNECTING;
+            this->statusTime = now;
+
+            if (!NetworkService::setSocketNonblock(this->control) || !NetworkService::setSocketNosigpipe(this->control)
+                || (connect(this->control, (struct sockaddr *)&addr, addrsize) != 0 && errno != EINPROGRESS))
+                this->reset();
+
+            return;
+        }
+
+        case PROXY_DATAGRAMS_CONNECTING: {
+            struct pollfd fd = {this->control, POLLOUT, 0};
+            int error = 0;
+            socklen_t length = sizeof(error);
+
+            if (::poll(&fd, 1, 0) == 1) {
+                IP_Port any;
+                NetworkService::ipInit(&any.ip, this->proxy.ip.family == AF_INET6);
+                any.port = 0;
+
+                int request = Proxy::start(&this->handshake, PROXY_TYPE_SOCKS5, any, SOCKS5_COMMAND_UDP_ASSOCIATE,
+                                           this->output, sizeof(this->output));
+
+                if (getsockopt(this->control, SOL_SOCKET, SO_ERROR, (char *)&error, &length) != 0 || error != 0
+                    || request == -1) {
+                    this->reset();
+                    return;
+                }
+
+                this->status = PROXY_DATAGRAMS_NEGOTIATING;
+                this->inputLength = 0;
+                this->outputLength = (size_t)request;
+            }
+            break;
+        }
+
+        case PROXY_DATAGRAMS_NEGOTIATING:
+            if (!this->progress()) {
+                this->reset();
+                return;
+            }
+            break;
+
+        case PROXY_DATAGRAMS_ASSOCIATED: {
+            if (now - this->statusTime < PROXY_CHECK_INTERVAL)
+                return;
+
+            /* The association ends with the control connection. */
+            uint8_t discard[64];
+            ssize_t received = recv(this->control, (char *)discard, sizeof(discard), 0);
+            this->statusTime = now;
+
+            if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                this->reset();
+
+            return;
+        }
+    }
+
+    if (this->status != PROXY_DATAGRAMS_ASSOCIATED && now - this->statusTime >= PROXY_ASSOCIATE_TIMEOUT)
+        this->reset();
+#endif
+}
+
+/* Write what is pending to the proxy and handle what it answered.
+ *
+ * return false if the association failed.
+ */
+bool ProxyDatagrams::progress()
+{
+#ifdef PROXY_DATAGRAMS_SUPPORTED
+    if (this->outputLength) {
+        ssize_t written = ::send(this->control, (const char *)this->output, this->outputLength, 0);
+
+        if (written < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+        this->outputLength -= (size_t)written;
+        memmove(this->output, this->output + written, this->outputLength);
+
+        if (this->outputLength)
+            return true;
+    }
+
+    ssize_t received = recv(this->control, (char *)this->input + this->inputLength,
+                            sizeof(this->input) - this->inputLength, 0);
+
+    if (received == 0)
+        return false;
+
+    if (received < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+    this->inputLength += (size_t)received;
+
+    size_t consumed, request;
+    int result = Proxy::handle(&this->handshake, this->input, this->inputLength, &consumed,
+                               this->output, sizeof(this->output), &request);
+
+    if (result == -1)
+        return false;
+
+    this->inputLength -= consumed;
+    memmove(this->input, this->input + consumed, this->inputLength);
+    this->outputLength = request;
+
+    if (result == 1) {
+        this->relay = this->handshake.bound;
+
+        /* An unspecified address means the relay is the proxy host itself. */
+        if (!NetworkService::ipIsset(&this->relay.ip) || (this->relay.ip.family == AF_INET && this->relay.ip.ip4.uint32 == 0)
+            || (this->relay.ip.family == AF_INET6 && IN6_IS_ADDR_UNSPECIFIED(&this->relay.ip.ip6.in6_addr)))
+            this->relay.ip = this->proxy.ip;
+
+        this->status = PROXY_DATAGRAMS_ASSOCIATED;
+        this->statusTime = NetworkService::getCurrentTimeMonotonic();
+        this->failures = 0;
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* Drop the control connection and try again after a backoff. */
+void ProxyDatagrams::reset()
+{
+    if (this->status != PROXY_DATAGRAMS_SLEEPING)
+        NetworkService::killSock(this->control);
+
+    this->status = PROXY_DATAGRAMS_SLEEPING;
+    this->nextAttempt = NetworkService::getCurrentTimeMonotonic()
+        + std::min<uint64_t>(PROXY_RETRY_MAXIMUM, (uint64_t)PROXY_RETRY_MINIMUM << std::min<uint32_t>(this->failures, 6));
+    ++this->failures;
+}
@@ -0,0 +1,115 @@
+//
+//  Proxy.hpp
+//  PeerJet
+//
+//  Created by Compy on 12/11/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef Proxy_hpp
+#define Proxy_hpp
+
+#include <cstdint>
+#include <stdio.h>
+#include "Node.hpp"
+
+/* Largest request we send and largest reply header we accept from a proxy. */
+#define PROXY_MAX_REQUEST_SIZE      512
+#define PROXY_MAX_REPLY_SIZE        2048
+
+/* Header in front of every datagram relayed by a SOCKS5 UDP association:
+ * reserved (2), fragment (1), address type (1), address (4 or 16), port (2).
+ */
+#define SOCKS5_UDP_HEADER_MAX_SIZE  (3 + 1 + 16 + 2)
+
+#define SOCKS5_COMMAND_CONNECT      1
+#define SOCKS5_COMMAND_UDP_ASSOCIATE 3
+
+/* State of the negotiation with a proxy, one per connection so any number of
+ * them can run at once. No I/O is done here, the owner of the socket feeds
+ * the replies in and writes the requests out.
+ */
+struct ProxyHandshake {
+    uint8_t type;           /* ProxyType */
+    uint8_t command;        /* SOCKS5_COMMAND_* */
+    uint8_t step;
+    IP_Port target;         /* where the tunnel goes, port in network byte order */
+    IP_Port bound;          /* SOCKS5: address the proxy answered with (the UDP relay of an association) */
+};
+
+class Proxy {
+public:
+    /* Start a handshake for a tunnel to target, command is SOCKS5_COMMAND_UDP_ASSOCIATE
+     * to ask a SOCKS5 proxy for an association instead (target is then where we
+     * send from, 0.0.0.0:0 if unknown).
+     *
+     * return the length of the first request written to out, -1 on failure.
+     */
+    static int start(struct ProxyHandshake* handshake, ProxyType type, IP_Port target, uint8_t command,
+                     uint8_t* out, size_t size);
+
+    /* Feed what the proxy sent so far. *consumed is set to the bytes used, a
+     * request to send next is written to out and its length put in *outLength.
+     *
+     * return 1 once the tunnel is up, 0 while more is expected, -1 on failure.
+     */
+    static int handle(struct ProxyHandshake* handshake, const uint8_t* data, size_t length, size_t* consumed,
+                      uint8_t* out, size_t size, size_t* outLength);
+
+    /* Put the SOCKS5 UDP header for target in front of data.
+     *
+     * return the length of the packet written to out, -1 if it doesn't fit.
+     */
+    static int wrapDatagram(IP_Port target, const uint8_t* data, uint16_t length, uint8_t* out, size_t size);
+
+    /* Strip the SOCKS5 UDP header of a datagram from the relay, fragments are refused.
+     *
+     * return the offset of the payload, -1 if the header is invalid.
+     */
+    static int unwrapDatagram(const uint8_t* packet, size_t length, IP_Port* source);
+};
+
+/* Datagrams through a SOCKS5 UDP association (SOCKS5 proxy with UDP enabled).
+ *
+ * getTransport() is used in place of the UDP socket of a NetworkingCore. The
+ * association is negotiated over a TCP connection kept open for its lifetime,
+ * every receive call of the transport advances it without blocking, and it
+ * is set up again with a backoff if the proxy drops it. Nothing is sent
+ * until the proxy told us where its relay is.
+ */
+class ProxyDatagrams {
+public:
+    /* return NULL if the sockets can't be created. */
+    static ProxyDatagrams* create(IP_Port proxy);
+    ~ProxyDatagrams();
+
+    const NetworkTransport* getTransport();
+    bool isAssociated();
+
+private:
+    ProxyDatagrams(IP_Port proxy);
+
+    static int send(void* object, IP_Port ipPort, const uint8_t* data, uint16_t length);
+    static int receive(void* object, IP_Port* ipPort, uint8_t* data, uint32_t* length);
+
+    void step();
+    bool progress();
+    void reset();
+
+    IP_Port proxy;
+    IP_Port relay;
+    sock_t control;
+    sock_t udp;
+    uint8_t status;
+    uint32_t failures;
+    uint64_t statusTime;
+    uint64_t nextAttempt;
+    struct ProxyHandshake handshake;
+    uint8_t input[PROXY_MAX_REPLY_SIZE];
+    size_t inputLength;
+    uint8_t output[PROXY_MAX_REQUEST_SIZE];
+    size_t outputLength;
+    NetworkTransport transport;
+};
+
+#endif /* Proxy_hpp */
@@ -0,0 +1,804 @@
+//
+//  Savedata.cpp
+//  PeerJet
+//
+//  Created by Compy on 12/13/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Crypto.hpp"
+#include "Savedata.hpp"
+#include "SavedataCipher.hpp"
+#include "Utils.hpp"
+
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined(WIN32)
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SAVEDATA_SUPPORTED
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define SAVEDATA_CRC32C_SSE42
+#endif
+
+/* SAVEDATA_SECTION_SELF record. */
+#define SELF_PUBLIC_KEY             0
+#define SELF_SECRET_KEY             32
+#define SELF_NOSPAM                 64
+#define SELF_STATUS                 68
+#define SELF_NAME_LENGTH            69
+#define SELF_STATUS_MESSAGE_LENGTH  70
+#define SELF_NAME                   72
+#define SELF_STATUS_MESSAGE         (SELF_NAME + MAX_NAME_LENGTH)
+
+/* SAVEDATA_SECTION_FRIENDS record. */
+#define FRIEND_PUBLIC_KEY           0
+#define FRIEND_STATUS               32
+#define FRIEND_USER_STATUS          33
+#define FRIEND_NAME_LENGTH          34
+#define FRIEND_STATUS_MESSAGE_LENGTH 35
+#define FRIEND_INFO_SIZE            36
+#define FRIEND_LAST_SEEN            40
+#define FRIEND_NOSPAM               48
+#define FRIEND_NAME                 52
+#define FRIEND_STATUS_MESSAGE       (FRIEND_NAME + MAX_NAME_LENGTH)
+#define FRIEND_INFO                 (FRIEND_STATUS_MESSAGE + MAX_STATUSMESSAGE_LENGTH)
+#define FRIEND_CHECKSUM             (SAVEDATA_FRIEND_SIZE - sizeof(uint32_t))  /* CRC32C of the record before it */
+
+/* Sizes of a section before a record count of this is refused as corrupted. */
+#define SAVEDATA_MAX_RECORD_SIZE    (64 * 1024)
+#define SAVEDATA_MAX_RECORDS        (1u << 26)
+
+/* Chunks of an encrypted profile sealed before they are written out, bounds the memory a save takes. */
+#define SAVEDATA_SEAL_BATCH         64
+
+/* CRC32C (Castagnoli), reflected polynomial. */
+struct Crc32cTable {
+    uint32_t entries[256];
+
+    Crc32cTable()
+    {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+
+            for (int bit = 0; bit < 8; ++bit)
+                crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+
+            this->entries[i] = crc;
+        }
+    }
+};
+
+static uint32_t crc32cSoftware(uint32_t crc, const uint8_t *data, size_t length)
+{
+    static const Crc32cTable table;
+
+    while (length--)
+        crc = table.entries[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+
+    return crc;
+}
+
+#ifdef SAVEDATA_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const uint8_t *data, size_t length)
+{
+#if defined(__x86_64__)
+    uint64_t wide = crc;
+
+    for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t), data += sizeof(uint64_t)) {
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        wide = _mm_crc32_u64(wide, value);
+    }
+
+    crc = (uint32_t)wide;
+#endif
+
+    while (length--)
+        crc = _mm_crc32_u8(crc, *data++);
+
+    return crc;
+}
+#endif
+
+/* Running CRC32C without the final inversion, start from 0xFFFFFFFF. */
+static uint32_t crc32cUpdate(uint32_t crc, const uint8_t *data, size_t length)
+{
+#ifdef SAVEDATA_CRC32C_SSE42
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+
+    if (hardware)
+        return crc32cHardware(crc, data, length);
+#endif
+
+    return crc32cSoftware(crc, data, length);
+}
+
+uint32_t Savedata::checksum(const uint8_t *data, size_t length)
+{
+    return ~crc32cUpdate(0xFFFFFFFF, data, length);
+}
+
+static void encodeFriend(const Friend *f, uint8_t *record)
+{
+    memset(record, 0, SAVEDATA_FRIEND_SIZE);
+    memcpy(record + FRIEND_PUBLIC_KEY, f->real_pk, PEERJET_KEY_LENGTH);
+    record[FRIEND_STATUS] = f->status == FRIEND_ONLINE ? FRIEND_CONFIRMED : f->status;
+    record[FRIEND_USER_STATUS] = (uint8_t)f->userstatus;
+    record[FRIEND_NAME_LENGTH] = (uint8_t)f->name_length;
+    record[FRIEND_STATUS_MESSAGE_LENGTH] = (uint8_t)f->statusmessage_length;
+    record[FRIEND_INFO_SIZE] = (uint8_t)f->info_size;
+    Utils::writeUint64(record + FRIEND_LAST_SEEN, f->last_seen_time);
+    Utils::writeUint32(record + FRIEND_NOSPAM, f->friendrequest_nospam);
+    memcpy(record + FRIEND_NAME, f->name, f->name_length);
+    memcpy(record + FRIEND_STATUS_MESSAGE, f->statusmessage, f->statusmessage_length);
+    memcpy(record + FRIEND_INFO, f->info, f->info_size);
+    Utils::writeUint32(record + FRIEND_CHECKSUM, Savedata::checksum(record, FRIEND_CHECKSUM));
+}
+
+/* Lengths out of range are cut down, the record is covered by a checksum already. */
+static void decodeFriend(Friend *f, const uint8_t *record)
+{
+    uint8_t status = record[FRIEND_STATUS];
+    memcpy(f->real_pk, record + FRIEND_PUBLIC_KEY, PEERJET_KEY_LENGTH);
+    f->friendcon_id = -1;
+    f->status = status >= FRIEND_ADDED && status <= FRIEND_CONFIRMED ? status : FRIEND_CONFIRMED;
+    f->userstatus = record[FRIEND_USER_STATUS] <= USER_STATUS_BUSY ? (UserStatusType)record[FRIEND_USER_STATUS] : USER_STATUS_NONE;
+    f->name_length = std::min<uint16_t>(record[FRIEND_NAME_LENGTH], MAX_NAME_LENGTH);
+    f->statusmessage_length = std::min<uint16_t>(record[FRIEND_STATUS_MESSAGE_LENGTH], MAX_STATUSMESSAGE_LENGTH);
+    f->info_size = std::min<uint16_t>(record[FRIEND_INFO_SIZE], MAX_FRIEND_REQUEST_DATA_SIZE);
+    f->last_seen_time = Utils::readUint64(record + FRIEND_LAST_SEEN);
+    f->friendrequest_nospam = Utils::readUint32(record + FRIEND_NOSPAM);
+    memcpy(f->name, record + FRIEND_NAME, f->name_length);
+    memcpy(f->statusmessage, record + FRIEND_STATUS_MESSAGE, f->statusmessage_length);
+    memcpy(f->info, record + FRIEND_INFO, f->info_size);
+}
+
+void Savedata::encodeSelf(Node *node, uint8_t *record)
+{
+    memset(record, 0, SAVEDATA_SELF_SIZE);
+    memcpy(record + SELF_PUBLIC_KEY, node->address, PEERJET_KEY_LENGTH);
+    memcpy(record + SELF_SECRET_KEY, node->secretKey, PEERJET_KEY_LENGTH);
+    Utils::writeUint32(record + SELF_NOSPAM, node->nospam);
+    record[SELF_STATUS] = (uint8_t)node->status;
+    record[SELF_NAME_LENGTH] = (uint8_t)node->name.size();
+    record[SELF_STATUS_MESSAGE_LENGTH] = (uint8_t)node->statusMessage.size();
+    memcpy(record + SELF_NAME, node->name.data(), node->name.size());
+    memcpy(record + SELF_STATUS_MESSAGE, node->statusMessage.data(), node->statusMessage.size());
+}
+
+void Savedata::decodeSelf(Node *node, const uint8_t *record)
+{
+    size_t nameLength = std::min<size_t>(record[SELF_NAME_LENGTH], MAX_NAME_LENGTH);
+    size_t statusMessageLength = std::min<size_t>(record[SELF_STATUS_MESSAGE_LENGTH], MAX_STATUSMESSAGE_LENGTH);
+
+    memcpy(node->address, record + SELF_PUBLIC_KEY, PEERJET_KEY_LENGTH);
+    memcpy(node->secretKey, record + SELF_SECRET_KEY, PEERJET_KEY_LENGTH);
+    node->nospam = Utils::readUint32(record + SELF_NOSPAM);
+    node->status = record[SELF_STATUS] <= USER_STATUS_BUSY ? (UserStatusType)record[SELF_STATUS] : USER_STATUS_NONE;
+    node->name.assign((const char *)record + SELF_NAME, nameLength);
+    node->statusMessage.assign((const char *)record + SELF_STATUS_MESSAGE, statusMessageLength);
+}
+
+/* The file now ends at end and matches the node, nothing is left to save. */
+void Savedata::saved(Node *node, uint64_t end, uint64_t snapshotSize, uint64_t logSize)
+{
+    node->saveEnd = end;
+    node->saveSnapshotSize = snapshotSize;
+    node->saveLogSize = logSize;
+    node->selfSaveDirty = false;
+    node->removedSinceSave.clear();
+
+    /* Friends not decoded yet are as saved. */
+    for (size_t i = 0; i < node->friends.size(); ++i) {
+        if (node->friends[i])
+            node->friends[i]->save_dirty = 0;
+    }
+}
+
+bool Savedata::loadMapped(Node *node, const uint8_t *map, uint64_t size)
+{
+    if (size < SAVEDATA_HEADER_SIZE || memcmp(map, SAVEDATA_MAGIC, SAVEDATA_MAGIC_LENGTH) != 0)
+        return false;
+
+    uint32_t version = Utils::readUint32(map + 8);
+
+    if (version < 1 || version > SAVEDATA_VERSION)
+        return false;
+
+    uint32_t sectionCount = Utils::readUint32(map + 12);
+    uint64_t logOffset = Utils::readUint64(map + 16);
+    uint64_t tableEnd = SAVEDATA_HEADER_SIZE + (uint64_t)sectionCount * SAVEDATA_SECTION_ENTRY_SIZE;
+
+    if (sectionCount > SAVEDATA_MAX_SECTIONS || tableEnd > logOffset || logOffset > size)
+        return false;
+
+    /* The header is checksummed with its checksum field zeroed, followed by the section table. */
+    uint8_t header[SAVEDATA_HEADER_SIZE];
+    memcpy(header, map, sizeof(header));
+    memset(header + 24, 0, sizeof(uint32_t));
+    uint32_t crc = crc32cUpdate(0xFFFFFFFF, header, sizeof(header));
+    crc = ~crc32cUpdate(crc, map + SAVEDATA_HEADER_SIZE, tableEnd - SAVEDATA_HEADER_SIZE);
+
+    if (crc != Utils::readUint32(map + 24))
+        return false;
+
+    const uint8_t *self = NULL;
+    const uint8_t *friendRecords = NULL;
+    uint32_t friendCount = 0, friendSize = 0;
+
+    for (uint32_t i = 0; i < sectionCount; ++i) {
+        const uint8_t *entry = map + SAVEDATA_HEADER_SIZE + i * SAVEDATA_SECTION_ENTRY_SIZE;
+        uint32_t type = Utils::readUint32(entry);
+        uint32_t recordSize = Utils::readUint32(entry + 4);
+        uint32_t count = Utils::readUint32(entry + 8);
+        uint64_t offset = Utils::readUint64(entry + 16);
+
+        /* Sections we don't know are never read, nor checked. */
+        if (type != SAVEDATA_SECTION_SELF && type != SAVEDATA_SECTION_FRIENDS)
+            continue;
+
+        if (recordSize > SAVEDATA_MAX_RECORD_SIZE || count > SAVEDATA_MAX_RECORDS || offset < tableEnd
+            || offset > logOffset || (uint64_t)recordSize * count > logOffset - offset)
+            return false;
+
+        /* Friend records are checked one by one when they are decoded. */
+        if ((type == SAVEDATA_SECTION_SELF || version < 2)
+            && Savedata::checksum(map + offset, (size_t)recordSize * count) != Utils::readUint32(entry + 12))
+            return false;
+
+        if (type == SAVEDATA_SECTION_SELF) {
+            if (recordSize < SAVEDATA_SELF_SIZE || count != 1)
+                return false;
+
+            self = map + offset;
+        } else {
+            if (recordSize < SAVEDATA_FRIEND_SIZE)
+                return false;
+
+            friendRecords = map + offset;
+            friendCount = count;
+            friendSize = recordSize;
+        }
+    }
+
+    if (!self)
+        return false;
+
+    /* Friends are kept as their records in the file until they are used. */
+    std::vector<const uint8_t*> records(friendCount);
+
+    for (uint32_t i = 0; i < friendCount; ++i)
+        records[i] = friendRecords + (size_t)i * friendSize;
+
+    /* Replay the log, friends are looked up by key only if it has friend records. */
+    std::unordered_map<std::string, size_t> index;
+    uint64_t end = logOffset;
+
+    while (size - end >= SAVEDATA_LOG_HEADER_SIZE) {
+        uint32_t length = Utils::readUint32(map + end);
+        const uint8_t *entry = map + end + SAVEDATA_LOG_HEADER_SIZE;
+
+        if (length > size - end - SAVEDATA_LOG_HEADER_SIZE || Savedata::checksum(entry, length) != Utils::readUint32(map + end + 4))
+            break;
+
+        for (size_t offset = 0; offset + SAVEDATA_RECORD_HEADER_SIZE <= length; ) {
+            uint8_t type = entry[offset];
+            uint16_t recordLength = Utils::readUint16(entry + offset + 1);
+            const uint8_t *record = entry + offset + SAVEDATA_RECORD_HEADER_SIZE;
+            offset += SAVEDATA_RECORD_HEADER_SIZE + recordLength;
+
+            if (offset > length)
+                break;
+
+            if (type == SAVEDATA_RECORD_SELF && recordLength >= SAVEDATA_SELF_SIZE) {
+                self = record;
+                continue;
+            }
+
+            if ((type != SAVEDATA_RECORD_FRIEND || recordLength < SAVEDATA_FRIEND_SIZE)
+                && (type != SAVEDATA_RECORD_REMOVED || recordLength < PEERJET_KEY_LENGTH))
+                continue;
+
+            if (index.empty()) {
+                index.reserve(records.size() + 1);
+
+                for (size_t i = 0; i < records.size(); ++i)
+                    index[std::string((const char *)records[i] + FRIEND_PUBLIC_KEY, PEERJET_KEY_LENGTH)] = i;
+            }
+
+            std::string key((const char *)record, PEERJET_KEY_LENGTH);
+            std::unordered_map<std::string, size_t>::iterator it = index.find(key);
+
+            if (type == SAVEDATA_RECORD_FRIEND) {
+                if (it == index.end()) {
+                    index[key] = records.size();
+                    records.push_back(record);
+                } else {
+                    records[it->second] = record;
+                }
+            } else if (it != index.end()) {
+                /* Removed friends leave a hole until the log is replayed, so indexes stay valid. */
+                records[it->second] = NULL;
+                index.erase(it);
+            }
+        }
+
+        end += SAVEDATA_LOG_HEADER_SIZE + length;
+    }
+
+    records.erase(std::remove(records.begin(), records.end(), (const uint8_t *)NULL), records.end());
+
+    decodeSelf(node, self);
+    node->friends.assign(records.size(), NULL);
+    node->friendKeys.resize(records.size() * PEERJET_KEY_LENGTH);
+
+    for (size_t i = 0; i < records.size(); ++i)
+        memcpy(&node->friendKeys[i * PEERJET_KEY_LENGTH], records[i] + FRIEND_PUBLIC_KEY, PEERJET_KEY_LENGTH);
+
+    if (!records.empty()) {
+        SavedataProfile *profile = new SavedataProfile();
+        profile->map = NULL;
+        profile->mapSize = 0;
+        profile->records.swap(records);
+        profile->checked.assign(profile->records.size(), version < 2);
+        profile->pending = profile->records.size();
+        profile->recordChecksums = version >= 2;
+        node->saveProfile = profile;
+    }
+
+    Savedata::saved(node, end, logOffset, end - logOffset);
+    return true;
+}
+
+const uint8_t *Savedata::checkedRecord(SavedataProfile *profile, uint32_t friendNumber)
+{
+    const uint8_t *record = profile->records[friendNumber];
+
+    if (!profile->checked[friendNumber]) {
+        if (Savedata::checksum(record, FRIEND_CHECKSUM) != Utils::readUint32(record + FRIEND_CHECKSUM))
+            return NULL;
+
+        profile->checked[friendNumber] = 1;
+    }
+
+    return record;
+}
+
+Friend *Savedata::loadFriend(Node *node, uint32_t friendNumber)
+{
+    SavedataProfile *profile = node->saveProfile;
+    const uint8_t *record = Savedata::checkedRecord(profile, friendNumber);
+    Friend *f = new Friend();
+
+    if (record) {
+        decodeFriend(f, record);
+    } else {
+        /* The key was indexed on load, the rest is lost. Saved again in full by the next save. */
+        memcpy(f->real_pk, &node->friendKeys[friendNumber * PEERJET_KEY_LENGTH], PEERJET_KEY_LENGTH);
+        f->friendcon_id = -1;
+        f->status = FRIEND_CONFIRMED;
+        f->save_dirty = 1;
+    }
+
+    node->friends[friendNumber] = f;
+    profile->records[friendNumber] = NULL;
+
+    if (--profile->pending == 0)
+        Savedata::release(node);
+
+    return f;
+}
+
+const Friend *Savedata::peekFriend(Node *node, uint32_t friendNumber, Friend *scratch)
+{
+    const uint8_t *record = Savedata::checkedRecord(node->saveProfile, friendNumber);
+
+    if (!record)
+        return Savedata::loadFriend(node, friendNumber);
+
+    decodeFriend(scratch, record);
+    return scratch;
+}
+
+void Savedata::friendRemoved(Node *node, uint32_t friendNumber)
+{
+    SavedataProfile *profile = node->saveProfile;
+
+    if (!profile || friendNumber >= profile->records.size())
+        return;
+
+    if (profile->records[friendNumber])
+        --profile->pending;
+
+    profile->records.erase(profile->records.begin() + friendNumber);
+    profile->checked.erase(profile->checked.begin() + friendNumber);
+
+    if (profile->pending == 0)
+        Savedata::release(node);
+}
+
+void Savedata::release(Node *node)
+{
+    SavedataProfile *profile = node->saveProfile;
+
+    if (!profile)
+        return;
+
+#ifdef SAVEDATA_SUPPORTED
+    if (profile->map)
+        munmap(profile->map, (size_t)profile->mapSize);
+#endif
+
+    sodium_memzero(profile->plain.data(), profile->plain.size());
+    delete profile;
+    node->saveProfile = NULL;
+}
+
+bool Savedata::loadEncrypted(Node *node, const uint8_t *map, uint64_t size)
+{
+    if (!node->config->savePassphrase)
+        return false;
+
+    SavedataKey *key = new SavedataKey();
+    std::vector<uint8_t> plain;
+    uint64_t end = 0, chunks = 0;
+
+    /* The one key derivation, every later save of this node uses the same key. */
+    bool loaded = SavedataCipher::deriveKey(key, node->config->savePassphrase, node->config->savePassphraseLength, map)
+                  && SavedataCipher::open(key, map, size, &plain, &end, &chunks)
+                  && Savedata::loadMapped(node, plain.data(), plain.size());
+
+    /* Friends not decoded yet are read from it later, wiped once they all were. */
+    if (loaded && node->saveProfile) {
+        node->saveProfile->plain.swap(plain);
+    } else {
+        sodium_memzero(plain.data(), plain.size());
+    }
+
+    if (!loaded) {
+        sodium_memzero(key, sizeof(*key));
+        delete key;
+        return false;
+    }
+
+    node->saveKey = key;
+    node->saveEnd = end;
+    node->saveChunks = chunks;
+    return true;
+}
+
+#ifdef SAVEDATA_SUPPORTED
+static bool writeFully(int fd, const uint8_t *data, size_t length, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t n = pwrite(fd, data + done, length - done, offset + (off_t)done);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            return false;
+
+        done += (size_t)n;
+    }
+
+    return true;
+}
+
+static bool syncData(int fd)
+{
+#if defined(__APPLE__)
+    return fsync(fd) == 0;
+#else
+    return fdatasync(fd) == 0;
+#endif
+}
+
+/* Make a rename in the directory of path durable. */
+static void syncDirectory(const char *path)
+{
+    std::string directory(path);
+    size_t slash = directory.rfind('/');
+    directory = slash == std::string::npos ? "." : slash == 0 ? "/" : directory.substr(0, slash);
+    int fd = open(directory.c_str(), O_RDONLY);
+
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/* Seal plain a batch of chunks at a time and write it at offset.
+ *
+ * return the size written, 0 on failure.
+ */
+static uint64_t writeSealed(int fd, const SavedataKey *key, const uint8_t *prefix, uint64_t chunk, uint8_t kind,
+                            uint8_t endKind, const uint8_t *plain, uint64_t length, uint64_t offset)
+{
+    std::vector<uint8_t> sealed((size_t)SavedataCipher::sealedSize(std::min<uint64_t>(length, SAVEDATA_SEAL_BATCH * SAVEDATA_CHUNK_SIZE)));
+    uint64_t written = 0;
+
+    for (uint64_t done = 0; ; ) {
+        uint64_t batch = std::min<uint64_t>(length - done, SAVEDATA_SEAL_BATCH * SAVEDATA_CHUNK_SIZE);
+        bool last = done + batch == length;
+        uint64_t size = SavedataCipher::sealedSize(batch);
+
+        SavedataCipher::seal(key, prefix, chunk, kind, last ? endKind : kind, plain + done, batch, sealed.data());
+
+        if (!writeFully(fd, sealed.data(), (size_t)size, (off_t)(offset + written)))
+            return 0;
+
+        chunk += SavedataCipher::chunkCount(batch);
+        written += size;
+        done += batch;
+
+        if (last)
+            return written;
+    }
+}
+#endif
+
+bool Savedata::exists(const char *path)
+{
+#ifdef SAVEDATA_SUPPORTED
+    struct stat st;
+    return stat(path, &st) == 0 && st.st_size > 0;
+#else
+    return false;
+#endif
+}
+
+bool Savedata::load(Node *node, const char *path)
+{
+#ifdef SAVEDATA_SUPPORTED
+    if (!node->friends.empty())
+        return false;
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || st.st_size < SAVEDATA_HEADER_SIZE) {
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return false;
+
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+    bool loaded;
+
+    if (SavedataCipher::isEncrypted((const uint8_t *)map, (uint64_t)st.st_size)) {
+        loaded = Savedata::loadEncrypted(node, (const uint8_t *)map, (uint64_t)st.st_size);
+    } else {
+        loaded = Savedata::loadMapped(node, (const uint8_t *)map, (uint64_t)st.st_size);
+
+        /* Written encrypted by the next save. */
+        if (loaded && node->config->savePassphrase)
+            node->saveEnd = 0;
+
+        /* Kept until the last friend was decoded, friends are used in any order. */
+        if (loaded && node->saveProfile) {
+            node->saveProfile->map = map;
+            node->saveProfile->mapSize = (uint64_t)st.st_size;
+            madvise(map, (size_t)st.st_size, MADV_RANDOM);
+            return true;
+        }
+    }
+
+    munmap(map, (size_t)st.st_size);
+    return loaded;
+#else
+    return false;
+#endif
+}
+
+bool Savedata::saveSnapshot(Node *node, const char *path)
+{
+#ifdef SAVEDATA_SUPPORTED
+    const uint32_t sectionCount = 2;
+    uint64_t selfOffset = SAVEDATA_HEADER_SIZE + sectionCount * SAVEDATA_SECTION_ENTRY_SIZE;
+    uint64_t friendsOffset = selfOffset + SAVEDATA_SELF_SIZE;
+    uint64_t size = friendsOffset + (uint64_t)node->friends.size() * SAVEDATA_FRIEND_SIZE;
+    std::vector<uint8_t> buffer((size_t)size);
+    uint8_t *data = buffer.data();
+
+    encodeSelf(node, data + selfOffset);
+
+    for (size_t i = 0; i < node->friends.size(); ++i) {
+        const Friend *f = node->friends[i];
+        uint8_t *record = data + friendsOffset + i * SAVEDATA_FRIEND_SIZE;
+        const uint8_t *saved = f ? NULL : Savedata::checkedRecord(node->saveProfile, (uint32_t)i);
+
+        /* Not decoded yet, written back as it was loaded. */
+        if (saved) {
+            memcpy(record, saved, SAVEDATA_FRIEND_SIZE);
+            Utils::writeUint32(record + FRIEND_CHECKSUM, Savedata::checksum(record, FRIEND_CHECKSUM));
+        } else {
+            encodeFriend(f ? f : Savedata::loadFriend(node, (uint32_t)i), record);
+        }
+    }
+
+    uint8_t *entry = data + SAVEDATA_HEADER_SIZE;
+    Utils::writeUint32(entry, SAVEDATA_SECTION_SELF);
+    Utils::writeUint32(entry + 4, SAVEDATA_SELF_SIZE);
+    Utils::writeUint32(entry + 8, 1);
+    Utils::writeUint32(entry + 12, Savedata::checksum(data + selfOffset, SAVEDATA_SELF_SIZE));
+    Utils::writeUint64(entry + 16, selfOffset);
+
+    entry += SAVEDATA_SECTION_ENTRY_SIZE;
+    Utils::writeUint32(entry, SAVEDATA_SECTION_FRIENDS);
+    Utils::writeUint32(entry + 4, SAVEDATA_FRIEND_SIZE);
+    Utils::writeUint32(entry + 8, (uint32_t)node->friends.size());
+    Utils::writeUint32(entry + 12, Savedata::checksum(data + friendsOffset, size - friendsOffset));
+    Utils::writeUint64(entry + 16, friendsOffset);
+
+    memcpy(data, SAVEDATA_MAGIC, SAVEDATA_MAGIC_LENGTH);
+    Utils::writeUint32(data + 8, SAVEDATA_VERSION);
+    Utils::writeUint32(data + 12, sectionCount);
+    Utils::writeUint64(data + 16, size);
+    Utils::writeUint32(data + 24, Savedata::checksum(data, selfOffset));
+
+    if (node->config->savePassphrase && !node->saveKey) {
+        node->saveKey = new SavedataKey();
+
+        if (!SavedataCipher::deriveKey(node->saveKey, node->config->savePassphrase, node->config->savePassphraseLength, NULL)) {
+            delete node->saveKey;
+            node->saveKey = NULL;
+            sodium_memzero(data + selfOffset + SELF_SECRET_KEY, PEERJET_KEY_LENGTH);
+            return false;
+        }
+    }
+
+    /* The profile holds our secret key. */
+    std::string temporary = std::string(path) + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if (fd == -1) {
+        sodium_memzero(data + selfOffset + SELF_SECRET_KEY, PEERJET_KEY_LENGTH);
+        return false;
+    }
+
+    uint64_t end = size;
+    bool written;
+
+    if (node->saveKey) {
+        SavedataCipher::newFile(node->saveKey);
+        end = SAVEDATA_CIPHER_HEADER_SIZE;
+        written = writeFully(fd, node->saveKey->header, SAVEDATA_CIPHER_HEADER_SIZE, 0);
+        uint64_t sealed = written ? writeSealed(fd, node->saveKey, NULL, 0, SAVEDATA_CHUNK_SNAPSHOT,
+                                                SAVEDATA_CHUNK_SNAPSHOT_END, data, size, end) : 0;
+        end += sealed;
+        written = sealed > 0;
+    } else {
+        written = writeFully(fd, data, buffer.size(), 0);
+    }
+
+    written = written && syncData(fd);
+    close(fd);
+    sodium_memzero(data + selfOffset + SELF_SECRET_KEY, PEERJET_KEY_LENGTH);
+
+    if (!written || rename(temporary.c_str(), path) != 0) {
+        unlink(temporary.c_str());
+        return false;
+    }
+
+    syncDirectory(path);
+    Savedata::saved(node, end, size, 0);
+    node->saveChunks = node->saveKey ? SavedataCipher::chunkCount(size) : 0;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Savedata::save(Node *node, const char *path)
+{
+#ifdef SAVEDATA_SUPPORTED
+    if (node->saveEnd == 0 || (node->config->savePassphrase && !node->saveKey) || node->saveLogSize > std::max<uint64_t>(node->saveSnapshotSize, SAVEDATA_COMPACT_MINIMUM))
+        return Savedata::saveSnapshot(node, path);
+
+    std::vector<uint8_t> entry(SAVEDATA_LOG_HEADER_SIZE);
+
+    if (node->selfSaveDirty) {
+        size_t offset = entry.size();
+        entry.resize(offset + SAVEDATA_RECORD_HEADER_SIZE + SAVEDATA_SELF_SIZE);
+        entry[offset] = SAVEDATA_RECORD_SELF;
+        Utils::writeUint16(&entry[offset + 1], SAVEDATA_SELF_SIZE);
+        encodeSelf(node, &entry[offset + SAVEDATA_RECORD_HEADER_SIZE]);
+    }
+
+    for (size_t i = 0; i < node->removedSinceSave.size(); i += PEERJET_KEY_LENGTH) {
+        size_t offset = entry.size();
+        entry.resize(offset + SAVEDATA_RECORD_HEADER_SIZE + PEERJET_KEY_LENGTH);
+        entry[offset] = SAVEDATA_RECORD_REMOVED;
+        Utils::writeUint16(&entry[offset + 1], PEERJET_KEY_LENGTH);
+        memcpy(&entry[offset + SAVEDATA_RECORD_HEADER_SIZE], &node->removedSinceSave[i], PEERJET_KEY_LENGTH);
+    }
+
+    for (size_t i = 0; i < node->friends.size(); ++i) {
+        if (!node->friends[i] || !node->friends[i]->save_dirty)
+            continue;
+
+        size_t offset = entry.size();
+        entry.resize(offset + SAVEDATA_RECORD_HEADER_SIZE + SAVEDATA_FRIEND_SIZE);
+        entry[offset] = SAVEDATA_RECORD_FRIEND;
+        Utils::writeUint16(&entry[offset + 1], SAVEDATA_FRIEND_SIZE);
+        encodeFriend(node->friends[i], &entry[offset + SAVEDATA_RECORD_HEADER_SIZE]);
+    }
+
+    if (entry.size() == SAVEDATA_LOG_HEADER_SIZE)
+        return true;
+
+    Utils::writeUint32(&entry[0], (uint32_t)(entry.size() - SAVEDATA_LOG_HEADER_SIZE));
+    Utils::writeUint32(&entry[4], Savedata::checksum(&entry[SAVEDATA_LOG_HEADER_SIZE], entry.size() - SAVEDATA_LOG_HEADER_SIZE));
+
+    int fd = open(path, O_WRONLY);
+    struct stat st;
+
+    /* Gone or cut short behind our back, start over from a snapshot. */
+    if (fd == -1 || fstat(fd, &st) != 0 || (uint64_t)st.st_size < node->saveEnd) {
+        if (fd != -1)
+            close(fd);
+
+        return Savedata::saveSnapshot(node, path);
+    }
+
+    /* Drop what a save interrupted by a crash left after the last good entry. */
+    bool written = (uint64_t)st.st_size == node->saveEnd || ftruncate(fd, (off_t)node->saveEnd) == 0;
+    uint64_t size = entry.size();
+
+    if (written && node->saveKey) {
+        /* A new prefix for every attempt, the chunk numbers may be those of an append that failed. */
+        uint8_t start[SAVEDATA_CHUNK_PREFIX_SIZE];
+        const uint8_t *prefix;
+        SavedataCipher::newDelta(start, &prefix);
+        written = writeFully(fd, start, sizeof(start), (off_t)node->saveEnd);
+        uint64_t sealed = written ? writeSealed(fd, node->saveKey, prefix, node->saveChunks, SAVEDATA_CHUNK_LOG,
+                                                SAVEDATA_CHUNK_LOG_END, entry.data(), entry.size(),
+                                                node->saveEnd + sizeof(start)) : 0;
+        size = sizeof(start) + sealed;
+        written = sealed > 0;
+    } else if (written) {
+        written = writeFully(fd, entry.data(), entry.size(), (off_t)node->saveEnd);
+    }
+
+    written = written && syncData(fd);
+    close(fd);
+
+    if (node->selfSaveDirty)
+        sodium_memzero(&entry[SAVEDATA_LOG_HEADER_SIZE + SAVEDATA_RECORD_HEADER_SIZE + SELF_SECRET_KEY], PEERJET_KEY_LENGTH);
+
+    if (!written)
+        return false;
+
+    if (node->saveKey)
+        node->saveChunks += SavedataCipher::chunkCount(entry.size());
+
+    Savedata::saved(node, node->saveEnd + size, node->saveSnapshotSize, node->saveLogSize + entry.size());
+    return true;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,126 @@
+//
+//  Savedata.hpp
+//  PeerJet
+//
+//  Created by Compy on 12/13/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef Savedata_hpp
+#define Savedata_hpp
+
+#include <cstdint>
+#include <stdio.h>
+#include <vector>
+#include "Node.hpp"
+
+/* Profile file (NodeConfiguration::savePath).
+ *
+ * A snapshot followed by a log of deltas:
+ *
+ *   header          magic, version, section count, offset of the log, CRC32C of header + table
+ *   section table   type, record size, record count, CRC32C, offset of each section
+ *   sections        fixed size records: one SAVEDATA_SECTION_SELF, one per friend in SAVEDATA_SECTION_FRIENDS
+ *   log             one entry per Node::save: length, CRC32C, then the changed records
+ *
+ * Integers are big endian. The file is mapped when loaded, only the sections
+ * that are read get their checksum verified and sections of unknown type are
+ * skipped, so newer versions can add some. A log entry cut short by a crash
+ * fails its checksum and is ignored along with everything after it, a save is
+ * either fully in the file or not at all.
+ *
+ * Friend records end with a CRC32C of their own (since version 2). Loading
+ * only indexes their keys, a friend is checked and decoded the first time it
+ * is used (Savedata::loadFriend) and the file stays mapped until all were.
+ */
+#define SAVEDATA_MAGIC              "PJSAVE01"
+#define SAVEDATA_MAGIC_LENGTH       8
+#define SAVEDATA_VERSION            2
+
+#define SAVEDATA_HEADER_SIZE        32
+#define SAVEDATA_SECTION_ENTRY_SIZE 24
+#define SAVEDATA_MAX_SECTIONS       16
+
+#define SAVEDATA_SECTION_SELF       1
+#define SAVEDATA_SECTION_FRIENDS    2
+
+/* Records of the log, [type][length (2)][record]. A friend record adds or replaces the friend with its key. */
+#define SAVEDATA_RECORD_SELF        1
+#define SAVEDATA_RECORD_FRIEND      2
+#define SAVEDATA_RECORD_REMOVED     3   /* public key of a friend that was removed */
+
+#define SAVEDATA_LOG_HEADER_SIZE    (2 * sizeof(uint32_t))
+#define SAVEDATA_RECORD_HEADER_SIZE (1 + sizeof(uint16_t))
+
+#define SAVEDATA_SELF_SIZE          288
+#define SAVEDATA_FRIEND_SIZE        288
+
+/* A new snapshot replaces the log once the log is larger than the snapshot and this. */
+#define SAVEDATA_COMPACT_MINIMUM    (64 * 1024)
+
+/* What Savedata::load keeps of the file while some friends are not decoded yet. */
+struct SavedataProfile {
+    void *map;                          /* mapping of a profile in clear, NULL for an encrypted one */
+    uint64_t mapSize;
+    std::vector<uint8_t> plain;         /* the decrypted profile, wiped when released */
+    std::vector<const uint8_t*> records; /* record of each friend loaded, by friend number, NULL once decoded */
+    std::vector<uint8_t> checked;       /* 1 once the checksum of the record was verified */
+    size_t pending;                     /* records not decoded yet */
+    bool recordChecksums;               /* false for version 1, whose sections were checked whole when loaded */
+};
+
+class Savedata {
+public:
+    /* Replace the keys, profile and friends of a node that has no friends yet with the ones saved at path,
+     * an encrypted profile is opened with NodeConfiguration::savePassphrase.
+     *
+     * return false if the file can't be read or isn't a valid profile, the node is left untouched.
+     */
+    static bool load(Node* node, const char* path);
+
+    /* return true if there is a file at path. */
+    static bool exists(const char* path);
+
+    /* Append what changed since the last load or save to the log, or write a new
+     * snapshot if there is none yet or the log grew past SAVEDATA_COMPACT_MINIMUM
+     * and the size of the snapshot.
+     */
+    static bool save(Node* node, const char* path);
+
+    /* Write a snapshot of the node to a temporary file and rename it over path. */
+    static bool saveSnapshot(Node* node, const char* path);
+
+    /* Decode the friend at friendNumber from the record it was loaded with, the
+     * first time it is used (Node::getFriend). A record that fails its checksum
+     * leaves a friend with its key only.
+     *
+     * return the friend, now in Node::friends.
+     */
+    static Friend* loadFriend(Node* node, uint32_t friendNumber);
+
+    /* Decode the friend at friendNumber into scratch without keeping it, for
+     * what only reads a few fields of every friend (NodeActor).
+     *
+     * return scratch, or the friend decoded for good if its record fails its checksum.
+     */
+    static const Friend* peekFriend(Node* node, uint32_t friendNumber, Friend* scratch);
+
+    /* The friend at friendNumber was removed, the records after it move down. */
+    static void friendRemoved(Node* node, uint32_t friendNumber);
+
+    /* Unmap or wipe what load kept of the file. */
+    static void release(Node* node);
+
+    /* return the CRC32C of data. */
+    static uint32_t checksum(const uint8_t* data, size_t length);
+
+private:
+    static bool loadMapped(Node* node, const uint8_t* map, uint64_t size);
+    static const uint8_t* checkedRecord(SavedataProfile* profile, uint32_t friendNumber);
+    static bool loadEncrypted(Node* node, const uint8_t* map, uint64_t size);
+    static void encodeSelf(Node* node, uint8_t* record);
+    static void decodeSelf(Node* node, const uint8_t* record);
+    static void saved(Node* node, uint64_t end, uint64_t snapshotSize, uint64_t logSize);
+};
+
+#endif /* Savedata_hpp */
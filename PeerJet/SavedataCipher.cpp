@@ -0,0 +1,242 @@
+//
+//  SavedataCipher.cpp
+//  PeerJet
+//
+//  Created by Compy on 12/14/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <atomic>
+#include <string.h>
+#include <thread>
+#include "SavedataCipher.hpp"
+#include "Utils.hpp"
+
+/* Header of an encrypted profile. */
+#define HEADER_VERSION      8
+#define HEADER_CHUNK_SIZE   12
+#define HEADER_OPSLIMIT     16
+#define HEADER_MEMLIMIT     24
+#define HEADER_SALT         32
+#define HEADER_PREFIX       48
+
+/* Limits accepted from a header, anything above would let a crafted file stall or exhaust the machine. */
+#define MAX_OPSLIMIT        16
+#define MAX_MEMLIMIT        (1024ULL * 1024 * 1024)
+
+/* Chunks below this are sealed and opened on the calling thread only. */
+#define PARALLEL_MINIMUM    4
+
+/* Run work(i) for every i below count, spread over the cores. */
+template <class Work>
+static void parallelFor(uint64_t count, const Work& work)
+{
+    unsigned int threads = std::thread::hardware_concurrency();
+
+    if (threads > count)
+        threads = (unsigned int)count;
+
+    if (threads <= 1 || count < PARALLEL_MINIMUM) {
+        for (uint64_t i = 0; i < count; ++i)
+            work(i);
+
+        return;
+    }
+
+    std::atomic<uint64_t> next(0);
+    auto run = [&]() {
+        for (uint64_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count; )
+            work(i);
+    };
+
+    std::vector<std::thread> workers;
+
+    for (unsigned int i = 1; i < threads; ++i)
+        workers.push_back(std::thread(run));
+
+    run();
+
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+}
+
+/* Nonce and additional data of chunk n, prefix NULL for that of the header. */
+static void chunkNonce(const SavedataKey *key, const uint8_t *prefix, uint64_t chunk, uint8_t *nonce)
+{
+    memcpy(nonce, prefix ? prefix : key->header + HEADER_PREFIX, SAVEDATA_CIPHER_PREFIX_SIZE);
+    Utils::writeUint64(nonce + SAVEDATA_CIPHER_PREFIX_SIZE, chunk);
+}
+
+static void chunkData(const SavedataKey *key, uint8_t kind, uint8_t *data)
+{
+    memcpy(data, key->header, SAVEDATA_CIPHER_HEADER_SIZE);
+    data[SAVEDATA_CIPHER_HEADER_SIZE] = kind;
+}
+
+bool SavedataCipher::isEncrypted(const uint8_t *data, uint64_t size)
+{
+    return size >= SAVEDATA_CIPHER_HEADER_SIZE && memcmp(data, SAVEDATA_CIPHER_MAGIC, strlen(SAVEDATA_CIPHER_MAGIC)) == 0;
+}
+
+bool SavedataCipher::deriveKey(SavedataKey *key, const uint8_t *passphrase, size_t length, const uint8_t *header)
+{
+    if (header) {
+        uint64_t opslimit = Utils::readUint64(header + HEADER_OPSLIMIT);
+        uint64_t memlimit = Utils::readUint64(header + HEADER_MEMLIMIT);
+
+        if (Utils::readUint32(header + HEADER_VERSION) != SAVEDATA_CIPHER_VERSION
+            || Utils::readUint32(header + HEADER_CHUNK_SIZE) != SAVEDATA_CHUNK_SIZE
+            || opslimit == 0 || opslimit > MAX_OPSLIMIT || memlimit > MAX_MEMLIMIT)
+            return false;
+
+        memcpy(key->header, header, SAVEDATA_CIPHER_HEADER_SIZE);
+    } else {
+        memset(key->header, 0, SAVEDATA_CIPHER_HEADER_SIZE);
+        memcpy(key->header, SAVEDATA_CIPHER_MAGIC, strlen(SAVEDATA_CIPHER_MAGIC));
+        Utils::writeUint32(key->header + HEADER_VERSION, SAVEDATA_CIPHER_VERSION);
+        Utils::writeUint32(key->header + HEADER_CHUNK_SIZE, SAVEDATA_CHUNK_SIZE);
+        Utils::writeUint64(key->header + HEADER_OPSLIMIT, crypto_pwhash_OPSLIMIT_INTERACTIVE);
+        Utils::writeUint64(key->header + HEADER_MEMLIMIT, crypto_pwhash_MEMLIMIT_INTERACTIVE);
+        randombytes_buf(key->header + HEADER_SALT, SAVEDATA_CIPHER_SALT_SIZE);
+    }
+
+    return crypto_pwhash(key->key, sizeof(key->key), (const char *)passphrase, length, key->header + HEADER_SALT,
+                         Utils::readUint64(key->header + HEADER_OPSLIMIT), (size_t)Utils::readUint64(key->header + HEADER_MEMLIMIT),
+                         crypto_pwhash_ALG_ARGON2ID13) == 0;
+}
+
+void SavedataCipher::newFile(SavedataKey *key)
+{
+    randombytes_buf(key->header + HEADER_PREFIX, SAVEDATA_CIPHER_PREFIX_SIZE);
+}
+
+uint64_t SavedataCipher::chunkCount(uint64_t length)
+{
+    return length == 0 ? 1 : (length + SAVEDATA_CHUNK_SIZE - 1) / SAVEDATA_CHUNK_SIZE;
+}
+
+uint64_t SavedataCipher::sealedSize(uint64_t length)
+{
+    return length + SavedataCipher::chunkCount(length) * (SAVEDATA_CHUNK_HEADER_SIZE + SAVEDATA_CHUNK_TAG_SIZE);
+}
+
+void SavedataCipher::newDelta(uint8_t *chunk, const uint8_t **prefix)
+{
+    Utils::writeUint32(chunk, ((uint32_t)SAVEDATA_CHUNK_LOG_PREFIX << 24) | SAVEDATA_CIPHER_PREFIX_SIZE);
+    randombytes_buf(chunk + SAVEDATA_CHUNK_HEADER_SIZE, SAVEDATA_CIPHER_PREFIX_SIZE);
+    *prefix = chunk + SAVEDATA_CHUNK_HEADER_SIZE;
+}
+
+void SavedataCipher::seal(const SavedataKey *key, const uint8_t *prefix, uint64_t chunk, uint8_t kind, uint8_t endKind,
+                          const uint8_t *plain, uint64_t length, uint8_t *sealed)
+{
+    uint64_t count = SavedataCipher::chunkCount(length);
+
+    /* Every chunk but the last is full, so where chunk i goes is known without sealing the ones before. */
+    parallelFor(count, [&](uint64_t i) {
+        uint64_t offset = i * SAVEDATA_CHUNK_SIZE;
+        uint64_t size = i + 1 == count ? length - offset : SAVEDATA_CHUNK_SIZE;
+        uint8_t *out = sealed + i * (SAVEDATA_CHUNK_HEADER_SIZE + SAVEDATA_CHUNK_TAG_SIZE + SAVEDATA_CHUNK_SIZE);
+        uint8_t nonce[crypto_aead_xchacha20poly1305_ietf_NPUBBYTES];
+        uint8_t data[SAVEDATA_CIPHER_HEADER_SIZE + 1];
+        uint8_t chunkKind = i + 1 == count ? endKind : kind;
+
+        chunkNonce(key, prefix, chunk + i, nonce);
+        chunkData(key, chunkKind, data);
+        Utils::writeUint32(out, ((uint32_t)chunkKind << 24) | (uint32_t)(size + SAVEDATA_CHUNK_TAG_SIZE));
+        crypto_aead_xchacha20poly1305_ietf_encrypt(out + SAVEDATA_CHUNK_HEADER_SIZE, NULL, plain + offset, size,
+                                                   data, sizeof(data), NULL, nonce, key->key);
+    });
+}
+
+bool SavedataCipher::open(const SavedataKey *key, const uint8_t *data, uint64_t size, std::vector<uint8_t> *plain,
+                          uint64_t *end, uint64_t *chunks)
+{
+    struct Chunk {
+        uint64_t offset;    /* of its ciphertext in data */
+        uint64_t plain;     /* of its plaintext in plain */
+        uint32_t length;    /* of its ciphertext */
+        uint8_t kind;
+        bool opened;
+        const uint8_t *prefix;  /* of its delta, NULL for the snapshot */
+    };
+
+    std::vector<Chunk> found;
+    uint64_t offset = SAVEDATA_CIPHER_HEADER_SIZE, plainSize = 0;
+    const uint8_t *prefix = NULL;
+    bool delta = false;     /* past the snapshot, a chunk needs a prefix */
+
+    while (size - offset >= SAVEDATA_CHUNK_HEADER_SIZE) {
+        uint32_t header = Utils::readUint32(data + offset);
+        Chunk chunk = {offset + SAVEDATA_CHUNK_HEADER_SIZE, plainSize, header & 0xFFFFFF, (uint8_t)(header >> 24), false,
+                       prefix};
+
+        if (chunk.kind == SAVEDATA_CHUNK_LOG_PREFIX) {
+            if (!delta || prefix || chunk.length != SAVEDATA_CIPHER_PREFIX_SIZE || chunk.length > size - chunk.offset)
+                break;
+
+            prefix = data + chunk.offset;
+            offset = chunk.offset + chunk.length;
+            continue;
+        }
+
+        if (chunk.length < SAVEDATA_CHUNK_TAG_SIZE || chunk.length > SAVEDATA_CHUNK_SIZE + SAVEDATA_CHUNK_TAG_SIZE
+            || chunk.length > size - chunk.offset || delta != (prefix != NULL))
+            break;
+
+        /* The next delta brings its own prefix. */
+        if (chunk.kind == SAVEDATA_CHUNK_SNAPSHOT_END || chunk.kind == SAVEDATA_CHUNK_LOG_END) {
+            delta = true;
+            prefix = NULL;
+        }
+
+        found.push_back(chunk);
+        plainSize += chunk.length - SAVEDATA_CHUNK_TAG_SIZE;
+        offset = chunk.offset + chunk.length;
+    }
+
+    plain->resize(plainSize);
+
+    parallelFor(found.size(), [&](uint64_t i) {
+        Chunk& chunk = found[i];
+        uint8_t nonce[crypto_aead_xchacha20poly1305_ietf_NPUBBYTES];
+        uint8_t additional[SAVEDATA_CIPHER_HEADER_SIZE + 1];
+
+        chunkNonce(key, chunk.prefix, i, nonce);
+        chunkData(key, chunk.kind, additional);
+        chunk.opened = crypto_aead_xchacha20poly1305_ietf_decrypt(plain->data() + chunk.plain, NULL, NULL,
+                                                                  data + chunk.offset, chunk.length, additional,
+                                                                  sizeof(additional), nonce, key->key) == 0;
+    });
+
+    /* The snapshot has to be whole, the deltas count up to the first one that isn't. */
+    bool snapshot = true;
+    size_t kept = 0;
+
+    for (size_t i = 0; i < found.size() && found[i].opened; ++i) {
+        uint8_t kind = found[i].kind;
+
+        if (snapshot ? kind != SAVEDATA_CHUNK_SNAPSHOT && kind != SAVEDATA_CHUNK_SNAPSHOT_END
+                     : kind != SAVEDATA_CHUNK_LOG && kind != SAVEDATA_CHUNK_LOG_END)
+            break;
+
+        if (kind == SAVEDATA_CHUNK_SNAPSHOT_END || kind == SAVEDATA_CHUNK_LOG_END) {
+            snapshot = false;
+            kept = i + 1;
+        }
+    }
+
+    if (kept == 0) {
+        sodium_memzero(plain->data(), plain->size());
+        plain->clear();
+        return false;
+    }
+
+    const Chunk& last = found[kept - 1];
+    uint64_t plainEnd = last.plain + last.length - SAVEDATA_CHUNK_TAG_SIZE;
+    sodium_memzero(plain->data() + plainEnd, plain->size() - plainEnd);
+    plain->resize(plainEnd);
+    *end = last.offset + last.length;
+    *chunks = kept;
+    return true;
+}
@@ -0,0 +1,105 @@
+//
+//  SavedataCipher.hpp
+//  PeerJet
+//
+//  Created by Compy on 12/14/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef SavedataCipher_hpp
+#define SavedataCipher_hpp
+
+#include <cstdint>
+#include <stdio.h>
+#include <vector>
+#include "Crypto.hpp"
+
+/* Encrypted profile file (NodeConfiguration::savePassphrase).
+ *
+ * The plain profile (Savedata.hpp) cut in chunks, each one sealed on its own
+ * with XChaCha20-Poly1305 so they are encrypted and decrypted in parallel:
+ *
+ *   header   magic, version, chunk size, pwhash limits and salt, nonce prefix
+ *   chunks   [kind (1)][length (3)][ciphertext + tag], kind and length big endian
+ *
+ * Chunk n is sealed with a nonce prefix followed by n and with the header
+ * and its kind as additional data, so chunks can't be reordered, moved to
+ * another file or have their kind changed. The snapshot ends with a
+ * SAVEDATA_CHUNK_SNAPSHOT_END chunk, the deltas appended by Node::save end
+ * with a SAVEDATA_CHUNK_LOG_END chunk each: a file cut anywhere still opens to
+ * the snapshot and the deltas that were completely written. The key is derived
+ * once from the passphrase and kept for later saves.
+ *
+ * The snapshot takes the prefix of the header, new for every snapshot. Every
+ * delta starts with a SAVEDATA_CHUNK_LOG_PREFIX chunk holding a random prefix
+ * of its own, in clear: a delta written again at the same chunk numbers, after
+ * a failed or torn append, never shares a nonce with the one before.
+ */
+#define SAVEDATA_CIPHER_MAGIC           "PJCRYPT1"
+#define SAVEDATA_CIPHER_VERSION         2
+#define SAVEDATA_CIPHER_HEADER_SIZE     64
+#define SAVEDATA_CIPHER_SALT_SIZE       crypto_pwhash_SALTBYTES
+#define SAVEDATA_CIPHER_PREFIX_SIZE     16
+
+#define SAVEDATA_CHUNK_SIZE             (64 * 1024)
+#define SAVEDATA_CHUNK_HEADER_SIZE      4
+#define SAVEDATA_CHUNK_TAG_SIZE         crypto_aead_xchacha20poly1305_ietf_ABYTES
+
+#define SAVEDATA_CHUNK_SNAPSHOT         1
+#define SAVEDATA_CHUNK_SNAPSHOT_END     2
+#define SAVEDATA_CHUNK_LOG              3
+#define SAVEDATA_CHUNK_LOG_END          4
+#define SAVEDATA_CHUNK_LOG_PREFIX       5   /* [kind][length][prefix], not sealed nor numbered */
+
+#define SAVEDATA_CHUNK_PREFIX_SIZE      (SAVEDATA_CHUNK_HEADER_SIZE + SAVEDATA_CIPHER_PREFIX_SIZE)
+
+/* Key of an encrypted profile, along with the header of the file it was last written to. */
+struct SavedataKey {
+    uint8_t key[crypto_aead_xchacha20poly1305_ietf_KEYBYTES];
+    uint8_t header[SAVEDATA_CIPHER_HEADER_SIZE];
+};
+
+class SavedataCipher {
+public:
+    /* return true if data starts with the header of an encrypted profile. */
+    static bool isEncrypted(const uint8_t* data, uint64_t size);
+
+    /* Derive the key of a profile from passphrase, with the salt and limits
+     * of header or with a new salt and the default limits if header is NULL.
+     *
+     * return false if header is invalid or the derivation failed.
+     */
+    static bool deriveKey(SavedataKey* key, const uint8_t* passphrase, size_t length, const uint8_t* header);
+
+    /* Pick a new nonce prefix for a file about to be written, the header is in key->header. */
+    static void newFile(SavedataKey* key);
+
+    /* return the size of length bytes once sealed. */
+    static uint64_t sealedSize(uint64_t length);
+
+    /* return the number of chunks length bytes are sealed in. */
+    static uint64_t chunkCount(uint64_t length);
+
+    /* Write the SAVEDATA_CHUNK_LOG_PREFIX chunk starting a delta, SAVEDATA_CHUNK_PREFIX_SIZE
+     * bytes, with a new random prefix. prefix is set to where it is in chunk.
+     */
+    static void newDelta(uint8_t* chunk, const uint8_t** prefix);
+
+    /* Seal plain into chunks numbered from chunk, the last one of kind endKind and the others of kind.
+     * prefix is that of the delta (newDelta), NULL for the snapshot.
+     */
+    static void seal(const SavedataKey* key, const uint8_t* prefix, uint64_t chunk, uint8_t kind, uint8_t endKind,
+                     const uint8_t* plain, uint64_t length, uint8_t* sealed);
+
+    /* Open the encrypted profile in data (its header included) into plain.
+     *
+     * end is set to the size of the file up to its last complete delta, and
+     * chunks to the number of sealed chunks until there.
+     *
+     * return false if the snapshot doesn't open (wrong key or corrupted).
+     */
+    static bool open(const SavedataKey* key, const uint8_t* data, uint64_t size, std::vector<uint8_t>* plain,
+                     uint64_t* end, uint64_t* chunks);
+};
+
+#endif /* SavedataCipher_hpp */
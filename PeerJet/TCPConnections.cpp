@@ -0,0 +1,1061 @@
+//
+//  TCPConnections.cpp
+//  PeerJet
+//
+//  Created by Compy on 12/10/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <algorithm>
+#include <deque>
+#include "TCPConnections.hpp"
+#include "Utils.hpp"
+
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined(WIN32)
+#include <netinet/tcp.h>
+#include <poll.h>
+#define TCP_CLIENT_SUPPORTED
+#endif
+
+/* Bytes read from a relay before they are parsed, and encrypted frames waiting for its socket. */
+#define TCP_CLIENT_BUFFER_SIZE      (64 * 1024)
+
+/* Bytes the kernel may hold unsent for a relay socket. Keeping its queue short
+ * makes packets wait in our queues, where lossless ones can overtake lossy ones.
+ */
+#define TCP_CLIENT_NOTSENT_LOWAT    (16 * 1024)
+
+/* Reads of one relay per tick, so a busy relay can't stall the loop. */
+#define TCP_CLIENT_READ_BUDGET      16
+
+/* Largest packet a connection can send, the id of its route goes in front. */
+#define TCP_MAX_DATA_LENGTH         (TCP_MAX_PACKET_SIZE - crypto_box_MACBYTES - 1)
+
+typedef enum {
+    TCP_RELAY_SLEEPING,     /* not connected, tried again at nextAttempt */
+    TCP_RELAY_CONNECTING,   /* waiting for connect() to finish */
+    TCP_RELAY_PROXY,        /* negotiating the tunnel with the proxy */
+    TCP_RELAY_HANDSHAKE,    /* handshake sent, waiting for the answer */
+    TCP_RELAY_CONFIRMED
+} TCPRelayStatus;
+
+typedef enum {
+    TCP_ROUTE_NONE,
+    TCP_ROUTE_REQUESTED,    /* routing request sent */
+    TCP_ROUTE_REGISTERED,   /* the relay gave us an id, the peer isn't there */
+    TCP_ROUTE_ONLINE,
+    TCP_ROUTE_REFUSED       /* the relay had no id left, not asked again until it reconnects */
+} TCPRouteStatus;
+
+typedef std::vector<uint8_t> TCPPacket;
+
+struct TCPRelay {
+    IP_Port ipPort;
+    uint8_t publicKey[crypto_box_PUBLICKEYBYTES];
+    sock_t sock;
+    uint8_t status;
+    uint32_t failures;      /* attempts since the relay last answered a ping */
+    uint64_t nextAttempt;
+    uint64_t statusTime;    /* when the current attempt started */
+    uint64_t lastPinged;
+    uint64_t pingId;        /* 0 if no ping is waiting for its pong */
+    uint64_t rtt;           /* ms, UINT64_MAX until the first pong */
+
+    struct ProxyHandshake proxy;
+    uint8_t tempSecretKey[crypto_box_SECRETKEYBYTES];
+    uint8_t sharedKey[crypto_box_BEFORENMBYTES];
+    uint8_t sentNonce[crypto_box_NONCEBYTES];
+    uint8_t recvNonce[crypto_box_NONCEBYTES];
+
+    /* TCP_CLIENT_BUFFER_SIZE each, allocated while connected. */
+    uint8_t *input;
+    uint32_t inputLength;
+    uint8_t *output;
+    uint32_t outputStart;
+    uint32_t outputLength;
+
+    int32_t routes[NUM_CLIENT_CONNECTIONS]; /* connection using each id, -1 if none */
+    std::deque<TCPPacket> control;          /* routing, pings and onion packets, sent first */
+    std::deque<uint32_t> losslessReady;     /* connections with lossless packets for us, in turn */
+    std::deque<uint32_t> lossyReady;
+};
+
+struct TCPStream {
+    uint8_t publicKey[crypto_box_PUBLICKEYBYTES];
+    int relay;              /* relay packets go through, -1 while no route is online */
+    uint8_t routeStatus[TCP_MAX_RELAYS];
+    uint8_t routeId[TCP_MAX_RELAYS];
+
+    std::deque<TCPPacket> lossless;
+    std::deque<TCPPacket> lossy;
+    uint32_t losslessBytes;
+    int losslessQueuedOn;   /* relay whose losslessReady has us, -1 if none */
+    int lossyQueuedOn;
+};
+
+static void unschedule(std::deque<uint32_t>* ready, uint32_t connection)
+{
+    ready->erase(std::remove(ready->begin(), ready->end(), connection), ready->end());
+}
+
+/* return the delay before the next attempt after failures failed ones, with jitter
+ * so relays that went down together don't come back together.
+ */
+static uint64_t reconnectDelay(uint32_t failures)
+{
+    uint64_t delay = TCP_RECONNECT_MAXIMUM;
+
+    if (failures < 16)
+        delay = std::min<uint64_t>(delay, (uint64_t)TCP_RECONNECT_MINIMUM << (failures ? failures - 1 : 0));
+
+    return delay / 2 + Crypto::randomInt() % (delay / 2 + 1);
+}
+
+TCPConnections::TCPConnections(const uint8_t* publicKey, const uint8_t* secretKey)
+{
+    memcpy(this->publicKey, publicKey, crypto_box_PUBLICKEYBYTES);
+    memcpy(this->secretKey, secretKey, crypto_box_SECRETKEYBYTES);
+    this->dataCallback = NULL;
+    this->dataObject = NULL;
+    this->statusCallback = NULL;
+    this->statusObject = NULL;
+    this->onionCallback = NULL;
+    this->onionObject = NULL;
+    this->proxyType = PROXY_TYPE_NONE;
+    memset(&this->proxy, 0, sizeof(this->proxy));
+    this->dropped = 0;
+    this->reconnects = 0;
+}
+
+TCPConnections::~TCPConnections()
+{
+    for (size_t i = 0; i < this->relays.size(); ++i) {
+        struct TCPRelay *relay = this->relays[i];
+
+        if (relay->status != TCP_RELAY_SLEEPING)
+            NetworkService::killSock(relay->sock);
+
+        free(relay->input);
+        free(relay->output);
+        sodium_memzero(relay->tempSecretKey, sizeof(relay->tempSecretKey));
+        delete relay;
+    }
+
+    for (size_t i = 0; i < this->streams.size(); ++i)
+        delete this->streams[i];
+
+    sodium_memzero(this->secretKey, sizeof(this->secretKey));
+}
+
+bool TCPConnections::addRelay(IP_Port ipPort, const uint8_t* relayPublicKey)
+{
+#ifdef TCP_CLIENT_SUPPORTED
+    if (this->relays.size() >= TCP_MAX_RELAYS)
+        return false;
+
+    if (ipPort.ip.family != AF_INET && ipPort.ip.family != AF_INET6)
+        return false;
+
+    for (size_t i = 0; i < this->relays.size(); ++i) {
+        if (Crypto::comparePublicKeys(this->relays[i]->publicKey, relayPublicKey) == 0)
+            return false;
+    }
+
+    struct TCPRelay *relay = new TCPRelay();
+    relay->ipPort = ipPort;
+    memcpy(relay->publicKey, relayPublicKey, crypto_box_PUBLICKEYBYTES);
+    relay->status = TCP_RELAY_SLEEPING;
+    relay->failures = 0;
+    relay->nextAttempt = 0;
+    relay->input = NULL;
+    relay->output = NULL;
+    this->relays.push_back(relay);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void TCPConnections::setProxy(ProxyType type, IP_Port proxy)
+{
+    this->proxyType = type;
+    this->proxy = proxy;
+}
+
+int TCPConnections::addConnection(const uint8_t* publicKey)
+{
+    size_t connection = 0;
+
+    for (size_t i = 0; i < this->streams.size(); ++i) {
+        if (this->streams[i] && Crypto::comparePublicKeys(this->streams[i]->publicKey, publicKey) == 0)
+            return -1;
+    }
+
+    while (connection < this->streams.size() && this->streams[connection])
+        ++connection;
+
+    if (connection == this->streams.size())
+        this->streams.push_back(NULL);
+
+    struct TCPStream *stream = new TCPStream();
+    memcpy(stream->publicKey, publicKey, crypto_box_PUBLICKEYBYTES);
+    stream->relay = -1;
+    memset(stream->routeStatus, TCP_ROUTE_NONE, sizeof(stream->routeStatus));
+    stream->losslessBytes = 0;
+    stream->losslessQueuedOn = -1;
+    stream->lossyQueuedOn = -1;
+    this->streams[connection] = stream;
+
+    for (uint32_t i = 0; i < this->relays.size(); ++i) {
+        if (this->relays[i]->status == TCP_RELAY_CONFIRMED) {
+            this->requestRoute(i, (uint32_t)connection);
+            this->flush(i);
+        }
+    }
+
+    return (int)connection;
+}
+
+bool TCPConnections::removeConnection(uint32_t connection)
+{
+    if (connection >= this->streams.size() || !this->streams[connection])
+        return false;
+
+    struct TCPStream *stream = this->streams[connection];
+
+    for (uint32_t i = 0; i < this->relays.size(); ++i) {
+        struct TCPRelay *relay = this->relays[i];
+
+        unschedule(&relay->losslessReady, connection);
+        unschedule(&relay->lossyReady, connection);
+
+        if (stream->routeStatus[i] != TCP_ROUTE_REGISTERED && stream->routeStatus[i] != TCP_ROUTE_ONLINE)
+            continue;
+
+        /* A route we only requested is let go when its response arrives. */
+        uint8_t packet[2] = {TCP_PACKET_DISCONNECT_NOTIFICATION, (uint8_t)(stream->routeId[i] + NUM_RESERVED_PORTS)};
+        relay->routes[stream->routeId[i]] = -1;
+        this->sendControl(relay, packet, sizeof(packet));
+        this->flush(i);
+    }
+
+    delete stream;
+    this->streams[connection] = NULL;
+    return true;
+}
+
+bool TCPConnections::isOnline(uint32_t connection)
+{
+    return connection < this->streams.size() && this->streams[connection] && this->streams[connection]->relay != -1;
+}
+
+int TCPConnections::sendPacket(uint32_t connection, const uint8_t* data, uint16_t length, bool lossless)
+{
+    if (connection >= this->streams.size() || !this->streams[connection])
+        return -1;
+
+    struct TCPStream *stream = this->streams[connection];
+
+    if (stream->relay == -1 || length == 0 || length > TCP_MAX_DATA_LENGTH)
+        return -1;
+
+    if (lossless) {
+        if (stream->losslessBytes + length > TCP_STREAM_QUEUE_SIZE)
+            return -1;
+
+        stream->lossless.push_back(TCPPacket(data, data + length));
+        stream->losslessBytes += length;
+    } else {
+        if (stream->lossy.size() >= TCP_STREAM_LOSSY_PACKETS) {
+            ++this->dropped;
+            return -1;
+        }
+
+        stream->lossy.push_back(TCPPacket(data, data + length));
+    }
+
+    this->schedule(connection);
+
+    /* Frames still waiting mean the socket is full, the next tick writes when it drains. */
+    if (this->relays[stream->relay]->outputLength == 0)
+        this->flush((uint32_t)stream->relay);
+
+    return 0;
+}
+
+bool TCPConnections::sendOnionRequest(const uint8_t* data, uint16_t length)
+{
+    int best = -1;
+
+    if (length == 0 || length > TCP_MAX_DATA_LENGTH)
+        return false;
+
+    for (size_t i = 0; i < this->relays.size(); ++i) {
+        if (this->relays[i]->status == TCP_RELAY_CONFIRMED && (best == -1 || this->relays[i]->rtt < this->relays[best]->rtt))
+            best = (int)i;
+    }
+
+    if (best == -1)
+        return false;
+
+    uint8_t packet[1 + TCP_MAX_DATA_LENGTH];
+    packet[0] = TCP_PACKET_ONION_REQUEST;
+    memcpy(packet + 1, data, length);
+
+    if (!this->sendControl(this->relays[best], packet, 1 + length))
+        return false;
+
+    this->flush((uint32_t)best);
+    return true;
+}
+
+void TCPConnections::setDataCallback(TCPDataCallback callback, void* object)
+{
+    this->dataCallback = callback;
+    this->dataObject = object;
+}
+
+void TCPConnections::setStatusCallback(TCPStatusCallback callback, void* object)
+{
+    this->statusCallback = callback;
+    this->statusObject = object;
+}
+
+void TCPConnections::setOnionCallback(TCPOnionCallback callback, void* object)
+{
+    this->onionCallback = callback;
+    this->onionObject = object;
+}
+
+TCPConnectionsStats TCPConnections::getStats()
+{
+    TCPConnectionsStats stats;
+    memset(&stats, 0, sizeof(stats));
+
+    for (size_t i = 0; i < this->relays.size(); ++i) {
+        if (this->relays[i]->status == TCP_RELAY_CONFIRMED)
+            ++stats.relays;
+    }
+
+    for (size_t i = 0; i < this->streams.size(); ++i) {
+        if (!this->streams[i])
+            continue;
+
+        if (this->streams[i]->relay != -1)
+            ++stats.connections;
+
+        stats.queuedBytes += this->streams[i]->losslessBytes;
+    }
+
+    stats.dropped = this->dropped;
+    stats.reconnects = this->reconnects;
+    return stats;
+}
+
+void TCPConnections::tick()
+{
+#ifdef TCP_CLIENT_SUPPORTED
+    uint64_t now = NetworkService::getCurrentTimeMonotonic();
+    uint32_t active = 0;
+    uint32_t target = 1;
+
+    for (size_t i = 0; i < this->streams.size(); ++i) {
+        if (this->streams[i]) {
+            target = TCP_POOL_SIZE;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < this->relays.size(); ++i) {
+        if (this->relays[i]->status != TCP_RELAY_SLEEPING)
+            ++active;
+    }
+
+    /* Top the pool up, relays that failed the least first. */
+    while (active < target) {
+        int best = -1;
+
+        for (size_t i = 0; i < this->relays.size(); ++i) {
+            struct TCPRelay *relay = this->relays[i];
+
+            if (relay->status == TCP_RELAY_SLEEPING && relay->nextAttempt <= now
+                && (best == -1 || relay->failures < this->relays[best]->failures))
+                best = (int)i;
+        }
+
+        if (best == -1)
+            break;
+
+        this->connectRelay((uint32_t)best, now);
+        ++active;
+    }
+
+    struct pollfd fds[TCP_MAX_RELAYS];
+    uint32_t indexes[TCP_MAX_RELAYS];
+    nfds_t count = 0;
+
+    for (uint32_t i = 0; i < this->relays.size(); ++i) {
+        struct TCPRelay *relay = this->relays[i];
+
+        if (relay->status == TCP_RELAY_SLEEPING)
+            continue;
+
+        fds[count].fd = relay->sock;
+        fds[count].events = POLLIN;
+        fds[count].revents = 0;
+
+        if (relay->status == TCP_RELAY_CONNECTING || relay->outputLength)
+            fds[count].events |= POLLOUT;
+
+        indexes[count++] = i;
+    }
+
+    if (count == 0 || poll(fds, count, 0) < 0)
+        return;
+
+    for (nfds_t k = 0; k < count; ++k) {
+        uint32_t index = indexes[k];
+        struct TCPRelay *relay = this->relays[index];
+        short events = fds[k].revents;
+
+        if (relay->status == TCP_RELAY_CONNECTING && (events & (POLLOUT | POLLERR | POLLHUP))) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+
+            if (getsockopt(relay->sock, SOL_SOCKET, SO_ERROR, (char *)&error, &length) != 0 || error != 0) {
+                this->killRelay(index, now);
+                continue;
+            }
+
+            if (!this->startTunnel(index)) {
+                this->killRelay(index, now);
+                continue;
+            }
+        }
+
+        if (relay->status != TCP_RELAY_CONNECTING && (events & (POLLIN | POLLERR | POLLHUP))
+            && !this->readRelay(index, now)) {
+            this->killRelay(index, now);
+            continue;
+        }
+
+        if (relay->status != TCP_RELAY_CONFIRMED) {
+            if (now - relay->statusTime >= TCP_CONNECTION_TIMEOUT) {
+                this->killRelay(index, now);
+                continue;
+            }
+        } else if (relay->pingId) {
+            if (now - relay->lastPinged >= TCP_PING_TIMEOUT) {
+                this->killRelay(index, now);
+                continue;
+            }
+        } else if (now - relay->lastPinged >= TCP_PING_FREQUENCY) {
+            uint8_t ping[1 + sizeof(uint64_t)];
+            ping[0] = TCP_PACKET_PING;
+            relay->pingId = Crypto::random64b() | 1;
+            relay->lastPinged = now;
+            memcpy(ping + 1, &relay->pingId, sizeof(uint64_t));
+            this->sendControl(relay, ping, sizeof(ping));
+        }
+
+        if (relay->status != TCP_RELAY_CONNECTING && !this->flush(index))
+            this->killRelay(index, now);
+    }
+#endif
+}
+
+void TCPConnections::connectRelay(uint32_t index, uint64_t now)
+{
+#ifdef TCP_CLIENT_SUPPORTED
+    struct TCPRelay *relay = this->relays[index];
+    IP_Port ipPort = this->proxyType == PROXY_TYPE_NONE ? relay->ipPort : this->proxy;
+    struct sockaddr_storage addr;
+    socklen_t addrsize = (socklen_t)NetworkService::ipportToSockaddr(NULL, ipPort, &addr);
+
+    if (relay->failures)
+        ++this->reconnects;
+
+    if (addrsize)
+        relay->sock = socket(addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+
+    if (addrsize == 0 || !NetworkService::sockIsValid(relay->sock)) {
+        ++relay->failures;
+        relay->nextAttempt = now + reconnectDelay(relay->failures);
+        return;
+    }
+
+    relay->status = TCP_RELAY_CONNECTING;
+    relay->statusTime = now;
+    relay->lastPinged = now;
+    relay->pingId = 0;
+    relay->rtt = UINT64_MAX;
+    relay->inputLength = 0;
+    relay->outputStart = 0;
+    relay->outputLength = 0;
+    std::fill(relay->routes, relay->routes + NUM_CLIENT_CONNECTIONS, -1);
+
+    int noDelay = 1;
+    setsockopt(relay->sock, IPPROTO_TCP, TCP_NODELAY, (char *)&noDelay, sizeof(noDelay));
+#ifdef TCP_NOTSENT_LOWAT
+    int lowat = TCP_CLIENT_NOTSENT_LOWAT;
+    setsockopt(relay->sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (char *)&lowat, sizeof(lowat));
+#endif
+
+    if (!relay->input)
+        relay->input = (uint8_t *)malloc(TCP_CLIENT_BUFFER_SIZE);
+
+    if (!relay->output)
+        relay->output = (uint8_t *)malloc(TCP_CLIENT_BUFFER_SIZE);
+
+    if (!relay->input || !relay->output || !NetworkService::setSocketNonblock(relay->sock)
+        || !NetworkService::setSocketNosigpipe(relay->sock)) {
+        this->killRelay(index, now);
+        return;
+    }
+
+    if (connect(relay->sock, (struct sockaddr *)&addr, addrsize) != 0 && errno != EINPROGRESS)
+        this->killRelay(index, now);
+#endif
+}
+
+/* The socket connected: ask the proxy for a tunnel to the relay, or start the handshake.
+ *
+ * return false on failure.
+ */
+bool TCPConnections::startTunnel(uint32_t index)
+{
+    struct TCPRelay *relay = this->relays[index];
+
+    if (this->proxyType == PROXY_TYPE_NONE)
+        return this->startHandshake(relay);
+
+    int length = Proxy::start(&relay->proxy, (ProxyType)this->proxyType, relay->ipPort, SOCKS5_COMMAND_CONNECT,
+                              relay->output, TCP_CLIENT_BUFFER_SIZE);
+
+    if (length == -1)
+        return false;
+
+    relay->status = TCP_RELAY_PROXY;
+    relay->outputStart = 0;
+    relay->outputLength = (uint32_t)length;
+    return true;
+}
+
+/* Write our handshake to the output of a relay.
+ *
+ * return false on failure.
+ */
+bool TCPConnections::startHandshake(struct TCPRelay* relay)
+{
+    uint8_t tempPublicKey[crypto_box_PUBLICKEYBYTES];
+    uint8_t plain[TCP_HANDSHAKE_PLAIN_SIZE];
+
+    if (relay->outputStart + relay->outputLength + TCP_CLIENT_HANDSHAKE_SIZE > TCP_CLIENT_BUFFER_SIZE)
+        return false;
+
+    uint8_t *handshake = relay->output + relay->outputStart + relay->outputLength;
+
+    crypto_box_keypair(tempPublicKey, relay->tempSecretKey);
+    Crypto::randomNonce(relay->sentNonce);
+    memcpy(plain, tempPublicKey, crypto_box_PUBLICKEYBYTES);
+    memcpy(plain + crypto_box_PUBLICKEYBYTES, relay->sentNonce, crypto_box_NONCEBYTES);
+    memcpy(handshake, this->publicKey, crypto_box_PUBLICKEYBYTES);
+    Crypto::randomNonce(handshake + crypto_box_PUBLICKEYBYTES);
+
+    if (Crypto::encryptData(relay->publicKey, this->secretKey, handshake + crypto_box_PUBLICKEYBYTES, plain,
+                            sizeof(plain), handshake + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES)
+        != TCP_HANDSHAKE_PLAIN_SIZE + crypto_box_MACBYTES)
+        return false;
+
+    relay->status = TCP_RELAY_HANDSHAKE;
+    relay->outputLength += TCP_CLIENT_HANDSHAKE_SIZE;
+    return true;
+}
+
+/* Close the socket of a relay, its routes go offline and it is tried again after a backoff. */
+void TCPConnections::killRelay(uint32_t index, uint64_t now)
+{
+    struct TCPRelay *relay = this->relays[index];
+
+    if (relay->status != TCP_RELAY_SLEEPING)
+        NetworkService::killSock(relay->sock);
+
+    relay->status = TCP_RELAY_SLEEPING;
+    ++relay->failures;
+    relay->nextAttempt = now + reconnectDelay(relay->failures);
+    relay->control.clear();
+    relay->losslessReady.clear();
+    relay->lossyReady.clear();
+    sodium_memzero(relay->tempSecretKey, sizeof(relay->tempSecretKey));
+
+    /* Buffers are kept, the relay is about to be retried or replaced by another. */
+    for (uint32_t connection = 0; connection < this->streams.size(); ++connection) {
+        struct TCPStream *stream = this->streams[connection];
+
+        if (!stream)
+            continue;
+
+        stream->routeStatus[index] = TCP_ROUTE_NONE;
+
+        if (stream->losslessQueuedOn == (int)index)
+            stream->losslessQueuedOn = -1;
+
+        if (stream->lossyQueuedOn == (int)index)
+            stream->lossyQueuedOn = -1;
+
+        if (stream->relay == (int)index)
+            this->updateRoute(connection);
+    }
+}
+
+void TCPConnections::confirmRelay(uint32_t index, uint64_t now)
+{
+    struct TCPRelay *relay = this->relays[index];
+    uint8_t ping[1 + sizeof(uint64_t)];
+
+    relay->status = TCP_RELAY_CONFIRMED;
+
+    /* The first packet confirms us to the relay, the pong gives the first RTT. */
+    ping[0] = TCP_PACKET_PING;
+    relay->pingId = Crypto::random64b() | 1;
+    relay->lastPinged = now;
+    memcpy(ping + 1, &relay->pingId, sizeof(uint64_t));
+    this->sendControl(relay, ping, sizeof(ping));
+
+    for (uint32_t connection = 0; connection < this->streams.size(); ++connection) {
+        if (this->streams[connection])
+            this->requestRoute(index, connection);
+    }
+}
+
+/* return false if the relay closed the connection or sent something invalid. */
+bool TCPConnections::readRelay(uint32_t index, uint64_t now)
+{
+#ifdef TCP_CLIENT_SUPPORTED
+    struct TCPRelay *relay = this->relays[index];
+    uint8_t plain[TCP_MAX_PACKET_SIZE];
+
+    for (int reads = 0; reads < TCP_CLIENT_READ_BUDGET && relay->status != TCP_RELAY_SLEEPING; ++reads) {
+        ssize_t received = recv(relay->sock, relay->input + relay->inputLength,
+                                TCP_CLIENT_BUFFER_SIZE - relay->inputLength, 0);
+
+        if (received == 0)
+            return false;
+
+        if (received < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+        relay->inputLength += (uint32_t)received;
+        uint32_t offset = 0;
+
+        if (relay->status == TCP_RELAY_PROXY) {
+            size_t consumed, request;
+            int result = Proxy::handle(&relay->proxy, relay->input, relay->inputLength, &consumed,
+                                       relay->output + relay->outputStart + relay->outputLength,
+                                       TCP_CLIENT_BUFFER_SIZE - relay->outputStart - relay->outputLength, &request);
+
+            if (result == -1)
+                return false;
+
+            offset = (uint32_t)consumed;
+            relay->outputLength += (uint32_t)request;
+
+            if (result == 1 && !this->startHandshake(relay))
+                return false;
+        }
+
+        if (relay->status == TCP_RELAY_HANDSHAKE && relay->inputLength - offset >= TCP_SERVER_HANDSHAKE_SIZE) {
+            if (!this->handleHandshake(relay, relay->input + offset))
+                return false;
+
+            offset += TCP_SERVER_HANDSHAKE_SIZE;
+            this->confirmRelay(index, now);
+        }
+
+        if (relay->status != TCP_RELAY_CONFIRMED) {
+            relay->inputLength -= offset;
+            memmove(relay->input, relay->input + offset, relay->inputLength);
+            continue;
+        }
+
+        while (relay->inputLength - offset >= 2) {
+            uint16_t length = Utils::readUint16(relay->input + offset);
+
+            if (length <= crypto_box_MACBYTES || length > TCP_MAX_PACKET_SIZE)
+                return false;
+
+            if (relay->inputLength - offset < 2u + length)
+                break;
+
+            int plainLength = Crypto::decryptDataSymmetric(relay->sharedKey, relay->recvNonce,
+                                                           relay->input + offset + 2, length, plain);
+
+            if (plainLength <= 0)
+                return false;
+
+            Crypto::incrementNonce(relay->recvNonce);
+            offset += 2u + length;
+
+            if (!this->handlePacket(index, plain, (uint16_t)plainLength, now))
+                return false;
+        }
+
+        relay->inputLength -= offset;
+        memmove(relay->input, relay->input + offset, relay->inputLength);
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool TCPConnections::handleHandshake(struct TCPRelay* relay, const uint8_t* data)
+{
+    uint8_t plain[TCP_HANDSHAKE_PLAIN_SIZE];
+
+    if (Crypto::decryptData(relay->publicKey, this->secretKey, data, data + crypto_box_NONCEBYTES,
+                            TCP_SERVER_HANDSHAKE_SIZE - crypto_box_NONCEBYTES, plain) != TCP_HANDSHAKE_PLAIN_SIZE)
+        return false;
+
+    Crypto::encryptPrecompute(plain, relay->tempSecretKey, relay->sharedKey);
+    memcpy(relay->recvNonce, plain + crypto_box_PUBLICKEYBYTES, crypto_box_NONCEBYTES);
+    sodium_memzero(relay->tempSecretKey, sizeof(relay->tempSecretKey));
+    return true;
+}
+
+bool TCPConnections::handlePacket(uint32_t index, const uint8_t* data, uint16_t length, uint64_t now)
+{
+    struct TCPRelay *relay = this->relays[index];
+
+    switch (data[0]) {
+        case TCP_PACKET_ROUTING_RESPONSE:
+            if (length != 2 + crypto_box_PUBLICKEYBYTES)
+                return false;
+
+            this->handleRoutingResponse(index, data[1], data + 2);
+            return true;
+
+        case TCP_PACKET_CONNECTION_NOTIFICATION:
+        case TCP_PACKET_DISCONNECT_NOTIFICATION:
+            if (length != 2)
+                return false;
+
+            this->handleRouteStatus(index, data[1], data[0] == TCP_PACKET_CONNECTION_NOTIFICATION);
+            return true;
+
+        case TCP_PACKET_PING: {
+            if (length != 1 + sizeof(uint64_t))
+                return false;
+
+            uint8_t response[1 + sizeof(uint64_t)];
+            response[0] = TCP_PACKET_PONG;
+            memcpy(response + 1, data + 1, sizeof(uint64_t));
+            this->sendControl(relay, response, sizeof(response));
+            return true;
+        }
+
+        case TCP_PACKET_PONG: {
+            if (length != 1 + sizeof(uint64_t))
+                return false;
+
+            uint64_t pingId;
+            memcpy(&pingId, data + 1, sizeof(uint64_t));
+
+            if (pingId && pingId == relay->pingId) {
+                relay->pingId = 0;
+                relay->rtt = now - relay->lastPinged;
+                relay->failures = 0;
+            }
+
+            return true;
+        }
+
+        case TCP_PACKET_OOB_RECV:
+            /* Nobody sends us out of band data yet. */
+            return true;
+
+        case TCP_PACKET_ONION_RESPONSE:
+            if (this->onionCallback)
+                this->onionCallback(this->onionObject, data + 1, length - 1);
+
+            return true;
+
+        default:
+            break;
+    }
+
+    if (data[0] < NUM_RESERVED_PORTS)
+        return false;
+
+    int32_t connection = relay->routes[data[0] - NUM_RESERVED_PORTS];
+
+    if (connection != -1 && length > 1 && this->dataCallback)
+        this->dataCallback(this->dataObject, (uint32_t)connection, data + 1, length - 1);
+
+    return true;
+}
+
+void TCPConnections::handleRoutingResponse(uint32_t index, uint8_t id, const uint8_t* publicKey)
+{
+    struct TCPRelay *relay = this->relays[index];
+    struct TCPStream *stream = NULL;
+    uint32_t connection;
+
+    for (connection = 0; connection < this->streams.size(); ++connection) {
+        stream = this->streams[connection];
+
+        if (stream && stream->routeStatus[index] == TCP_ROUTE_REQUESTED
+            && Crypto::comparePublicKeys(stream->publicKey, publicKey) == 0)
+            break;
+
+        stream = NULL;
+    }
+
+    if (id == 0) {
+        if (stream)
+            stream->routeStatus[index] = TCP_ROUTE_REFUSED;
+
+        return;
+    }
+
+    if (id < NUM_RESERVED_PORTS)
+        return;
+
+    /* The connection was removed while we waited, give the id back. */
+    if (!stream) {
+        uint8_t packet[2] = {TCP_PACKET_DISCONNECT_NOTIFICATION, id};
+        this->sendControl(relay, packet, sizeof(packet));
+        return;
+    }
+
+    stream->routeStatus[index] = TCP_ROUTE_REGISTERED;
+    stream->routeId[index] = id - NUM_RESERVED_PORTS;
+    relay->routes[id - NUM_RESERVED_PORTS] = (int32_t)connection;
+}
+
+void TCPConnections::handleRouteStatus(uint32_t index, uint8_t id, bool online)
+{
+    if (id < NUM_RESERVED_PORTS)
+        return;
+
+    int32_t connection = this->relays[index]->routes[id - NUM_RESERVED_PORTS];
+
+    if (connection == -1)
+        return;
+
+    this->streams[connection]->routeStatus[index] = online ? TCP_ROUTE_ONLINE : TCP_ROUTE_REGISTERED;
+    this->updateRoute((uint32_t)connection);
+}
+
+/* Packets that aren't from a connection go ahead of everything else, there are few of them. */
+bool TCPConnections::sendControl(struct TCPRelay* relay, const uint8_t* data, uint16_t length)
+{
+    if (relay->status != TCP_RELAY_CONFIRMED)
+        return false;
+
+    relay->control.push_back(TCPPacket(data, data + length));
+    return true;
+}
+
+void TCPConnections::requestRoute(uint32_t index, uint32_t connection)
+{
+    struct TCPStream *stream = this->streams[connection];
+    uint8_t packet[1 + crypto_box_PUBLICKEYBYTES];
+
+    if (stream->routeStatus[index] != TCP_ROUTE_NONE)
+        return;
+
+    packet[0] = TCP_PACKET_ROUTING_REQUEST;
+    memcpy(packet + 1, stream->publicKey, crypto_box_PUBLICKEYBYTES);
+
+    if (this->sendControl(this->relays[index], packet, sizeof(packet)))
+        stream->routeStatus[index] = TCP_ROUTE_REQUESTED;
+}
+
+/* Pick the relay a connection sends through after one of its routes changed.
+ *
+ * A connection stays on its relay while that route is online, so its packets
+ * aren't reordered. Otherwise the online route with the lowest RTT is taken.
+ */
+void TCPConnections::updateRoute(uint32_t connection)
+{
+    struct TCPStream *stream = this->streams[connection];
+    int best = stream->relay;
+    bool wasOnline = stream->relay != -1;
+
+    if (best != -1 && (stream->routeStatus[best] != TCP_ROUTE_ONLINE || this->relays[best]->status != TCP_RELAY_CONFIRMED))
+        best = -1;
+
+    for (size_t i = 0; best == -1 && i < this->relays.size(); ++i) {
+        if (stream->routeStatus[i] == TCP_ROUTE_ONLINE && this->relays[i]->status == TCP_RELAY_CONFIRMED)
+            best = (int)i;
+    }
+
+    for (size_t i = 0; best != stream->relay && i < this->relays.size(); ++i) {
+        if (stream->routeStatus[i] == TCP_ROUTE_ONLINE && this->relays[i]->status == TCP_RELAY_CONFIRMED
+            && this->relays[i]->rtt < this->relays[best]->rtt)
+            best = (int)i;
+    }
+
+    if (best != stream->relay) {
+        if (stream->losslessQueuedOn != -1)
+            unschedule(&this->relays[stream->losslessQueuedOn]->losslessReady, connection);
+
+        if (stream->lossyQueuedOn != -1)
+            unschedule(&this->relays[stream->lossyQueuedOn]->lossyReady, connection);
+
+        stream->losslessQueuedOn = -1;
+        stream->lossyQueuedOn = -1;
+        stream->relay = best;
+
+        /* Lossy packets queued for the old route are stale by now. */
+        stream->lossy.clear();
+        this->schedule(connection);
+    }
+
+    if (wasOnline != (best != -1) && this->statusCallback)
+        this->statusCallback(this->statusObject, connection, best != -1);
+}
+
+/* Put a connection with queued packets in line on its relay. */
+void TCPConnections::schedule(uint32_t connection)
+{
+    struct TCPStream *stream = this->streams[connection];
+
+    if (stream->relay == -1)
+        return;
+
+    struct TCPRelay *relay = this->relays[stream->relay];
+
+    if (!stream->lossless.empty() && stream->losslessQueuedOn == -1) {
+        relay->losslessReady.push_back(connection);
+        stream->losslessQueuedOn = stream->relay;
+    }
+
+    if (!stream->lossy.empty() && stream->lossyQueuedOn == -1) {
+        relay->lossyReady.push_back(connection);
+        stream->lossyQueuedOn = stream->relay;
+    }
+}
+
+/* Encrypt queued packets into the output of a relay until it is full: control
+ * packets, then a lossless packet of each waiting connection in turn, then lossy
+ * ones the same way.
+ */
+void TCPConnections::fill(uint32_t index)
+{
+    struct TCPRelay *relay = this->relays[index];
+    uint8_t packet[1 + TCP_MAX_DATA_LENGTH];
+
+    while (relay->status == TCP_RELAY_CONFIRMED) {
+        if (!relay->control.empty()) {
+            TCPPacket& control = relay->control.front();
+
+            if (!this->write(relay, control.data(), (uint16_t)control.size()))
+                return;
+
+            relay->control.pop_front();
+            continue;
+        }
+
+        bool lossless = !relay->losslessReady.empty();
+        std::deque<uint32_t> *ready = lossless ? &relay->losslessReady : &relay->lossyReady;
+
+        if (ready->empty())
+            return;
+
+        uint32_t connection = ready->front();
+        struct TCPStream *stream = this->streams[connection];
+        std::deque<TCPPacket> *queue = lossless ? &stream->lossless : &stream->lossy;
+        TCPPacket& data = queue->front();
+
+        packet[0] = stream->routeId[index] + NUM_RESERVED_PORTS;
+        memcpy(packet + 1, data.data(), data.size());
+
+        if (!this->write(relay, packet, (uint16_t)(1 + data.size())))
+            return;
+
+        if (lossless)
+            stream->losslessBytes -= (uint32_t)data.size();
+
+        queue->pop_front();
+        ready->pop_front();
+
+        if (!queue->empty()) {
+            ready->push_back(connection);
+        } else if (lossless) {
+            stream->losslessQueuedOn = -1;
+        } else {
+            stream->lossyQueuedOn = -1;
+        }
+    }
+}
+
+/* Write the output of a relay, refilling it from the queues while the socket takes it.
+ *
+ * return false if the connection failed.
+ */
+bool TCPConnections::flush(uint32_t index)
+{
+#ifdef TCP_CLIENT_SUPPORTED
+    struct TCPRelay *relay = this->relays[index];
+
+    while (relay->status == TCP_RELAY_PROXY || relay->status == TCP_RELAY_HANDSHAKE || relay->status == TCP_RELAY_CONFIRMED) {
+        this->fill(index);
+
+        if (relay->outputLength == 0)
+            return true;
+
+#ifdef MSG_NOSIGNAL
+        ssize_t written = send(relay->sock, relay->output + relay->outputStart, relay->outputLength, MSG_NOSIGNAL);
+#else
+        ssize_t written = send(relay->sock, relay->output + relay->outputStart, relay->outputLength, 0);
+#endif
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        relay->outputStart += (uint32_t)written;
+        relay->outputLength -= (uint32_t)written;
+
+        if (relay->outputLength == 0)
+            relay->outputStart = 0;
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* Encrypt a packet into the output of a relay.
+ *
+ * return false if the output has no room for it.
+ */
+bool TCPConnections::write(struct TCPRelay* relay, const uint8_t* data, uint16_t length)
+{
+    uint32_t frame = 2 + length + crypto_box_MACBYTES;
+
+    if (relay->outputStart + relay->outputLength + frame > TCP_CLIENT_BUFFER_SIZE) {
+        if (relay->outputLength + frame > TCP_CLIENT_BUFFER_SIZE)
+            return false;
+
+        memmove(relay->output, relay->output + relay->outputStart, relay->outputLength);
+        relay->outputStart = 0;
+    }
+
+    uint8_t *out = relay->output + relay->outputStart + relay->outputLength;
+    Utils::writeUint16(out, (uint16_t)(length + crypto_box_MACBYTES));
+
+    if (Crypto::encryptDataSymmetric(relay->sharedKey, relay->sentNonce, data, length, out + 2) != (int)(frame - 2))
+        return false;
+
+    Crypto::incrementNonce(relay->sentNonce);
+    relay->outputLength += frame;
+    return true;
+}
@@ -0,0 +1,158 @@
+//
+//  TCPConnections.hpp
+//  PeerJet
+//
+//  Created by Compy on 12/10/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef TCPConnections_hpp
+#define TCPConnections_hpp
+
+#include <cstdint>
+#include <stdio.h>
+#include <vector>
+#include "Proxy.hpp"
+#include "TCPServer.hpp"
+
+/* Relays a pool knows about, only a few of them are connected at a time. */
+#define TCP_MAX_RELAYS              16
+
+/* Relays kept connected while there are connections, a single one is kept
+ * for onion traffic when there are none.
+ */
+#define TCP_POOL_SIZE               3
+
+/* Backoff between attempts to reconnect a relay, doubled on every failure. */
+#define TCP_RECONNECT_MINIMUM       1000    /* ms */
+#define TCP_RECONNECT_MAXIMUM       (5 * 60 * 1000) /* ms */
+
+/* Lossless bytes a connection queues before sendPacket fails, the caller keeps
+ * what it couldn't send and retries.
+ */
+#define TCP_STREAM_QUEUE_SIZE       (64 * 1024)
+
+/* Lossy packets a connection queues, further ones are dropped. */
+#define TCP_STREAM_LOSSY_PACKETS    32
+
+/* Called with the packets a connection receives. */
+typedef void (*TCPDataCallback)(void *object, uint32_t connection, const uint8_t *data, uint16_t length);
+
+/* Called when a connection gets its first route through a relay or loses its last one. */
+typedef void (*TCPStatusCallback)(void *object, uint32_t connection, bool online);
+
+/* Called with the TCP_PACKET_ONION_RESPONSE packets relays send us. */
+typedef void (*TCPOnionCallback)(void *object, const uint8_t *data, uint16_t length);
+
+typedef struct {
+    uint32_t relays;        /* relays connected and confirmed */
+    uint32_t connections;   /* connections with a route online */
+    uint64_t queuedBytes;   /* lossless bytes waiting in connection queues */
+    uint64_t dropped;       /* lossy packets dropped because a queue was full */
+    uint64_t reconnects;    /* connection attempts after a failure */
+} TCPConnectionsStats;
+
+struct TCPRelay;
+struct TCPStream;
+
+/* Client side of the relays (Node::addTcpRelay).
+ *
+ * Every connection to a peer is multiplexed over the same small pool of relay
+ * sockets instead of one socket per peer and relay: a relay connection routes
+ * up to NUM_CLIENT_CONNECTIONS peers, and every peer is routed through each
+ * connected relay so it stays reachable when one of them goes away.
+ *
+ * Packets wait in per connection queues and are encrypted into the socket in
+ * round robin between the connections, lossless packets before lossy ones, so
+ * neither one busy peer nor bulk lossy traffic can hold up the others. Relays
+ * that fail are retried in the background with exponential backoff.
+ *
+ * Everything is driven by tick(), nothing blocks: relays behind a proxy
+ * negotiate their tunnels side by side.
+ */
+class TCPConnections {
+public:
+    TCPConnections(const uint8_t* publicKey, const uint8_t* secretKey);
+    ~TCPConnections();
+
+    /* Add a relay, ipPort.port is in network byte order.
+     *
+     * return false if the pool is full, the relay is known already or the
+     * platform has no TCP client support.
+     */
+    bool addRelay(IP_Port ipPort, const uint8_t* relayPublicKey);
+
+    /* Reach relays through an HTTP CONNECT or SOCKS5 proxy, the port of proxy is in
+     * network byte order. Only applies to connections made afterwards.
+     */
+    void setProxy(ProxyType type, IP_Port proxy);
+
+    /* Route packets to and from the peer with publicKey.
+     *
+     * return the connection number, -1 on failure.
+     */
+    int addConnection(const uint8_t* publicKey);
+    bool removeConnection(uint32_t connection);
+    bool isOnline(uint32_t connection);
+
+    /* Queue a packet to a peer, it is sent as soon as the relay socket takes it.
+     *
+     * return 0 on success, -1 if the connection doesn't exist or its queue is full.
+     */
+    int sendPacket(uint32_t connection, const uint8_t* data, uint16_t length, bool lossless);
+
+    /* Send an onion request through one of the relays.
+     *
+     * return false if no relay is connected.
+     */
+    bool sendOnionRequest(const uint8_t* data, uint16_t length);
+
+    void setDataCallback(TCPDataCallback callback, void* object);
+    void setStatusCallback(TCPStatusCallback callback, void* object);
+    void setOnionCallback(TCPOnionCallback callback, void* object);
+
+    TCPConnectionsStats getStats();
+
+    void tick();
+
+private:
+    void connectRelay(uint32_t index, uint64_t now);
+    bool startTunnel(uint32_t index);
+    bool startHandshake(struct TCPRelay* relay);
+    void killRelay(uint32_t index, uint64_t now);
+    void confirmRelay(uint32_t index, uint64_t now);
+    bool readRelay(uint32_t index, uint64_t now);
+    bool handleHandshake(struct TCPRelay* relay, const uint8_t* data);
+    bool handlePacket(uint32_t index, const uint8_t* data, uint16_t length, uint64_t now);
+    void handleRoutingResponse(uint32_t index, uint8_t id, const uint8_t* publicKey);
+    void handleRouteStatus(uint32_t index, uint8_t id, bool online);
+
+    bool sendControl(struct TCPRelay* relay, const uint8_t* data, uint16_t length);
+    void requestRoute(uint32_t index, uint32_t connection);
+    void updateRoute(uint32_t connection);
+    void schedule(uint32_t connection);
+    void fill(uint32_t index);
+    bool flush(uint32_t index);
+    bool write(struct TCPRelay* relay, const uint8_t* data, uint16_t length);
+
+    uint8_t publicKey[crypto_box_PUBLICKEYBYTES];
+    uint8_t secretKey[crypto_box_SECRETKEYBYTES];
+
+    std::vector<struct TCPRelay*> relays;
+    std::vector<struct TCPStream*> streams; /* NULL for free connection numbers */
+
+    uint8_t proxyType;      /* ProxyType */
+    IP_Port proxy;
+
+    TCPDataCallback dataCallback;
+    void* dataObject;
+    TCPStatusCallback statusCallback;
+    void* statusObject;
+    TCPOnionCallback onionCallback;
+    void* onionObject;
+
+    uint64_t dropped;
+    uint64_t reconnects;
+};
+
+#endif /* TCPConnections_hpp */
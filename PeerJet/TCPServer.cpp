@@ -0,0 +1,1394 @@
+//
+//  TCPServer.cpp
+//  PeerJet
+//
+//  Created by Compy on 12/9/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include "TCPServer.hpp"
+#include "Utils.hpp"
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define TCP_SERVER_EPOLL
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__DragonFly__)
+#include <sys/event.h>
+#define TCP_SERVER_KQUEUE
+#endif
+
+#if defined(TCP_SERVER_EPOLL) || defined(TCP_SERVER_KQUEUE)
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#define TCP_SERVER_SUPPORTED
+#endif
+
+/* Scratch buffer every worker reads into, complete frames are decrypted straight from it. */
+#define TCP_READ_BUFFER_SIZE    (64 * 1024)
+
+/* Reads of one connection per wakeup before the others get their turn. */
+#define TCP_READ_BUDGET         4
+#define TCP_ACCEPT_BUDGET       256
+#define TCP_MAX_EVENTS          256
+
+/* ms between two passes over the connections of a worker for timeouts and pings. */
+#define TCP_SWEEP_INTERVAL      1000
+
+/* Largest thing a client sends in one go: the handshake or a frame. */
+#define TCP_INPUT_SIZE          (2 + TCP_MAX_PACKET_SIZE > TCP_CLIENT_HANDSHAKE_SIZE ? 2 + TCP_MAX_PACKET_SIZE : TCP_CLIENT_HANDSHAKE_SIZE)
+
+/* Poller data of the two descriptors of a worker that aren't connections. */
+#define TCP_EVENT_LISTEN        UINT64_MAX
+#define TCP_EVENT_WAKE          (UINT64_MAX - 1)
+
+/* A connection is named by a handle: generation, worker, slot in the worker.
+ * The generation changes every time the slot is reused, so stale handles
+ * held by other connections or other workers never reach a new client.
+ */
+#define TCP_HANDLE(generation, worker, index) (((uint64_t)(generation) << 32) | ((uint64_t)(worker) << 24) | (index))
+#define TCP_HANDLE_WORKER(handle)       ((uint32_t)((handle) >> 24) & 0xFF)
+#define TCP_HANDLE_INDEX(handle)        ((uint32_t)(handle) & 0xFFFFFF)
+#define TCP_HANDLE_GENERATION(handle)   ((uint32_t)((handle) >> 32))
+
+#define TCP_MAX_WORKERS         256
+
+typedef enum {
+    TCP_STATUS_NO_STATUS,
+    TCP_STATUS_CONNECTED,   /* waiting for the handshake */
+    TCP_STATUS_UNCONFIRMED, /* handshake answered, waiting for the first packet */
+    TCP_STATUS_CONFIRMED
+} TCPStatus;
+
+/* Frames waiting to be written, in a ring so one writev sends all of them. */
+struct TCPRing {
+    uint32_t head;
+    uint32_t length;
+    uint8_t data[TCP_SEND_BUFFER_SIZE];
+};
+
+/* The start of a frame that didn't arrive completely yet. */
+struct TCPInput {
+    uint32_t length;
+    uint8_t data[TCP_INPUT_SIZE];
+};
+
+/* Connection a client asked us to route (TCP_PACKET_ROUTING_REQUEST). */
+struct TCPRoute {
+    uint8_t publicKey[crypto_box_PUBLICKEYBYTES];
+    uint64_t peer;          /* handle of the other client once both asked for each other */
+    uint8_t peerId;         /* route of the other client leading to us */
+    uint8_t status;         /* 0 = free, 1 = waiting for the other client, 2 = online */
+};
+
+/* Kept small, an idle client costs this and nothing else. */
+struct TCPSecureConnection {
+    sock_t sock;
+    uint32_t index;         /* slot in TCPWorker::connections */
+    uint32_t generation;
+    uint8_t status;
+    bool flushing;          /* in TCPWorker::flushList */
+    bool reading;           /* in TCPWorker::readList */
+    uint8_t publicKey[crypto_box_PUBLICKEYBYTES];
+    uint8_t sharedKey[crypto_box_BEFORENMBYTES];
+    uint8_t sentNonce[crypto_box_NONCEBYTES];
+    uint8_t recvNonce[crypto_box_NONCEBYTES];
+    uint64_t connectedTime;
+    uint64_t lastPinged;
+    uint64_t pingId;        /* 0 if no ping is waiting for its pong */
+
+    struct TCPInput *input;
+    struct TCPRing *output;
+    struct TCPRoute *routes; /* NUM_CLIENT_CONNECTIONS, allocated with the first routing request */
+};
+
+typedef enum {
+    TCP_MESSAGE_LINK,       /* from asked for target on route fromId */
+    TCP_MESSAGE_LINKED,     /* route id of target now leads to from */
+    TCP_MESSAGE_UNLINK,     /* route id of target no longer leads to from */
+    TCP_MESSAGE_DATA,       /* data for route id of target */
+    TCP_MESSAGE_OOB,        /* out of band data from the client with publicKey */
+    TCP_MESSAGE_KILL        /* another connection took over the public key of target */
+} TCPMessageType;
+
+/* What a worker hands to the worker owning another connection. */
+struct TCPMessage {
+    uint8_t type;
+    uint8_t id;
+    uint8_t fromId;
+    uint16_t length;
+    uint64_t target;
+    uint64_t from;
+    uint8_t publicKey[crypto_box_PUBLICKEYBYTES];
+    uint8_t data[TCP_MAX_PACKET_SIZE];
+};
+
+struct TCPEvent {
+    uint64_t data;
+    bool readable;
+    bool writable;
+};
+
+struct TCPWorker {
+    TCPWorker(TCPServer* server, uint32_t index);
+    ~TCPWorker();
+
+    bool init();
+    bool listen(IP ip, uint16_t port, bool shared);
+    void run();
+    void stop();
+
+    /* Hand a message to the worker owning target, handled at once if that is us. */
+    void route(TCPMessageType type, uint64_t target, uint8_t id, uint64_t from, uint8_t fromId,
+               const uint8_t* publicKey, const uint8_t* data, uint16_t length);
+
+    void post(TCPMessageType type, uint64_t target, uint8_t id, uint64_t from, uint8_t fromId,
+              const uint8_t* publicKey, const uint8_t* data, uint16_t length);
+    void handleInbox();
+    void dispatch(TCPMessageType type, uint64_t target, uint8_t id, uint64_t from, uint8_t fromId,
+                  const uint8_t* publicKey, const uint8_t* data, uint16_t length);
+
+    void acceptClients(uint64_t now);
+    void readClient(uint32_t index);
+    bool consume(uint32_t index, const uint8_t* data, size_t length);
+    bool handleFrame(uint32_t index, const uint8_t* frame, size_t length);
+    bool handleHandshake(struct TCPSecureConnection* conn, const uint8_t* data);
+    bool handlePacket(uint32_t index, const uint8_t* data, uint16_t length);
+    bool handleRoutingRequest(uint32_t index, const uint8_t* publicKey);
+    bool handleDisconnect(uint32_t index, uint8_t connectionId);
+
+    void handleLink(struct TCPSecureConnection* conn, uint64_t from, uint8_t fromId, const uint8_t* publicKey);
+    void handleLinked(struct TCPSecureConnection* conn, uint8_t id, uint64_t from, uint8_t fromId, const uint8_t* publicKey);
+    void linkRoute(struct TCPSecureConnection* conn, uint8_t id, uint64_t peer, uint8_t peerId);
+
+    bool sendPacket(struct TCPSecureConnection* conn, const uint8_t* data, uint16_t length);
+    bool sendControl(struct TCPSecureConnection* conn, uint8_t packetId, uint8_t connectionId);
+    bool queue(struct TCPSecureConnection* conn, const uint8_t* data, size_t length);
+    bool flush(struct TCPSecureConnection* conn);
+    void flushAll();
+    void sweep(uint64_t now);
+    void kill(uint32_t index);
+
+    uint64_t handleOf(const struct TCPSecureConnection* conn);
+    struct TCPSecureConnection* getConnection(uint64_t handle);
+
+    TCPServer* server;
+    uint32_t index;
+    int poller;
+    sock_t listenSock;
+    int wakePipe[2];
+    std::thread thread;
+    std::atomic<bool> stopping;
+
+    std::vector<struct TCPSecureConnection*> connections;
+    std::vector<uint32_t> freeConnections;
+    std::vector<uint64_t> flushList;   /* connections with frames to write this iteration */
+    std::vector<uint64_t> readList;    /* connections that used up their read budget */
+    uint8_t readBuffer[TCP_READ_BUFFER_SIZE];
+
+    std::mutex inboxLock;
+    std::vector<struct TCPMessage> inbox;
+    bool woken;                         /* a byte is in wakePipe, guarded by inboxLock */
+
+    std::atomic<uint64_t> connectionCount;
+    std::atomic<uint64_t> confirmedCount;
+    std::atomic<uint64_t> bufferedBytes;
+    std::atomic<uint64_t> forwarded;
+    std::atomic<uint64_t> dropped;
+};
+
+#ifdef TCP_SERVER_SUPPORTED
+static int newPoller()
+{
+#ifdef TCP_SERVER_EPOLL
+    return epoll_create1(EPOLL_CLOEXEC);
+#else
+    return kqueue();
+#endif
+}
+
+/* Watch sock. Connections are edge triggered and watched for writing too,
+ * so a worker never has to change its registration.
+ */
+static bool pollerAdd(int poller, sock_t sock, uint64_t data, bool connection)
+{
+#ifdef TCP_SERVER_EPOLL
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = data;
+
+    if (connection)
+        event.events |= EPOLLOUT | EPOLLRDHUP | EPOLLET;
+
+    return epoll_ctl(poller, EPOLL_CTL_ADD, sock, &event) == 0;
+#else
+    struct kevent changes[2];
+    int count = 0;
+    uint16_t flags = EV_ADD | (connection ? EV_CLEAR : 0);
+    EV_SET(&changes[count++], sock, EVFILT_READ, flags, 0, 0, (void *)(uintptr_t)data);
+
+    if (connection)
+        EV_SET(&changes[count++], sock, EVFILT_WRITE, flags, 0, 0, (void *)(uintptr_t)data);
+
+    return kevent(poller, changes, count, NULL, 0, NULL) == 0;
+#endif
+}
+
+/* Errors and hangups are reported as readable, the read then fails. */
+static int pollerWait(int poller, struct TCPEvent *events, int maxEvents, int timeout)
+{
+#ifdef TCP_SERVER_EPOLL
+    struct epoll_event raw[TCP_MAX_EVENTS];
+    int count = epoll_wait(poller, raw, std::min(maxEvents, TCP_MAX_EVENTS), timeout);
+
+    for (int i = 0; i < count; ++i) {
+        events[i].data = raw[i].data.u64;
+        events[i].readable = (raw[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0;
+        events[i].writable = (raw[i].events & EPOLLOUT) != 0;
+    }
+
+    return count;
+#else
+    struct kevent raw[TCP_MAX_EVENTS];
+    struct timespec wait;
+    wait.tv_sec = timeout / 1000;
+    wait.tv_nsec = (timeout % 1000) * 1000000L;
+    int count = kevent(poller, NULL, 0, raw, std::min(maxEvents, TCP_MAX_EVENTS), &wait);
+
+    for (int i = 0; i < count; ++i) {
+        events[i].data = (uint64_t)(uintptr_t)raw[i].udata;
+        events[i].readable = raw[i].filter == EVFILT_READ || (raw[i].flags & (EV_EOF | EV_ERROR));
+        events[i].writable = raw[i].filter == EVFILT_WRITE;
+    }
+
+    return count;
+#endif
+}
+#endif
+
+TCPWorker::TCPWorker(TCPServer* server, uint32_t index)
+{
+    this->server = server;
+    this->index = index;
+    this->poller = -1;
+    this->listenSock = -1;
+    this->wakePipe[0] = -1;
+    this->wakePipe[1] = -1;
+    this->stopping = false;
+    this->woken = false;
+    this->connectionCount = 0;
+    this->confirmedCount = 0;
+    this->bufferedBytes = 0;
+    this->forwarded = 0;
+    this->dropped = 0;
+}
+
+TCPWorker::~TCPWorker()
+{
+#ifdef TCP_SERVER_SUPPORTED
+    for (size_t i = 0; i < this->connections.size(); ++i) {
+        struct TCPSecureConnection *conn = this->connections[i];
+
+        if (conn->status != TCP_STATUS_NO_STATUS)
+            NetworkService::killSock(conn->sock);
+
+        free(conn->input);
+        free(conn->output);
+        free(conn->routes);
+        sodium_memzero(conn->sharedKey, sizeof(conn->sharedKey));
+        free(conn);
+    }
+
+    if (NetworkService::sockIsValid(this->listenSock))
+        NetworkService::killSock(this->listenSock);
+
+    if (this->poller != -1)
+        close(this->poller);
+
+    if (this->wakePipe[0] != -1) {
+        close(this->wakePipe[0]);
+        close(this->wakePipe[1]);
+    }
+#endif
+}
+
+bool TCPWorker::init()
+{
+#ifdef TCP_SERVER_SUPPORTED
+    this->poller = newPoller();
+
+    if (this->poller == -1 || pipe(this->wakePipe) != 0) {
+        this->wakePipe[0] = this->wakePipe[1] = -1;
+        return false;
+    }
+
+    return NetworkService::setSocketNonblock(this->wakePipe[0]) && NetworkService::setSocketNonblock(this->wakePipe[1])
+           && pollerAdd(this->poller, this->wakePipe[0], TCP_EVENT_WAKE, false);
+#else
+    return false;
+#endif
+}
+
+/* Bind a listening socket. Workers after the first share the port of the first one. */
+bool TCPWorker::listen(IP ip, uint16_t port, bool shared)
+{
+#ifdef TCP_SERVER_SUPPORTED
+    IP_Port ipPort = {ip, htons(port)};
+    struct sockaddr_storage addr;
+    socklen_t addrsize = (socklen_t)NetworkService::ipportToSockaddr(NULL, ipPort, &addr);
+
+    if (addrsize == 0)
+        return false;
+
+    this->listenSock = socket(ip.family, SOCK_STREAM, IPPROTO_TCP);
+
+    if (!NetworkService::sockIsValid(this->listenSock))
+        return false;
+
+    NetworkService::setSocketReuseaddr(this->listenSock);
+
+#ifdef SO_REUSEPORT
+    int set = 1;
+
+    if (setsockopt(this->listenSock, SOL_SOCKET, SO_REUSEPORT, (void *)&set, sizeof(set)) != 0 && shared)
+        return false;
+#else
+    if (shared)
+        return false;
+#endif
+
+    if (ip.family == AF_INET6)
+        NetworkService::setSocketDualstack(this->listenSock);
+
+    return bind(this->listenSock, (struct sockaddr *)&addr, addrsize) == 0
+           && ::listen(this->listenSock, SOMAXCONN) == 0
+           && NetworkService::setSocketNonblock(this->listenSock)
+           && pollerAdd(this->poller, this->listenSock, TCP_EVENT_LISTEN, false);
+#else
+    return false;
+#endif
+}
+
+void TCPWorker::stop()
+{
+    this->stopping = true;
+
+    if (this->wakePipe[1] != -1 && write(this->wakePipe[1], "", 1) < 0) {
+        /* The pipe is full, the worker wakes up anyway. */
+    }
+}
+
+uint64_t TCPWorker::handleOf(const struct TCPSecureConnection* conn)
+{
+    return TCP_HANDLE(conn->generation, this->index, conn->index);
+}
+
+/* return the connection of one of our handles, NULL if it was closed since. */
+struct TCPSecureConnection* TCPWorker::getConnection(uint64_t handle)
+{
+    uint32_t index = TCP_HANDLE_INDEX(handle);
+
+    if (TCP_HANDLE_WORKER(handle) != this->index || index >= this->connections.size())
+        return NULL;
+
+    struct TCPSecureConnection *conn = this->connections[index];
+
+    if (conn->status == TCP_STATUS_NO_STATUS || conn->generation != TCP_HANDLE_GENERATION(handle))
+        return NULL;
+
+    return conn;
+}
+
+void TCPWorker::run()
+{
+#ifdef TCP_SERVER_SUPPORTED
+    struct TCPEvent events[TCP_MAX_EVENTS];
+    std::vector<uint64_t> reading;
+    uint64_t nextSweep = NetworkService::getCurrentTimeMonotonic() + TCP_SWEEP_INTERVAL;
+
+    while (!this->stopping) {
+        uint64_t now = NetworkService::getCurrentTimeMonotonic();
+        int timeout = 0;
+
+        if (this->readList.empty() && nextSweep > now)
+            timeout = (int)std::min<uint64_t>(nextSweep - now, TCP_SWEEP_INTERVAL);
+
+        int count = pollerWait(this->poller, events, TCP_MAX_EVENTS, timeout);
+        now = NetworkService::getCurrentTimeMonotonic();
+
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data == TCP_EVENT_LISTEN) {
+                this->acceptClients(now);
+                continue;
+            }
+
+            if (events[i].data == TCP_EVENT_WAKE) {
+                this->handleInbox();
+                continue;
+            }
+
+            struct TCPSecureConnection *conn = this->getConnection(events[i].data);
+
+            if (!conn)
+                continue;
+
+            if (events[i].writable && conn->output && !this->flush(conn)) {
+                this->kill(TCP_HANDLE_INDEX(events[i].data));
+                continue;
+            }
+
+            if (events[i].readable && !conn->reading)
+                this->readClient(TCP_HANDLE_INDEX(events[i].data));
+        }
+
+        reading.swap(this->readList);
+
+        for (size_t i = 0; i < reading.size(); ++i) {
+            struct TCPSecureConnection *conn = this->getConnection(reading[i]);
+
+            if (conn) {
+                conn->reading = false;
+                this->readClient(TCP_HANDLE_INDEX(reading[i]));
+            }
+        }
+
+        reading.clear();
+        this->flushAll();
+
+        if (now >= nextSweep) {
+            this->sweep(now);
+            this->flushAll();
+            nextSweep = now + TCP_SWEEP_INTERVAL;
+        }
+    }
+#endif
+}
+
+void TCPWorker::acceptClients(uint64_t now)
+{
+#ifdef TCP_SERVER_SUPPORTED
+    for (int i = 0; i < TCP_ACCEPT_BUDGET; ++i) {
+#ifdef TCP_SERVER_EPOLL
+        sock_t sock = accept4(this->listenSock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        sock_t sock = accept(this->listenSock, NULL, NULL);
+#endif
+
+        if (!NetworkService::sockIsValid(sock)) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            return;
+        }
+
+#ifndef TCP_SERVER_EPOLL
+        if (!NetworkService::setSocketNonblock(sock) || !NetworkService::setSocketNosigpipe(sock)) {
+            NetworkService::killSock(sock);
+            continue;
+        }
+#endif
+
+        int noDelay = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *)&noDelay, sizeof(noDelay));
+
+        uint32_t index;
+
+        if (!this->freeConnections.empty()) {
+            index = this->freeConnections.back();
+            this->freeConnections.pop_back();
+        } else if (this->connections.size() <= TCP_HANDLE_INDEX(UINT32_MAX)) {
+            struct TCPSecureConnection *conn = (struct TCPSecureConnection *)calloc(1, sizeof(struct TCPSecureConnection));
+
+            if (!conn) {
+                NetworkService::killSock(sock);
+                return;
+            }
+
+            conn->generation = 1;
+            conn->index = (uint32_t)this->connections.size();
+            index = conn->index;
+            this->connections.push_back(conn);
+        } else {
+            NetworkService::killSock(sock);
+            return;
+        }
+
+        struct TCPSecureConnection *conn = this->connections[index];
+        conn->sock = sock;
+        conn->status = TCP_STATUS_CONNECTED;
+        conn->connectedTime = now;
+        conn->pingId = 0;
+        ++this->connectionCount;
+
+        if (!pollerAdd(this->poller, sock, this->handleOf(conn), true))
+            this->kill(index);
+    }
+#endif
+}
+
+void TCPWorker::readClient(uint32_t index)
+{
+#ifdef TCP_SERVER_SUPPORTED
+    struct TCPSecureConnection *conn = this->connections[index];
+
+    for (int i = 0; i < TCP_READ_BUDGET; ++i) {
+        ssize_t length = recv(conn->sock, (char *)this->readBuffer, sizeof(this->readBuffer), 0);
+
+        if (length < 0 && errno == EINTR)
+            continue;
+
+        if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+
+        if (length <= 0 || !this->consume(index, this->readBuffer, (size_t)length)) {
+            this->kill(index);
+            return;
+        }
+
+        /* A short read emptied the socket, the next data raises a new edge. */
+        if ((size_t)length < sizeof(this->readBuffer))
+            return;
+    }
+
+    /* Edge triggered: the data left has to be read without a new event. */
+    conn->reading = true;
+    this->readList.push_back(this->handleOf(conn));
+#endif
+}
+
+/* return the size of the frame starting at data, 2 while its length is unknown, 0 if it is invalid. */
+static size_t frameSize(const struct TCPSecureConnection *conn, const uint8_t *data, size_t available)
+{
+    if (conn->status == TCP_STATUS_CONNECTED)
+        return TCP_CLIENT_HANDSHAKE_SIZE;
+
+    if (available < 2)
+        return 2;
+
+    uint16_t length = Utils::readUint16(data);
+
+    if (length <= crypto_box_MACBYTES || length > TCP_MAX_PACKET_SIZE)
+        return 0;
+
+    return 2 + (size_t)length;
+}
+
+/* Split what was read into frames, the start of an incomplete one is kept for the next read.
+ *
+ * return false if the connection must be closed.
+ */
+bool TCPWorker::consume(uint32_t index, const uint8_t* data, size_t length)
+{
+    struct TCPSecureConnection *conn = this->connections[index];
+    size_t position = 0;
+
+    while (conn->input) {
+        struct TCPInput *input = conn->input;
+        size_t needed = frameSize(conn, input->data, input->length);
+
+        if (needed == 0)
+            return false;
+
+        size_t take = std::min(needed - input->length, length - position);
+        memcpy(input->data + input->length, data + position, take);
+        input->length += (uint32_t)take;
+        position += take;
+
+        if (input->length < needed)
+            return true;
+
+        /* Only the length prefix so far. */
+        if (needed == 2)
+            continue;
+
+        bool valid = this->handleFrame(index, input->data, needed);
+        free(input);
+        conn->input = NULL;
+        this->bufferedBytes -= sizeof(struct TCPInput);
+
+        if (!valid)
+            return false;
+    }
+
+    while (position < length) {
+        size_t needed = frameSize(conn, data + position, length - position);
+
+        if (needed == 0)
+            return false;
+
+        if (length - position < needed) {
+            conn->input = (struct TCPInput *)malloc(sizeof(struct TCPInput));
+
+            if (!conn->input)
+                return false;
+
+            this->bufferedBytes += sizeof(struct TCPInput);
+            conn->input->length = (uint32_t)(length - position);
+            memcpy(conn->input->data, data + position, length - position);
+            return true;
+        }
+
+        if (!this->handleFrame(index, data + position, needed))
+            return false;
+
+        position += needed;
+    }
+
+    return true;
+}
+
+bool TCPWorker::handleFrame(uint32_t index, const uint8_t* frame, size_t length)
+{
+    struct TCPSecureConnection *conn = this->connections[index];
+
+    if (conn->status == TCP_STATUS_CONNECTED)
+        return this->handleHandshake(conn, frame);
+
+    uint8_t plain[TCP_MAX_PACKET_SIZE];
+    int plainLength = Crypto::decryptDataSymmetric(conn->sharedKey, conn->recvNonce, frame + 2,
+                                                   (uint32_t)(length - 2), plain);
+
+    if (plainLength != (int)(length - 2 - crypto_box_MACBYTES) || plainLength == 0)
+        return false;
+
+    Crypto::incrementNonce(conn->recvNonce);
+
+    /* The first packet proves the client has the keys, only now others can find it. */
+    if (conn->status == TCP_STATUS_UNCONFIRMED) {
+        conn->status = TCP_STATUS_CONFIRMED;
+        conn->lastPinged = NetworkService::getCurrentTimeMonotonic();
+        ++this->confirmedCount;
+
+        uint64_t old = this->server->addClient(conn->publicKey, this->handleOf(conn));
+
+        if (old)
+            this->route(TCP_MESSAGE_KILL, old, 0, 0, 0, NULL, NULL, 0);
+    }
+
+    return this->handlePacket(index, plain, (uint16_t)plainLength);
+}
+
+bool TCPWorker::handleHandshake(struct TCPSecureConnection* conn, const uint8_t* data)
+{
+    uint8_t plain[TCP_HANDSHAKE_PLAIN_SIZE];
+    const uint8_t *clientKey = data;
+    const uint8_t *nonce = data + crypto_box_PUBLICKEYBYTES;
+
+    if (Crypto::decryptData(clientKey, this->server->secretKey, nonce, nonce + crypto_box_NONCEBYTES,
+                            TCP_HANDSHAKE_PLAIN_SIZE + crypto_box_MACBYTES, plain) != TCP_HANDSHAKE_PLAIN_SIZE)
+        return false;
+
+    uint8_t tempPublicKey[crypto_box_PUBLICKEYBYTES];
+    uint8_t tempSecretKey[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(tempPublicKey, tempSecretKey);
+    Crypto::encryptPrecompute(plain, tempSecretKey, conn->sharedKey);
+    sodium_memzero(tempSecretKey, sizeof(tempSecretKey));
+
+    memcpy(conn->publicKey, clientKey, crypto_box_PUBLICKEYBYTES);
+    memcpy(conn->recvNonce, plain + crypto_box_PUBLICKEYBYTES, crypto_box_NONCEBYTES);
+
+    uint8_t response[TCP_SERVER_HANDSHAKE_SIZE];
+    Crypto::randomNonce(conn->sentNonce);
+    memcpy(plain, tempPublicKey, crypto_box_PUBLICKEYBYTES);
+    memcpy(plain + crypto_box_PUBLICKEYBYTES, conn->sentNonce, crypto_box_NONCEBYTES);
+    Crypto::randomNonce(response);
+
+    if (Crypto::encryptData(clientKey, this->server->secretKey, response, plain, TCP_HANDSHAKE_PLAIN_SIZE,
+                            response + crypto_box_NONCEBYTES) != TCP_HANDSHAKE_PLAIN_SIZE + crypto_box_MACBYTES)
+        return false;
+
+    conn->status = TCP_STATUS_UNCONFIRMED;
+    return this->queue(conn, response, sizeof(response));
+}
+
+bool TCPWorker::handlePacket(uint32_t index, const uint8_t* data, uint16_t length)
+{
+    struct TCPSecureConnection *conn = this->connections[index];
+
+    switch (data[0]) {
+        case TCP_PACKET_ROUTING_REQUEST:
+            if (length != 1 + crypto_box_PUBLICKEYBYTES)
+                return false;
+
+            return this->handleRoutingRequest(index, data + 1);
+
+        case TCP_PACKET_CONNECTION_NOTIFICATION:
+            return length == 2;
+
+        case TCP_PACKET_DISCONNECT_NOTIFICATION:
+            if (length != 2)
+                return false;
+
+            return this->handleDisconnect(index, data[1]);
+
+        case TCP_PACKET_PING: {
+            if (length != 1 + sizeof(uint64_t))
+                return false;
+
+            uint8_t response[1 + sizeof(uint64_t)];
+            response[0] = TCP_PACKET_PONG;
+            memcpy(response + 1, data + 1, sizeof(uint64_t));
+            this->sendPacket(conn, response, sizeof(response));
+            return true;
+        }
+
+        case TCP_PACKET_PONG: {
+            if (length != 1 + sizeof(uint64_t))
+                return false;
+
+            uint64_t pingId;
+            memcpy(&pingId, data + 1, sizeof(uint64_t));
+
+            if (pingId && pingId == conn->pingId)
+                conn->pingId = 0;
+
+            return true;
+        }
+
+        case TCP_PACKET_OOB_SEND: {
+            if (length <= 1 + crypto_box_PUBLICKEYBYTES || length > 1 + crypto_box_PUBLICKEYBYTES + TCP_MAX_OOB_DATA_LENGTH)
+                return false;
+
+            uint64_t target = this->server->findClient(data + 1);
+
+            if (target && target != this->handleOf(conn)) {
+                this->route(TCP_MESSAGE_OOB, target, 0, this->handleOf(conn), 0, conn->publicKey,
+                            data + 1 + crypto_box_PUBLICKEYBYTES, length - 1 - crypto_box_PUBLICKEYBYTES);
+            }
+
+            return true;
+        }
+
+        case TCP_PACKET_ONION_REQUEST:
+        case TCP_PACKET_ONION_RESPONSE:
+            /* No onion on relays yet. */
+            return true;
+
+        default:
+            break;
+    }
+
+    if (data[0] < NUM_RESERVED_PORTS)
+        return false;
+
+    uint8_t id = data[0] - NUM_RESERVED_PORTS;
+
+    /* Data for a connection that isn't online (yet) is dropped, not an error. */
+    if (conn->routes && conn->routes[id].status == 2) {
+        this->route(TCP_MESSAGE_DATA, conn->routes[id].peer, conn->routes[id].peerId, this->handleOf(conn), id,
+                    NULL, data + 1, length - 1);
+    }
+
+    return true;
+}
+
+bool TCPWorker::handleRoutingRequest(uint32_t index, const uint8_t* publicKey)
+{
+    struct TCPSecureConnection *conn = this->connections[index];
+    uint8_t response[2 + crypto_box_PUBLICKEYBYTES];
+    response[0] = TCP_PACKET_ROUTING_RESPONSE;
+    response[1] = 0;
+    memcpy(response + 2, publicKey, crypto_box_PUBLICKEYBYTES);
+
+    if (Crypto::comparePublicKeys(publicKey, conn->publicKey) == 0) {
+        this->sendPacket(conn, response, sizeof(response));
+        return true;
+    }
+
+    if (!conn->routes) {
+        conn->routes = (struct TCPRoute *)calloc(NUM_CLIENT_CONNECTIONS, sizeof(struct TCPRoute));
+
+        if (!conn->routes)
+            return false;
+    }
+
+    int unused = -1;
+
+    for (int i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
+        if (conn->routes[i].status == 0) {
+            if (unused == -1)
+                unused = i;
+        } else if (Crypto::comparePublicKeys(conn->routes[i].publicKey, publicKey) == 0) {
+            response[1] = (uint8_t)(i + NUM_RESERVED_PORTS);
+            this->sendPacket(conn, response, sizeof(response));
+            return true;
+        }
+    }
+
+    if (unused == -1) {
+        this->sendPacket(conn, response, sizeof(response));
+        return true;
+    }
+
+    struct TCPRoute *route = &conn->routes[unused];
+    memcpy(route->publicKey, publicKey, crypto_box_PUBLICKEYBYTES);
+    route->status = 1;
+    route->peer = 0;
+    response[1] = (uint8_t)(unused + NUM_RESERVED_PORTS);
+    this->sendPacket(conn, response, sizeof(response));
+
+    /* If the other client asked for us too, its worker links both routes. */
+    uint64_t target = this->server->findClient(publicKey);
+
+    if (target)
+        this->route(TCP_MESSAGE_LINK, target, 0, this->handleOf(conn), (uint8_t)unused, conn->publicKey, NULL, 0);
+
+    return true;
+}
+
+bool TCPWorker::handleDisconnect(uint32_t index, uint8_t connectionId)
+{
+    struct TCPSecureConnection *conn = this->connections[index];
+
+    if (connectionId < NUM_RESERVED_PORTS)
+        return false;
+
+    uint8_t id = connectionId - NUM_RESERVED_PORTS;
+
+    if (!conn->routes || conn->routes[id].status == 0)
+        return false;
+
+    if (conn->routes[id].status == 2)
+        this->route(TCP_MESSAGE_UNLINK, conn->routes[id].peer, conn->routes[id].peerId, this->handleOf(conn), id, NULL, NULL, 0);
+
+    memset(&conn->routes[id], 0, sizeof(struct TCPRoute));
+    return true;
+}
+
+/* Point route id of conn to peer, telling the client if it used to lead elsewhere. */
+void TCPWorker::linkRoute(struct TCPSecureConnection* conn, uint8_t id, uint64_t peer, uint8_t peerId)
+{
+    struct TCPRoute *route = &conn->routes[id];
+
+    if (route->status == 2) {
+        if (route->peer == peer && route->peerId == peerId)
+            return;
+
+        /* The other client reconnected before we heard it left. */
+        this->sendControl(conn, TCP_PACKET_DISCONNECT_NOTIFICATION, id + NUM_RESERVED_PORTS);
+    }
+
+    route->status = 2;
+    route->peer = peer;
+    route->peerId = peerId;
+    this->sendControl(conn, TCP_PACKET_CONNECTION_NOTIFICATION, id + NUM_RESERVED_PORTS);
+}
+
+void TCPWorker::handleLink(struct TCPSecureConnection* conn, uint64_t from, uint8_t fromId, const uint8_t* publicKey)
+{
+    if (!conn->routes)
+        return;
+
+    for (int i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
+        struct TCPRoute *route = &conn->routes[i];
+
+        if (route->status == 0 || Crypto::comparePublicKeys(route->publicKey, publicKey) != 0)
+            continue;
+
+        this->linkRoute(conn, (uint8_t)i, from, fromId);
+        this->route(TCP_MESSAGE_LINKED, from, fromId, this->handleOf(conn), (uint8_t)i, conn->publicKey, NULL, 0);
+        return;
+    }
+}
+
+void TCPWorker::handleLinked(struct TCPSecureConnection* conn, uint8_t id, uint64_t from, uint8_t fromId, const uint8_t* publicKey)
+{
+    if (!conn->routes || id >= NUM_CLIENT_CONNECTIONS || conn->routes[id].status == 0
+        || Crypto::comparePublicKeys(conn->routes[id].publicKey, publicKey) != 0)
+        return;
+
+    this->linkRoute(conn, id, from, fromId);
+}
+
+void TCPWorker::route(TCPMessageType type, uint64_t target, uint8_t id, uint64_t from, uint8_t fromId,
+                      const uint8_t* publicKey, const uint8_t* data, uint16_t length)
+{
+    if (TCP_HANDLE_WORKER(target) == this->index) {
+        this->dispatch(type, target, id, from, fromId, publicKey, data, length);
+    } else {
+        this->server->getWorker(target)->post(type, target, id, from, fromId, publicKey, data, length);
+    }
+}
+
+/* Called by other workers. */
+void TCPWorker::post(TCPMessageType type, uint64_t target, uint8_t id, uint64_t from, uint8_t fromId,
+                     const uint8_t* publicKey, const uint8_t* data, uint16_t length)
+{
+    std::lock_guard<std::mutex> guard(this->inboxLock);
+    this->inbox.push_back(TCPMessage());
+    struct TCPMessage &message = this->inbox.back();
+    message.type = (uint8_t)type;
+    message.target = target;
+    message.id = id;
+    message.from = from;
+    message.fromId = fromId;
+    message.length = length;
+
+    if (publicKey)
+        memcpy(message.publicKey, publicKey, crypto_box_PUBLICKEYBYTES);
+
+    if (length)
+        memcpy(message.data, data, length);
+
+    if (!this->woken) {
+        this->woken = true;
+
+        if (write(this->wakePipe[1], "", 1) < 0) {
+            /* Already readable. */
+        }
+    }
+}
+
+void TCPWorker::handleInbox()
+{
+    std::vector<struct TCPMessage> messages;
+    uint8_t drain[64];
+
+    while (read(this->wakePipe[0], drain, sizeof(drain)) > 0) {
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(this->inboxLock);
+        messages.swap(this->inbox);
+        this->woken = false;
+    }
+
+    for (size_t i = 0; i < messages.size(); ++i) {
+        struct TCPMessage &message = messages[i];
+        this->dispatch((TCPMessageType)message.type, message.target, message.id, message.from, message.fromId,
+                       message.publicKey, message.data, message.length);
+    }
+}
+
+void TCPWorker::dispatch(TCPMessageType type, uint64_t target, uint8_t id, uint64_t from, uint8_t fromId,
+                         const uint8_t* publicKey, const uint8_t* data, uint16_t length)
+{
+    struct TCPSecureConnection *conn = this->getConnection(target);
+
+    if (!conn)
+        return;
+
+    switch (type) {
+        case TCP_MESSAGE_LINK:
+            this->handleLink(conn, from, fromId, publicKey);
+            break;
+
+        case TCP_MESSAGE_LINKED:
+            this->handleLinked(conn, id, from, fromId, publicKey);
+            break;
+
+        case TCP_MESSAGE_UNLINK: {
+            struct TCPRoute *route = conn->routes ? &conn->routes[id] : NULL;
+
+            if (route && route->status == 2 && route->peer == from && route->peerId == fromId) {
+                route->status = 1;
+                route->peer = 0;
+                this->sendControl(conn, TCP_PACKET_DISCONNECT_NOTIFICATION, id + NUM_RESERVED_PORTS);
+            }
+            break;
+        }
+
+        case TCP_MESSAGE_DATA: {
+            struct TCPRoute *route = conn->routes ? &conn->routes[id] : NULL;
+
+            if (!route || route->status != 2 || route->peer != from || route->peerId != fromId)
+                break;
+
+            uint8_t packet[TCP_MAX_PACKET_SIZE];
+            packet[0] = id + NUM_RESERVED_PORTS;
+            memcpy(packet + 1, data, length);
+
+            if (this->sendPacket(conn, packet, length + 1))
+                ++this->forwarded;
+            break;
+        }
+
+        case TCP_MESSAGE_OOB: {
+            uint8_t packet[1 + crypto_box_PUBLICKEYBYTES + TCP_MAX_OOB_DATA_LENGTH];
+            packet[0] = TCP_PACKET_OOB_RECV;
+            memcpy(packet + 1, publicKey, crypto_box_PUBLICKEYBYTES);
+            memcpy(packet + 1 + crypto_box_PUBLICKEYBYTES, data, length);
+            this->sendPacket(conn, packet, 1 + crypto_box_PUBLICKEYBYTES + length);
+            break;
+        }
+
+        case TCP_MESSAGE_KILL:
+            this->kill(TCP_HANDLE_INDEX(target));
+            break;
+    }
+}
+
+/* Encrypt a packet into the send buffer of conn, written at the end of the iteration.
+ *
+ * return false if it was dropped.
+ */
+bool TCPWorker::sendPacket(struct TCPSecureConnection* conn, const uint8_t* data, uint16_t length)
+{
+    if (conn->status == TCP_STATUS_CONNECTED || length + crypto_box_MACBYTES > TCP_MAX_PACKET_SIZE)
+        return false;
+
+    uint8_t frame[2 + TCP_MAX_PACKET_SIZE];
+    size_t frameLength = 2 + length + crypto_box_MACBYTES;
+
+    /* Hand what is queued to the kernel early before giving up on the packet. */
+    if (conn->output && TCP_SEND_BUFFER_SIZE - conn->output->length < frameLength && this->flush(conn)
+        && conn->output && TCP_SEND_BUFFER_SIZE - conn->output->length < frameLength) {
+        ++this->dropped;
+        return false;
+    }
+
+    if (Crypto::encryptDataSymmetric(conn->sharedKey, conn->sentNonce, data, length, frame + 2)
+        != (int)(length + crypto_box_MACBYTES))
+        return false;
+
+    Utils::writeUint16(frame, (uint16_t)(length + crypto_box_MACBYTES));
+    Crypto::incrementNonce(conn->sentNonce);
+    return this->queue(conn, frame, frameLength);
+}
+
+bool TCPWorker::sendControl(struct TCPSecureConnection* conn, uint8_t packetId, uint8_t connectionId)
+{
+    uint8_t packet[2] = {packetId, connectionId};
+    return this->sendPacket(conn, packet, sizeof(packet));
+}
+
+bool TCPWorker::queue(struct TCPSecureConnection* conn, const uint8_t* data, size_t length)
+{
+    if (!conn->output) {
+        conn->output = (struct TCPRing *)malloc(sizeof(struct TCPRing));
+
+        if (!conn->output)
+            return false;
+
+        conn->output->head = 0;
+        conn->output->length = 0;
+        this->bufferedBytes += sizeof(struct TCPRing);
+    }
+
+    struct TCPRing *ring = conn->output;
+
+    if (TCP_SEND_BUFFER_SIZE - ring->length < length)
+        return false;
+
+    uint32_t tail = (ring->head + ring->length) % TCP_SEND_BUFFER_SIZE;
+    size_t first = std::min(length, (size_t)(TCP_SEND_BUFFER_SIZE - tail));
+    memcpy(ring->data + tail, data, first);
+    memcpy(ring->data, data + first, length - first);
+    ring->length += (uint32_t)length;
+
+    if (!conn->flushing) {
+        conn->flushing = true;
+        this->flushList.push_back(this->handleOf(conn));
+    }
+
+    return true;
+}
+
+/* Write everything queued for conn, all frames in one writev.
+ *
+ * return false if the connection broke.
+ */
+bool TCPWorker::flush(struct TCPSecureConnection* conn)
+{
+#ifdef TCP_SERVER_SUPPORTED
+    struct TCPRing *ring = conn->output;
+
+    while (ring->length > 0) {
+        struct iovec iov[2];
+        size_t first = std::min((size_t)ring->length, (size_t)(TCP_SEND_BUFFER_SIZE - ring->head));
+        iov[0].iov_base = ring->data + ring->head;
+        iov[0].iov_len = first;
+        iov[1].iov_base = ring->data;
+        iov[1].iov_len = ring->length - first;
+
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = iov;
+        message.msg_iovlen = iov[1].iov_len ? 2 : 1;
+
+#ifdef MSG_NOSIGNAL
+        ssize_t written = sendmsg(conn->sock, &message, MSG_NOSIGNAL);
+#else
+        ssize_t written = sendmsg(conn->sock, &message, 0);
+#endif
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+
+            /* Full, the writable edge brings us back. */
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        ring->head = (uint32_t)((ring->head + (size_t)written) % TCP_SEND_BUFFER_SIZE);
+        ring->length -= (uint32_t)written;
+    }
+
+    free(ring);
+    conn->output = NULL;
+    this->bufferedBytes -= sizeof(struct TCPRing);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void TCPWorker::flushAll()
+{
+    std::vector<uint64_t> flushing;
+    flushing.swap(this->flushList);
+
+    for (size_t i = 0; i < flushing.size(); ++i) {
+        struct TCPSecureConnection *conn = this->getConnection(flushing[i]);
+
+        if (!conn)
+            continue;
+
+        conn->flushing = false;
+
+        if (conn->output && !this->flush(conn))
+            this->kill(TCP_HANDLE_INDEX(flushing[i]));
+    }
+
+    /* Keep the capacity for the next iteration. */
+    if (this->flushList.empty())
+        this->flushList.swap(flushing);
+
+    this->flushList.clear();
+}
+
+void TCPWorker::sweep(uint64_t now)
+{
+    for (uint32_t i = 0; i < this->connections.size(); ++i) {
+        struct TCPSecureConnection *conn = this->connections[i];
+
+        switch (conn->status) {
+            case TCP_STATUS_CONNECTED:
+            case TCP_STATUS_UNCONFIRMED:
+                if (now - conn->connectedTime >= TCP_CONNECTION_TIMEOUT)
+                    this->kill(i);
+                break;
+
+            case TCP_STATUS_CONFIRMED:
+                if (conn->pingId) {
+                    if (now - conn->lastPinged >= TCP_PING_TIMEOUT)
+                        this->kill(i);
+                } else if (now - conn->lastPinged >= TCP_PING_FREQUENCY) {
+                    uint8_t ping[1 + sizeof(uint64_t)];
+                    uint64_t pingId = Crypto::random64b() | 1;
+                    ping[0] = TCP_PACKET_PING;
+                    memcpy(ping + 1, &pingId, sizeof(uint64_t));
+
+                    if (this->sendPacket(conn, ping, sizeof(ping))) {
+                        conn->pingId = pingId;
+                        conn->lastPinged = now;
+                    }
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+void TCPWorker::kill(uint32_t index)
+{
+    struct TCPSecureConnection *conn = this->connections[index];
+    uint64_t handle = this->handleOf(conn);
+
+    if (conn->status == TCP_STATUS_NO_STATUS)
+        return;
+
+    if (conn->status == TCP_STATUS_CONFIRMED) {
+        this->server->removeClient(conn->publicKey, handle);
+        --this->confirmedCount;
+    }
+
+    /* Closed first so nothing we route below ends up in its buffers. */
+    conn->status = TCP_STATUS_NO_STATUS;
+    ++conn->generation;
+
+    if (conn->generation == 0)
+        conn->generation = 1;
+
+    NetworkService::killSock(conn->sock);
+    --this->connectionCount;
+
+    if (conn->routes) {
+        for (uint8_t i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
+            if (conn->routes[i].status == 2)
+                this->route(TCP_MESSAGE_UNLINK, conn->routes[i].peer, conn->routes[i].peerId, handle, i, NULL, NULL, 0);
+        }
+
+        free(conn->routes);
+        conn->routes = NULL;
+    }
+
+    if (conn->input) {
+        free(conn->input);
+        conn->input = NULL;
+        this->bufferedBytes -= sizeof(struct TCPInput);
+    }
+
+    if (conn->output) {
+        free(conn->output);
+        conn->output = NULL;
+        this->bufferedBytes -= sizeof(struct TCPRing);
+    }
+
+    conn->flushing = false;
+    conn->reading = false;
+    sodium_memzero(conn->sharedKey, sizeof(conn->sharedKey));
+    this->freeConnections.push_back(index);
+}
+
+bool TCPServer::Key::operator==(const Key& other) const
+{
+    return memcmp(this->data, other.data, sizeof(this->data)) == 0;
+}
+
+/* Keys are random, their first bytes are as good as any hash. */
+size_t TCPServer::KeyHash::operator()(const Key& key) const
+{
+    size_t hash;
+    memcpy(&hash, key.data + 1, sizeof(hash));
+    return hash;
+}
+
+TCPServer::TCPServer(const uint8_t* publicKey, const uint8_t* secretKey)
+{
+    memcpy(this->publicKey, publicKey, sizeof(this->publicKey));
+    memcpy(this->secretKey, secretKey, sizeof(this->secretKey));
+    this->port = 0;
+}
+
+TCPServer* TCPServer::create(IP ip, uint16_t port, const uint8_t* publicKey, const uint8_t* secretKey,
+                             unsigned int workers)
+{
+#ifdef TCP_SERVER_SUPPORTED
+    if (ip.family != AF_INET && ip.family != AF_INET6)
+        return NULL;
+
+    NetworkService::networkingAtStartup();
+    workers = std::max(1u, std::min(workers, (unsigned int)TCP_MAX_WORKERS));
+    TCPServer *server = new TCPServer(publicKey, secretKey);
+
+    for (unsigned int i = 0; i < workers; ++i) {
+        TCPWorker *worker = new TCPWorker(server, i);
+        server->workers.push_back(worker);
+
+        if (!worker->init()) {
+            delete server;
+            return NULL;
+        }
+
+        if (i == 0) {
+            struct sockaddr_storage addr;
+            socklen_t addrsize = sizeof(addr);
+
+            if (!worker->listen(ip, port, false)
+                || getsockname(worker->listenSock, (struct sockaddr *)&addr, &addrsize) != 0) {
+                delete server;
+                return NULL;
+            }
+
+            server->port = ntohs(addr.ss_family == AF_INET ? ((struct sockaddr_in *)&addr)->sin_port
+                                                           : ((struct sockaddr_in6 *)&addr)->sin6_port);
+        } else if (!worker->listen(ip, server->port, true)) {
+            /* No port sharing: the worker only serves clients handed to it. */
+            if (NetworkService::sockIsValid(worker->listenSock))
+                NetworkService::killSock(worker->listenSock);
+
+            worker->listenSock = -1;
+        }
+    }
+
+    for (size_t i = 0; i < server->workers.size(); ++i)
+        server->workers[i]->thread = std::thread(&TCPWorker::run, server->workers[i]);
+
+    return server;
+#else
+    return NULL;
+#endif
+}
+
+TCPServer::~TCPServer()
+{
+    for (size_t i = 0; i < this->workers.size(); ++i)
+        this->workers[i]->stop();
+
+    for (size_t i = 0; i < this->workers.size(); ++i) {
+        if (this->workers[i]->thread.joinable())
+            this->workers[i]->thread.join();
+    }
+
+    for (size_t i = 0; i < this->workers.size(); ++i)
+        delete this->workers[i];
+
+    sodium_memzero(this->secretKey, sizeof(this->secretKey));
+}
+
+uint16_t TCPServer::getPort()
+{
+    return this->port;
+}
+
+TCPServerStats TCPServer::getStats()
+{
+    TCPServerStats stats;
+    memset(&stats, 0, sizeof(stats));
+
+    for (size_t i = 0; i < this->workers.size(); ++i) {
+        TCPWorker *worker = this->workers[i];
+        stats.connections += worker->connectionCount;
+        stats.confirmed += worker->confirmedCount;
+        stats.bufferedBytes += worker->bufferedBytes;
+        stats.forwarded += worker->forwarded;
+        stats.dropped += worker->dropped;
+    }
+
+    return stats;
+}
+
+uint64_t TCPServer::findClient(const uint8_t* publicKey)
+{
+    Key key;
+    memcpy(key.data, publicKey, sizeof(key.data));
+    KeyShard &shard = this->shards[publicKey[0] % TCP_KEY_SHARDS];
+    std::lock_guard<std::mutex> guard(shard.lock);
+    std::unordered_map<Key, uint64_t, KeyHash>::iterator it = shard.clients.find(key);
+    return it == shard.clients.end() ? 0 : it->second;
+}
+
+/* return the handle of the connection that had the key before, 0 if none. */
+uint64_t TCPServer::addClient(const uint8_t* publicKey, uint64_t handle)
+{
+    Key key;
+    memcpy(key.data, publicKey, sizeof(key.data));
+    KeyShard &shard = this->shards[publicKey[0] % TCP_KEY_SHARDS];
+    std::lock_guard<std::mutex> guard(shard.lock);
+    uint64_t &entry = shard.clients[key];
+    uint64_t old = entry;
+    entry = handle;
+    return old;
+}
+
+void TCPServer::removeClient(const uint8_t* publicKey, uint64_t handle)
+{
+    Key key;
+    memcpy(key.data, publicKey, sizeof(key.data));
+    KeyShard &shard = this->shards[publicKey[0] % TCP_KEY_SHARDS];
+    std::lock_guard<std::mutex> guard(shard.lock);
+    std::unordered_map<Key, uint64_t, KeyHash>::iterator it = shard.clients.find(key);
+
+    if (it != shard.clients.end() && it->second == handle)
+        shard.clients.erase(it);
+}
+
+TCPWorker* TCPServer::getWorker(uint64_t handle)
+{
+    return this->workers[TCP_HANDLE_WORKER(handle)];
+}
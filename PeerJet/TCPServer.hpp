@@ -0,0 +1,129 @@
+//
+//  TCPServer.hpp
+//  PeerJet
+//
+//  Created by Compy on 12/9/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef TCPServer_hpp
+#define TCPServer_hpp
+
+#include <cstdint>
+#include <mutex>
+#include <stdio.h>
+#include <unordered_map>
+#include <vector>
+#include "Crypto.hpp"
+#include "NetworkService.hpp"
+
+/* Relay protocol, compatible with the toxcore TCP server.
+ *
+ * The client opens with [client public key][nonce][encrypted: temporary public key, base nonce],
+ * the server answers [nonce][encrypted: temporary public key, base nonce]. Both sides then
+ * exchange frames of [length (big endian uint16)][packet encrypted with the shared key of the
+ * temporary keys], the nonce of each direction starts at its base nonce and is incremented
+ * after every frame.
+ */
+#define TCP_HANDSHAKE_PLAIN_SIZE    (crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES)
+#define TCP_SERVER_HANDSHAKE_SIZE   (crypto_box_NONCEBYTES + TCP_HANDSHAKE_PLAIN_SIZE + crypto_box_MACBYTES)
+#define TCP_CLIENT_HANDSHAKE_SIZE   (crypto_box_PUBLICKEYBYTES + TCP_SERVER_HANDSHAKE_SIZE)
+
+/* Largest encrypted packet in a frame. */
+#define TCP_MAX_PACKET_SIZE         2048
+#define TCP_MAX_OOB_DATA_LENGTH     1024
+
+/* Packets 0 to NUM_RESERVED_PORTS - 1 are control packets, data for the routed
+ * connection n travels in packets starting with n + NUM_RESERVED_PORTS.
+ */
+#define NUM_RESERVED_PORTS          16
+#define NUM_CLIENT_CONNECTIONS      (256 - NUM_RESERVED_PORTS)
+
+#define TCP_PACKET_ROUTING_REQUEST      0   /* [public key] */
+#define TCP_PACKET_ROUTING_RESPONSE     1   /* [connection id or 0][public key] */
+#define TCP_PACKET_CONNECTION_NOTIFICATION 2 /* [connection id] */
+#define TCP_PACKET_DISCONNECT_NOTIFICATION 3 /* [connection id] */
+#define TCP_PACKET_PING                 4   /* [ping id (8 bytes)] */
+#define TCP_PACKET_PONG                 5   /* [ping id (8 bytes)] */
+#define TCP_PACKET_OOB_SEND             6   /* [public key][data] */
+#define TCP_PACKET_OOB_RECV             7   /* [public key][data] */
+#define TCP_PACKET_ONION_REQUEST        8
+#define TCP_PACKET_ONION_RESPONSE       9
+
+#define TCP_CONNECTION_TIMEOUT      10000   /* ms a client has to finish the handshake */
+#define TCP_PING_FREQUENCY          30000   /* ms */
+#define TCP_PING_TIMEOUT            10000   /* ms */
+
+/* Bytes queued for a client before further packets to it are dropped. Together with
+ * one partial incoming frame this bounds the memory of a connection, both buffers
+ * are only allocated while they hold data.
+ */
+#define TCP_SEND_BUFFER_SIZE        (32 * 1024)
+
+/* Locks guarding the public key index, picked by the first byte of the key. */
+#define TCP_KEY_SHARDS              64
+
+struct TCPWorker;
+
+typedef struct {
+    uint64_t connections;   /* sockets, including handshakes in progress */
+    uint64_t confirmed;     /* clients that sent their first packet */
+    uint64_t bufferedBytes; /* memory held by send and partial receive buffers */
+    uint64_t forwarded;     /* packets relayed between clients */
+    uint64_t dropped;       /* packets dropped because a send buffer was full */
+} TCPServerStats;
+
+/* Relay for clients that can't reach each other over UDP (Node::addTcpRelay).
+ *
+ * Every worker thread runs its own epoll (kqueue on the BSDs) loop over its own
+ * listening socket, the kernel spreads new connections over them (SO_REUSEPORT).
+ * A connection is only ever touched by the worker that accepted it, packets to a
+ * client of another worker are handed over through that worker's inbox.
+ */
+class TCPServer {
+public:
+    /* Listen on ip:port (host byte order) with workers threads.
+     *
+     * return NULL if the port can't be bound or the platform has no TCP server support.
+     */
+    static TCPServer* create(IP ip, uint16_t port, const uint8_t* publicKey, const uint8_t* secretKey,
+                             unsigned int workers);
+    ~TCPServer();
+
+    /* return the port we listen on, in host byte order. */
+    uint16_t getPort();
+    TCPServerStats getStats();
+
+private:
+    friend struct TCPWorker;
+
+    TCPServer(const uint8_t* publicKey, const uint8_t* secretKey);
+
+    struct Key {
+        uint8_t data[crypto_box_PUBLICKEYBYTES];
+        bool operator==(const Key& other) const;
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+
+    /* Confirmed clients by public key, the value is the handle of their connection. */
+    struct KeyShard {
+        std::mutex lock;
+        std::unordered_map<Key, uint64_t, KeyHash> clients;
+    };
+
+    uint64_t findClient(const uint8_t* publicKey);
+    uint64_t addClient(const uint8_t* publicKey, uint64_t handle);
+    void removeClient(const uint8_t* publicKey, uint64_t handle);
+    TCPWorker* getWorker(uint64_t handle);
+
+    uint8_t publicKey[crypto_box_PUBLICKEYBYTES];
+    uint8_t secretKey[crypto_box_SECRETKEYBYTES];
+    uint16_t port;
+    std::vector<TCPWorker*> workers;
+    KeyShard shards[TCP_KEY_SHARDS];
+};
+
+#endif /* TCPServer_hpp */
@@ -17,6 +17,42 @@ class Utils {
 public:
     static void updateUnixTime();
     static uint64_t getUnixTime();
+
+    /* Integers on the wire and on disk, big endian. buffer needs no alignment. */
+    static inline void writeUint16(uint8_t *buffer, uint16_t value)
+    {
+        buffer[0] = (uint8_t)(value >> 8);
+        buffer[1] = (uint8_t)value;
+    }
+
+    static inline void writeUint32(uint8_t *buffer, uint32_t value)
+    {
+        buffer[0] = (uint8_t)(value >> 24);
+        buffer[1] = (uint8_t)(value >> 16);
+        buffer[2] = (uint8_t)(value >> 8);
+        buffer[3] = (uint8_t)value;
+    }
+
+    static inline void writeUint64(uint8_t *buffer, uint64_t value)
+    {
+        writeUint32(buffer, (uint32_t)(value >> 32));
+        writeUint32(buffer + 4, (uint32_t)value);
+    }
+
+    static inline uint16_t readUint16(const uint8_t *buffer)
+    {
+        return (uint16_t)((buffer[0] << 8) | buffer[1]);
+    }
+
+    static inline uint32_t readUint32(const uint8_t *buffer)
+    {
+        return ((uint32_t)buffer[0] << 24) | ((uint32_t)buffer[1] << 16) | ((uint32_t)buffer[2] << 8) | buffer[3];
+    }
+
+    static inline uint64_t readUint64(const uint8_t *buffer)
+    {
+        return ((uint64_t)readUint32(buffer) << 32) | readUint32(buffer + 4);
+    }
     
 private:
     static uint64_t unixTime;
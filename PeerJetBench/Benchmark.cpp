@@ -0,0 +1,168 @@
+//
+//  Benchmark.cpp
+//  PeerJetBench
+//
+//  Created by Compy on 12/4/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include "Benchmark.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+typedef struct {
+    const char *name;
+    BenchmarkFunction function;
+} BenchmarkEntry;
+
+static std::vector<BenchmarkEntry>& registry()
+{
+    static std::vector<BenchmarkEntry> benchmarks;
+    return benchmarks;
+}
+
+BenchmarkState::BenchmarkState(uint64_t iterations)
+    : iterations(iterations), remaining(iterations), bytesPerIteration(0), running(false), error(NULL),
+      elapsed(std::chrono::steady_clock::duration::zero())
+{
+}
+
+bool BenchmarkState::keepRunning()
+{
+    if (!this->running) {
+        if (this->error)
+            return false;
+
+        this->running = true;
+        this->start = std::chrono::steady_clock::now();
+    }
+
+    if (this->remaining != 0 && !this->error) {
+        --this->remaining;
+        return true;
+    }
+
+    this->elapsed += std::chrono::steady_clock::now() - this->start;
+    return false;
+}
+
+void BenchmarkState::pauseTiming()
+{
+    this->elapsed += std::chrono::steady_clock::now() - this->start;
+}
+
+void BenchmarkState::resumeTiming()
+{
+    this->start = std::chrono::steady_clock::now();
+}
+
+void BenchmarkState::setBytesPerIteration(uint64_t bytes)
+{
+    this->bytesPerIteration = bytes;
+}
+
+void BenchmarkState::skipWithError(const char *message)
+{
+    this->error = message;
+}
+
+uint64_t BenchmarkState::getIterations() const
+{
+    return this->iterations;
+}
+
+uint64_t BenchmarkState::getBytesPerIteration() const
+{
+    return this->bytesPerIteration;
+}
+
+double BenchmarkState::getElapsedSeconds() const
+{
+    return std::chrono::duration<double>(this->elapsed).count();
+}
+
+const char *BenchmarkState::getError() const
+{
+    return this->error;
+}
+
+int Benchmark::registerBenchmark(const char *name, BenchmarkFunction function)
+{
+    BenchmarkEntry entry;
+    entry.name = name;
+    entry.function = function;
+    registry().push_back(entry);
+    return (int)registry().size();
+}
+
+int Benchmark::runAll(int argc, const char * argv[])
+{
+    const char *filter = NULL;
+    double minTime = 0.5;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+            minTime = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--list") == 0) {
+            for (size_t j = 0; j < registry().size(); ++j)
+                printf("%s\n", registry()[j].name);
+            return 0;
+        } else {
+            fprintf(stderr, "usage: %s [--filter substring] [--min-time seconds] [--list]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    int failures = 0;
+    printf("%-44s %14s %14s %12s %12s\n", "Benchmark", "Time", "Iterations", "ops/s", "MB/s");
+
+    for (size_t i = 0; i < registry().size(); ++i) {
+        const BenchmarkEntry& entry = registry()[i];
+
+        if (filter && !strstr(entry.name, filter))
+            continue;
+
+        uint64_t iterations = 1;
+
+        for (;;) {
+            BenchmarkState state(iterations);
+            entry.function(state);
+
+            if (state.getError()) {
+                printf("%-44s ERROR: %s\n", entry.name, state.getError());
+                ++failures;
+                break;
+            }
+
+            double seconds = state.getElapsedSeconds();
+
+            if (seconds >= minTime || iterations >= 1000000000ULL) {
+                double perOp = seconds * 1e9 / (double)iterations;
+                printf("%-44s %11.1f ns %14llu %12.0f", entry.name, perOp, (unsigned long long)iterations,
+                       (double)iterations / seconds);
+
+                if (state.getBytesPerIteration())
+                    printf(" %12.1f", (double)state.getBytesPerIteration() * iterations / seconds / 1e6);
+
+                printf("\n");
+                break;
+            }
+
+            /* Aim a bit past the minimum time, growing at most tenfold per round. */
+            double scale = seconds > 0 ? minTime * 1.4 / seconds : 10.0;
+
+            if (scale > 10.0)
+                scale = 10.0;
+
+            if (scale < 2.0)
+                scale = 2.0;
+
+            iterations = (uint64_t)(iterations * scale);
+        }
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,89 @@
+//
+//  Benchmark.hpp
+//  PeerJetBench
+//
+//  Created by Compy on 12/4/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef Benchmark_hpp
+#define Benchmark_hpp
+
+#include <chrono>
+#include <cstdint>
+#include <stdio.h>
+
+/* Minimal Google Benchmark style harness.
+ *
+ *  static void BM_something(BenchmarkState& state)
+ *  {
+ *      setup();
+ *      while (state.keepRunning())
+ *          something();
+ *  }
+ *  BENCHMARK(BM_something);
+ *
+ * Every benchmark is run with a growing iteration count until one run takes
+ * at least the minimum time, that run is reported.
+ */
+class BenchmarkState {
+public:
+    explicit BenchmarkState(uint64_t iterations);
+
+    /* return true while the benchmark should do one more iteration. */
+    bool keepRunning();
+
+    /* Exclude setup work done inside the loop from the measurement. */
+    void pauseTiming();
+    void resumeTiming();
+
+    /* Bytes processed by a single iteration, used to report a bandwidth. */
+    void setBytesPerIteration(uint64_t bytes);
+
+    /* Report an error and stop the benchmark, nothing is measured. */
+    void skipWithError(const char *message);
+
+    uint64_t getIterations() const;
+    uint64_t getBytesPerIteration() const;
+    double getElapsedSeconds() const;
+    const char *getError() const;
+
+private:
+    uint64_t iterations;
+    uint64_t remaining;
+    uint64_t bytesPerIteration;
+    bool running;
+    const char *error;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::duration elapsed;
+};
+
+typedef void (*BenchmarkFunction)(BenchmarkState& state);
+
+class Benchmark {
+public:
+    static int registerBenchmark(const char *name, BenchmarkFunction function);
+
+    /* Run every registered benchmark whose name contains the --filter argument.
+     *
+     * return 0 on success, non zero if an argument was bad or a benchmark failed.
+     */
+    static int runAll(int argc, const char * argv[]);
+};
+
+/* Keep the compiler from optimizing away a computed value. */
+template <class T>
+inline void doNotOptimize(T const& value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "r,m"(value) : "memory");
+#else
+    static volatile const void *sink;
+    sink = &value;
+#endif
+}
+
+#define BENCHMARK(function) \
+static int benchmark_registration_##function = Benchmark::registerBenchmark(#function, function)
+
+#endif /* Benchmark_hpp */
@@ -0,0 +1,115 @@
+//
+//  BootstrapBench.cpp
+//  PeerJetBench
+//
+//  Created by Compy on 12/18/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <thread>
+#include <vector>
+#include "Benchmark.hpp"
+#include "BootstrapServer.hpp"
+#include "NatTraversal.hpp"
+
+/* Clients on addresses of their own, so the kernel spreads them over the workers. */
+#define BENCH_CLIENTS           4
+#define BENCH_WORKERS           4
+#define BENCH_BATCH             64
+
+/* A round not answered within this long (ms) means datagrams were lost. */
+#define BENCH_ROUND_TIMEOUT     1000
+
+static int countResponse(void *object, IP_Port ipPort, const uint8_t *data, uint16_t length)
+{
+    ++*(uint64_t *)object;
+    return 0;
+}
+
+/* Every client sends a batch of requests of one kind, then waits for all of them to come back. */
+static void bootstrapRound(BenchmarkState& state, const uint8_t* request, uint16_t length, uint8_t responseId)
+{
+    BootstrapServerConfig config;
+    memset(&config, 0, sizeof(config));
+    config.version = 1;
+    config.motd = "bench";
+    config.rate = UINT32_MAX;
+    config.workers = BENCH_WORKERS;
+
+    IP ip;
+    NetworkService::ipInit(&ip, 0);
+    NetworkService::addrParseIp("127.0.0.1", &ip);
+    BootstrapServer *server = BootstrapServer::create(ip, 0, &config);
+
+    if (!server) {
+        state.skipWithError("could not bind a UDP socket");
+        return;
+    }
+
+    IP_Port address;
+    address.ip = ip;
+    address.port = htons(server->getPort());
+
+    std::vector<NetworkingCore*> clients;
+    uint64_t received = 0;
+
+    for (uint32_t i = 0; i < BENCH_CLIENTS; ++i) {
+        IP source;
+        NetworkService::ipInit(&source, 0);
+        source.ip4.uint32 = htonl(0x7F000001 + i + 1);
+        NetworkingCore *client = NetworkService::newNetworkingEx(source, 0, 0, NULL);
+
+        if (!client) {
+            state.skipWithError("could not bind a client socket");
+            break;
+        }
+
+        NetworkService::registerHandler(client, responseId, &countResponse, &received);
+        clients.push_back(client);
+    }
+
+    while (clients.size() == BENCH_CLIENTS && state.keepRunning()) {
+        uint64_t expected = received + BENCH_CLIENTS * BENCH_BATCH;
+
+        for (uint32_t i = 0; i < BENCH_BATCH; ++i) {
+            for (size_t c = 0; c < clients.size(); ++c)
+                NetworkService::sendPacket(clients[c], address, request, length);
+        }
+
+        uint64_t deadline = NetworkService::getCurrentTimeMonotonic() + BENCH_ROUND_TIMEOUT;
+
+        while (received < expected && NetworkService::getCurrentTimeMonotonic() < deadline) {
+            for (size_t c = 0; c < clients.size(); ++c)
+                NetworkService::poll(clients[c]);
+
+            /* Let the workers run where they share our CPU. */
+            std::this_thread::yield();
+        }
+
+        if (received < expected) {
+            state.skipWithError("responses were lost");
+            break;
+        }
+    }
+
+    state.setBytesPerIteration(BENCH_CLIENTS * BENCH_BATCH * length);
+
+    for (size_t c = 0; c < clients.size(); ++c)
+        NetworkService::killNetworking(clients[c]);
+
+    delete server;
+}
+
+static void BM_bootstrapInfo(BenchmarkState& state)
+{
+    uint8_t request[BOOTSTRAP_INFO_REQUEST_SIZE] = {BOOTSTRAP_INFO_PACKET_ID};
+    bootstrapRound(state, request, sizeof(request), BOOTSTRAP_INFO_PACKET_ID);
+}
+BENCHMARK(BM_bootstrapInfo);
+
+static void BM_bootstrapReflect(BenchmarkState& state)
+{
+    uint8_t request[NAT_REFLECT_PACKET_SIZE] = {NET_PACKET_REFLECT_REQUEST};
+    bootstrapRound(state, request, sizeof(request), NET_PACKET_REFLECT_RESPONSE);
+}
+BENCHMARK(BM_bootstrapReflect);
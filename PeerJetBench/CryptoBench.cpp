@@ -0,0 +1,331 @@
+//
+//  CryptoBench.cpp
+//  PeerJetBench
+//
+//  Created by Compy on 12/4/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <vector>
+#include "Benchmark.hpp"
+#include "Crypto.hpp"
+
+#define BENCH_PACKET_SIZE 1024
+
+/* Nonces and keys the word-wise kernels are checked against the byte loops with. */
+#define BENCH_DIFFERENTIAL_ROUNDS 100000
+
+/* The byte at a time nonce arithmetic Crypto used before, the reference for the limb version. */
+static void referenceIncrementNonceNumber(uint8_t *nonce, uint32_t number)
+{
+    uint8_t add[crypto_box_NONCEBYTES] = {0};
+    add[crypto_box_NONCEBYTES - 4] = (uint8_t)(number >> 24);
+    add[crypto_box_NONCEBYTES - 3] = (uint8_t)(number >> 16);
+    add[crypto_box_NONCEBYTES - 2] = (uint8_t)(number >> 8);
+    add[crypto_box_NONCEBYTES - 1] = (uint8_t)number;
+
+    uint_fast16_t carry = 0;
+
+    for (uint32_t i = crypto_box_NONCEBYTES; i != 0; --i) {
+        carry += (uint_fast16_t)nonce[i - 1] + (uint_fast16_t)add[i - 1];
+        nonce[i - 1] = (uint8_t)carry;
+        carry >>= 8;
+    }
+}
+
+/* A random nonce, its low bytes often all ones so the carries cross limbs. */
+static void differentialNonce(uint8_t *nonce, uint32_t round)
+{
+    Crypto::randomNonce(nonce);
+    uint32_t ones = Crypto::randomInt() % (crypto_box_NONCEBYTES + 1);
+
+    if (round % 2 == 0)
+        memset(nonce + crypto_box_NONCEBYTES - ones, 0xFF, ones);
+}
+
+static bool nonceMatchesReference(void)
+{
+    for (uint32_t round = 0; round < BENCH_DIFFERENTIAL_ROUNDS; ++round) {
+        uint8_t nonce[crypto_box_NONCEBYTES], reference[crypto_box_NONCEBYTES];
+        differentialNonce(nonce, round);
+        memcpy(reference, nonce, sizeof(nonce));
+        uint32_t number = round % 3 == 0 ? 1 : round % 3 == 1 ? UINT32_MAX : Crypto::randomInt();
+
+        if (number == 1)
+            Crypto::incrementNonce(nonce);
+        else
+            Crypto::incrementNonceNumber(nonce, number);
+
+        referenceIncrementNonceNumber(reference, number);
+
+        if (memcmp(nonce, reference, sizeof(nonce)) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+static int64_t referenceFindPublicKey(const uint8_t *keys, size_t count, const uint8_t *publicKey)
+{
+    for (size_t i = 0; i < count; ++i) {
+        if (Crypto::comparePublicKeys(keys + i * crypto_box_PUBLICKEYBYTES, publicKey) == 0)
+            return (int64_t)i;
+    }
+
+    return -1;
+}
+
+/* Every count around the batch size, looking for each key, a missing one and keys
+ * differing from one in a single byte, with a duplicate so the first match counts.
+ */
+static bool findMatchesReference(void)
+{
+    for (size_t count = 0; count <= 19; ++count) {
+        std::vector<uint8_t> keys((count + 1) * crypto_box_PUBLICKEYBYTES);
+        randombytes(keys.data(), keys.size());
+
+        if (count >= 3)
+            memcpy(&keys[(count - 1) * crypto_box_PUBLICKEYBYTES], &keys[crypto_box_PUBLICKEYBYTES], crypto_box_PUBLICKEYBYTES);
+
+        for (size_t target = 0; target <= count; ++target) {
+            for (int flip = -1; flip < (int)crypto_box_PUBLICKEYBYTES; ++flip) {
+                uint8_t key[crypto_box_PUBLICKEYBYTES];
+                memcpy(key, &keys[target * crypto_box_PUBLICKEYBYTES], sizeof(key));
+
+                if (flip >= 0)
+                    key[flip] ^= 1 << (flip % 8);
+
+                if (Crypto::findPublicKey(keys.data(), count, key) != referenceFindPublicKey(keys.data(), count, key))
+                    return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static void BM_encryptDataSymmetric(BenchmarkState& state)
+{
+    uint8_t key[crypto_box_KEYBYTES];
+    uint8_t nonce[crypto_box_NONCEBYTES];
+    uint8_t plain[BENCH_PACKET_SIZE] = {0};
+    uint8_t encrypted[BENCH_PACKET_SIZE + crypto_box_MACBYTES];
+    Crypto::newSymmetricKey(key);
+    Crypto::randomNonce(nonce);
+
+    while (state.keepRunning()) {
+        doNotOptimize(Crypto::encryptDataSymmetric(key, nonce, plain, sizeof(plain), encrypted));
+        Crypto::incrementNonce(nonce);
+    }
+
+    state.setBytesPerIteration(sizeof(plain));
+}
+BENCHMARK(BM_encryptDataSymmetric);
+
+static void BM_decryptDataSymmetric(BenchmarkState& state)
+{
+    uint8_t key[crypto_box_KEYBYTES];
+    uint8_t nonce[crypto_box_NONCEBYTES];
+    uint8_t plain[BENCH_PACKET_SIZE] = {0};
+    uint8_t encrypted[BENCH_PACKET_SIZE + crypto_box_MACBYTES];
+    Crypto::newSymmetricKey(key);
+    Crypto::randomNonce(nonce);
+    Crypto::encryptDataSymmetric(key, nonce, plain, sizeof(plain), encrypted);
+
+    while (state.keepRunning()) {
+        if (Crypto::decryptDataSymmetric(key, nonce, encrypted, sizeof(encrypted), plain) != BENCH_PACKET_SIZE)
+            state.skipWithError("decryption failed");
+    }
+
+    state.setBytesPerIteration(sizeof(plain));
+}
+BENCHMARK(BM_decryptDataSymmetric);
+
+static void BM_encryptPrecompute(BenchmarkState& state)
+{
+    uint8_t pk[crypto_box_PUBLICKEYBYTES], sk[crypto_box_SECRETKEYBYTES];
+    uint8_t key[crypto_box_BEFORENMBYTES];
+    crypto_box_keypair(pk, sk);
+
+    while (state.keepRunning()) {
+        Crypto::encryptPrecompute(pk, sk, key);
+        doNotOptimize(key);
+    }
+}
+BENCHMARK(BM_encryptPrecompute);
+
+static void BM_createRequest(BenchmarkState& state)
+{
+    uint8_t pk1[crypto_box_PUBLICKEYBYTES], sk1[crypto_box_SECRETKEYBYTES];
+    uint8_t pk2[crypto_box_PUBLICKEYBYTES], sk2[crypto_box_SECRETKEYBYTES];
+    uint8_t data[64] = {0};
+    uint8_t packet[MAX_CRYPTO_REQUEST_SIZE];
+    crypto_box_keypair(pk1, sk1);
+    crypto_box_keypair(pk2, sk2);
+
+    while (state.keepRunning()) {
+        doNotOptimize(Crypto::createRequest(pk1, sk1, packet, pk2, data, sizeof(data), CRYPTO_PACKET_FRIEND_REQ));
+    }
+}
+BENCHMARK(BM_createRequest);
+
+static void BM_handleRequest(BenchmarkState& state)
+{
+    uint8_t pk1[crypto_box_PUBLICKEYBYTES], sk1[crypto_box_SECRETKEYBYTES];
+    uint8_t pk2[crypto_box_PUBLICKEYBYTES], sk2[crypto_box_SECRETKEYBYTES];
+    uint8_t data[64] = {0};
+    uint8_t packet[MAX_CRYPTO_REQUEST_SIZE];
+    uint8_t sender[crypto_box_PUBLICKEYBYTES];
+    uint8_t out[MAX_CRYPTO_REQUEST_SIZE];
+    uint8_t requestId;
+    crypto_box_keypair(pk1, sk1);
+    crypto_box_keypair(pk2, sk2);
+    int length = Crypto::createRequest(pk1, sk1, packet, pk2, data, sizeof(data), CRYPTO_PACKET_FRIEND_REQ);
+
+    while (state.keepRunning()) {
+        if (Crypto::handleRequest(pk2, sk2, sender, out, &requestId, packet, (uint16_t)length) != sizeof(data))
+            state.skipWithError("handleRequest failed");
+    }
+}
+BENCHMARK(BM_handleRequest);
+
+static void BM_incrementNonce(BenchmarkState& state)
+{
+    uint8_t nonce[crypto_box_NONCEBYTES] = {0};
+
+    if (!nonceMatchesReference())
+        state.skipWithError("nonce arithmetic differs from the byte loop");
+
+    while (state.keepRunning()) {
+        Crypto::incrementNonce(nonce);
+        doNotOptimize(nonce);
+    }
+}
+BENCHMARK(BM_incrementNonce);
+
+static void BM_incrementNonceNumber(BenchmarkState& state)
+{
+    uint8_t nonce[crypto_box_NONCEBYTES] = {0};
+
+    while (state.keepRunning()) {
+        Crypto::incrementNonceNumber(nonce, 0x1234567);
+        doNotOptimize(nonce);
+    }
+}
+BENCHMARK(BM_incrementNonceNumber);
+
+static void BM_incrementNonceNumberBytes(BenchmarkState& state)
+{
+    uint8_t nonce[crypto_box_NONCEBYTES] = {0};
+
+    while (state.keepRunning()) {
+        referenceIncrementNonceNumber(nonce, 0x1234567);
+        doNotOptimize(nonce);
+    }
+}
+BENCHMARK(BM_incrementNonceNumberBytes);
+
+static void BM_newNonce(BenchmarkState& state)
+{
+    uint8_t nonce[crypto_box_NONCEBYTES];
+
+    while (state.keepRunning()) {
+        Crypto::newNonce(nonce);
+        doNotOptimize(nonce);
+    }
+}
+BENCHMARK(BM_newNonce);
+
+static void BM_randomInt(BenchmarkState& state)
+{
+    while (state.keepRunning())
+        doNotOptimize(Crypto::randomInt());
+}
+BENCHMARK(BM_randomInt);
+
+static void BM_randomNonce(BenchmarkState& state)
+{
+    uint8_t nonce[crypto_box_NONCEBYTES];
+
+    while (state.keepRunning()) {
+        Crypto::randomNonce(nonce);
+        doNotOptimize(nonce);
+    }
+}
+BENCHMARK(BM_randomNonce);
+
+/* What every random nonce cost before the buffered generator. */
+static void BM_randombytesNonce(BenchmarkState& state)
+{
+    uint8_t nonce[crypto_box_NONCEBYTES];
+
+    while (state.keepRunning()) {
+        randombytes(nonce, sizeof(nonce));
+        doNotOptimize(nonce);
+    }
+}
+BENCHMARK(BM_randombytesNonce);
+
+/* One packet through both ends of a session, the receiver getting them slightly out of order. */
+static void BM_sessionNonce(BenchmarkState& state)
+{
+    uint8_t base[crypto_box_NONCEBYTES];
+    uint8_t nonce[crypto_box_NONCEBYTES];
+    CryptoSessionNonces sender, receiver;
+    Crypto::randomNonce(base);
+    Crypto::sessionInit(&sender, base, base);
+    Crypto::sessionInit(&receiver, base, base);
+
+    while (state.keepRunning()) {
+        uint32_t number = Crypto::sessionNextNonce(&sender, nonce) ^ 1;
+
+        if (!Crypto::sessionReceiveNonce(&receiver, number, nonce))
+            state.skipWithError("fresh nonce taken as a replay");
+
+        Crypto::sessionAccept(&receiver, number);
+
+        if (Crypto::sessionReceiveNonce(&receiver, number, nonce))
+            state.skipWithError("replay accepted");
+    }
+}
+BENCHMARK(BM_sessionNonce);
+
+static void BM_comparePublicKeys(BenchmarkState& state)
+{
+    uint8_t pk1[crypto_box_PUBLICKEYBYTES], pk2[crypto_box_PUBLICKEYBYTES];
+    randombytes(pk1, sizeof(pk1));
+    memcpy(pk2, pk1, sizeof(pk1));
+
+    while (state.keepRunning())
+        doNotOptimize(Crypto::comparePublicKeys(pk1, pk2));
+}
+BENCHMARK(BM_comparePublicKeys);
+
+/* The key looked for is the last of 1024, the scan getFriendByPublicKey does for a large friend list. */
+static void findPublicKey(BenchmarkState& state, bool reference)
+{
+    const size_t count = 1024;
+    std::vector<uint8_t> keys(count * crypto_box_PUBLICKEYBYTES);
+    randombytes(keys.data(), keys.size());
+    const uint8_t *last = &keys[(count - 1) * crypto_box_PUBLICKEYBYTES];
+
+    if (!reference && !findMatchesReference())
+        state.skipWithError("findPublicKey differs from the comparePublicKeys scan");
+
+    while (state.keepRunning())
+        doNotOptimize(reference ? referenceFindPublicKey(keys.data(), count, last) : Crypto::findPublicKey(keys.data(), count, last));
+
+    state.setBytesPerIteration(keys.size());
+}
+
+static void BM_findPublicKey(BenchmarkState& state)
+{
+    findPublicKey(state, false);
+}
+BENCHMARK(BM_findPublicKey);
+
+static void BM_findPublicKeyScan(BenchmarkState& state)
+{
+    findPublicKey(state, true);
+}
+BENCHMARK(BM_findPublicKeyScan);
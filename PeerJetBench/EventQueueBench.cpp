@@ -0,0 +1,86 @@
+//
+//  EventQueueBench.cpp
+//  PeerJetBench
+//
+//  Created by Compy on 12/18/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include "Benchmark.hpp"
+#include "EventQueue.hpp"
+
+#define BENCH_EVENT_BATCH       64
+#define BENCH_MESSAGE_SIZE      128
+
+/* An application thread draining the queue in batches until it is told to stop
+ * and everything posted came through.
+ */
+static void consume(EventQueue *queue, std::atomic<bool> *stop, uint64_t *consumed, uint64_t *bytes)
+{
+    NodeEvent events[BENCH_EVENT_BATCH];
+
+    for (;;) {
+        /* Nothing is posted once stop is set, an empty poll after it is the end. */
+        bool stopping = stop->load(std::memory_order_acquire);
+        size_t count = queue->poll(events, BENCH_EVENT_BATCH);
+
+        if (count == 0) {
+            if (stopping)
+                return;
+
+            std::this_thread::yield();
+            continue;
+        }
+
+        for (size_t i = 0; i < count; ++i)
+            *bytes += events[i].length;
+
+        queue->release(events, count);
+        *consumed += count;
+    }
+}
+
+/* Friend messages posted by the node's thread and drained by another one, the
+ * payloads borrowed from the pool and given back.
+ */
+static void BM_eventQueueCrossThread(BenchmarkState& state)
+{
+    EventQueue queue;
+    std::atomic<bool> stop(false);
+    uint64_t consumed = 0;
+    uint64_t bytes = 0;
+    uint8_t message[BENCH_MESSAGE_SIZE];
+    memset(message, 'a', sizeof(message));
+    std::thread consumer(&consume, &queue, &stop, &consumed, &bytes);
+
+    while (state.keepRunning()) {
+        for (uint32_t i = 0; i < BENCH_EVENT_BATCH; ++i) {
+            NodeEvent event;
+            memset(&event, 0, sizeof(event));
+            event.type = NODE_EVENT_FRIEND_MESSAGE;
+            event.friendNumber = i;
+            queue.post(&event, NULL, 0, message, sizeof(message));
+        }
+
+        queue.flush();
+    }
+
+    /* What is left in the backlog goes out as the consumer makes room. */
+    while (queue.getStats().backlog) {
+        queue.flush();
+        std::this_thread::yield();
+    }
+
+    stop.store(true, std::memory_order_release);
+    consumer.join();
+    EventQueueStats stats = queue.getStats();
+
+    if (stats.delivered != stats.posted || consumed != stats.posted || bytes != stats.posted * BENCH_MESSAGE_SIZE)
+        state.skipWithError("events were lost");
+
+    state.setBytesPerIteration(BENCH_EVENT_BATCH * BENCH_MESSAGE_SIZE);
+}
+BENCHMARK(BM_eventQueueCrossThread);
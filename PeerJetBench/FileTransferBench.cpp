@@ -0,0 +1,250 @@
+//
+//  FileTransferBench.cpp
+//  PeerJetBench
+//
+//  Created by Compy on 12/7/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <deque>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+#include "Benchmark.hpp"
+#include "Node.hpp"
+
+#define BENCH_LARGE_FILE    (16 * 1024 * 1024)
+#define BENCH_SMALL_FILE    (48 * 1024)
+
+/* Two nodes wired back to back, friend packets wait in a queue until drain(). */
+class NodePair {
+public:
+    NodePair()
+    {
+        NodeConfiguration config;
+        memset(&config, 0, sizeof(config));
+        this->nodes[0] = new Node(&config);
+        this->nodes[1] = new Node(&config);
+        this->done = false;
+        this->sinkPath = NULL;
+
+        for (int i = 0; i < 2; ++i) {
+            this->ends[i].pair = this;
+            this->ends[i].to = 1 - i;
+
+            FriendTransport transport;
+            memset(&transport, 0, sizeof(transport));
+            transport.sendLossless = &NodePair::send;
+            transport.sendLossy = &NodePair::send;
+            transport.object = &this->ends[i];
+            this->nodes[i]->setFriendTransport(&transport);
+            this->nodes[i]->setUserData(this);
+        }
+
+        this->nodes[0]->addFriendNoRequest(*this->nodes[1]->getAddress());
+        this->nodes[1]->addFriendNoRequest(*this->nodes[0]->getAddress());
+        this->nodes[0]->setFriendConnectionStatus(0, CONNECTION_TYPE_UDP);
+        this->nodes[1]->setFriendConnectionStatus(0, CONNECTION_TYPE_UDP);
+        this->nodes[1]->setFileReceiveCallback(&NodePair::accept);
+        this->nodes[1]->setFileReceiveChunkCallback(&NodePair::receive);
+    }
+
+    ~NodePair()
+    {
+        delete this->nodes[0];
+        delete this->nodes[1];
+    }
+
+    /* Run both nodes until the file in flight arrived. */
+    bool run()
+    {
+        this->done = false;
+
+        for (uint32_t idle = 0; !this->done && idle < 1000; ) {
+            if (this->queue.empty()) {
+                this->nodes[0]->tick();
+                this->nodes[1]->tick();
+
+                /* Give a file being received to disk time to reach it. */
+                if (++idle > 1)
+                    usleep(100);
+
+                continue;
+            }
+
+            Packet& packet = this->queue.front();
+            this->nodes[packet.to]->handleFriendPacket(0, packet.data.data(), (uint16_t)packet.data.size());
+            this->queue.pop_front();
+            idle = 0;
+        }
+
+        return this->done;
+    }
+
+    Node* nodes[2];
+    const char* sinkPath; /* receive to this file instead of the chunk callbacks */
+
+private:
+    struct End {
+        NodePair* pair;
+        int to;
+    };
+
+    struct Packet {
+        int to;
+        std::vector<uint8_t> data;
+    };
+
+    static int64_t send(void *object, uint32_t friendNumber, const uint8_t *data, uint16_t length)
+    {
+        End *end = (End *)object;
+        end->pair->queue.push_back(Packet());
+        end->pair->queue.back().to = end->to;
+        end->pair->queue.back().data.assign(data, data + length);
+        return 0;
+    }
+
+    static void accept(Node* node, uint32_t friendNumber, uint32_t fileNumber, uint32_t fileKind, uint64_t fileSize,
+                       const uint8_t *filename, size_t filenameLength, void* userData)
+    {
+        NodePair *pair = (NodePair *)userData;
+
+        if (pair->sinkPath) {
+            node->fileReceiveToPath(friendNumber, fileNumber, pair->sinkPath, true);
+        } else {
+            node->fileControl(friendNumber, fileNumber, FILE_CONTROL_RESUME);
+        }
+    }
+
+    static void receive(Node* node, uint32_t friendNumber, uint32_t fileNumber, uint64_t position, const uint8_t *data,
+                        size_t length, void* userData)
+    {
+        if (length == 0)
+            ((NodePair *)userData)->done = true;
+    }
+
+    End ends[2];
+    std::deque<Packet> queue;
+    bool done;
+};
+
+static uint8_t fileId[FILE_ID_LENGTH];
+static const uint8_t filename[] = "bench.bin";
+
+/* Temporary file of size bytes, removed when the descriptor is closed. */
+static int tempFile(size_t size)
+{
+    char path[] = "/tmp/peerjet-bench-XXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd == -1)
+        return -1;
+
+    unlink(path);
+    std::vector<uint8_t> data(size, 0x5A);
+
+    if (write(fd, data.data(), size) != (ssize_t)size) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static std::vector<uint8_t> *callbackData;
+
+/* What an application feeding the library from a file has to do. */
+static void readChunk(Node* node, uint32_t friendNumber, uint32_t fileNumber, uint64_t position, size_t length, void* userData)
+{
+    if (length == 0)
+        return;
+
+    uint8_t chunk[MAX_UDP_PACKET_SIZE];
+    memcpy(chunk, callbackData->data() + position, length);
+    node->fileSendChunk(friendNumber, fileNumber, position, chunk, length);
+}
+
+static void BM_fileSendCallback(BenchmarkState& state)
+{
+    NodePair pair;
+    std::vector<uint8_t> data(BENCH_LARGE_FILE, 0x5A);
+    callbackData = &data;
+    pair.nodes[0]->setFileChunkRequestCallback(&readChunk);
+
+    while (state.keepRunning()) {
+        if (pair.nodes[0]->fileSend(0, 0, data.size(), fileId, filename, sizeof(filename) - 1) == -1 || !pair.run()) {
+            state.skipWithError("transfer failed");
+            return;
+        }
+    }
+
+    state.setBytesPerIteration(BENCH_LARGE_FILE);
+}
+BENCHMARK(BM_fileSendCallback);
+
+static void sendFromFd(BenchmarkState& state, size_t size)
+{
+    NodePair pair;
+    int fd = tempFile(size);
+
+    if (fd == -1) {
+        state.skipWithError("could not create a temporary file");
+        return;
+    }
+
+    while (state.keepRunning()) {
+        if (pair.nodes[0]->fileSendFd(0, 0, fd, fileId, filename, sizeof(filename) - 1) == -1 || !pair.run()) {
+            state.skipWithError("transfer failed");
+            break;
+        }
+    }
+
+    state.setBytesPerIteration(size);
+    close(fd);
+}
+
+/* Large files are sent from a mapping. */
+static void BM_fileSendMapped(BenchmarkState& state)
+{
+    sendFromFd(state, BENCH_LARGE_FILE);
+}
+BENCHMARK(BM_fileSendMapped);
+
+/* Small files are read with pread. */
+static void BM_fileSendRead(BenchmarkState& state)
+{
+    sendFromFd(state, BENCH_SMALL_FILE);
+}
+BENCHMARK(BM_fileSendRead);
+
+/* Mapped file to a file on the other end, written by the writer thread. */
+static void BM_fileReceiveToPath(BenchmarkState& state)
+{
+    NodePair pair;
+    int fd = tempFile(BENCH_LARGE_FILE);
+    char path[] = "/tmp/peerjet-bench-XXXXXX";
+    int sinkFd = mkstemp(path);
+
+    if (fd == -1 || sinkFd == -1) {
+        state.skipWithError("could not create a temporary file");
+        return;
+    }
+
+    close(sinkFd);
+    pair.sinkPath = path;
+
+    while (state.keepRunning()) {
+        /* Every iteration is a new file, not a resume of the last one. */
+        fileId[0]++;
+
+        if (pair.nodes[0]->fileSendFd(0, 0, fd, fileId, filename, sizeof(filename) - 1) == -1 || !pair.run()) {
+            state.skipWithError("transfer failed");
+            break;
+        }
+    }
+
+    state.setBytesPerIteration(BENCH_LARGE_FILE);
+    close(fd);
+    unlink(path);
+}
+BENCHMARK(BM_fileReceiveToPath);
@@ -0,0 +1,249 @@
+//
+//  MessageBench.cpp
+//  PeerJetBench
+//
+//  Created by Compy on 12/12/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <deque>
+#include <vector>
+#include "Benchmark.hpp"
+#include "Node.hpp"
+
+#define BENCH_MESSAGES      1000
+#define BENCH_MESSAGE_SIZE  32
+#define BENCH_FAN_OUT       64
+#define BENCH_BROADCASTS    16
+
+/* One node sending to a few friends, every friend packet waits in a queue until run(). */
+class MessageFan {
+public:
+    MessageFan(uint32_t friends)
+    {
+        NodeConfiguration config;
+        memset(&config, 0, sizeof(config));
+        this->nodes.push_back(new Node(&config));
+
+        for (uint32_t i = 0; i < friends; ++i)
+            this->nodes.push_back(new Node(&config));
+
+        this->ends.resize(this->nodes.size());
+
+        for (uint32_t i = 0; i < this->nodes.size(); ++i) {
+            this->ends[i].fan = this;
+            this->ends[i].from = i;
+
+            FriendTransport transport;
+            memset(&transport, 0, sizeof(transport));
+            transport.sendLossless = &MessageFan::send;
+            transport.sendLossy = &MessageFan::send;
+            transport.sendLosslessBatch = &MessageFan::sendBatch;
+            transport.object = &this->ends[i];
+            this->nodes[i]->setFriendTransport(&transport);
+            this->nodes[i]->setUserData(this);
+        }
+
+        /* Friend i - 1 of the sender is node i, the sender is friend 0 of every other node. */
+        for (uint32_t i = 1; i < this->nodes.size(); ++i) {
+            this->nodes[0]->addFriendNoRequest(*this->nodes[i]->getAddress());
+            this->nodes[i]->addFriendNoRequest(*this->nodes[0]->getAddress());
+            this->nodes[0]->setFriendConnectionStatus(i - 1, CONNECTION_TYPE_UDP);
+            this->nodes[i]->setFriendConnectionStatus(0, CONNECTION_TYPE_UDP);
+            this->nodes[i]->setFriendMessageCallback(&MessageFan::message);
+            this->nodes[i]->setFriendNameCallback(&MessageFan::name);
+        }
+
+        this->nodes[0]->setFriendReadReceiptCallback(&MessageFan::receipt);
+        this->packets = 0;
+        this->batches = 0;
+        this->received = 0;
+        this->receipts = 0;
+        this->names = 0;
+    }
+
+    ~MessageFan()
+    {
+        for (size_t i = 0; i < this->nodes.size(); ++i)
+            delete this->nodes[i];
+    }
+
+    /* Run every node until counter reaches target. */
+    bool run(const uint64_t& counter, uint64_t target)
+    {
+        for (uint32_t idle = 0; counter < target && idle < 1000; ) {
+            if (this->queue.empty()) {
+                for (size_t i = 0; i < this->nodes.size(); ++i)
+                    this->nodes[i]->tick();
+
+                ++idle;
+                continue;
+            }
+
+            Packet& packet = this->queue.front();
+            Node *node = this->nodes[packet.to];
+            uint32_t friendNumber = packet.to == 0 ? packet.from - 1 : 0;
+            node->handleFriendPacket(friendNumber, packet.data.data(), (uint16_t)packet.data.size());
+            this->queue.pop_front();
+            idle = 0;
+        }
+
+        return counter >= target;
+    }
+
+    std::vector<Node*> nodes;
+    uint64_t packets;
+    uint64_t batches;
+    uint64_t received;
+    uint64_t receipts;
+    uint64_t names;
+
+private:
+    struct End {
+        MessageFan* fan;
+        uint32_t from;
+    };
+
+    struct Packet {
+        uint32_t from;
+        uint32_t to;
+        std::vector<uint8_t> data;
+    };
+
+    static int64_t send(void *object, uint32_t friendNumber, const uint8_t *data, uint16_t length)
+    {
+        End *end = (End *)object;
+        end->fan->queue.push_back(Packet());
+        end->fan->queue.back().from = end->from;
+        end->fan->queue.back().to = end->from == 0 ? friendNumber + 1 : 0;
+        end->fan->queue.back().data.assign(data, data + length);
+        ++end->fan->packets;
+        return 0;
+    }
+
+    static void sendBatch(void *object, FriendPacket *packets, size_t count)
+    {
+        ++((End *)object)->fan->batches;
+
+        for (size_t i = 0; i < count; ++i)
+            packets[i].result = send(object, packets[i].friendNumber, packets[i].data, packets[i].length);
+    }
+
+    static void name(Node* node, uint32_t friendNumber, const std::string& name, size_t length, void* userData)
+    {
+        ++((MessageFan *)userData)->names;
+    }
+
+    static void message(Node* node, uint32_t friendNumber, MessageType type, const uint8_t* message, size_t length,
+                        void* userData)
+    {
+        ++((MessageFan *)userData)->received;
+    }
+
+    static void receipt(Node* node, uint32_t friendNumber, uint32_t messageId, void* userData)
+    {
+        ++((MessageFan *)userData)->receipts;
+    }
+
+    std::vector<End> ends;
+    std::deque<Packet> queue;
+};
+
+/* Bursts of small messages, each one read receipted. */
+static void burst(BenchmarkState& state, uint32_t friends)
+{
+    MessageFan fan(friends);
+    uint8_t message[BENCH_MESSAGE_SIZE];
+    memset(message, 'x', sizeof(message));
+    uint64_t sent = 0;
+
+    while (state.keepRunning()) {
+        for (uint32_t i = 0; i < BENCH_MESSAGES; ++i) {
+            if (fan.nodes[0]->sendMessage(i % friends, MESSAGE_TYPE_NORMAL, message, sizeof(message)) == -1) {
+                state.skipWithError("message refused");
+                return;
+            }
+        }
+
+        sent += BENCH_MESSAGES;
+
+        if (!fan.run(fan.receipts, sent) || fan.received < sent) {
+            state.skipWithError("receipts missing");
+            return;
+        }
+    }
+
+    /* Packets of both directions, receipts included. */
+    if (fan.packets * 4 > sent)
+        state.skipWithError("messages were not packed together");
+
+    state.setBytesPerIteration(BENCH_MESSAGES * BENCH_MESSAGE_SIZE);
+}
+
+static void BM_messageBurst(BenchmarkState& state)
+{
+    burst(state, 1);
+}
+BENCHMARK(BM_messageBurst);
+
+static void BM_messageBurstFanOut(BenchmarkState& state)
+{
+    burst(state, 16);
+}
+BENCHMARK(BM_messageBurstFanOut);
+
+/* The same message to many friends, one call per message. */
+static void BM_messageBroadcast(BenchmarkState& state)
+{
+    MessageFan fan(BENCH_FAN_OUT);
+    uint8_t message[BENCH_MESSAGE_SIZE];
+    memset(message, 'x', sizeof(message));
+    uint32_t friends[BENCH_FAN_OUT];
+    uint64_t sent = 0;
+
+    for (uint32_t i = 0; i < BENCH_FAN_OUT; ++i)
+        friends[i] = i;
+
+    while (state.keepRunning()) {
+        for (uint32_t i = 0; i < BENCH_BROADCASTS; ++i) {
+            if (fan.nodes[0]->broadcastMessage(friends, BENCH_FAN_OUT, MESSAGE_TYPE_NORMAL, message, sizeof(message),
+                                               NULL) != BENCH_FAN_OUT) {
+                state.skipWithError("message refused");
+                return;
+            }
+        }
+
+        sent += BENCH_FAN_OUT * BENCH_BROADCASTS;
+
+        if (!fan.run(fan.receipts, sent) || fan.received < sent) {
+            state.skipWithError("receipts missing");
+            return;
+        }
+    }
+
+    state.setBytesPerIteration(BENCH_FAN_OUT * BENCH_BROADCASTS * BENCH_MESSAGE_SIZE);
+}
+BENCHMARK(BM_messageBroadcast);
+
+/* Name changes reaching every friend. */
+static void BM_setNameBroadcast(BenchmarkState& state)
+{
+    MessageFan fan(BENCH_FAN_OUT);
+    uint64_t sent = 0;
+    uint64_t iteration = 0;
+
+    while (state.keepRunning()) {
+        fan.nodes[0]->setName(++iteration & 1 ? "bench-a" : "bench-b");
+        sent += BENCH_FAN_OUT;
+
+        if (!fan.run(fan.names, sent)) {
+            state.skipWithError("names missing");
+            return;
+        }
+    }
+
+    /* One batch per name change. */
+    if (fan.batches != iteration)
+        state.skipWithError("name changes were not batched");
+}
+BENCHMARK(BM_setNameBroadcast);
@@ -0,0 +1,387 @@
+//
+//  NetCryptoBench.cpp
+//  PeerJetBench
+//
+//  Created by Compy on 12/18/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "Benchmark.hpp"
+#include "NetCrypto.hpp"
+
+#define BENCH_FRAME_SIZE        160     /* an audio frame */
+#define BENCH_BATCH             16
+#define BENCH_BULK_SIZE         1024
+
+/* Frames sent once per fixture to measure their latency from send to callback. */
+#define BENCH_LATENCY_FRAMES    20000
+
+/* Sender and receiver of one session over loopback sockets. */
+class SessionFixture {
+public:
+    SessionFixture()
+    {
+        this->sender = NULL;
+        this->receiver = NULL;
+        this->senderNet = NULL;
+        this->receiverNet = NULL;
+        this->received = 0;
+
+        IP ip;
+        NetworkService::ipInit(&ip, 0);
+        NetworkService::addrParseIp("127.0.0.1", &ip);
+        this->senderNet = NetworkService::newNetworkingEx(ip, 0, 0, NULL);
+        this->receiverNet = NetworkService::newNetworkingEx(ip, 0, 0, NULL);
+
+        if (!this->senderNet || !this->receiverNet)
+            return;
+
+        uint8_t senderKey[crypto_box_PUBLICKEYBYTES], receiverKey[crypto_box_PUBLICKEYBYTES];
+        uint8_t secretKey[crypto_box_SECRETKEYBYTES];
+        crypto_box_keypair(senderKey, secretKey);
+        this->sender = new NetCrypto(this->senderNet, senderKey, secretKey);
+        crypto_box_keypair(receiverKey, secretKey);
+        this->receiver = new NetCrypto(this->receiverNet, receiverKey, secretKey);
+        this->receiver->setAcceptCallback(&SessionFixture::accept, NULL);
+        this->receiver->setFramesCallback(&SessionFixture::onFrames, this);
+
+        IP_Port address;
+        address.ip = ip;
+        address.port = this->receiverNet->port;
+        this->connection = this->sender->addConnection(receiverKey, address);
+
+        /* Handshakes are handled on the tick after they were read. */
+        for (int i = 0; i < 2000 && !(this->sender->isOnline(this->connection) && this->receiver->isOnline(0)); ++i)
+            this->step();
+    }
+
+    ~SessionFixture()
+    {
+        delete this->sender;
+        delete this->receiver;
+
+        if (this->senderNet)
+            NetworkService::killNetworking(this->senderNet);
+
+        if (this->receiverNet)
+            NetworkService::killNetworking(this->receiverNet);
+    }
+
+    bool ready()
+    {
+        return this->sender && this->sender->isOnline(this->connection) && this->receiver->isOnline(0);
+    }
+
+    void step()
+    {
+        NetworkService::poll(this->senderNet);
+        this->sender->tick();
+        NetworkService::poll(this->receiverNet);
+        this->receiver->tick();
+    }
+
+    /* Frames carry the time they were sent (ns), the receiver keeps how long they took. */
+    bool sendFrame()
+    {
+        uint8_t frame[BENCH_FRAME_SIZE] = {0};
+        int64_t sent = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        memcpy(frame, &sent, sizeof(sent));
+        return this->sender->sendPacket(this->connection, frame, sizeof(frame), false) != -1;
+    }
+
+    /* Keep the send ring of the session full of lossless packets. */
+    void load()
+    {
+        uint8_t packet[BENCH_BULK_SIZE] = {0};
+
+        while (this->sender->sendPacket(this->connection, packet, sizeof(packet), true) != -1)
+            ;
+    }
+
+    /* Send a frame every iteration and report the latency of each, at least count of them. */
+    void measure(const char *name, bool loaded, size_t count)
+    {
+        this->latencies.clear();
+        this->latencies.reserve(count);
+
+        for (size_t i = 0; i < count * 2 && this->latencies.size() < count; ++i) {
+            if (loaded)
+                this->load();
+
+            this->sendFrame();
+            this->step();
+        }
+
+        if (this->latencies.size() < 2)
+            return;
+
+        /* Jitter as in RFC 3550: the mean difference between the latencies of consecutive frames. */
+        double jitter = 0;
+
+        for (size_t i = 1; i < this->latencies.size(); ++i) {
+            int64_t delta = this->latencies[i] - this->latencies[i - 1];
+            jitter += delta < 0 ? -delta : delta;
+        }
+
+        jitter /= this->latencies.size() - 1;
+        std::vector<int64_t> sorted = this->latencies;
+        std::sort(sorted.begin(), sorted.end());
+        fprintf(stderr, "%s: %zu frames from send to callback, median %.1f us, p99 %.1f us, max %.1f us, "
+                "jitter %.1f us\n", name, sorted.size(), sorted[sorted.size() / 2] / 1000.0,
+                sorted[sorted.size() * 99 / 100] / 1000.0, sorted.back() / 1000.0, jitter / 1000.0);
+    }
+
+    NetworkingCore *senderNet;
+    NetworkingCore *receiverNet;
+    NetCrypto *sender;
+    NetCrypto *receiver;
+    int connection;
+    uint64_t received;
+    std::vector<int64_t> latencies;
+
+private:
+    static bool accept(void *object, const uint8_t *publicKey, IP_Port source)
+    {
+        return true;
+    }
+
+    static void onFrames(void *object, const NetCryptoFrame *frames, size_t count)
+    {
+        SessionFixture *fixture = (SessionFixture *)object;
+        int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+
+        for (size_t i = 0; i < count; ++i) {
+            int64_t sent;
+            memcpy(&sent, frames[i].data, sizeof(sent));
+
+            if (fixture->latencies.size() < fixture->latencies.capacity())
+                fixture->latencies.push_back(now - sent);
+        }
+
+        fixture->received += count;
+    }
+};
+
+static void lossyFrames(BenchmarkState& state, const char *name, bool loaded)
+{
+    SessionFixture session;
+
+    if (!session.ready()) {
+        state.skipWithError("could not establish a session over loopback");
+        return;
+    }
+
+    static std::vector<const char *> measured;
+
+    if (std::find(measured.begin(), measured.end(), name) == measured.end()) {
+        measured.push_back(name);
+        session.measure(name, loaded, BENCH_LATENCY_FRAMES);
+    }
+
+    session.received = 0;
+
+    while (state.keepRunning()) {
+        if (loaded)
+            session.load();
+
+        for (int i = 0; i < BENCH_BATCH; ++i)
+            session.sendFrame();
+
+        session.step();
+    }
+
+    if (session.received == 0)
+        state.skipWithError("no frame came through");
+
+    state.setBytesPerIteration(BENCH_BATCH * BENCH_FRAME_SIZE);
+}
+
+/* A batch of lossy frames from one session to the other through the kernel:
+ * encrypted in place, read, decrypted in place and handed over in one callback.
+ */
+static void BM_lossyFrames(BenchmarkState& state)
+{
+    lossyFrames(state, "BM_lossyFrames", false);
+}
+BENCHMARK(BM_lossyFrames);
+
+/* The same with the session's send ring kept full of lossless packets. */
+static void BM_lossyFramesUnderLoad(BenchmarkState& state)
+{
+    lossyFrames(state, "BM_lossyFramesUnderLoad", true);
+}
+BENCHMARK(BM_lossyFramesUnderLoad);
+
+/* One sender with a session to each of BENCH_FAN_OUT receivers over loopback. */
+#define BENCH_FAN_OUT           64
+#define BENCH_FAN_PACKET_SIZE   256
+
+class FanFixture {
+public:
+    FanFixture()
+    {
+        this->sender = NULL;
+        this->received = 0;
+
+        IP ip;
+        NetworkService::ipInit(&ip, 0);
+        NetworkService::addrParseIp("127.0.0.1", &ip);
+        this->senderNet = NetworkService::newNetworkingEx(ip, 0, 0, NULL);
+
+        if (!this->senderNet)
+            return;
+
+        uint8_t publicKey[crypto_box_PUBLICKEYBYTES], secretKey[crypto_box_SECRETKEYBYTES];
+        crypto_box_keypair(publicKey, secretKey);
+        this->sender = new NetCrypto(this->senderNet, publicKey, secretKey);
+
+        for (uint32_t i = 0; i < BENCH_FAN_OUT; ++i) {
+            NetworkingCore *net = NetworkService::newNetworkingEx(ip, 0, 0, NULL);
+
+            if (!net)
+                return;
+
+            crypto_box_keypair(publicKey, secretKey);
+            NetCrypto *receiver = new NetCrypto(net, publicKey, secretKey);
+            receiver->setAcceptCallback(&FanFixture::accept, NULL);
+            receiver->setDataCallback(&FanFixture::onData, this);
+            this->receiverNets.push_back(net);
+            this->receivers.push_back(receiver);
+
+            IP_Port address;
+            address.ip = ip;
+            address.port = net->port;
+            this->connections.push_back((uint32_t)this->sender->addConnection(publicKey, address));
+        }
+
+        for (int i = 0; i < 2000 && !this->ready(); ++i)
+            this->step();
+    }
+
+    ~FanFixture()
+    {
+        delete this->sender;
+
+        for (size_t i = 0; i < this->receivers.size(); ++i) {
+            delete this->receivers[i];
+            NetworkService::killNetworking(this->receiverNets[i]);
+        }
+
+        if (this->senderNet)
+            NetworkService::killNetworking(this->senderNet);
+    }
+
+    bool ready()
+    {
+        if (!this->sender || this->connections.size() != BENCH_FAN_OUT)
+            return false;
+
+        for (size_t i = 0; i < this->connections.size(); ++i) {
+            if (!this->sender->isOnline(this->connections[i]) || !this->receivers[i]->isOnline(0))
+                return false;
+        }
+
+        return true;
+    }
+
+    void step()
+    {
+        NetworkService::poll(this->senderNet);
+        this->sender->tick();
+
+        for (size_t i = 0; i < this->receivers.size(); ++i) {
+            NetworkService::poll(this->receiverNets[i]);
+            this->receivers[i]->tick();
+        }
+    }
+
+    /* Run until every receiver has its packets and the sender its acknowledgements. */
+    bool drain(uint64_t expected)
+    {
+        for (int i = 0; i < 1000 && this->received < expected; ++i)
+            this->step();
+
+        for (int i = 0; i < 4; ++i)
+            this->step();
+
+        return this->received >= expected;
+    }
+
+    NetworkingCore *senderNet;
+    NetCrypto *sender;
+    std::vector<NetworkingCore*> receiverNets;
+    std::vector<NetCrypto*> receivers;
+    std::vector<uint32_t> connections;
+    uint64_t received;
+
+private:
+    static bool accept(void *object, const uint8_t *publicKey, IP_Port source)
+    {
+        return true;
+    }
+
+    static void onData(void *object, uint32_t connection, const uint8_t *data, uint16_t length)
+    {
+        ++((FanFixture *)object)->received;
+    }
+};
+
+/* The same lossless packet to every session, one sendPacket each or all in one sendPackets. */
+static void fanOut(BenchmarkState& state, bool batched)
+{
+    FanFixture fan;
+
+    if (!fan.ready()) {
+        state.skipWithError("could not establish the sessions over loopback");
+        return;
+    }
+
+    uint8_t data[BENCH_FAN_PACKET_SIZE] = {0};
+    NetCryptoPacket packets[BENCH_FAN_OUT];
+    uint64_t expected = 0;
+
+    while (state.keepRunning()) {
+        if (batched) {
+            for (uint32_t i = 0; i < BENCH_FAN_OUT; ++i) {
+                packets[i].connection = fan.connections[i];
+                packets[i].data = data;
+                packets[i].length = sizeof(data);
+            }
+
+            fan.sender->sendPackets(packets, BENCH_FAN_OUT);
+        } else {
+            for (uint32_t i = 0; i < BENCH_FAN_OUT; ++i)
+                fan.sender->sendPacket(fan.connections[i], data, sizeof(data), true);
+        }
+
+        expected += BENCH_FAN_OUT;
+        state.pauseTiming();
+
+        if (!fan.drain(expected)) {
+            state.skipWithError("packets were lost");
+            break;
+        }
+
+        state.resumeTiming();
+    }
+
+    state.setBytesPerIteration(BENCH_FAN_OUT * BENCH_FAN_PACKET_SIZE);
+}
+
+/* Sender side only: queueing, encryption and the system calls. */
+static void BM_fanOutSerial(BenchmarkState& state)
+{
+    fanOut(state, false);
+}
+BENCHMARK(BM_fanOutSerial);
+
+static void BM_fanOutBatched(BenchmarkState& state)
+{
+    fanOut(state, true);
+}
+BENCHMARK(BM_fanOutBatched);
@@ -0,0 +1,209 @@
+//
+//  NetworkServiceBench.cpp
+//  PeerJetBench
+//
+//  Created by Compy on 12/4/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include "Benchmark.hpp"
+#include "NetworkService.hpp"
+
+#define BENCH_PACKET_ID     200
+#define BENCH_PACKET_SIZE   1024
+
+static int countPacket(void *object, IP_Port ipPort, const uint8_t *data, uint16_t length)
+{
+    ++*(uint64_t *)object;
+    return 0;
+}
+
+/* One datagram through the kernel and back: sendPacket to ourselves on
+ * 127.0.0.1 and poll() it out of the socket.
+ */
+static void BM_sendPacketLoopback(BenchmarkState& state)
+{
+    IP ip;
+    NetworkService::ipInit(&ip, 0);
+    NetworkService::addrParseIp("127.0.0.1", &ip);
+    NetworkingCore *net = NetworkService::newNetworkingEx(ip, 0, 0, NULL);
+
+    if (!net) {
+        state.skipWithError("could not bind a UDP socket");
+        return;
+    }
+
+    uint64_t received = 0;
+    NetworkService::registerHandler(net, BENCH_PACKET_ID, &countPacket, &received);
+
+    IP_Port self;
+    self.ip = ip;
+    self.port = net->port;
+
+    uint8_t packet[BENCH_PACKET_SIZE] = {BENCH_PACKET_ID};
+
+    while (state.keepRunning()) {
+        NetworkService::sendPacket(net, self, packet, sizeof(packet));
+        NetworkService::poll(net);
+    }
+
+    if (received == 0)
+        state.skipWithError("no packet came back");
+
+    state.setBytesPerIteration(sizeof(packet));
+    NetworkService::killNetworking(net);
+}
+BENCHMARK(BM_sendPacketLoopback);
+
+typedef struct {
+    IP_Port from;
+    uint8_t data[MAX_UDP_PACKET_SIZE];
+    uint16_t length;
+    bool pending;
+} Mailbox;
+
+static int mailboxSend(void *object, IP_Port ipPort, const uint8_t *data, uint16_t length)
+{
+    Mailbox *mailbox = (Mailbox *)object;
+    mailbox->from = ipPort;
+    memcpy(mailbox->data, data, length);
+    mailbox->length = length;
+    mailbox->pending = true;
+    return length;
+}
+
+static int mailboxRecv(void *object, IP_Port *ipPort, uint8_t *data, uint32_t *length)
+{
+    Mailbox *mailbox = (Mailbox *)object;
+
+    if (!mailbox->pending)
+        return -1;
+
+    *ipPort = mailbox->from;
+    memcpy(data, mailbox->data, mailbox->length);
+    *length = mailbox->length;
+    mailbox->pending = false;
+    return 0;
+}
+
+/* The library side of the packet path without the kernel: sendPacket and
+ * poll dispatch over a virtual transport that hands the packet straight back.
+ */
+static void BM_sendPacketVirtual(BenchmarkState& state)
+{
+    Mailbox mailbox;
+    mailbox.pending = false;
+
+    NetworkTransport transport;
+    transport.send = &mailboxSend;
+    transport.recv = &mailboxRecv;
+    transport.object = &mailbox;
+
+    IP ip;
+    NetworkService::ipInit(&ip, 0);
+    NetworkService::addrParseIp("10.0.0.1", &ip);
+    NetworkingCore *net = NetworkService::newVirtualNetworking(ip, 33445, &transport);
+
+    uint64_t received = 0;
+    NetworkService::registerHandler(net, BENCH_PACKET_ID, &countPacket, &received);
+
+    IP_Port self;
+    self.ip = ip;
+    self.port = net->port;
+
+    uint8_t packet[BENCH_PACKET_SIZE] = {BENCH_PACKET_ID};
+
+    while (state.keepRunning()) {
+        NetworkService::sendPacket(net, self, packet, sizeof(packet));
+        NetworkService::poll(net);
+    }
+
+    state.setBytesPerIteration(sizeof(packet));
+    NetworkService::killNetworking(net);
+}
+BENCHMARK(BM_sendPacketVirtual);
+
+/* A fleet of instances coming up at once on a range of ports, all of them
+ * bound before any is closed.
+ */
+#define BENCH_FLEET_SIZE        128
+#define BENCH_FLEET_PORT_FROM   41000
+#define BENCH_FLEET_PORT_TO     (BENCH_FLEET_PORT_FROM + 2 * BENCH_FLEET_SIZE - 1)
+
+static void bindFleet(BenchmarkState& state, NetworkBindStrategy strategy)
+{
+    IP ip;
+    NetworkService::ipInit(&ip, 0);
+    NetworkService::addrParseIp("127.0.0.1", &ip);
+
+    NetworkingOptions options;
+    memset(&options, 0, sizeof(options));
+    options.bindStrategy = strategy;
+    NetworkingCore *fleet[BENCH_FLEET_SIZE];
+
+    while (state.keepRunning()) {
+        for (uint32_t i = 0; i < BENCH_FLEET_SIZE; ++i) {
+            options.bindKey = i;
+            fleet[i] = NetworkService::newNetworkingWithOptions(ip, BENCH_FLEET_PORT_FROM, BENCH_FLEET_PORT_TO,
+                                                                &options, NULL);
+        }
+
+        state.pauseTiming();
+        bool failed = false;
+
+        for (uint32_t i = 0; i < BENCH_FLEET_SIZE; ++i) {
+            failed = failed || !fleet[i];
+            NetworkService::killNetworking(fleet[i]);
+        }
+
+        state.resumeTiming();
+
+        if (failed) {
+            state.skipWithError("ports of the range were taken");
+            return;
+        }
+    }
+}
+
+static void BM_bindFleetSequential(BenchmarkState& state)
+{
+    bindFleet(state, NET_BIND_SEQUENTIAL);
+}
+BENCHMARK(BM_bindFleetSequential);
+
+static void BM_bindFleetRandom(BenchmarkState& state)
+{
+    bindFleet(state, NET_BIND_RANDOM);
+}
+BENCHMARK(BM_bindFleetRandom);
+
+static void BM_bindFleetHashed(BenchmarkState& state)
+{
+    bindFleet(state, NET_BIND_HASHED);
+}
+BENCHMARK(BM_bindFleetHashed);
+
+static void BM_ipportEqual(BenchmarkState& state)
+{
+    IP_Port a, b;
+    NetworkService::ipInit(&a.ip, 1);
+    NetworkService::addrParseIp("::ffff:192.168.1.10", &a.ip);
+    NetworkService::ipInit(&b.ip, 0);
+    NetworkService::addrParseIp("192.168.1.10", &b.ip);
+    a.port = b.port = htons(33445);
+
+    while (state.keepRunning())
+        doNotOptimize(NetworkService::ipportEqual(&a, &b));
+}
+BENCHMARK(BM_ipportEqual);
+
+static void BM_addrParseIp(BenchmarkState& state)
+{
+    IP ip;
+
+    while (state.keepRunning()) {
+        NetworkService::addrParseIp("2001:db8::1", &ip);
+        doNotOptimize(ip);
+    }
+}
+BENCHMARK(BM_addrParseIp);
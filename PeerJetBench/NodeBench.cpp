@@ -0,0 +1,168 @@
+//
+//  NodeBench.cpp
+//  PeerJetBench
+//
+//  Created by Compy on 12/4/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "Benchmark.hpp"
+#include "Crypto.hpp"
+#include "Node.hpp"
+#include "NodeActor.hpp"
+
+#define BENCH_FRIENDS 1000
+
+static void addFriends(Node& node, uint32_t count, uint8_t *lastKey)
+{
+    for (uint32_t i = 0; i < count; ++i) {
+        uint8_t sk[crypto_box_SECRETKEYBYTES];
+        crypto_box_keypair(lastKey, sk);
+        node.addFriendNoRequest(lastKey);
+    }
+}
+
+static void BM_getFriendByPublicKey(BenchmarkState& state)
+{
+    NodeConfiguration config;
+    memset(&config, 0, sizeof(config));
+    Node node(&config);
+    uint8_t last[PEERJET_KEY_LENGTH];
+    addFriends(node, BENCH_FRIENDS, last);
+
+    while (state.keepRunning()) {
+        if (node.getFriendByPublicKey(last) != BENCH_FRIENDS - 1)
+            state.skipWithError("friend not found");
+    }
+}
+BENCHMARK(BM_getFriendByPublicKey);
+
+static void BM_addFriendNoRequest(BenchmarkState& state)
+{
+    NodeConfiguration config;
+    memset(&config, 0, sizeof(config));
+    Node *node = new Node(&config);
+    uint8_t pk[PEERJET_KEY_LENGTH], sk[crypto_box_SECRETKEYBYTES];
+
+    while (state.keepRunning()) {
+        state.pauseTiming();
+        crypto_box_keypair(pk, sk);
+
+        if (node->friendListSize() >= BENCH_FRIENDS) {
+            delete node;
+            node = new Node(&config);
+        }
+
+        state.resumeTiming();
+        node->addFriendNoRequest(pk);
+    }
+
+    delete node;
+}
+BENCHMARK(BM_addFriendNoRequest);
+
+static void BM_tickIdle(BenchmarkState& state)
+{
+    NodeConfiguration config;
+    memset(&config, 0, sizeof(config));
+    config.udpEnabled = true;
+    Node node(&config);
+
+    if (!node.getNetworking()) {
+        state.skipWithError("could not bind a UDP socket");
+        return;
+    }
+
+    uint8_t last[PEERJET_KEY_LENGTH];
+    addFriends(node, BENCH_FRIENDS, last);
+
+    while (state.keepRunning())
+        node.tick();
+}
+BENCHMARK(BM_tickIdle);
+
+static int64_t discard(void *object, uint32_t friendNumber, const uint8_t *data, uint16_t length)
+{
+    return 0;
+}
+
+/* A status change reaching every online friend, a typing change reaching one. */
+static void BM_profileChanges(BenchmarkState& state)
+{
+    NodeConfiguration config;
+    memset(&config, 0, sizeof(config));
+    Node node(&config);
+    FriendTransport transport;
+    memset(&transport, 0, sizeof(transport));
+    transport.sendLossless = &discard;
+    transport.sendLossy = &discard;
+    node.setFriendTransport(&transport);
+
+    uint8_t last[PEERJET_KEY_LENGTH];
+    addFriends(node, BENCH_FRIENDS, last);
+
+    for (uint32_t i = 0; i < BENCH_FRIENDS; ++i)
+        node.setFriendConnectionStatus(i, CONNECTION_TYPE_UDP);
+
+    node.tick();
+    uint32_t iteration = 0;
+
+    while (state.keepRunning()) {
+        node.setStatus(++iteration & 1 ? USER_STATUS_AWAY : USER_STATUS_NONE);
+        node.setTyping(iteration % BENCH_FRIENDS, true);
+        node.tick();
+    }
+}
+BENCHMARK(BM_profileChanges);
+
+#define BENCH_READERS 2
+
+static void readNames(NodeActor *actor, std::atomic<bool> *stop, uint64_t *reads)
+{
+    for (uint32_t i = 0; !stop->load(std::memory_order_relaxed); ++i) {
+        doNotOptimize(actor->getFriendName(i % BENCH_FRIENDS));
+        ++*reads;
+    }
+}
+
+/* A name change made on another thread applied and published by every tick, with
+ * threads reading friend names from the snapshots all along.
+ */
+static void BM_actorTickWithReaders(BenchmarkState& state)
+{
+    NodeConfiguration config;
+    memset(&config, 0, sizeof(config));
+    Node node(&config);
+    NodeActor *actor = node.getActor();
+    uint8_t last[PEERJET_KEY_LENGTH];
+    addFriends(node, BENCH_FRIENDS, last);
+    node.tick();
+
+    std::atomic<bool> stop(false);
+    std::vector<uint64_t> reads(BENCH_READERS, 0);
+    std::vector<std::thread> readers;
+
+    for (uint32_t i = 0; i < BENCH_READERS; ++i)
+        readers.push_back(std::thread(&readNames, actor, &stop, &reads[i]));
+
+    uint32_t iteration = 0;
+
+    while (state.keepRunning()) {
+        actor->setName(++iteration & 1 ? "odd" : "even");
+        node.tick();
+    }
+
+    stop.store(true);
+
+    for (uint32_t i = 0; i < BENCH_READERS; ++i)
+        readers[i].join();
+
+    NodeActorStats stats = actor->getStats();
+
+    if (stats.applied < iteration || node.getName() != (iteration & 1 ? "odd" : "even"))
+        state.skipWithError("a command was lost");
+}
+BENCHMARK(BM_actorTickWithReaders);
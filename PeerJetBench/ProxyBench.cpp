@@ -0,0 +1,104 @@
+//
+//  ProxyBench.cpp
+//  PeerJetBench
+//
+//  Created by Compy on 12/11/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <unistd.h>
+#include "Benchmark.hpp"
+#include "Proxy.hpp"
+#include "ProxyStandIn.hpp"
+
+#define BENCH_PACKET_SIZE       1024
+#define BENCH_BATCH             16
+#define BENCH_PACKET_ID         200
+
+/* ms to wait for the association or the echoes before giving up. */
+#define BENCH_TIMEOUT           5000
+
+static int echo(void *object, IP_Port ipPort, const uint8_t *data, uint16_t length)
+{
+    NetworkService::sendPacket((NetworkingCore *)object, ipPort, data, length);
+    return 0;
+}
+
+static int count(void *object, IP_Port ipPort, const uint8_t *data, uint16_t length)
+{
+    ++*(uint64_t *)object;
+    return 0;
+}
+
+/* Datagrams to a peer and its echoes back, through a SOCKS5 UDP association. */
+static void BM_proxyUdpAssociate(BenchmarkState& state)
+{
+    ProxyStandIn *standIn = ProxyStandIn::create();
+    IP_Port proxy;
+    NetworkService::ipInit(&proxy.ip, 0);
+    NetworkService::addrParseIp("127.0.0.1", &proxy.ip);
+
+    if (!standIn) {
+        state.skipWithError("could not start the proxy");
+        return;
+    }
+
+    proxy.port = htons(standIn->getPort());
+
+    ProxyDatagrams *datagrams = ProxyDatagrams::create(proxy);
+    NetworkingCore *client = datagrams ? NetworkService::newVirtualNetworking(proxy.ip, 0, datagrams->getTransport()) : NULL;
+    NetworkingCore *peer = NetworkService::newNetworkingEx(proxy.ip, 0, 0, NULL);
+    uint64_t echoes = 0;
+
+    if (client && peer) {
+        NetworkService::registerHandler(peer, BENCH_PACKET_ID, &echo, peer);
+        NetworkService::registerHandler(client, BENCH_PACKET_ID, &count, &echoes);
+    }
+
+    uint64_t start = NetworkService::getCurrentTimeMonotonic();
+
+    while (client && peer && !datagrams->isAssociated() && NetworkService::getCurrentTimeMonotonic() - start < BENCH_TIMEOUT) {
+        NetworkService::poll(client);
+        usleep(100);
+    }
+
+    if (!client || !peer || !datagrams->isAssociated()) {
+        state.skipWithError("no UDP association");
+    } else {
+        IP_Port target;
+        target.ip = proxy.ip;
+        target.port = peer->port;
+
+        uint8_t packet[BENCH_PACKET_SIZE];
+        memset(packet, 0x5A, sizeof(packet));
+        packet[0] = BENCH_PACKET_ID;
+        uint64_t sent = 0;
+
+        while (state.keepRunning()) {
+            for (int i = 0; i < BENCH_BATCH; ++i)
+                NetworkService::sendPacket(client, target, packet, sizeof(packet));
+
+            sent += BENCH_BATCH;
+            start = NetworkService::getCurrentTimeMonotonic();
+
+            /* Loopback doesn't lose datagrams unless a buffer overflows, we wait for all of them. */
+            while (echoes < sent && NetworkService::getCurrentTimeMonotonic() - start < BENCH_TIMEOUT) {
+                NetworkService::poll(peer);
+                NetworkService::poll(client);
+            }
+
+            if (echoes < sent) {
+                state.skipWithError("datagrams lost");
+                break;
+            }
+        }
+
+        state.setBytesPerIteration(BENCH_BATCH * BENCH_PACKET_SIZE);
+    }
+
+    NetworkService::killNetworking(client);
+    NetworkService::killNetworking(peer);
+    delete datagrams;
+    delete standIn;
+}
+BENCHMARK(BM_proxyUdpAssociate);
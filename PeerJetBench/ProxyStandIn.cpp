@@ -0,0 +1,358 @@
+//
+//  ProxyStandIn.cpp
+//  PeerJetBench
+//
+//  Created by Compy on 12/11/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "ProxyStandIn.hpp"
+
+#define STANDIN_BUFFER_SIZE     (64 * 1024)
+
+static bool readAll(int sock, uint8_t *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t n = recv(sock, data, length, 0);
+
+        if (n <= 0)
+            return false;
+
+        data += n;
+        length -= (size_t)n;
+    }
+
+    return true;
+}
+
+static bool writeAll(int sock, const uint8_t *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t n = send(sock, data, length, MSG_NOSIGNAL);
+
+        if (n <= 0)
+            return false;
+
+        data += n;
+        length -= (size_t)n;
+    }
+
+    return true;
+}
+
+/* return a socket connected to addr, -1 on failure. */
+static int connectTo(const struct sockaddr_storage *addr, socklen_t addrsize)
+{
+    int sock = socket(addr->ss_family, SOCK_STREAM, IPPROTO_TCP);
+
+    if (sock != -1 && connect(sock, (const struct sockaddr *)addr, addrsize) != 0) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+ProxyStandIn::ProxyStandIn() : listenSock(-1), port(0), stopping(false), tunnels(0)
+{
+}
+
+ProxyStandIn* ProxyStandIn::create()
+{
+    ProxyStandIn *proxy = new ProxyStandIn();
+    struct sockaddr_in addr;
+    socklen_t addrsize = sizeof(addr);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    proxy->listenSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    if (proxy->listenSock == -1 || bind(proxy->listenSock, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(proxy->listenSock, 512) != 0
+        || getsockname(proxy->listenSock, (struct sockaddr *)&addr, &addrsize) != 0) {
+        delete proxy;
+        return NULL;
+    }
+
+    proxy->port = ntohs(addr.sin_port);
+    proxy->thread = std::thread(&ProxyStandIn::run, proxy);
+    return proxy;
+}
+
+ProxyStandIn::~ProxyStandIn()
+{
+    this->stopping = true;
+
+    if (this->listenSock != -1)
+        shutdown(this->listenSock, SHUT_RDWR);
+
+    if (this->thread.joinable())
+        this->thread.join();
+
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+
+        for (size_t i = 0; i < this->sockets.size(); ++i)
+            shutdown(this->sockets[i], SHUT_RDWR);
+    }
+
+    for (size_t i = 0; i < this->sessions.size(); ++i)
+        this->sessions[i].join();
+
+    for (size_t i = 0; i < this->sockets.size(); ++i)
+        close(this->sockets[i]);
+
+    if (this->listenSock != -1)
+        close(this->listenSock);
+}
+
+uint16_t ProxyStandIn::getPort()
+{
+    return this->port;
+}
+
+uint64_t ProxyStandIn::getTunnels()
+{
+    return this->tunnels;
+}
+
+void ProxyStandIn::run()
+{
+    while (!this->stopping) {
+        int client = accept(this->listenSock, NULL, NULL);
+
+        if (client == -1)
+            break;
+
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->sockets.push_back(client);
+        this->sessions.push_back(std::thread(&ProxyStandIn::serve, this, client));
+    }
+}
+
+void ProxyStandIn::serve(int client)
+{
+    uint8_t first;
+
+    if (recv(client, &first, 1, MSG_PEEK) != 1)
+        return;
+
+    if (first == 5) {
+        this->serveSocks5(client);
+    } else {
+        this->serveHttp(client);
+    }
+}
+
+bool ProxyStandIn::serveSocks5(int client)
+{
+    uint8_t request[4 + 16 + 2];
+    uint8_t methods[255];
+
+    if (!readAll(client, request, 2) || !readAll(client, methods, request[1]))
+        return false;
+
+    uint8_t method[2] = {5, 0};
+
+    if (!writeAll(client, method, sizeof(method)) || !readAll(client, request, 4))
+        return false;
+
+    struct sockaddr_storage addr;
+    socklen_t addrsize;
+    memset(&addr, 0, sizeof(addr));
+
+    if (request[3] == 1) {
+        struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
+
+        if (!readAll(client, request + 4, 4 + 2))
+            return false;
+
+        addr4->sin_family = AF_INET;
+        memcpy(&addr4->sin_addr, request + 4, 4);
+        memcpy(&addr4->sin_port, request + 8, 2);
+        addrsize = sizeof(*addr4);
+    } else if (request[3] == 4) {
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+
+        if (!readAll(client, request + 4, 16 + 2))
+            return false;
+
+        addr6->sin6_family = AF_INET6;
+        memcpy(&addr6->sin6_addr, request + 4, 16);
+        memcpy(&addr6->sin6_port, request + 20, 2);
+        addrsize = sizeof(*addr6);
+    } else {
+        return false;
+    }
+
+    if (request[1] == 3) {
+        this->associate(client);
+        return true;
+    }
+
+    uint8_t reply[10] = {5, 0, 0, 1};
+    int target = request[1] == 1 ? connectTo(&addr, addrsize) : -1;
+
+    if (target == -1) {
+        reply[1] = 5;
+        writeAll(client, reply, sizeof(reply));
+        return false;
+    }
+
+    if (writeAll(client, reply, sizeof(reply))) {
+        ++this->tunnels;
+        this->splice(client, target);
+    }
+
+    close(target);
+    return true;
+}
+
+bool ProxyStandIn::serveHttp(int client)
+{
+    char header[2048];
+    size_t length = 0;
+
+    /* Byte by byte, nothing of the tunnel may be read past the header. */
+    while (length < 4 || memcmp(header + length - 4, "\r\n\r\n", 4) != 0) {
+        if (length == sizeof(header) - 1 || recv(client, header + length, 1, 0) != 1)
+            return false;
+
+        ++length;
+    }
+
+    header[length] = 0;
+
+    char host[64];
+    unsigned int port;
+    struct sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
+    struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
+
+    if (sscanf(header, "CONNECT %63[0-9.]:%u HTTP/1.", host, &port) != 2 || inet_pton(AF_INET, host, &addr4->sin_addr) != 1) {
+        const char *refused = "HTTP/1.1 400 Bad Request\r\n\r\n";
+        writeAll(client, (const uint8_t *)refused, strlen(refused));
+        return false;
+    }
+
+    addr4->sin_family = AF_INET;
+    addr4->sin_port = htons((uint16_t)port);
+    int target = connectTo(&addr, sizeof(*addr4));
+    const char *reply = target == -1 ? "HTTP/1.1 502 Bad Gateway\r\n\r\n" : "HTTP/1.1 200 Connection established\r\n\r\n";
+
+    if (writeAll(client, (const uint8_t *)reply, strlen(reply)) && target != -1) {
+        ++this->tunnels;
+        this->splice(client, target);
+    }
+
+    if (target != -1)
+        close(target);
+
+    return target != -1;
+}
+
+void ProxyStandIn::splice(int a, int b)
+{
+    static thread_local uint8_t buffer[STANDIN_BUFFER_SIZE];
+    struct pollfd fds[2] = {{a, POLLIN, 0}, {b, POLLIN, 0}};
+
+    while (!this->stopping && poll(fds, 2, 1000) >= 0) {
+        for (int i = 0; i < 2; ++i) {
+            if (!fds[i].revents)
+                continue;
+
+            ssize_t n = recv(fds[i].fd, buffer, sizeof(buffer), 0);
+
+            if (n <= 0 || !writeAll(fds[1 - i].fd, buffer, (size_t)n))
+                return;
+        }
+    }
+}
+
+/* Relay datagrams for the client until it closes the control connection. */
+void ProxyStandIn::associate(int client)
+{
+    static thread_local uint8_t buffer[STANDIN_BUFFER_SIZE];
+    struct sockaddr_in addr;
+    socklen_t addrsize = sizeof(addr);
+    uint8_t reply[10] = {5, 0, 0, 1};
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int udp = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+    if (udp == -1 || bind(udp, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || getsockname(udp, (struct sockaddr *)&addr, &addrsize) != 0) {
+        reply[1] = 1;
+        writeAll(client, reply, sizeof(reply));
+
+        if (udp != -1)
+            close(udp);
+
+        return;
+    }
+
+    memcpy(reply + 4, &addr.sin_addr, 4);
+    memcpy(reply + 8, &addr.sin_port, 2);
+
+    if (!writeAll(client, reply, sizeof(reply))) {
+        close(udp);
+        return;
+    }
+
+    ++this->tunnels;
+
+    /* The first datagram tells us where the client sends from. */
+    struct sockaddr_in owner;
+    bool known = false;
+    struct pollfd fds[2] = {{client, POLLIN, 0}, {udp, POLLIN, 0}};
+
+    while (!this->stopping && poll(fds, 2, 1000) >= 0) {
+        if (fds[0].revents && recv(client, buffer, sizeof(buffer), 0) <= 0)
+            break;
+
+        if (!fds[1].revents)
+            continue;
+
+        struct sockaddr_in from;
+        socklen_t fromsize = sizeof(from);
+        ssize_t n = recvfrom(udp, buffer + 10, sizeof(buffer) - 10, 0, (struct sockaddr *)&from, &fromsize);
+
+        if (n <= 0)
+            continue;
+
+        if (!known || (from.sin_addr.s_addr == owner.sin_addr.s_addr && from.sin_port == owner.sin_port)) {
+            owner = from;
+            known = true;
+
+            /* [0 0 0 1 address port] data, IPv4 destinations only. */
+            if (n < 10 || buffer[10] != 0 || buffer[11] != 0 || buffer[12] != 0 || buffer[13] != 1)
+                continue;
+
+            struct sockaddr_in to;
+            memset(&to, 0, sizeof(to));
+            to.sin_family = AF_INET;
+            memcpy(&to.sin_addr, buffer + 14, 4);
+            memcpy(&to.sin_port, buffer + 18, 2);
+            sendto(udp, buffer + 20, (size_t)n - 10, 0, (struct sockaddr *)&to, sizeof(to));
+        } else {
+            uint8_t *packet = buffer;
+            packet[0] = packet[1] = packet[2] = 0;
+            packet[3] = 1;
+            memcpy(packet + 4, &from.sin_addr, 4);
+            memcpy(packet + 8, &from.sin_port, 2);
+            sendto(udp, packet, (size_t)n + 10, 0, (struct sockaddr *)&owner, sizeof(owner));
+        }
+    }
+
+    close(udp);
+}
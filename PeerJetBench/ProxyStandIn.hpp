@@ -0,0 +1,56 @@
+//
+//  ProxyStandIn.hpp
+//  PeerJetBench
+//
+//  Created by Compy on 12/11/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef ProxyStandIn_hpp
+#define ProxyStandIn_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Small local proxy to run the proxy transports against.
+ *
+ * Speaks HTTP CONNECT and SOCKS5 (no authentication, CONNECT and UDP ASSOCIATE)
+ * on the same port, told apart by the first byte. A blocking thread serves
+ * every session, it is only meant for benchmarks and trying things out.
+ */
+class ProxyStandIn {
+public:
+    /* Listen on 127.0.0.1, return NULL on failure. */
+    static ProxyStandIn* create();
+    ~ProxyStandIn();
+
+    /* return the port we listen on, in host byte order. */
+    uint16_t getPort();
+
+    /* return the sessions that got their tunnel or association. */
+    uint64_t getTunnels();
+
+private:
+    ProxyStandIn();
+
+    void run();
+    void serve(int client);
+    bool serveSocks5(int client);
+    bool serveHttp(int client);
+    void splice(int a, int b);
+    void associate(int client);
+
+    int listenSock;
+    uint16_t port;
+    std::atomic<bool> stopping;
+    std::atomic<uint64_t> tunnels;
+    std::thread thread;
+    std::mutex lock;
+    std::vector<std::thread> sessions;
+    std::vector<int> sockets;
+};
+
+#endif /* ProxyStandIn_hpp */
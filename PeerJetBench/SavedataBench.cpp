@@ -0,0 +1,172 @@
+//
+//  SavedataBench.cpp
+//  PeerJetBench
+//
+//  Created by Compy on 12/13/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+#include "Benchmark.hpp"
+#include "Crypto.hpp"
+#include "Node.hpp"
+#include "Savedata.hpp"
+
+#define BENCH_SAVED_FRIENDS 10000
+
+static const char passphrase[] = "correct horse battery staple";
+
+/* A profile file with BENCH_SAVED_FRIENDS friends, removed with the object. */
+class SavedProfile {
+public:
+    SavedProfile(bool encrypted = false)
+    {
+        char path[] = "/tmp/peerjet-bench-XXXXXX";
+        int fd = mkstemp(path);
+
+        if (fd != -1)
+            close(fd);
+
+        this->path = path;
+        memset(&this->config, 0, sizeof(this->config));
+        this->config.savePath = this->path.c_str();
+
+        if (encrypted) {
+            this->config.savePassphrase = (const uint8_t *)passphrase;
+            this->config.savePassphraseLength = strlen(passphrase);
+        }
+
+        this->node = new Node(&this->config);
+        this->node->setName("bench");
+
+        for (uint32_t i = 0; i < BENCH_SAVED_FRIENDS; ++i) {
+            uint8_t pk[PEERJET_KEY_LENGTH], sk[crypto_box_SECRETKEYBYTES];
+            crypto_box_keypair(pk, sk);
+            this->node->addFriendNoRequest(pk);
+        }
+
+        this->ready = fd != -1 && this->node->saveSnapshot();
+    }
+
+    ~SavedProfile()
+    {
+        delete this->node;
+        unlink(this->path.c_str());
+    }
+
+    std::string path;
+    NodeConfiguration config;
+    Node* node;
+    bool ready;
+};
+
+/* Start a node from the profile, the file is mapped and the keys of the friends indexed. */
+static void BM_savedataLoad(BenchmarkState& state)
+{
+    SavedProfile profile;
+
+    if (!profile.ready) {
+        state.skipWithError("could not write the profile");
+        return;
+    }
+
+    while (state.keepRunning()) {
+        Node node(&profile.config);
+
+        if (node.friendListSize() != BENCH_SAVED_FRIENDS)
+            state.skipWithError("friends not loaded");
+    }
+
+    state.setBytesPerIteration(BENCH_SAVED_FRIENDS * SAVEDATA_FRIEND_SIZE);
+}
+BENCHMARK(BM_savedataLoad);
+
+/* The whole profile rewritten after every change. */
+static void BM_savedataSnapshot(BenchmarkState& state)
+{
+    SavedProfile profile;
+
+    if (!profile.ready) {
+        state.skipWithError("could not write the profile");
+        return;
+    }
+
+    uint64_t iteration = 0;
+
+    while (state.keepRunning()) {
+        profile.node->setStatus(++iteration & 1 ? USER_STATUS_AWAY : USER_STATUS_NONE);
+
+        if (!profile.node->saveSnapshot())
+            state.skipWithError("snapshot failed");
+    }
+
+    state.setBytesPerIteration(BENCH_SAVED_FRIENDS * SAVEDATA_FRIEND_SIZE);
+}
+BENCHMARK(BM_savedataSnapshot);
+
+/* Only the change appended, compared to BM_savedataSnapshot. */
+static void BM_savedataSaveDelta(BenchmarkState& state)
+{
+    SavedProfile profile;
+
+    if (!profile.ready) {
+        state.skipWithError("could not write the profile");
+        return;
+    }
+
+    uint64_t iteration = 0;
+
+    while (state.keepRunning()) {
+        profile.node->setStatus(++iteration & 1 ? USER_STATUS_AWAY : USER_STATUS_NONE);
+
+        if (!profile.node->save())
+            state.skipWithError("save failed");
+    }
+}
+BENCHMARK(BM_savedataSaveDelta);
+
+/* Unlocking an encrypted profile: one key derivation, then the chunks opened in parallel. */
+static void BM_savedataEncryptedLoad(BenchmarkState& state)
+{
+    SavedProfile profile(true);
+
+    if (!profile.ready) {
+        state.skipWithError("could not write the profile");
+        return;
+    }
+
+    while (state.keepRunning()) {
+        Node node(&profile.config);
+
+        if (node.friendListSize() != BENCH_SAVED_FRIENDS)
+            state.skipWithError("friends not loaded");
+    }
+
+    state.setBytesPerIteration(BENCH_SAVED_FRIENDS * SAVEDATA_FRIEND_SIZE);
+}
+BENCHMARK(BM_savedataEncryptedLoad);
+
+/* The key is kept once derived, a snapshot only seals and writes. */
+static void BM_savedataEncryptedSnapshot(BenchmarkState& state)
+{
+    SavedProfile profile(true);
+
+    if (!profile.ready) {
+        state.skipWithError("could not write the profile");
+        return;
+    }
+
+    uint64_t iteration = 0;
+
+    while (state.keepRunning()) {
+        profile.node->setStatus(++iteration & 1 ? USER_STATUS_AWAY : USER_STATUS_NONE);
+
+        if (!profile.node->saveSnapshot())
+            state.skipWithError("snapshot failed");
+    }
+
+    state.setBytesPerIteration(BENCH_SAVED_FRIENDS * SAVEDATA_FRIEND_SIZE);
+}
+BENCHMARK(BM_savedataEncryptedSnapshot);
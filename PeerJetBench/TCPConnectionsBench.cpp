@@ -0,0 +1,222 @@
+//
+//  TCPConnectionsBench.cpp
+//  PeerJetBench
+//
+//  Created by Compy on 12/10/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <vector>
+#include "Benchmark.hpp"
+#include "ProxyStandIn.hpp"
+#include "TCPConnections.hpp"
+
+#define BENCH_PACKET_SIZE       1024
+#define BENCH_BATCH             16
+#define BENCH_PEERS             8
+#define BENCH_ROUTED_PEERS      64
+
+/* ms to wait for routes or packets before giving up. */
+#define BENCH_TIMEOUT           5000
+
+struct Peer {
+    Peer()
+    {
+        uint8_t secretKey[crypto_box_SECRETKEYBYTES];
+        crypto_box_keypair(this->publicKey, secretKey);
+        this->pool = new TCPConnections(this->publicKey, secretKey);
+        this->pool->setDataCallback(&Peer::receive, this);
+        this->received = 0;
+    }
+
+    ~Peer()
+    {
+        delete this->pool;
+    }
+
+    static void receive(void *object, uint32_t connection, const uint8_t *data, uint16_t length)
+    {
+        ((Peer *)object)->received += length;
+    }
+
+    uint8_t publicKey[crypto_box_PUBLICKEYBYTES];
+    TCPConnections *pool;
+    uint64_t received;
+};
+
+/* A hub peer routed to count peers through one relay, optionally all of them behind a proxy. */
+class PoolFixture {
+public:
+    PoolFixture(size_t count, ProxyType proxyType = PROXY_TYPE_NONE)
+    {
+        IP ip;
+        NetworkService::ipInit(&ip, 0);
+        NetworkService::addrParseIp("127.0.0.1", &ip);
+        crypto_box_keypair(this->publicKey, this->secretKey);
+        this->server = TCPServer::create(ip, 0, this->publicKey, this->secretKey, 1);
+
+        for (size_t i = 0; i < count; ++i)
+            this->peers.push_back(new Peer());
+
+        this->proxyType = proxyType;
+        this->standIn = proxyType == PROXY_TYPE_NONE ? NULL : ProxyStandIn::create();
+    }
+
+    ~PoolFixture()
+    {
+        for (size_t i = 0; i < this->peers.size(); ++i)
+            delete this->peers[i];
+
+        delete this->server;
+        delete this->standIn;
+    }
+
+    bool ready()
+    {
+        return this->server && (this->proxyType == PROXY_TYPE_NONE || this->standIn);
+    }
+
+    /* Add the relay everywhere and route the hub to every peer.
+     *
+     * return false if the routes didn't come online in time.
+     */
+    bool link()
+    {
+        IP_Port ipPort;
+        NetworkService::ipInit(&ipPort.ip, 0);
+        NetworkService::addrParseIp("127.0.0.1", &ipPort.ip);
+        ipPort.port = htons(this->server->getPort());
+
+        if (this->standIn) {
+            IP_Port proxy = ipPort;
+            proxy.port = htons(this->standIn->getPort());
+            this->hub.pool->setProxy(this->proxyType, proxy);
+
+            for (size_t i = 0; i < this->peers.size(); ++i)
+                this->peers[i]->pool->setProxy(this->proxyType, proxy);
+        }
+
+        this->hub.pool->addRelay(ipPort, this->publicKey);
+
+        for (size_t i = 0; i < this->peers.size(); ++i) {
+            this->peers[i]->pool->addRelay(ipPort, this->publicKey);
+            this->peers[i]->pool->addConnection(this->hub.publicKey);
+            this->hub.pool->addConnection(this->peers[i]->publicKey);
+        }
+
+        return this->run([this]() { return this->hub.pool->getStats().connections == this->peers.size(); });
+    }
+
+    /* Tick every pool until done() or the timeout. */
+    template <class Condition>
+    bool run(Condition done)
+    {
+        uint64_t start = NetworkService::getCurrentTimeMonotonic();
+
+        while (!done()) {
+            if (NetworkService::getCurrentTimeMonotonic() - start > BENCH_TIMEOUT)
+                return false;
+
+            this->hub.pool->tick();
+
+            for (size_t i = 0; i < this->peers.size(); ++i)
+                this->peers[i]->pool->tick();
+        }
+
+        return true;
+    }
+
+    TCPServer* server;
+    Peer hub;
+    std::vector<Peer*> peers;
+
+private:
+    uint8_t publicKey[crypto_box_PUBLICKEYBYTES];
+    uint8_t secretKey[crypto_box_SECRETKEYBYTES];
+    ProxyType proxyType;
+    ProxyStandIn* standIn;
+};
+
+static void routes(BenchmarkState& state, ProxyType proxyType)
+{
+    while (state.keepRunning()) {
+        state.pauseTiming();
+        PoolFixture *fixture = new PoolFixture(BENCH_ROUTED_PEERS, proxyType);
+        state.resumeTiming();
+
+        bool linked = fixture->ready() && fixture->link();
+
+        state.pauseTiming();
+        delete fixture;
+        state.resumeTiming();
+
+        if (!linked) {
+            state.skipWithError("routes didn't come online");
+            return;
+        }
+    }
+}
+
+/* Bring up the routes of a peer to many others, all over a single relay socket. */
+static void BM_tcpPoolRoutes(BenchmarkState& state)
+{
+    routes(state, PROXY_TYPE_NONE);
+}
+BENCHMARK(BM_tcpPoolRoutes);
+
+/* The same with every pool behind a SOCKS5 proxy, the tunnels are negotiated side by side. */
+static void BM_tcpPoolRoutesSocks5(BenchmarkState& state)
+{
+    routes(state, PROXY_TYPE_SOCKS5);
+}
+BENCHMARK(BM_tcpPoolRoutesSocks5);
+
+/* And behind an HTTP CONNECT proxy. */
+static void BM_tcpPoolRoutesHttp(BenchmarkState& state)
+{
+    routes(state, PROXY_TYPE_HTTP);
+}
+BENCHMARK(BM_tcpPoolRoutesHttp);
+
+/* Lossless packets from one peer to several, multiplexed over its relay socket. */
+static void BM_tcpPoolForward(BenchmarkState& state)
+{
+    PoolFixture fixture(BENCH_PEERS);
+
+    if (!fixture.ready() || !fixture.link()) {
+        state.skipWithError("routes didn't come online");
+        return;
+    }
+
+    uint8_t packet[BENCH_PACKET_SIZE];
+    uint64_t sent = 0;
+    memset(packet, 0x5A, sizeof(packet));
+
+    while (state.keepRunning()) {
+        for (int i = 0; i < BENCH_BATCH; ++i) {
+            if (fixture.hub.pool->sendPacket((uint32_t)(i % BENCH_PEERS), packet, sizeof(packet), true) != 0) {
+                state.skipWithError("queue full");
+                return;
+            }
+        }
+
+        sent += BENCH_BATCH * BENCH_PACKET_SIZE;
+
+        bool arrived = fixture.run([&]() {
+            uint64_t received = 0;
+
+            for (size_t i = 0; i < fixture.peers.size(); ++i)
+                received += fixture.peers[i]->received;
+
+            return received == sent;
+        });
+
+        if (!arrived) {
+            state.skipWithError("packets lost");
+            return;
+        }
+    }
+
+    state.setBytesPerIteration(BENCH_BATCH * BENCH_PACKET_SIZE);
+}
+BENCHMARK(BM_tcpPoolForward);
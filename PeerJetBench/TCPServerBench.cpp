@@ -0,0 +1,362 @@
+//
+//  TCPServerBench.cpp
+//  PeerJetBench
+//
+//  Created by Compy on 12/9/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <thread>
+#include <vector>
+#include "Benchmark.hpp"
+#include "TCPServer.hpp"
+
+#define BENCH_PACKET_SIZE       1024
+#define BENCH_BATCH             16
+
+/* Clients kept connected to the relay by BM_tcpRelayForwardIdle, PEERJET_BENCH_IDLE_CLIENTS overrides it. */
+#define BENCH_IDLE_CLIENTS      10000
+
+/* Connections per loopback source address, below the ephemeral port range. */
+#define BENCH_CLIENTS_PER_SOURCE 20000
+
+/* Blocking client speaking the relay protocol. */
+class RelayClient {
+public:
+    RelayClient()
+    {
+        this->sock = -1;
+        crypto_box_keypair(this->publicKey, this->secretKey);
+    }
+
+    ~RelayClient()
+    {
+        if (this->sock != -1)
+            close(this->sock);
+    }
+
+    /* Connect from 127.0.0.(source + 1) and send a ping to get confirmed. */
+    bool connect(uint16_t port, const uint8_t* serverKey, uint32_t source)
+    {
+        this->sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+        if (this->sock == -1)
+            return false;
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(0x7F000001 + source);
+
+        struct timeval timeout = {2, 0};
+        setsockopt(this->sock, SOL_SOCKET, SO_RCVTIMEO, (void *)&timeout, sizeof(timeout));
+        int noDelay = 1;
+        setsockopt(this->sock, IPPROTO_TCP, TCP_NODELAY, (void *)&noDelay, sizeof(noDelay));
+
+        if (source && bind(this->sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+            return false;
+
+        addr.sin_addr.s_addr = htonl(0x7F000001);
+        addr.sin_port = htons(port);
+
+        if (::connect(this->sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+            return false;
+
+        uint8_t tempPublicKey[crypto_box_PUBLICKEYBYTES];
+        uint8_t tempSecretKey[crypto_box_SECRETKEYBYTES];
+        uint8_t plain[TCP_HANDSHAKE_PLAIN_SIZE];
+        uint8_t handshake[TCP_CLIENT_HANDSHAKE_SIZE];
+        crypto_box_keypair(tempPublicKey, tempSecretKey);
+        Crypto::randomNonce(this->sentNonce);
+        memcpy(plain, tempPublicKey, crypto_box_PUBLICKEYBYTES);
+        memcpy(plain + crypto_box_PUBLICKEYBYTES, this->sentNonce, crypto_box_NONCEBYTES);
+        memcpy(handshake, this->publicKey, crypto_box_PUBLICKEYBYTES);
+        Crypto::randomNonce(handshake + crypto_box_PUBLICKEYBYTES);
+        Crypto::encryptData(serverKey, this->secretKey, handshake + crypto_box_PUBLICKEYBYTES, plain, sizeof(plain),
+                            handshake + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES);
+
+        uint8_t response[TCP_SERVER_HANDSHAKE_SIZE];
+
+        if (!this->writeAll(handshake, sizeof(handshake)) || !this->readAll(response, sizeof(response)))
+            return false;
+
+        if (Crypto::decryptData(serverKey, this->secretKey, response, response + crypto_box_NONCEBYTES,
+                                sizeof(response) - crypto_box_NONCEBYTES, plain) != TCP_HANDSHAKE_PLAIN_SIZE)
+            return false;
+
+        Crypto::encryptPrecompute(plain, tempSecretKey, this->sharedKey);
+        memcpy(this->recvNonce, plain + crypto_box_PUBLICKEYBYTES, crypto_box_NONCEBYTES);
+
+        uint8_t ping[1 + sizeof(uint64_t)] = {TCP_PACKET_PING, 1};
+        return this->send(ping, sizeof(ping)) && this->flush();
+    }
+
+    /* Queue a packet, flush() writes everything queued at once. */
+    bool send(const uint8_t* data, uint16_t length)
+    {
+        size_t offset = this->output.size();
+        this->output.resize(offset + 2 + length + crypto_box_MACBYTES);
+        uint8_t *frame = this->output.data() + offset;
+        frame[0] = (uint8_t)((length + crypto_box_MACBYTES) >> 8);
+        frame[1] = (uint8_t)(length + crypto_box_MACBYTES);
+
+        if (Crypto::encryptDataSymmetric(this->sharedKey, this->sentNonce, data, length, frame + 2) == -1)
+            return false;
+
+        Crypto::incrementNonce(this->sentNonce);
+        return true;
+    }
+
+    bool flush()
+    {
+        bool written = this->writeAll(this->output.data(), this->output.size());
+        this->output.clear();
+        return written;
+    }
+
+    /* return the length of the next packet, -1 on error or timeout. */
+    int receive(uint8_t* data)
+    {
+        uint8_t frame[TCP_MAX_PACKET_SIZE];
+
+        if (!this->readAll(frame, 2))
+            return -1;
+
+        uint16_t length = (uint16_t)((frame[0] << 8) | frame[1]);
+
+        if (length > TCP_MAX_PACKET_SIZE || !this->readAll(frame, length))
+            return -1;
+
+        int plainLength = Crypto::decryptDataSymmetric(this->sharedKey, this->recvNonce, frame, length, data);
+        Crypto::incrementNonce(this->recvNonce);
+        return plainLength;
+    }
+
+    /* return the first packet starting with packetId, skipping others. */
+    int receive(uint8_t packetId, uint8_t* data)
+    {
+        for (int length; (length = this->receive(data)) != -1; ) {
+            if (length > 0 && data[0] == packetId)
+                return length;
+        }
+
+        return -1;
+    }
+
+    uint8_t publicKey[crypto_box_PUBLICKEYBYTES];
+
+private:
+    bool writeAll(const uint8_t* data, size_t length)
+    {
+        while (length > 0) {
+            ssize_t written = ::send(this->sock, data, length, MSG_NOSIGNAL);
+
+            if (written <= 0)
+                return false;
+
+            data += written;
+            length -= (size_t)written;
+        }
+
+        return true;
+    }
+
+    bool readAll(uint8_t* data, size_t length)
+    {
+        while (length > 0) {
+            ssize_t n = recv(this->sock, data, length, 0);
+
+            if (n <= 0)
+                return false;
+
+            data += n;
+            length -= (size_t)n;
+        }
+
+        return true;
+    }
+
+    int sock;
+    uint8_t secretKey[crypto_box_SECRETKEYBYTES];
+    uint8_t sharedKey[crypto_box_BEFORENMBYTES];
+    uint8_t sentNonce[crypto_box_NONCEBYTES];
+    uint8_t recvNonce[crypto_box_NONCEBYTES];
+    std::vector<uint8_t> output;
+};
+
+/* A relay on 127.0.0.1 with a worker per core, or PEERJET_BENCH_RELAY_WORKERS. */
+class RelayFixture {
+public:
+    RelayFixture()
+    {
+        IP ip;
+        NetworkService::ipInit(&ip, 0);
+        NetworkService::addrParseIp("127.0.0.1", &ip);
+        crypto_box_keypair(this->publicKey, this->secretKey);
+
+        const char *workers = getenv("PEERJET_BENCH_RELAY_WORKERS");
+        this->server = TCPServer::create(ip, 0, this->publicKey, this->secretKey,
+                                         workers ? (unsigned int)atoi(workers) : std::thread::hardware_concurrency());
+    }
+
+    ~RelayFixture()
+    {
+        for (size_t i = 0; i < this->idle.size(); ++i)
+            delete this->idle[i];
+
+        delete this->server;
+    }
+
+    bool connect(RelayClient* client, uint32_t source = 0)
+    {
+        return client->connect(this->server->getPort(), this->publicKey, source);
+    }
+
+    /* Route a to b and b to a, return the connection id a sends to b on. */
+    int link(RelayClient* a, RelayClient* b)
+    {
+        uint8_t request[1 + crypto_box_PUBLICKEYBYTES] = {TCP_PACKET_ROUTING_REQUEST};
+        uint8_t packet[TCP_MAX_PACKET_SIZE];
+
+        memcpy(request + 1, b->publicKey, crypto_box_PUBLICKEYBYTES);
+
+        if (!a->send(request, sizeof(request)) || !a->flush() || a->receive(TCP_PACKET_ROUTING_RESPONSE, packet) == -1)
+            return -1;
+
+        int id = packet[1];
+        memcpy(request + 1, a->publicKey, crypto_box_PUBLICKEYBYTES);
+
+        if (!b->send(request, sizeof(request)) || !b->flush() || b->receive(TCP_PACKET_CONNECTION_NOTIFICATION, packet) == -1
+            || a->receive(TCP_PACKET_CONNECTION_NOTIFICATION, packet) == -1)
+            return -1;
+
+        return id;
+    }
+
+    /* Connect count clients that stay idle, every one costs two descriptors here. */
+    size_t addIdleClients(size_t count)
+    {
+        struct rlimit limit;
+
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+            count = std::min(count, (size_t)(limit.rlim_cur / 2 > 64 ? limit.rlim_cur / 2 - 64 : 0));
+        }
+
+        while (this->idle.size() < count) {
+            RelayClient *client = new RelayClient();
+
+            if (!this->connect(client, 1 + (uint32_t)(this->idle.size() / BENCH_CLIENTS_PER_SOURCE))) {
+                delete client;
+                break;
+            }
+
+            this->idle.push_back(client);
+        }
+
+        return this->idle.size();
+    }
+
+    TCPServer* server;
+    uint8_t publicKey[crypto_box_PUBLICKEYBYTES];
+
+private:
+    uint8_t secretKey[crypto_box_SECRETKEYBYTES];
+    std::vector<RelayClient*> idle;
+};
+
+/* Connect, handshake and first packet of a client. */
+static void BM_tcpRelayConnect(BenchmarkState& state)
+{
+    RelayFixture relay;
+
+    if (!relay.server) {
+        state.skipWithError("could not start the relay");
+        return;
+    }
+
+    while (state.keepRunning()) {
+        RelayClient client;
+
+        if (!relay.connect(&client)) {
+            state.skipWithError("handshake failed");
+            return;
+        }
+    }
+}
+BENCHMARK(BM_tcpRelayConnect);
+
+static void forward(BenchmarkState& state, RelayFixture& relay)
+{
+    RelayClient a, b;
+    int id;
+
+    if (!relay.connect(&a) || !relay.connect(&b) || (id = relay.link(&a, &b)) == -1) {
+        state.skipWithError("could not link two clients");
+        return;
+    }
+
+    uint8_t packet[1 + BENCH_PACKET_SIZE];
+    uint8_t received[TCP_MAX_PACKET_SIZE];
+    memset(packet, 0x5A, sizeof(packet));
+    packet[0] = (uint8_t)id;
+
+    while (state.keepRunning()) {
+        for (int i = 0; i < BENCH_BATCH; ++i)
+            a.send(packet, sizeof(packet));
+
+        if (!a.flush()) {
+            state.skipWithError("send failed");
+            return;
+        }
+
+        for (int i = 0; i < BENCH_BATCH; ++i) {
+            if (b.receive(received) != (int)sizeof(packet)) {
+                state.skipWithError("packet lost");
+                return;
+            }
+        }
+    }
+
+    state.setBytesPerIteration(BENCH_BATCH * BENCH_PACKET_SIZE);
+}
+
+/* Two clients exchanging data through the relay. */
+static void BM_tcpRelayForward(BenchmarkState& state)
+{
+    RelayFixture relay;
+
+    if (!relay.server) {
+        state.skipWithError("could not start the relay");
+        return;
+    }
+
+    forward(state, relay);
+}
+BENCHMARK(BM_tcpRelayForward);
+
+/* The same with many idle clients on the relay: their cost should only be memory. */
+static void BM_tcpRelayForwardIdle(BenchmarkState& state)
+{
+    static RelayFixture *relay = NULL;
+
+    if (!relay) {
+        relay = new RelayFixture();
+
+        if (!relay->server) {
+            state.skipWithError("could not start the relay");
+            return;
+        }
+
+        const char *value = getenv("PEERJET_BENCH_IDLE_CLIENTS");
+        size_t wanted = value ? (size_t)strtoul(value, NULL, 10) : BENCH_IDLE_CLIENTS;
+        relay->addIdleClients(wanted);
+    }
+
+    forward(state, *relay);
+}
+BENCHMARK(BM_tcpRelayForwardIdle);
@@ -0,0 +1,15 @@
+//
+//  main.cpp
+//  PeerJetBench
+//
+//  Created by Compy on 12/4/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include "Benchmark.hpp"
+#include "NetworkService.hpp"
+
+int main(int argc, const char * argv[]) {
+    NetworkService::networkingAtStartup();
+    return Benchmark::runAll(argc, argv);
+}
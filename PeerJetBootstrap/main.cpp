@@ -0,0 +1,125 @@
+//
+//  main.cpp
+//  PeerJetBootstrap
+//
+//  Created by Compy on 12/18/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include "BootstrapServer.hpp"
+
+/* The counters are printed this often (s). */
+#define STATS_INTERVAL  60
+
+static std::atomic<bool> stopping(false);
+
+static void onSignal(int signal)
+{
+    stopping = true;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--port N] [--ipv6] [--workers N] [--pin-workers] [--systemd]\n"
+            "          [--version N] [--motd text] [--motd-file path] [--refresh ms] [--rate n]\n", name);
+}
+
+static bool parseOptions(int argc, const char * argv[], uint16_t* port, bool* ipv6, BootstrapServerConfig* config)
+{
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--ipv6") == 0) {
+            *ipv6 = true;
+            continue;
+        } else if (strcmp(argv[i], "--pin-workers") == 0) {
+            config->pinWorkers = true;
+            continue;
+        } else if (strcmp(argv[i], "--systemd") == 0) {
+            config->activated = true;
+            continue;
+        }
+
+        if (i + 1 >= argc)
+            return false;
+
+        const char *value = argv[i + 1];
+
+        if (strcmp(argv[i], "--port") == 0) {
+            *port = (uint16_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--workers") == 0) {
+            config->workers = (unsigned int)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--version") == 0) {
+            config->version = (uint32_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--motd") == 0) {
+            config->motd = value;
+        } else if (strcmp(argv[i], "--motd-file") == 0) {
+            config->motdPath = value;
+        } else if (strcmp(argv[i], "--refresh") == 0) {
+            config->refreshInterval = (uint32_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--rate") == 0) {
+            config->rate = (uint32_t)strtoul(value, NULL, 10);
+        } else {
+            return false;
+        }
+
+        ++i;
+    }
+
+    return config->workers > 0;
+}
+
+static void printStats(BootstrapServer *server)
+{
+    BootstrapServerStats stats = server->getStats();
+    printf("received %llu, info %llu, reflected %llu, rate limited %llu, unsupported %llu\n",
+           (unsigned long long)stats.received, (unsigned long long)stats.info, (unsigned long long)stats.reflected,
+           (unsigned long long)stats.limited, (unsigned long long)stats.unsupported);
+    fflush(stdout);
+}
+
+int main(int argc, const char * argv[]) {
+    BootstrapServerConfig config;
+    memset(&config, 0, sizeof(config));
+    config.workers = std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() : 1;
+    uint16_t port = TOX_PORT_DEFAULT;
+    bool ipv6 = false;
+
+    if (!parseOptions(argc, argv, &port, &ipv6, &config)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    IP ip;
+    NetworkService::ipInit(&ip, ipv6);
+    BootstrapServer *server = BootstrapServer::create(ip, port, &config);
+
+    if (!server) {
+        fprintf(stderr, "Failed to listen on port %u\n", port);
+        return 1;
+    }
+
+    printf("listening on port %u\n", server->getPort());
+    fflush(stdout);
+    signal(SIGINT, &onSignal);
+    signal(SIGTERM, &onSignal);
+    std::chrono::steady_clock::time_point lastStats = std::chrono::steady_clock::now();
+
+    while (!stopping) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        if (std::chrono::steady_clock::now() - lastStats >= std::chrono::seconds(STATS_INTERVAL)) {
+            lastStats = std::chrono::steady_clock::now();
+            printStats(server);
+        }
+    }
+
+    printStats(server);
+    delete server;
+    return 0;
+}
@@ -0,0 +1,284 @@
+//
+//  GossipScenario.cpp
+//  PeerJetSim
+//
+//  Created by Compy on 12/2/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "Node.hpp"
+#include "Scenario.hpp"
+#include "SimulatedNetwork.hpp"
+
+/* Packet IDs of the simulator workload, outside of anything the library uses. */
+#define SIM_PACKET_JOIN     200
+#define SIM_PACKET_PEERS    201
+#define SIM_PACKET_RUMOR    202
+
+#define SIM_TARGET_PEERS    8
+#define SIM_MAX_PEERS       16
+#define SIM_ROUND_INTERVAL  200 /* ms */
+#define SIM_RUMOR_FANOUT    3
+#define SIM_RUMOR_ROUNDS    8
+
+struct SimPeer {
+    Node* node;
+    NetworkingCore* net;
+    IP_Port address;
+    std::vector<IP_Port> known;
+    uint64_t lastRound;
+    bool hasRumor;
+    uint64_t rumorTime;
+    uint32_t rumorRounds;
+};
+
+static std::mt19937_64 rng;
+
+static bool knows(const SimPeer* peer, IP_Port ipPort)
+{
+    for (size_t i = 0; i < peer->known.size(); ++i) {
+        if (NetworkService::ipportEqual(&peer->known[i], &ipPort))
+            return true;
+    }
+    return false;
+}
+
+static void addKnown(SimPeer* peer, IP_Port ipPort)
+{
+    if (peer->known.size() >= SIM_MAX_PEERS || knows(peer, ipPort))
+        return;
+
+    if (NetworkService::ipportEqual(&peer->address, &ipPort))
+        return;
+
+    peer->known.push_back(ipPort);
+}
+
+static IP_Port randomKnown(const SimPeer* peer)
+{
+    return peer->known[rng() % peer->known.size()];
+}
+
+static void sendPeers(SimPeer* peer, IP_Port to)
+{
+    uint8_t packet[2 + SIM_TARGET_PEERS * (SIZE_IP4 + SIZE_PORT)];
+    uint8_t count = 0;
+    uint8_t *p = packet + 2;
+
+    for (size_t i = 0; i < peer->known.size() && count < SIM_TARGET_PEERS; ++i) {
+        const IP_Port& candidate = peer->known[(i + rng()) % peer->known.size()];
+
+        if (NetworkService::ipportEqual(&candidate, &to))
+            continue;
+
+        memcpy(p, &candidate.ip.ip4.uint32, SIZE_IP4);
+        memcpy(p + SIZE_IP4, &candidate.port, SIZE_PORT);
+        p += SIZE_IP4 + SIZE_PORT;
+        ++count;
+    }
+
+    packet[0] = SIM_PACKET_PEERS;
+    packet[1] = count;
+    NetworkService::sendPacket(peer->net, to, packet, (uint16_t)(p - packet));
+}
+
+static int handleJoin(void *object, IP_Port source, const uint8_t *data, uint16_t length)
+{
+    SimPeer *peer = (SimPeer *)object;
+    sendPeers(peer, source);
+    addKnown(peer, source);
+    return 0;
+}
+
+static int handlePeers(void *object, IP_Port source, const uint8_t *data, uint16_t length)
+{
+    SimPeer *peer = (SimPeer *)object;
+
+    if (length < 2 || length < 2 + data[1] * (SIZE_IP4 + SIZE_PORT))
+        return -1;
+
+    addKnown(peer, source);
+    const uint8_t *p = data + 2;
+
+    for (uint8_t i = 0; i < data[1]; ++i, p += SIZE_IP4 + SIZE_PORT) {
+        IP_Port ipPort;
+        memset(&ipPort, 0, sizeof(ipPort));
+        ipPort.ip.family = AF_INET;
+        memcpy(&ipPort.ip.ip4.uint32, p, SIZE_IP4);
+        memcpy(&ipPort.port, p + SIZE_IP4, SIZE_PORT);
+
+        addKnown(peer, ipPort);
+    }
+
+    return 0;
+}
+
+static int handleRumor(void *object, IP_Port source, const uint8_t *data, uint16_t length)
+{
+    SimPeer *peer = (SimPeer *)object;
+
+    if (peer->hasRumor)
+        return 0;
+
+    peer->hasRumor = true;
+    peer->rumorTime = NetworkService::getCurrentTimeMonotonic();
+    peer->rumorRounds = SIM_RUMOR_ROUNDS;
+    return 0;
+}
+
+/* Periodic work of a peer: keep joining until we know enough peers, push the rumor. */
+static void doRound(SimPeer* peer, uint64_t now)
+{
+    if (now - peer->lastRound < SIM_ROUND_INTERVAL || peer->known.empty())
+        return;
+
+    peer->lastRound = now;
+
+    if (peer->known.size() < SIM_TARGET_PEERS) {
+        uint8_t join = SIM_PACKET_JOIN;
+        NetworkService::sendPacket(peer->net, randomKnown(peer), &join, 1);
+    }
+
+    if (peer->hasRumor && peer->rumorRounds > 0) {
+        uint8_t rumor = SIM_PACKET_RUMOR;
+
+        for (uint32_t i = 0; i < SIM_RUMOR_FANOUT; ++i)
+            NetworkService::sendPacket(peer->net, randomKnown(peer), &rumor, 1);
+
+        --peer->rumorRounds;
+    }
+}
+
+/* Every node joins through a random earlier node, then a rumor is pushed through the membership overlay. */
+int runGossipScenario(const SimulatorOptions* options)
+{
+    rng.seed(options->seed);
+    SimulatedNetwork network(options->link, options->seed);
+    network.install();
+
+    NodeConfiguration config;
+    memset(&config, 0, sizeof(config));
+    config.udpEnabled = true;
+
+    size_t memoryBefore = residentBytes();
+    std::vector<SimPeer*> peers;
+    peers.reserve(options->nodes);
+
+    IP_Port first;
+    memset(&first, 0, sizeof(first));
+    first.ip.family = AF_INET;
+    first.ip.ip4.uint32 = htonl(0x0A000001);
+
+    for (uint32_t i = 0; i < options->nodes; ++i) {
+        NetworkingCore *net = network.addEndpoint();
+
+        if (!net) {
+            fprintf(stderr, "Failed to create endpoint %u\n", i);
+            return 1;
+        }
+
+        SimPeer *peer = new SimPeer();
+        peer->net = net;
+        peer->address = first;
+        peer->address.ip.ip4.uint32 = htonl(0x0A000001 + i);
+        peer->address.port = net->port;
+        peer->node = new Node(&config, net);
+        peer->known.reserve(SIM_MAX_PEERS);
+        NetworkService::registerHandler(net, SIM_PACKET_JOIN, &handleJoin, peer);
+        NetworkService::registerHandler(net, SIM_PACKET_PEERS, &handlePeers, peer);
+        NetworkService::registerHandler(net, SIM_PACKET_RUMOR, &handleRumor, peer);
+        peers.push_back(peer);
+    }
+
+    size_t memoryAfter = residentBytes();
+
+    /* Every node bootstraps off a random node that joined before it. */
+    for (uint32_t i = 1; i < options->nodes; ++i)
+        peers[i]->known.push_back(peers[rng() % i]->address);
+
+    const uint64_t start = network.now();
+    uint64_t membershipConverged = 0;
+    uint64_t rumorStart = 0;
+    uint64_t rumor99 = 0;
+    uint64_t rumorAll = 0;
+    uint64_t ticks = 0;
+
+    std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+
+    while (network.now() - start < options->duration) {
+        network.advance(options->step);
+        const uint64_t now = network.now();
+        uint32_t converged = 0;
+        uint32_t informed = 0;
+
+        for (size_t i = 0; i < peers.size(); ++i) {
+            SimPeer *peer = peers[i];
+            peer->node->tick();
+            doRound(peer, now);
+            ++ticks;
+
+            if (peer->known.size() >= SIM_TARGET_PEERS)
+                ++converged;
+
+            if (peer->hasRumor)
+                ++informed;
+        }
+
+        if (!membershipConverged && converged == peers.size())
+            membershipConverged = now;
+
+        /* Start spreading a rumor once membership settled, or halfway through at the latest. */
+        if (!rumorStart && (membershipConverged || now - start >= options->duration / 2)) {
+            rumorStart = now;
+            handleRumor(peers[0], peers[0]->address, NULL, 0);
+        }
+
+        if (rumorStart && !rumor99 && informed * 100ULL >= peers.size() * 99ULL)
+            rumor99 = now;
+
+        if (rumorStart && !rumorAll && informed == peers.size()) {
+            rumorAll = now;
+
+            if (network.inFlight() == 0)
+                break;
+        }
+    }
+
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    const SimulatorStats& stats = network.getStats();
+
+    printf("nodes:                 %u\n", options->nodes);
+    printf("link:                  latency %ums jitter %ums loss %.3f reorder %.3f\n", options->link.latency,
+           options->link.jitter, options->link.loss, options->link.reorder);
+    printf("virtual time:          %llu ms in %.3f s wall\n", (unsigned long long)(network.now() - start), wall);
+    printf("datagrams:             %llu sent, %llu delivered, %llu dropped\n", (unsigned long long)stats.sent,
+           (unsigned long long)stats.delivered, (unsigned long long)stats.dropped);
+    printf("throughput:            %.0f datagrams/s, %.0f node ticks/s\n", stats.delivered / wall, ticks / wall);
+    printf("memory per node:       %zu bytes resident (Node %zu, NetworkingCore %zu)\n",
+           memoryAfter > memoryBefore ? (memoryAfter - memoryBefore) / options->nodes : 0, sizeof(Node),
+           sizeof(NetworkingCore));
+
+    if (membershipConverged)
+        printf("membership converged:  %llu ms\n", (unsigned long long)(membershipConverged - start));
+    else
+        printf("membership converged:  no\n");
+
+    if (rumorStart) {
+        printf("rumor 99%% coverage:    %s%llu ms\n", rumor99 ? "" : "not reached, ",
+               (unsigned long long)(rumor99 ? rumor99 - rumorStart : 0));
+        printf("rumor full coverage:   %s%llu ms\n", rumorAll ? "" : "not reached, ",
+               (unsigned long long)(rumorAll ? rumorAll - rumorStart : 0));
+    }
+
+    for (size_t i = 0; i < peers.size(); ++i) {
+        delete peers[i]->node;
+        delete peers[i];
+    }
+
+    network.uninstall();
+    return 0;
+}
@@ -0,0 +1,246 @@
+//
+//  HandshakeScenario.cpp
+//  PeerJetSim
+//
+//  Created by Compy on 12/17/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <vector>
+#include "Crypto.hpp"
+#include "NetCrypto.hpp"
+#include "Node.hpp"
+#include "Scenario.hpp"
+#include "SimulatedNetwork.hpp"
+
+/* Flooding endpoints, and the packets each one sends the victim every step. */
+#define SIM_HANDSHAKE_FLOODERS  16
+#define SIM_HANDSHAKE_FLOOD     40
+
+/* Friends start connecting this long (ms) after the flood, one every SIM_HANDSHAKE_SPACING. */
+#define SIM_HANDSHAKE_START     1000
+#define SIM_HANDSHAKE_SPACING   50
+
+struct Flooder {
+    NetworkingCore *net;
+    std::vector<uint8_t> cookies;   /* the cookies the victim gave us, back to back */
+};
+
+struct HandshakePeer {
+    uint64_t started;
+    uint64_t established;
+};
+
+static int handleFloodCookie(void *object, IP_Port source, const uint8_t *data, uint16_t length)
+{
+    Flooder *flooder = (Flooder *)object;
+
+    if (length != NET_CRYPTO_COOKIE_RESPONSE_SIZE || flooder->cookies.size() >= 64 * NET_CRYPTO_COOKIE_SIZE)
+        return 1;
+
+    flooder->cookies.insert(flooder->cookies.end(), data + 1, data + 1 + NET_CRYPTO_COOKIE_SIZE);
+    return 0;
+}
+
+static void onStatus(void *object, uint32_t connection, bool online)
+{
+    HandshakePeer *peer = (HandshakePeer *)object;
+
+    if (online && !peer->established)
+        peer->established = NetworkService::getCurrentTimeMonotonic();
+}
+
+static uint32_t received;
+
+static void onVictimFrames(Node *node, const LossyFrame *frames, size_t count, void *object)
+{
+    received += (uint32_t)count;
+}
+
+/* Send the victim one step worth of flood: handshakes with forged cookies, cookie
+ * requests in the name of its friends and random keys, and handshakes that bring
+ * the cookies back with garbage where the encrypted part goes.
+ */
+static void flood(Flooder *flooder, IP_Port victim, const uint8_t *victimKey,
+                  const std::vector<const uint8_t*>& friendKeys)
+{
+    uint8_t packet[NET_CRYPTO_HANDSHAKE_SIZE];
+
+    for (uint32_t i = 0; i < SIM_HANDSHAKE_FLOOD; ++i) {
+        uint32_t kind = i % 3;
+
+        if (kind == 0 || (kind == 2 && flooder->cookies.empty())) {
+            Crypto::randomBytes(packet, sizeof(packet));
+            packet[0] = NET_PACKET_CRYPTO_HS;
+            NetworkService::sendPacket(flooder->net, victim, packet, sizeof(packet));
+        } else if (kind == 1) {
+            memset(packet, 0, NET_CRYPTO_COOKIE_REQUEST_SIZE);
+            packet[0] = NET_PACKET_COOKIE_REQUEST;
+
+            if (Crypto::randomInt() % 2)
+                memcpy(packet + 1, friendKeys[Crypto::randomInt() % friendKeys.size()], crypto_box_PUBLICKEYBYTES);
+            else
+                Crypto::randomBytes(packet + 1, crypto_box_PUBLICKEYBYTES);
+
+            memcpy(packet + NET_CRYPTO_COOKIE_REQUEST_RECEIVER, victimKey, crypto_box_PUBLICKEYBYTES);
+            NetworkService::sendPacket(flooder->net, victim, packet, NET_CRYPTO_COOKIE_REQUEST_SIZE);
+        } else {
+            size_t cookies = flooder->cookies.size() / NET_CRYPTO_COOKIE_SIZE;
+            Crypto::randomBytes(packet, sizeof(packet));
+            packet[0] = NET_PACKET_CRYPTO_HS;
+            memcpy(packet + 1, &flooder->cookies[Crypto::randomInt() % cookies * NET_CRYPTO_COOKIE_SIZE],
+                   NET_CRYPTO_COOKIE_SIZE);
+            NetworkService::sendPacket(flooder->net, victim, packet, sizeof(packet));
+        }
+    }
+}
+
+/* Friends of one public node open sessions to it while flooders hammer it with handshakes.
+ *
+ * Forged cookies cost the victim a symmetric decryption, cookies it really gave
+ * out cost a curve operation at most, and only for so many per tick. Every
+ * friend has to get through and the victim may hold no more than its friends.
+ */
+int runHandshakeScenario(const SimulatorOptions* options)
+{
+    SimulatedNetwork network(options->link, options->seed);
+    network.install();
+
+    NodeConfiguration config;
+    memset(&config, 0, sizeof(config));
+    config.udpEnabled = true;
+
+    IP_Port victimAddress;
+    NetworkingCore *victimNet = network.addEndpoint(&victimAddress);
+
+    if (!victimNet) {
+        fprintf(stderr, "Failed to create the victim\n");
+        return 1;
+    }
+
+    Node *victim = new Node(&config, victimNet);
+    victim->setLossyPacketHandler(PACKET_ID_RANGE_LOSSY_START, &onVictimFrames, NULL);
+
+    std::vector<Node*> nodes;
+    std::vector<HandshakePeer> peers(options->nodes);
+    std::vector<const uint8_t*> friendKeys;
+
+    for (uint32_t i = 0; i < options->nodes; ++i) {
+        NetworkingCore *net = network.addEndpoint();
+
+        if (!net) {
+            fprintf(stderr, "Failed to create endpoint %u\n", i);
+            return 1;
+        }
+
+        Node *node = new Node(&config, net);
+        victim->addFriendNoRequest(*node->getAddress());
+        node->addFriendNoRequest(*victim->getAddress());
+        node->getNetCrypto()->setStatusCallback(&onStatus, &peers[i]);
+        friendKeys.push_back(*node->getAddress());
+        nodes.push_back(node);
+        peers[i].started = 0;
+        peers[i].established = 0;
+    }
+
+    std::vector<Flooder*> flooders;
+
+    for (uint32_t i = 0; i < SIM_HANDSHAKE_FLOODERS; ++i) {
+        Flooder *flooder = new Flooder();
+        flooder->net = network.addEndpoint();
+
+        if (!flooder->net) {
+            fprintf(stderr, "Failed to create flooder %u\n", i);
+            return 1;
+        }
+
+        NetworkService::registerHandler(flooder->net, NET_PACKET_COOKIE_RESPONSE, &handleFloodCookie, flooder);
+        flooders.push_back(flooder);
+    }
+
+    const uint64_t start = network.now();
+    uint32_t maxConnections = 0, maxPending = 0;
+    uint32_t next = 0;
+    std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+
+    while (network.now() - start < options->duration) {
+        network.advance(options->step);
+        const uint64_t now = network.now();
+
+        for (size_t i = 0; i < flooders.size(); ++i) {
+            NetworkService::poll(flooders[i]->net);
+            flood(flooders[i], victimAddress, *victim->getAddress(), friendKeys);
+        }
+
+        while (next < nodes.size() && now - start >= SIM_HANDSHAKE_START + (uint64_t)next * SIM_HANDSHAKE_SPACING) {
+            peers[next].started = now;
+            nodes[next]->getNetCrypto()->addConnection(*victim->getAddress(), victimAddress);
+            ++next;
+        }
+
+        /* The victim's burst is what it read since its last tick, before it handles it. */
+        NetworkService::poll(victimNet);
+        maxPending = std::max(maxPending, victim->getNetCrypto()->getStats().pending);
+        victim->tick();
+
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            nodes[i]->tick();
+
+            if (peers[i].established == now && nodes[i]->getNetCrypto()->isOnline(0)) {
+                const uint8_t hello[] = {PACKET_ID_RANGE_LOSSY_START, 'h', 'e', 'l', 'l', 'o'};
+                nodes[i]->getNetCrypto()->sendPacket(0, hello, sizeof(hello), false);
+            }
+        }
+
+        maxConnections = std::max(maxConnections, victim->getNetCrypto()->getStats().connections);
+    }
+
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    const SimulatorStats& stats = network.getStats();
+    NetCryptoStats v = victim->getNetCrypto()->getStats();
+    std::vector<uint64_t> times;
+
+    for (size_t i = 0; i < peers.size(); ++i) {
+        if (peers[i].established)
+            times.push_back(peers[i].established - peers[i].started);
+    }
+
+    std::sort(times.begin(), times.end());
+    uint64_t ticks = (network.now() - start) / options->step;
+
+    printf("friends:               %u, %u flooders sending %u packets per step each\n", options->nodes,
+           SIM_HANDSHAKE_FLOODERS, SIM_HANDSHAKE_FLOOD);
+    printf("link:                  latency %ums jitter %ums loss %.3f\n", options->link.latency, options->link.jitter,
+           options->link.loss);
+    printf("virtual time:          %llu ms in %.3f s wall\n", (unsigned long long)(network.now() - start), wall);
+    printf("datagrams:             %llu sent, %llu delivered, %llu dropped\n", (unsigned long long)stats.sent,
+           (unsigned long long)stats.delivered, (unsigned long long)stats.dropped);
+    printf("cookies:               %llu given out, %llu handshakes with a bad one\n", (unsigned long long)v.cookies,
+           (unsigned long long)v.badCookies);
+    printf("handshakes:            %llu queued, %llu coalesced, %llu sampled out, %llu rejected\n",
+           (unsigned long long)v.handshakesQueued, (unsigned long long)v.handshakesCoalesced,
+           (unsigned long long)v.handshakesDropped, (unsigned long long)v.handshakesRejected);
+    printf("curve operations:      %llu, %.1f per tick\n", (unsigned long long)v.keyAgreements,
+           ticks ? (double)v.keyAgreements / ticks : 0.0);
+    printf("victim holds:          %u connections at most, %u handshakes queued at most\n", maxConnections,
+           maxPending);
+    printf("established:           %zu of %u friends, %u said hello\n", times.size(), options->nodes, received);
+
+    if (!times.empty())
+        printf("time to establish:     median %llu ms, p90 %llu ms, max %llu ms\n",
+               (unsigned long long)times[times.size() / 2], (unsigned long long)times[times.size() * 9 / 10],
+               (unsigned long long)times.back());
+
+    for (size_t i = 0; i < nodes.size(); ++i)
+        delete nodes[i];
+
+    for (size_t i = 0; i < flooders.size(); ++i)
+        delete flooders[i];
+
+    delete victim;
+    network.uninstall();
+    return times.size() == options->nodes && maxConnections <= options->nodes ? 0 : 1;
+}
@@ -0,0 +1,189 @@
+//
+//  HostScenario.cpp
+//  PeerJetSim
+//
+//  Created by Compy on 12/18/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <vector>
+#include "NetCrypto.hpp"
+#include "Node.hpp"
+#include "NodeHost.hpp"
+#include "Scenario.hpp"
+#include "SimulatedNetwork.hpp"
+
+/* Remote peers, each one a friend of its share of the tenants. */
+#define SIM_HOST_PEERS          16
+
+/* Peers say hello to every tenant they are online with this often (ms). */
+#define SIM_HOST_HELLO_INTERVAL 500
+
+/* Tenants start being dialed this many per step. */
+#define SIM_HOST_CONNECTS_PER_STEP  50
+
+struct HostTenant {
+    Node *node;
+    bool heard;         /* got a hello */
+    bool answered;      /* its peer got the answer */
+};
+
+struct HostPeer {
+    Node *node;
+    std::vector<uint32_t> tenants;  /* by friend number */
+    uint64_t lastHello;
+};
+
+/* A tenant answers every hello on the session it came in on. */
+static void onTenantHello(Node *node, const LossyFrame *frames, size_t count, void *object)
+{
+    HostTenant *tenant = (HostTenant *)object;
+    tenant->heard = true;
+
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t answer[] = {PACKET_ID_RANGE_LOSSY_START + 1, 'h', 'i'};
+        node->sendLossyPacket(frames[i].friendNumber, answer, sizeof(answer));
+    }
+}
+
+static std::vector<HostTenant> *allTenants;
+
+static void onPeerAnswer(Node *node, const LossyFrame *frames, size_t count, void *object)
+{
+    HostPeer *peer = (HostPeer *)object;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (frames[i].friendNumber < peer->tenants.size())
+            (*allTenants)[peer->tenants[frames[i].friendNumber]].answered = true;
+    }
+}
+
+/* Many identities on one endpoint, reached at the same address by remote peers.
+ *
+ * Every tenant is a friend of one of the peers, which opens a session to it at
+ * the address of the host and says hello until it hears back. Every tenant has
+ * to be reached, nothing may go to the wrong one, and what a tenant costs is
+ * the memory the host grew by per identity.
+ */
+int runHostScenario(const SimulatorOptions* options)
+{
+    SimulatedNetwork network(options->link, options->seed);
+    network.install();
+
+    NodeConfiguration config;
+    memset(&config, 0, sizeof(config));
+    config.udpEnabled = true;
+
+    IP_Port hostAddress;
+    NetworkingCore *hostNet = network.addEndpoint(&hostAddress);
+
+    if (!hostNet) {
+        fprintf(stderr, "Failed to create the host\n");
+        return 1;
+    }
+
+    NodeHost host(hostNet);
+    std::vector<HostTenant> tenants(options->nodes);
+    allTenants = &tenants;
+    size_t before = residentBytes();
+
+    for (uint32_t i = 0; i < options->nodes; ++i) {
+        tenants[i].node = host.addNode(&config);
+        tenants[i].heard = false;
+        tenants[i].answered = false;
+
+        if (!tenants[i].node) {
+            fprintf(stderr, "Failed to add tenant %u\n", i);
+            return 1;
+        }
+
+        tenants[i].node->setLossyPacketHandler(PACKET_ID_RANGE_LOSSY_START, &onTenantHello, &tenants[i]);
+    }
+
+    size_t perTenant = options->nodes ? (residentBytes() - std::min(before, residentBytes())) / options->nodes : 0;
+    std::vector<HostPeer> peers(std::min<uint32_t>(options->nodes, SIM_HOST_PEERS));
+
+    for (uint32_t i = 0; i < peers.size(); ++i) {
+        NetworkingCore *net = network.addEndpoint();
+
+        if (!net) {
+            fprintf(stderr, "Failed to create peer %u\n", i);
+            return 1;
+        }
+
+        peers[i].node = new Node(&config, net);
+        peers[i].node->setLossyPacketHandler(PACKET_ID_RANGE_LOSSY_START + 1, &onPeerAnswer, &peers[i]);
+        peers[i].lastHello = 0;
+    }
+
+    for (uint32_t i = 0; i < options->nodes; ++i) {
+        HostPeer *peer = &peers[i % peers.size()];
+        peer->node->addFriendNoRequest(*tenants[i].node->getAddress());
+        peer->tenants.push_back(i);
+        tenants[i].node->addFriendNoRequest(*peer->node->getAddress());
+    }
+
+    const uint64_t start = network.now();
+    uint32_t next = 0;
+    std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+
+    while (network.now() - start < options->duration) {
+        network.advance(options->step);
+        const uint64_t now = network.now();
+
+        for (uint32_t i = 0; i < SIM_HOST_CONNECTS_PER_STEP && next < tenants.size(); ++i, ++next)
+            peers[next % peers.size()].node->getNetCrypto()->addConnection(*tenants[next].node->getAddress(),
+                                                                            hostAddress);
+
+        host.tick();
+
+        for (size_t i = 0; i < peers.size(); ++i) {
+            HostPeer *peer = &peers[i];
+            NetworkService::poll(peer->node->getNetworking());
+            peer->node->tick();
+
+            if (now - peer->lastHello < SIM_HOST_HELLO_INTERVAL)
+                continue;
+
+            peer->lastHello = now;
+
+            for (uint32_t f = 0; f < peer->tenants.size(); ++f) {
+                if (tenants[peer->tenants[f]].answered)
+                    continue;
+
+                const uint8_t hello[] = {PACKET_ID_RANGE_LOSSY_START, 'h', 'e', 'l', 'l', 'o'};
+                peer->node->sendLossyPacket(f, hello, sizeof(hello));
+            }
+        }
+    }
+
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    const SimulatorStats& stats = network.getStats();
+    NodeHostStats h = host.getStats();
+    uint32_t heard = 0, answered = 0;
+
+    for (size_t i = 0; i < tenants.size(); ++i) {
+        heard += tenants[i].heard;
+        answered += tenants[i].answered;
+    }
+
+    printf("tenants:               %u on one endpoint, %zu peers\n", h.nodes, peers.size());
+    printf("link:                  latency %ums jitter %ums loss %.3f\n", options->link.latency, options->link.jitter,
+           options->link.loss);
+    printf("virtual time:          %llu ms in %.3f s wall\n", (unsigned long long)(network.now() - start), wall);
+    printf("datagrams:             %llu sent, %llu delivered, %llu dropped\n", (unsigned long long)stats.sent,
+           (unsigned long long)stats.delivered, (unsigned long long)stats.dropped);
+    printf("host:                  %llu routed, %llu broadcast, %llu for no tenant\n", (unsigned long long)h.routed,
+           (unsigned long long)h.broadcast, (unsigned long long)h.dropped);
+    printf("reached:               %u of %u tenants heard hello, %u answers came back\n", heard, h.nodes, answered);
+    printf("memory per tenant:     %zu bytes\n", perTenant);
+
+    for (size_t i = 0; i < peers.size(); ++i)
+        delete peers[i].node;
+
+    network.uninstall();
+    return heard == options->nodes && answered == options->nodes ? 0 : 1;
+}
@@ -0,0 +1,149 @@
+//
+//  LanScenario.cpp
+//  PeerJetSim
+//
+//  Created by Compy on 12/15/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <chrono>
+#include <cstring>
+#include <vector>
+#include "Crypto.hpp"
+#include "LanDiscovery.hpp"
+#include "Node.hpp"
+#include "Scenario.hpp"
+#include "SimulatedFriendTransport.hpp"
+#include "SimulatedNetwork.hpp"
+
+/* Friends of every node on the segment, plus one that never shows up. */
+#define SIM_LAN_FRIENDS 2
+
+struct LanState {
+    uint32_t connected;
+    uint64_t firstConnected;
+    uint64_t allConnected;
+};
+
+static void onFriendConnectionStatus(Node* node, uint32_t friendNumber, ConnectionType connectionStatus, void* userData)
+{
+    LanState *state = (LanState *)userData;
+
+    if (connectionStatus == CONNECTION_TYPE_NONE)
+        return;
+
+    if (state->connected++ == 0)
+        state->firstConnected = NetworkService::getCurrentTimeMonotonic();
+}
+
+/* Every node on one segment befriends the next SIM_LAN_FRIENDS nodes and finds them through LAN discovery.
+ *
+ * Each node also has a friend that is never online, so nobody stops announcing:
+ * the broadcast rate of the segment once everyone was found shows how the
+ * announces back off and spread.
+ */
+int runLanScenario(const SimulatorOptions* options)
+{
+    SimulatedNetwork network(options->link, options->seed);
+    network.install();
+
+    NodeConfiguration config;
+    memset(&config, 0, sizeof(config));
+    config.udpEnabled = true;
+    config.localDiscoveryEnabled = true;
+
+    LanState state;
+    memset(&state, 0, sizeof(state));
+
+    std::vector<Node*> nodes;
+    std::vector<SimulatedFriendTransport*> transports;
+
+    for (uint32_t i = 0; i < options->nodes; ++i) {
+        IP_Port address;
+        NetworkingCore *net = network.addEndpoint(&address);
+
+        if (!net) {
+            fprintf(stderr, "Failed to create endpoint %u\n", i);
+            return 1;
+        }
+
+        Node *node = new Node(&config, net);
+        node->setUserData(&state);
+        node->setFriendConnectionStatusCallback(&onFriendConnectionStatus);
+        nodes.push_back(node);
+        transports.push_back(new SimulatedFriendTransport(&network, node, address));
+    }
+
+    uint32_t friendships = 0;
+
+    for (uint32_t i = 0; i < options->nodes; ++i) {
+        for (uint32_t j = 1; j <= SIM_LAN_FRIENDS && j < options->nodes; ++j) {
+            uint32_t other = (i + j) % options->nodes;
+
+            /* With few nodes the ring wraps onto friends already added. */
+            if (nodes[i]->getFriendByPublicKey(*nodes[other]->getAddress()) != -1)
+                continue;
+
+            if (!SimulatedFriendTransport::befriend(transports[i], transports[other])) {
+                fprintf(stderr, "Failed to befriend nodes %u and %u\n", i, other);
+                return 1;
+            }
+
+            friendships += 2;
+        }
+
+        uint8_t pk[PEERJET_KEY_LENGTH], sk[crypto_box_SECRETKEYBYTES];
+        crypto_box_keypair(pk, sk);
+        nodes[i]->addFriendNoRequest(pk);
+    }
+
+    const uint64_t start = network.now();
+    const uint64_t settle = start + options->duration / 2;
+    uint64_t broadcastsSettled = 0;
+
+    std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+
+    while (network.now() - start < options->duration) {
+        network.advance(options->step);
+
+        for (size_t i = 0; i < nodes.size(); ++i)
+            nodes[i]->tick();
+
+        if (!state.allConnected && state.connected >= friendships)
+            state.allConnected = network.now();
+
+        if (!broadcastsSettled && network.now() >= settle)
+            broadcastsSettled = network.getStats().broadcasts;
+    }
+
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    const SimulatorStats& stats = network.getStats();
+    double settledSeconds = (network.now() - settle) / 1000.0;
+
+    printf("nodes:                 %u, %u friendships\n", options->nodes, friendships / 2);
+    printf("link:                  latency %ums jitter %ums loss %.3f\n", options->link.latency, options->link.jitter,
+           options->link.loss);
+    printf("virtual time:          %llu ms in %.3f s wall\n", (unsigned long long)(network.now() - start), wall);
+    printf("datagrams:             %llu sent, %llu delivered, %llu dropped\n", (unsigned long long)stats.sent,
+           (unsigned long long)stats.delivered, (unsigned long long)stats.dropped);
+    printf("broadcasts:            %llu, %.2f/s in the second half (segment target %u/s)\n",
+           (unsigned long long)stats.broadcasts,
+           settledSeconds > 0 ? (stats.broadcasts - broadcastsSettled) / settledSeconds : 0.0,
+           LAN_DISCOVERY_SEGMENT_RATE);
+
+    if (state.firstConnected)
+        printf("first friend found:    %llu ms\n", (unsigned long long)(state.firstConnected - start));
+
+    if (state.allConnected)
+        printf("all friends found:     %llu ms\n", (unsigned long long)(state.allConnected - start));
+    else
+        printf("all friends found:     no, %u of %u\n", state.connected, friendships);
+
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        delete transports[i];
+        delete nodes[i];
+    }
+
+    network.uninstall();
+    return state.allConnected ? 0 : 1;
+}
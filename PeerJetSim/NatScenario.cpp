@@ -0,0 +1,184 @@
+//
+//  NatScenario.cpp
+//  PeerJetSim
+//
+//  Created by Compy on 12/16/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <vector>
+#include "NatTraversal.hpp"
+#include "Node.hpp"
+#include "Scenario.hpp"
+#include "SimulatedFriendTransport.hpp"
+#include "SimulatedNetwork.hpp"
+
+#define SIM_NAT_KINDS       (SIM_NAT_SYMMETRIC_RANDOM + 1)
+#define SIM_NAT_REFLECTORS  2
+
+static const char *natNames[SIM_NAT_KINDS] = {"none", "full", "restr", "port", "symm", "random"};
+
+static void onFriendConnectionStatus(Node* node, uint32_t friendNumber, ConnectionType connectionStatus, void* userData)
+{
+    uint64_t *direct = (uint64_t *)userData;
+
+    if (connectionStatus == CONNECTION_TYPE_UDP && !*direct)
+        *direct = NetworkService::getCurrentTimeMonotonic();
+}
+
+/* Pairs of friends behind every combination of NATs punch through to each other.
+ *
+ * Both ends of a pair start connected through the relay and bootstrap from the
+ * same two public nodes, which reflect their addresses. A pair made it once
+ * both ends moved to direct UDP.
+ */
+int runNatScenario(const SimulatorOptions* options)
+{
+    SimulatedNetwork network(options->link, options->seed);
+    network.install();
+
+    NodeConfiguration config;
+    memset(&config, 0, sizeof(config));
+    config.udpEnabled = true;
+
+    std::vector<Node*> nodes;
+    std::vector<SimulatedFriendTransport*> transports;
+    std::vector<IP_Port> reflectors;
+
+    for (uint32_t i = 0; i < SIM_NAT_REFLECTORS; ++i) {
+        IP_Port address;
+        NetworkingCore *net = network.addEndpoint(&address);
+
+        if (!net) {
+            fprintf(stderr, "Failed to create reflector %u\n", i);
+            return 1;
+        }
+
+        nodes.push_back(new Node(&config, net));
+        transports.push_back(NULL);
+        reflectors.push_back(address);
+    }
+
+    uint32_t pairs = options->nodes / 2;
+    std::vector<uint64_t> direct(pairs * 2, 0);
+
+    for (uint32_t i = 0; i < pairs * 2; ++i) {
+        uint32_t pair = i / 2;
+        uint32_t kind = i % 2 == 0 ? pair % SIM_NAT_KINDS : pair / SIM_NAT_KINDS % SIM_NAT_KINDS;
+        IP_Port address;
+        NetworkingCore *net = network.addEndpoint(&address, (SimulatedNat)kind);
+
+        if (!net) {
+            fprintf(stderr, "Failed to create endpoint %u\n", i);
+            return 1;
+        }
+
+        Node *node = new Node(&config, net);
+        node->setUserData(&direct[i]);
+        node->setFriendConnectionStatusCallback(&onFriendConnectionStatus);
+
+        for (uint32_t j = 0; j < SIM_NAT_REFLECTORS; ++j)
+            node->bootstrap(NetworkService::ipNtoa(&reflectors[j].ip), ntohs(reflectors[j].port), *nodes[j]->getAddress());
+
+        nodes.push_back(node);
+        transports.push_back(new SimulatedFriendTransport(&network, node, address));
+
+        if (i % 2 == 1 && !SimulatedFriendTransport::connectRelayed(transports[transports.size() - 2], transports.back())) {
+            fprintf(stderr, "Failed to connect pair %u\n", pair);
+            return 1;
+        }
+    }
+
+    /* connectRelayed reported the relay as the connection, only the punches count. */
+    std::fill(direct.begin(), direct.end(), 0);
+
+    const uint64_t start = network.now();
+    std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+
+    while (network.now() - start < options->duration) {
+        network.advance(options->step);
+
+        for (size_t i = 0; i < nodes.size(); ++i)
+            nodes[i]->tick();
+    }
+
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    const SimulatorStats& stats = network.getStats();
+
+    uint32_t tried[SIM_NAT_KINDS][SIM_NAT_KINDS], made[SIM_NAT_KINDS][SIM_NAT_KINDS];
+    memset(tried, 0, sizeof(tried));
+    memset(made, 0, sizeof(made));
+    std::vector<uint64_t> times;
+
+    for (uint32_t pair = 0; pair < pairs; ++pair) {
+        uint32_t a = pair % SIM_NAT_KINDS, b = pair / SIM_NAT_KINDS % SIM_NAT_KINDS;
+        uint32_t low = std::min(a, b), high = std::max(a, b);
+        ++tried[low][high];
+
+        if (direct[pair * 2] && direct[pair * 2 + 1]) {
+            ++made[low][high];
+            times.push_back(std::max(direct[pair * 2], direct[pair * 2 + 1]) - start);
+        }
+    }
+
+    NatTraversalStats total;
+    memset(&total, 0, sizeof(total));
+
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        NatTraversalStats s = nodes[i]->getNatTraversal()->getStats();
+        total.punches += s.punches;
+        total.succeeded += s.succeeded;
+        total.skipped += s.skipped;
+        total.pings += s.pings;
+    }
+
+    printf("nodes:                 %u, %u pairs, %u reflectors\n", pairs * 2, pairs, SIM_NAT_REFLECTORS);
+    printf("link:                  latency %ums jitter %ums loss %.3f\n", options->link.latency, options->link.jitter,
+           options->link.loss);
+    printf("virtual time:          %llu ms in %.3f s wall\n", (unsigned long long)(network.now() - start), wall);
+    printf("datagrams:             %llu sent, %llu delivered, %llu dropped, %llu stopped by NATs, %llu relayed\n",
+           (unsigned long long)stats.sent, (unsigned long long)stats.delivered, (unsigned long long)stats.dropped,
+           (unsigned long long)stats.natDrops, (unsigned long long)stats.relayed);
+    printf("punches:               %llu started, %llu succeeded, %llu skipped, %llu pings\n",
+           (unsigned long long)total.punches, (unsigned long long)total.succeeded, (unsigned long long)total.skipped,
+           (unsigned long long)total.pings);
+
+    printf("direct pairs by NAT:  ");
+
+    for (uint32_t b = 0; b < SIM_NAT_KINDS; ++b)
+        printf(" %7s", natNames[b]);
+
+    printf("\n");
+
+    for (uint32_t a = 0; a < SIM_NAT_KINDS; ++a) {
+        printf("  %-20s", natNames[a]);
+
+        for (uint32_t b = 0; b < SIM_NAT_KINDS; ++b) {
+            if (b < a || !tried[a][b])
+                printf(" %7s", "");
+            else
+                printf(" %3u/%-3u", made[a][b], tried[a][b]);
+        }
+
+        printf("\n");
+    }
+
+    std::sort(times.begin(), times.end());
+    printf("direct:                %zu of %u pairs (%.1f%%)\n", times.size(), pairs,
+           pairs ? times.size() * 100.0 / pairs : 0.0);
+
+    if (!times.empty())
+        printf("time to direct:        median %llu ms, p90 %llu ms\n", (unsigned long long)times[times.size() / 2],
+               (unsigned long long)times[times.size() * 9 / 10]);
+
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        delete transports[i];
+        delete nodes[i];
+    }
+
+    network.uninstall();
+    return times.empty() ? 1 : 0;
+}
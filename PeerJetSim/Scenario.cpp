@@ -0,0 +1,34 @@
+//
+//  Scenario.cpp
+//  PeerJetSim
+//
+//  Created by Compy on 12/18/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <stdio.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "Scenario.hpp"
+
+size_t residentBytes()
+{
+#if defined(__linux__)
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        unsigned long size = 0, resident = 0;
+        int n = fscanf(f, "%lu %lu", &size, &resident);
+        fclose(f);
+        if (n == 2)
+            return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+    }
+#endif
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#if defined(__APPLE__)
+    return (size_t)usage.ru_maxrss;
+#else
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+}
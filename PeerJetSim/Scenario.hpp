@@ -0,0 +1,51 @@
+//
+//  Scenario.hpp
+//  PeerJetSim
+//
+//  Created by Compy on 12/6/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef Scenario_hpp
+#define Scenario_hpp
+
+#include <cstddef>
+#include <cstdint>
+#include "SimulatedNetwork.hpp"
+
+typedef struct {
+    uint32_t nodes;
+    uint32_t step;
+    uint64_t duration;
+    uint64_t seed;
+    LinkParameters link;
+
+    /**
+     * Bytes in every file of the transfer scenario
+     */
+    uint64_t fileSize;
+
+    /**
+     * Files the transfer scenario sends at the same time
+     */
+    uint32_t files;
+
+    /**
+     * Have the library read the files from disk (Node::fileSendPath) instead of the chunk request callback
+     */
+    bool fromFile;
+} SimulatorOptions;
+
+/* Each scenario returns the exit code of the simulator. */
+int runGossipScenario(const SimulatorOptions* options);
+int runTransferScenario(const SimulatorOptions* options);
+int runLanScenario(const SimulatorOptions* options);
+int runNatScenario(const SimulatorOptions* options);
+int runHandshakeScenario(const SimulatorOptions* options);
+int runSessionScenario(const SimulatorOptions* options);
+int runHostScenario(const SimulatorOptions* options);
+
+/* Resident memory of the process in bytes, 0 if unknown. */
+size_t residentBytes();
+
+#endif /* Scenario_hpp */
@@ -0,0 +1,215 @@
+//
+//  SessionScenario.cpp
+//  PeerJetSim
+//
+//  Created by Compy on 12/18/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <vector>
+#include "NetCrypto.hpp"
+#include "Scenario.hpp"
+#include "SimulatedNetwork.hpp"
+
+/* Every peer but the first sends the hub a message this often (ms), the first sends as fast as it can. */
+#define SIM_SESSION_MESSAGE_INTERVAL    1000
+#define SIM_SESSION_MESSAGE_SIZE        64
+
+/* Peers start connecting this many per step, as a hub would see them come back after a restart. */
+#define SIM_SESSION_CONNECTS_PER_STEP   50
+
+struct SessionPeer {
+    NetworkingCore *net;
+    NetCrypto *netCrypto;
+    uint8_t publicKey[crypto_box_PUBLICKEYBYTES];
+    uint32_t sent;          /* sequence number of the next message */
+    uint64_t lastSent;
+};
+
+struct SessionHub {
+    std::vector<uint32_t> expected;     /* next sequence number by peer */
+    uint64_t delivered;
+    uint64_t outOfOrder;
+    uint64_t bulkBytes;
+};
+
+static bool acceptAll(void *object, const uint8_t *publicKey, IP_Port source)
+{
+    return true;
+}
+
+/* Messages start with the index of the peer and their sequence number. */
+static void onHubData(void *object, uint32_t connection, const uint8_t *data, uint16_t length)
+{
+    SessionHub *hub = (SessionHub *)object;
+
+    if (length < 8)
+        return;
+
+    uint32_t peer, sequence;
+    memcpy(&peer, data, sizeof(peer));
+    memcpy(&sequence, data + 4, sizeof(sequence));
+
+    if (peer >= hub->expected.size())
+        return;
+
+    if (sequence != hub->expected[peer])
+        ++hub->outOfOrder;
+
+    hub->expected[peer] = sequence + 1;
+    ++hub->delivered;
+
+    if (peer == 0)
+        hub->bulkBytes += length;
+}
+
+/* return false once the send ring is full. */
+static bool sendMessage(SessionPeer *peer, uint32_t index, uint16_t length)
+{
+    uint8_t message[NET_CRYPTO_MAX_DATA_SIZE];
+    memset(message, 0, length);
+    memcpy(message, &index, sizeof(index));
+    memcpy(message + 4, &peer->sent, sizeof(peer->sent));
+
+    if (peer->netCrypto->sendPacket(0, message, length, true) == -1)
+        return false;
+
+    ++peer->sent;
+    return true;
+}
+
+/* One hub holds a lossless session with every peer.
+ *
+ * The first peer keeps its send ring full and has to get close to the rate of
+ * its uplink, the others trickle sequenced messages. Everything has to arrive
+ * in order, and the hub's memory has to stay at its slabs and the buffers the
+ * bulk sender keeps in flight.
+ */
+int runSessionScenario(const SimulatorOptions* options)
+{
+    SimulatedNetwork network(options->link, options->seed);
+    network.install();
+
+    IP_Port hubAddress;
+    NetworkingCore *hubNet = network.addEndpoint(&hubAddress);
+
+    if (!hubNet || options->nodes == 0) {
+        fprintf(stderr, "Failed to create the hub\n");
+        return 1;
+    }
+
+    uint8_t hubPublicKey[crypto_box_PUBLICKEYBYTES], hubSecretKey[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(hubPublicKey, hubSecretKey);
+
+    SessionHub hub;
+    hub.expected.assign(options->nodes, 0);
+    hub.delivered = 0;
+    hub.outOfOrder = 0;
+    hub.bulkBytes = 0;
+
+    NetCrypto *hubCrypto = new NetCrypto(hubNet, hubPublicKey, hubSecretKey);
+    hubCrypto->setAcceptCallback(&acceptAll, NULL);
+    hubCrypto->setDataCallback(&onHubData, &hub);
+
+    std::vector<SessionPeer> peers(options->nodes);
+
+    for (uint32_t i = 0; i < options->nodes; ++i) {
+        uint8_t secretKey[crypto_box_SECRETKEYBYTES];
+        crypto_box_keypair(peers[i].publicKey, secretKey);
+        peers[i].net = network.addEndpoint();
+
+        if (!peers[i].net) {
+            fprintf(stderr, "Failed to create endpoint %u\n", i);
+            return 1;
+        }
+
+        peers[i].netCrypto = new NetCrypto(peers[i].net, peers[i].publicKey, secretKey);
+        peers[i].sent = 0;
+        peers[i].lastSent = 0;
+    }
+
+    const uint64_t start = network.now();
+    uint64_t bulkStart = 0;
+    uint32_t next = 0, maxEstablished = 0;
+    std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+
+    while (network.now() - start < options->duration) {
+        network.advance(options->step);
+        const uint64_t now = network.now();
+
+        for (uint32_t i = 0; i < SIM_SESSION_CONNECTS_PER_STEP && next < peers.size(); ++i, ++next)
+            peers[next].netCrypto->addConnection(hubPublicKey, hubAddress);
+
+        NetworkService::poll(hubNet);
+        hubCrypto->tick();
+
+        for (uint32_t i = 0; i < peers.size(); ++i) {
+            SessionPeer *peer = &peers[i];
+            NetworkService::poll(peer->net);
+            peer->netCrypto->tick();
+
+            if (!peer->netCrypto->isOnline(0))
+                continue;
+
+            if (i == 0) {
+                if (!bulkStart)
+                    bulkStart = now;
+
+                while (sendMessage(peer, i, NET_CRYPTO_MAX_DATA_SIZE))
+                    ;
+            } else if (now - peer->lastSent >= SIM_SESSION_MESSAGE_INTERVAL) {
+                peer->lastSent = now;
+                sendMessage(peer, i, SIM_SESSION_MESSAGE_SIZE);
+            }
+        }
+
+        maxEstablished = std::max(maxEstablished, hubCrypto->getStats().established);
+    }
+
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    const SimulatorStats& stats = network.getStats();
+    NetCryptoStats h = hubCrypto->getStats();
+    NetCryptoStats bulk = peers[0].netCrypto->getStats();
+    uint64_t sent = 0;
+
+    for (uint32_t i = 0; i < peers.size(); ++i)
+        sent += peers[i].sent;
+
+    /* Still in flight at the end, at most a ring per session. */
+    uint64_t undelivered = sent - hub.delivered;
+    double seconds = bulkStart ? (network.now() - bulkStart) / 1000.0 : 0;
+    double goodput = seconds > 0 ? hub.bulkBytes * 8 / seconds / 1000 : 0;
+
+    printf("sessions:              %u peers, %u established at most\n", options->nodes, maxEstablished);
+    printf("link:                  latency %ums jitter %ums loss %.3f bandwidth %u kbit/s queue %u\n",
+           options->link.latency, options->link.jitter, options->link.loss, options->link.bandwidth,
+           options->link.queue);
+    printf("virtual time:          %llu ms in %.3f s wall\n", (unsigned long long)(network.now() - start), wall);
+    printf("datagrams:             %llu sent, %llu delivered, %llu dropped, %llu queue drops\n",
+           (unsigned long long)stats.sent, (unsigned long long)stats.delivered, (unsigned long long)stats.dropped,
+           (unsigned long long)stats.queueDrops);
+    printf("messages:              %llu sent, %llu delivered, %llu out of order, %llu in flight at the end\n",
+           (unsigned long long)sent, (unsigned long long)hub.delivered, (unsigned long long)hub.outOfOrder,
+           (unsigned long long)undelivered);
+    printf("bulk goodput:          %.0f kbit/s", goodput);
+
+    if (options->link.bandwidth)
+        printf(", %.1f%% of the uplink", goodput * 100 / options->link.bandwidth);
+
+    printf(", %llu retransmissions\n", (unsigned long long)bulk.retransmissions);
+    printf("hub acks:              %llu for %llu messages\n", (unsigned long long)h.acks,
+           (unsigned long long)hub.delivered);
+    printf("hub pool:              %u buffers, %u in use\n", h.buffers, h.buffersUsed);
+    printf("hub memory:            %llu bytes, %llu per session\n", (unsigned long long)h.memory,
+           (unsigned long long)(h.connections ? h.memory / h.connections : 0));
+
+    for (uint32_t i = 0; i < peers.size(); ++i)
+        delete peers[i].netCrypto;
+
+    delete hubCrypto;
+    network.uninstall();
+    return maxEstablished == options->nodes && hub.outOfOrder == 0 && undelivered <= (uint64_t)options->nodes * NET_CRYPTO_WINDOW ? 0 : 1;
+}
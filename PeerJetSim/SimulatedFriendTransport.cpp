@@ -0,0 +1,168 @@
+//
+//  SimulatedFriendTransport.cpp
+//  PeerJetSim
+//
+//  Created by Compy on 12/6/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include "SimulatedFriendTransport.hpp"
+#include "NetCrypto.hpp"
+
+SimulatedFriendTransport::SimulatedFriendTransport(SimulatedNetwork* network, Node* node, IP_Port address)
+    : node(node), address(address), packetNumber(0)
+{
+    FriendTransport transport;
+    memset(&transport, 0, sizeof(transport));
+    transport.sendLossless = &SimulatedFriendTransport::sendLossless;
+    transport.sendLossy = &SimulatedFriendTransport::sendLossy;
+    transport.friendFoundOnLan = &SimulatedFriendTransport::friendReachable;
+    transport.friendHolePunched = &SimulatedFriendTransport::friendReachable;
+    transport.object = this;
+    node->setFriendTransport(&transport);
+
+    network->setRelayed(SIM_PACKET_FRIEND_RELAYED);
+    NetworkService::registerHandler(node->getNetworking(), SIM_PACKET_FRIEND_RELAYED, &SimulatedFriendTransport::handlePacket, this);
+}
+
+SimulatedFriendTransport::~SimulatedFriendTransport()
+{
+    NetworkService::registerHandler(this->node->getNetworking(), SIM_PACKET_FRIEND_RELAYED, NULL, NULL);
+    this->node->setFriendTransport(NULL);
+}
+
+bool SimulatedFriendTransport::connect(SimulatedFriendTransport* a, SimulatedFriendTransport* b)
+{
+    int32_t friendOfA = a->node->addFriendNoRequest(*b->node->getAddress());
+    int32_t friendOfB = b->node->addFriendNoRequest(*a->node->getAddress());
+
+    if (friendOfA < 0 || friendOfB < 0)
+        return false;
+
+    /* Both open the session, the friends come online once its handshake is done. */
+    a->setFriend(friendOfA, b->address, false);
+    b->setFriend(friendOfB, a->address, false);
+    return a->openSession(friendOfA) && b->openSession(friendOfB);
+}
+
+bool SimulatedFriendTransport::connectRelayed(SimulatedFriendTransport* a, SimulatedFriendTransport* b)
+{
+    int32_t friendOfA = a->node->addFriendNoRequest(*b->node->getAddress());
+    int32_t friendOfB = b->node->addFriendNoRequest(*a->node->getAddress());
+
+    if (friendOfA < 0 || friendOfB < 0)
+        return false;
+
+    a->setFriend(friendOfA, b->address, true);
+    b->setFriend(friendOfB, a->address, true);
+    a->node->setFriendConnectionStatus(friendOfA, CONNECTION_TYPE_TCP);
+    b->node->setFriendConnectionStatus(friendOfB, CONNECTION_TYPE_TCP);
+    return true;
+}
+
+void SimulatedFriendTransport::setFriend(uint32_t friendNumber, IP_Port address, bool relayed)
+{
+    if (this->friends.size() <= friendNumber) {
+        this->friends.resize(friendNumber + 1);
+        this->relayed.resize(friendNumber + 1);
+    }
+
+    this->friends[friendNumber] = address;
+    this->relayed[friendNumber] = relayed;
+}
+
+bool SimulatedFriendTransport::openSession(uint32_t friendNumber)
+{
+    uint8_t publicKey[PEERJET_KEY_LENGTH];
+
+    if (this->sessions.size() <= friendNumber)
+        this->sessions.resize(friendNumber + 1, -1);
+
+    if (!this->node->getFriendsPublicKey(friendNumber, publicKey))
+        return false;
+
+    this->sessions[friendNumber] = this->node->getNetCrypto()->addConnection(publicKey, this->friends[friendNumber]);
+    return this->sessions[friendNumber] != -1;
+}
+
+bool SimulatedFriendTransport::isOnline(uint32_t friendNumber)
+{
+    if (friendNumber < this->sessions.size() && this->sessions[friendNumber] != -1 &&
+        this->node->getNetCrypto()->isOnline((uint32_t)this->sessions[friendNumber]))
+        return true;
+
+    return friendNumber < this->relayed.size() && this->relayed[friendNumber];
+}
+
+bool SimulatedFriendTransport::befriend(SimulatedFriendTransport* a, SimulatedFriendTransport* b)
+{
+    return a->node->addFriendNoRequest(*b->node->getAddress()) >= 0 && b->node->addFriendNoRequest(*a->node->getAddress()) >= 0;
+}
+
+/* Found on the LAN or punched to, the friend is reached straight at ipPort once
+ * the session there is up, through the relay until then if it was relayed.
+ */
+void SimulatedFriendTransport::friendReachable(void *object, uint32_t friendNumber, IP_Port ipPort)
+{
+    SimulatedFriendTransport *transport = (SimulatedFriendTransport *)object;
+    bool relayed = friendNumber < transport->relayed.size() && transport->relayed[friendNumber];
+    transport->setFriend(friendNumber, ipPort, relayed);
+    transport->openSession(friendNumber);
+}
+
+Node* SimulatedFriendTransport::getNode()
+{
+    return this->node;
+}
+
+int64_t SimulatedFriendTransport::sendLossless(void *object, uint32_t friendNumber, const uint8_t *data, uint16_t length)
+{
+    return ((SimulatedFriendTransport *)object)->send(friendNumber, data, length, true);
+}
+
+int64_t SimulatedFriendTransport::sendLossy(void *object, uint32_t friendNumber, const uint8_t *data, uint16_t length)
+{
+    return ((SimulatedFriendTransport *)object)->send(friendNumber, data, length, false);
+}
+
+/* The session once it is up, the relay before that for relayed friends. */
+int64_t SimulatedFriendTransport::send(uint32_t friendNumber, const uint8_t *data, uint16_t length, bool lossless)
+{
+    if (friendNumber < this->sessions.size() && this->sessions[friendNumber] != -1) {
+        NetCrypto *netCrypto = this->node->getNetCrypto();
+
+        if (netCrypto->isOnline((uint32_t)this->sessions[friendNumber]))
+            return netCrypto->sendPacket((uint32_t)this->sessions[friendNumber], data, length, lossless);
+    }
+
+    if (friendNumber >= this->friends.size() || !this->relayed[friendNumber] ||
+        1 + PEERJET_KEY_LENGTH + length > MAX_UDP_PACKET_SIZE)
+        return -1;
+
+    uint8_t packet[MAX_UDP_PACKET_SIZE];
+    packet[0] = SIM_PACKET_FRIEND_RELAYED;
+    memcpy(packet + 1, *this->node->getAddress(), PEERJET_KEY_LENGTH);
+    memcpy(packet + 1 + PEERJET_KEY_LENGTH, data, length);
+
+    if (NetworkService::sendPacket(this->node->getNetworking(), this->friends[friendNumber], packet,
+                                   1 + PEERJET_KEY_LENGTH + length) == -1)
+        return -1;
+
+    return lossless ? this->packetNumber++ : 0;
+}
+
+int SimulatedFriendTransport::handlePacket(void *object, IP_Port source, const uint8_t *data, uint16_t length)
+{
+    SimulatedFriendTransport *transport = (SimulatedFriendTransport *)object;
+
+    if (length <= 1 + PEERJET_KEY_LENGTH)
+        return -1;
+
+    int friendNumber = transport->node->getFriendByPublicKey(data + 1);
+
+    if (friendNumber == -1)
+        return -1;
+
+    transport->node->handleFriendPacket(friendNumber, data + 1 + PEERJET_KEY_LENGTH, length - (1 + PEERJET_KEY_LENGTH));
+    return 0;
+}
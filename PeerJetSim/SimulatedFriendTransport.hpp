@@ -0,0 +1,75 @@
+//
+//  SimulatedFriendTransport.hpp
+//  PeerJetSim
+//
+//  Created by Compy on 12/6/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef SimulatedFriendTransport_hpp
+#define SimulatedFriendTransport_hpp
+
+#include <cstdint>
+#include <vector>
+#include "Node.hpp"
+#include "SimulatedNetwork.hpp"
+
+/* Friend packets through the relay of the simulated network: [id][public key of the sender][friend packet]. */
+#define SIM_PACKET_FRIEND_RELAYED   205
+
+/* Stand-in for the connection layer between simulated nodes.
+ *
+ * Friends reached directly get their packets over the sessions of NetCrypto,
+ * through the same lossy link as everything else, so lossless packets are
+ * recovered by its retransmissions. Friends connected through the relay
+ * (connectRelayed) get their packets past NATs that way, as plain datagrams,
+ * until a hole is punched to them and the session there is up.
+ */
+class SimulatedFriendTransport {
+public:
+    SimulatedFriendTransport(SimulatedNetwork* network, Node* node, IP_Port address);
+    ~SimulatedFriendTransport();
+
+    /* Add a and b as friends of each other and open the session between them,
+     * they come online once its handshake is done.
+     *
+     * return false if the nodes couldn't be added.
+     */
+    static bool connect(SimulatedFriendTransport* a, SimulatedFriendTransport* b);
+
+    /* Add a and b as friends of each other, connected through the relay (CONNECTION_TYPE_TCP).
+     *
+     * return false if the nodes couldn't be added.
+     */
+    static bool connectRelayed(SimulatedFriendTransport* a, SimulatedFriendTransport* b);
+
+    /* Add a and b as friends of each other, the connection comes up once they find each other on the LAN.
+     *
+     * return false if the nodes couldn't be added.
+     */
+    static bool befriend(SimulatedFriendTransport* a, SimulatedFriendTransport* b);
+
+    Node* getNode();
+
+    /* return true if packets to the friend get through, on the session or the relay. */
+    bool isOnline(uint32_t friendNumber);
+
+private:
+    static int64_t sendLossless(void *object, uint32_t friendNumber, const uint8_t *data, uint16_t length);
+    static int64_t sendLossy(void *object, uint32_t friendNumber, const uint8_t *data, uint16_t length);
+    static void friendReachable(void *object, uint32_t friendNumber, IP_Port ipPort);
+    static int handlePacket(void *object, IP_Port source, const uint8_t *data, uint16_t length);
+
+    int64_t send(uint32_t friendNumber, const uint8_t *data, uint16_t length, bool lossless);
+    void setFriend(uint32_t friendNumber, IP_Port address, bool relayed);
+    bool openSession(uint32_t friendNumber);
+
+    Node* node;
+    IP_Port address;
+    std::vector<IP_Port> friends; /* address of every friend by friend number */
+    std::vector<bool> relayed;    /* friends reached through the relay */
+    std::vector<int> sessions;    /* NetCrypto connection of every friend, -1 if none */
+    uint32_t packetNumber;
+};
+
+#endif /* SimulatedFriendTransport_hpp */
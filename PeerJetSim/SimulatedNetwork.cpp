@@ -0,0 +1,328 @@
+//
+//  SimulatedNetwork.cpp
+//  PeerJetSim
+//
+//  Created by Compy on 12/2/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include "SimulatedNetwork.hpp"
+
+/* Virtual time starts at an arbitrary non zero value so timestamps of 0 keep meaning "never". */
+#define SIMULATOR_START_TIME 1000000
+
+#define SIMULATOR_PORT 33445
+
+/* Public addresses of the NATs, in 198.18.0.0/15. */
+#define SIMULATOR_NAT_NETWORK 0xC6120000
+
+/* Ports NATs hand out. */
+#define SIMULATOR_NAT_PORT_FIRST 1024
+#define SIMULATOR_NAT_PORT_COUNT (65536 - SIMULATOR_NAT_PORT_FIRST)
+
+static uint64_t addressKey(uint32_t ip, uint16_t port)
+{
+    return ((uint64_t)ip << 16) | port;
+}
+
+SimulatedNetwork::SimulatedNetwork(const LinkParameters& link, uint64_t seed)
+    : link(link), rng(seed), time(SIMULATOR_START_TIME), sequence(0)
+{
+    memset(&this->stats, 0, sizeof(this->stats));
+    memset(this->relayed, 0, sizeof(this->relayed));
+}
+
+SimulatedNetwork::~SimulatedNetwork()
+{
+    while (!this->pending.empty()) {
+        delete this->pending.top();
+        this->pending.pop();
+    }
+
+    for (size_t i = 0; i < this->endpoints.size(); ++i) {
+        NetworkService::killNetworking(this->endpoints[i]->net);
+        delete this->endpoints[i];
+    }
+}
+
+void SimulatedNetwork::install()
+{
+    NetworkService::setTimeSource(&SimulatedNetwork::clock, this);
+}
+
+void SimulatedNetwork::uninstall()
+{
+    NetworkService::setTimeSource(NULL, NULL);
+}
+
+NetworkingCore* SimulatedNetwork::addEndpoint(IP_Port* ipPort, SimulatedNat nat)
+{
+    /* Hand out 10.0.0.0/8 addresses in order. */
+    uint32_t index = (uint32_t)this->endpoints.size();
+
+    if (index >= 0xFFFFFE)
+        return NULL;
+
+    Endpoint *endpoint = new Endpoint();
+    endpoint->network = this;
+    endpoint->nat = nat;
+    endpoint->publicIp = htonl(SIMULATOR_NAT_NETWORK | (index + 1));
+
+    /* Endpoints without a NAT leave the random stream of the scenarios alone. */
+    endpoint->nextPort = nat == SIM_NAT_NONE ? 0 : (uint16_t)(SIMULATOR_NAT_PORT_FIRST + this->rng() % SIMULATOR_NAT_PORT_COUNT);
+
+    IP_Port address;
+    memset(&address, 0, sizeof(address));
+    address.ip.family = AF_INET;
+    address.ip.ip4.uint32 = htonl(0x0A000000 | (index + 1));
+    address.port = htons(SIMULATOR_PORT);
+    endpoint->address = address;
+
+    NetworkTransport transport;
+    transport.send = &SimulatedNetwork::send;
+    transport.recv = &SimulatedNetwork::recv;
+    transport.object = endpoint;
+
+    endpoint->net = NetworkService::newVirtualNetworking(address.ip, SIMULATOR_PORT, &transport);
+
+    if (!endpoint->net) {
+        delete endpoint;
+        return NULL;
+    }
+
+    this->endpoints.push_back(endpoint);
+    this->addresses[address.ip.ip4.uint32] = index;
+
+    if (nat != SIM_NAT_NONE)
+        this->publicAddresses[endpoint->publicIp] = index;
+
+    if (ipPort)
+        *ipPort = address;
+
+    return endpoint->net;
+}
+
+void SimulatedNetwork::setRelayed(uint8_t packetId)
+{
+    this->relayed[packetId] = true;
+}
+
+void SimulatedNetwork::advance(uint64_t ms)
+{
+    this->time += ms;
+
+    while (!this->pending.empty() && this->pending.top()->deliverAt <= this->time * 1000) {
+        Datagram *datagram = this->pending.top();
+        this->pending.pop();
+
+        Endpoint *endpoint = this->endpoints[datagram->destination];
+        endpoint->inbox.push_back(std::make_pair(datagram->source, std::vector<uint8_t>()));
+        endpoint->inbox.back().second.swap(datagram->data);
+        delete datagram;
+    }
+}
+
+uint64_t SimulatedNetwork::now() const
+{
+    return this->time;
+}
+
+size_t SimulatedNetwork::inFlight() const
+{
+    return this->pending.size();
+}
+
+const SimulatorStats& SimulatedNetwork::getStats() const
+{
+    return this->stats;
+}
+
+int SimulatedNetwork::send(void *object, IP_Port ipPort, const uint8_t *data, uint16_t length)
+{
+    Endpoint *endpoint = (Endpoint *)object;
+    SimulatedNetwork *network = endpoint->network;
+
+    ++network->stats.sent;
+
+    if (ipPort.ip.family != AF_INET)
+        return -1;
+
+    /* Every endpoint not behind a NAT is on one segment, a broadcast reaches all the others. */
+    const bool relayed = length > 0 && network->relayed[data[0]];
+    const bool broadcast = !relayed && ipPort.ip.ip4.uint32 == INADDR_BROADCAST;
+    const bool natted = !relayed && endpoint->nat != SIM_NAT_NONE;
+    std::unordered_map<uint32_t, uint32_t>::const_iterator it = network->addresses.find(ipPort.ip.ip4.uint32);
+    IP_Port source = natted ? network->translate(endpoint, ipPort) : endpoint->address;
+    bool reachable;
+
+    if (relayed) {
+        reachable = it != network->addresses.end() && ipPort.port == htons(SIMULATOR_PORT);
+    } else if (broadcast) {
+        reachable = !natted && ipPort.port == htons(SIMULATOR_PORT);
+    } else if (it != network->addresses.end()) {
+        /* Endpoints without a NAT are public, the others are only reached through their NAT. */
+        reachable = network->endpoints[it->second]->nat == SIM_NAT_NONE && ipPort.port == htons(SIMULATOR_PORT);
+    } else {
+        it = network->publicAddresses.find(ipPort.ip.ip4.uint32);
+        reachable = it != network->publicAddresses.end();
+
+        if (reachable && !network->admit(network->endpoints[it->second], source, ntohs(ipPort.port))) {
+            ++network->stats.natDrops;
+            reachable = false;
+        }
+    }
+
+    /* Like UDP, sending into the void succeeds. */
+    if (!reachable) {
+        ++network->stats.dropped;
+        return length;
+    }
+
+    uint64_t now = network->time * 1000;
+    uint64_t departure = now;
+
+    if (network->link.bandwidth > 0) {
+        while (!endpoint->uplink.empty() && endpoint->uplink.front() <= now)
+            endpoint->uplink.pop_front();
+
+        if (!relayed && network->link.queue > 0 && endpoint->uplink.size() >= network->link.queue) {
+            ++network->stats.dropped;
+            ++network->stats.queueDrops;
+            return length;
+        }
+
+        /* kbit/s is bits per ms, so bits * 1000 / kbit/s is us. */
+        uint64_t serialization = ((uint64_t)length * 8 * 1000 + network->link.bandwidth - 1) / network->link.bandwidth;
+        departure = (endpoint->uplink.empty() ? now : endpoint->uplink.back()) + serialization;
+        endpoint->uplink.push_back(departure);
+    }
+
+    if (relayed) {
+        ++network->stats.relayed;
+        departure += (uint64_t)network->link.latency * 1000;
+    }
+
+    if (!broadcast) {
+        network->deliver(source, it->second, departure, relayed, data, length);
+        return length;
+    }
+
+    /* One transmission on the uplink, each receiver loses or delays its copy on its own. */
+    ++network->stats.broadcasts;
+
+    for (uint32_t i = 0; i < network->endpoints.size(); ++i) {
+        if (network->endpoints[i] != endpoint && network->endpoints[i]->nat == SIM_NAT_NONE)
+            network->deliver(source, i, departure, relayed, data, length);
+    }
+
+    return length;
+}
+
+void SimulatedNetwork::deliver(const IP_Port& source, uint32_t destination, uint64_t departure, bool reliable,
+                               const uint8_t *data, uint16_t length)
+{
+    std::uniform_real_distribution<double> chance(0.0, 1.0);
+
+    if (!reliable && this->link.loss > 0.0 && chance(this->rng) < this->link.loss) {
+        ++this->stats.dropped;
+        return;
+    }
+
+    uint64_t delay = this->link.latency;
+
+    if (!reliable && this->link.jitter > 0)
+        delay += this->rng() % (this->link.jitter + 1);
+
+    if (!reliable && this->link.reorder > 0.0 && chance(this->rng) < this->link.reorder)
+        delay += this->link.latency / 2 + this->link.jitter + 1;
+
+    Datagram *datagram = new Datagram();
+    datagram->deliverAt = departure + delay * 1000;
+    datagram->sequence = this->sequence++;
+    datagram->destination = destination;
+    datagram->source = source;
+    datagram->data.assign(data, data + length);
+    this->pending.push(datagram);
+}
+
+/* The address the NAT of endpoint sends a datagram to destination from, opening its mapping. */
+IP_Port SimulatedNetwork::translate(Endpoint* endpoint, IP_Port destination)
+{
+    const bool symmetric = endpoint->nat == SIM_NAT_SYMMETRIC || endpoint->nat == SIM_NAT_SYMMETRIC_RANDOM;
+    const uint64_t key = addressKey(destination.ip.ip4.uint32, destination.port);
+    std::unordered_map<uint64_t, uint16_t>::const_iterator it = endpoint->mappings.find(symmetric ? key : 0);
+    uint16_t port;
+
+    if (it != endpoint->mappings.end()) {
+        port = it->second;
+    } else {
+        do {
+            if (endpoint->nat == SIM_NAT_SYMMETRIC_RANDOM)
+                endpoint->nextPort = (uint16_t)(SIMULATOR_NAT_PORT_FIRST + this->rng() % SIMULATOR_NAT_PORT_COUNT);
+
+            port = endpoint->nextPort;
+            endpoint->nextPort = port == 65535 ? SIMULATOR_NAT_PORT_FIRST : port + 1;
+        } while (endpoint->ports.count(port));
+
+        endpoint->mappings[symmetric ? key : 0] = port;
+    }
+
+    std::unordered_set<uint64_t>& allowed = endpoint->ports[port];
+    allowed.insert(key);
+    allowed.insert(addressKey(destination.ip.ip4.uint32, 0));
+
+    IP_Port source;
+    memset(&source, 0, sizeof(source));
+    source.ip.family = AF_INET;
+    source.ip.ip4.uint32 = endpoint->publicIp;
+    source.port = htons(port);
+    return source;
+}
+
+/* return true if the NAT of endpoint lets a datagram from source in on port (host byte order). */
+bool SimulatedNetwork::admit(Endpoint* endpoint, IP_Port source, uint16_t port)
+{
+    std::unordered_map<uint16_t, std::unordered_set<uint64_t> >::const_iterator it = endpoint->ports.find(port);
+
+    if (it == endpoint->ports.end())
+        return false;
+
+    switch (endpoint->nat) {
+        case SIM_NAT_FULL_CONE:
+            return true;
+
+        case SIM_NAT_RESTRICTED_CONE:
+            return it->second.count(addressKey(source.ip.ip4.uint32, 0)) != 0;
+
+        default:
+            return it->second.count(addressKey(source.ip.ip4.uint32, source.port)) != 0;
+    }
+}
+
+int SimulatedNetwork::recv(void *object, IP_Port *ipPort, uint8_t *data, uint32_t *length)
+{
+    Endpoint *endpoint = (Endpoint *)object;
+
+    if (endpoint->inbox.empty())
+        return -1;
+
+    std::pair<IP_Port, std::vector<uint8_t> >& front = endpoint->inbox.front();
+    size_t size = front.second.size();
+
+    if (size > MAX_UDP_PACKET_SIZE)
+        size = MAX_UDP_PACKET_SIZE;
+
+    *ipPort = front.first;
+    memcpy(data, front.second.data(), size);
+    *length = (uint32_t)size;
+
+    ++endpoint->network->stats.delivered;
+    endpoint->network->stats.bytesDelivered += size;
+    endpoint->inbox.pop_front();
+    return 0;
+}
+
+uint64_t SimulatedNetwork::clock(void *object)
+{
+    return ((SimulatedNetwork *)object)->time;
+}
@@ -0,0 +1,173 @@
+//
+//  SimulatedNetwork.hpp
+//  PeerJetSim
+//
+//  Created by Compy on 12/2/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#ifndef SimulatedNetwork_hpp
+#define SimulatedNetwork_hpp
+
+#include <cstdint>
+#include <deque>
+#include <queue>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "NetworkService.hpp"
+
+typedef struct {
+    /**
+     * One way delay in milliseconds
+     */
+    uint32_t latency;
+
+    /**
+     * Uniformly distributed extra delay in milliseconds
+     */
+    uint32_t jitter;
+
+    /**
+     * Probability for a datagram to be dropped
+     */
+    double loss;
+
+    /**
+     * Probability for a datagram to be held back long enough to arrive after its successors
+     */
+    double reorder;
+
+    /**
+     * Uplink rate of every endpoint in kbit/s, 0 for unlimited
+     */
+    uint32_t bandwidth;
+
+    /**
+     * Datagrams an uplink queues before it drops (drop tail), only used with a bandwidth
+     */
+    uint32_t queue;
+} LinkParameters;
+
+typedef struct {
+    uint64_t sent;
+    uint64_t delivered;
+    uint64_t dropped;
+    uint64_t queueDrops;
+    uint64_t bytesDelivered;
+    uint64_t broadcasts;    /* datagrams sent to 255.255.255.255, each one delivered to every other endpoint */
+    uint64_t natDrops;      /* datagrams a NAT didn't let in */
+    uint64_t relayed;       /* datagrams that went through the relay (setRelayed) */
+} SimulatorStats;
+
+/* NAT in front of an endpoint. Mappings never expire. */
+typedef enum {
+    SIM_NAT_NONE,               /* reachable at its own address */
+    SIM_NAT_FULL_CONE,          /* one external port, open to everyone */
+    SIM_NAT_RESTRICTED_CONE,    /* one external port, open to the addresses it sent to */
+    SIM_NAT_PORT_RESTRICTED,    /* one external port, open to the addresses and ports it sent to */
+    SIM_NAT_SYMMETRIC,          /* a port per destination allocated in sequence, open to that destination only */
+    SIM_NAT_SYMMETRIC_RANDOM    /* the same with random ports */
+} SimulatedNat;
+
+/* In-process datagram network.
+ *
+ * Every endpoint is a NetworkingCore running on a virtual transport, datagrams
+ * travel through a delivery queue ordered by virtual time, and the monotonic
+ * clock of the library is driven by advance() while the simulator is installed.
+ *
+ * With a bandwidth set, every endpoint serializes its datagrams through an
+ * uplink of that rate with a drop tail queue in front of it, which is where
+ * congestion shows up.
+ *
+ * All endpoints share one segment: a datagram to 255.255.255.255 goes out on
+ * the uplink once and is delivered to every other endpoint.
+ *
+ * An endpoint behind a NAT is on a network of its own: it is only reached at
+ * the public address of its NAT (198.18.0.0/15), through the mappings its own
+ * datagrams opened. The other endpoints are public hosts.
+ */
+class SimulatedNetwork {
+public:
+    SimulatedNetwork(const LinkParameters& link, uint64_t seed);
+    ~SimulatedNetwork();
+
+    /* Make NetworkService use our virtual clock. */
+    void install();
+    void uninstall();
+
+    /* Create a new endpoint with its own address, stored in address if not NULL,
+     * behind a NAT of the given kind.
+     *
+     * return NULL if there are problems.
+     */
+    NetworkingCore* addEndpoint(IP_Port* address = NULL, SimulatedNat nat = SIM_NAT_NONE);
+
+    /* Datagrams starting with this packet ID go through a relay every endpoint
+     * reaches, standing in for a TCP relay: they get to the endpoint's own
+     * address past any NAT, reliably and with twice the latency.
+     */
+    void setRelayed(uint8_t packetId);
+
+    /* Move virtual time forward by ms milliseconds and hand out every datagram due by then. */
+    void advance(uint64_t ms);
+
+    uint64_t now() const;
+    size_t inFlight() const;
+    const SimulatorStats& getStats() const;
+
+private:
+    struct Endpoint {
+        SimulatedNetwork* network;
+        NetworkingCore* net;
+        IP_Port address;
+        std::deque<std::pair<IP_Port, std::vector<uint8_t> > > inbox;
+        std::deque<uint64_t> uplink; /* departure times (us) of the queued datagrams */
+
+        SimulatedNat nat;
+        uint32_t publicIp;          /* of its NAT, network byte order */
+        uint16_t nextPort;          /* next port a sequential NAT hands out */
+        std::unordered_map<uint64_t, uint16_t> mappings; /* external port by destination, 0 for cone NATs */
+        std::unordered_map<uint16_t, std::unordered_set<uint64_t> > ports; /* addresses let in, by external port */
+    };
+
+    struct Datagram {
+        uint64_t deliverAt; /* us */
+        uint64_t sequence;
+        uint32_t destination;
+        IP_Port source;
+        std::vector<uint8_t> data;
+    };
+
+    struct DatagramOrder {
+        bool operator()(const Datagram* a, const Datagram* b) const
+        {
+            if (a->deliverAt != b->deliverAt)
+                return a->deliverAt > b->deliverAt;
+            return a->sequence > b->sequence;
+        }
+    };
+
+    static int send(void *object, IP_Port ipPort, const uint8_t *data, uint16_t length);
+    static int recv(void *object, IP_Port *ipPort, uint8_t *data, uint32_t *length);
+    static uint64_t clock(void *object);
+
+    void deliver(const IP_Port& source, uint32_t destination, uint64_t departure, bool reliable, const uint8_t *data,
+                 uint16_t length);
+    IP_Port translate(Endpoint* endpoint, IP_Port destination);
+    bool admit(Endpoint* endpoint, IP_Port source, uint16_t port);
+
+    LinkParameters link;
+    std::mt19937_64 rng;
+    uint64_t time;
+    uint64_t sequence;
+    std::vector<Endpoint*> endpoints;
+    std::unordered_map<uint32_t, uint32_t> addresses;
+    std::unordered_map<uint32_t, uint32_t> publicAddresses; /* of the NATs */
+    std::priority_queue<Datagram*, std::vector<Datagram*>, DatagramOrder> pending;
+    bool relayed[256];
+    SimulatorStats stats;
+};
+
+#endif /* SimulatedNetwork_hpp */
@@ -0,0 +1,243 @@
+//
+//  TransferScenario.cpp
+//  PeerJetSim
+//
+//  Created by Compy on 12/6/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <chrono>
+#include <cstring>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+#include "Node.hpp"
+#include "Scenario.hpp"
+#include "SimulatedFriendTransport.hpp"
+#include "SimulatedNetwork.hpp"
+
+struct TransferState {
+    Node* sender;
+    Node* receiver;
+    uint64_t fileSize;
+    uint64_t received;
+    uint64_t corrupted;
+    uint32_t filesDone;
+    std::vector<uint64_t> finished; /* completion time of every file we receive, by pipe */
+    std::vector<uint8_t> chunk;
+};
+
+/* Content of every file is a function of its position so the receiver can check it. */
+static uint8_t patternByte(uint32_t fileNumber, uint64_t position)
+{
+    uint64_t x = (position + 1) * 0x9E3779B97F4A7C15ULL + fileNumber;
+    return (uint8_t)(x >> 56);
+}
+
+static void onChunkRequest(Node* node, uint32_t friendNumber, uint32_t fileNumber, uint64_t position, size_t length, void* userData)
+{
+    TransferState *state = (TransferState *)userData;
+
+    if (length == 0)
+        return;
+
+    state->chunk.resize(length);
+
+    for (size_t i = 0; i < length; ++i)
+        state->chunk[i] = patternByte(fileNumber, position + i);
+
+    node->fileSendChunk(friendNumber, fileNumber, position, state->chunk.data(), length);
+}
+
+static void onFileReceive(Node* node, uint32_t friendNumber, uint32_t fileNumber, uint32_t fileKind, uint64_t fileSize,
+                          const uint8_t *filename, size_t filenameLength, void* userData)
+{
+    node->fileControl(friendNumber, fileNumber, FILE_CONTROL_RESUME);
+}
+
+static void onChunkReceive(Node* node, uint32_t friendNumber, uint32_t fileNumber, uint64_t position, const uint8_t *data,
+                           size_t length, void* userData)
+{
+    TransferState *state = (TransferState *)userData;
+    uint32_t pipe = (fileNumber >> 16) - 1;
+
+    if (length == 0) {
+        state->finished[pipe] = NetworkService::getCurrentTimeMonotonic();
+        ++state->filesDone;
+        return;
+    }
+
+    /* The sender numbers the same file pipe - 1. */
+    for (size_t i = 0; i < length; ++i) {
+        if (data[i] != patternByte(pipe, position + i)) {
+            ++state->corrupted;
+            break;
+        }
+    }
+
+    state->received += length;
+}
+
+/* Write the content of file fileNumber to a temporary file.
+ *
+ * return the path, empty on failure.
+ */
+static std::string writeFile(uint32_t fileNumber, uint64_t size)
+{
+    char path[] = "/tmp/peerjet-sim-XXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd == -1)
+        return "";
+
+    std::vector<uint8_t> buffer(64 * 1024);
+
+    for (uint64_t position = 0; position < size; ) {
+        size_t length = size - position < buffer.size() ? (size_t)(size - position) : buffer.size();
+
+        for (size_t i = 0; i < length; ++i)
+            buffer[i] = patternByte(fileNumber, position + i);
+
+        if (write(fd, buffer.data(), length) != (ssize_t)length) {
+            close(fd);
+            unlink(path);
+            return "";
+        }
+
+        position += length;
+    }
+
+    close(fd);
+    return path;
+}
+
+/* Two friends, one sending options->files files to the other over the bottleneck link. */
+int runTransferScenario(const SimulatorOptions* options)
+{
+    SimulatedNetwork network(options->link, options->seed);
+    network.install();
+
+    NodeConfiguration config;
+    memset(&config, 0, sizeof(config));
+    config.udpEnabled = true;
+
+    IP_Port senderAddress, receiverAddress;
+    NetworkingCore *senderNet = network.addEndpoint(&senderAddress);
+    NetworkingCore *receiverNet = network.addEndpoint(&receiverAddress);
+
+    if (!senderNet || !receiverNet) {
+        fprintf(stderr, "Failed to create endpoints\n");
+        return 1;
+    }
+
+    TransferState state;
+    state.sender = new Node(&config, senderNet);
+    state.receiver = new Node(&config, receiverNet);
+    state.fileSize = options->fileSize;
+    state.received = 0;
+    state.corrupted = 0;
+    state.filesDone = 0;
+    state.finished.assign(MAX_CONCURRENT_FILE_PIPES, 0);
+
+    SimulatedFriendTransport *senderTransport = new SimulatedFriendTransport(&network, state.sender, senderAddress);
+    SimulatedFriendTransport *receiverTransport = new SimulatedFriendTransport(&network, state.receiver, receiverAddress);
+
+    if (!SimulatedFriendTransport::connect(senderTransport, receiverTransport)) {
+        fprintf(stderr, "Failed to connect the nodes\n");
+        return 1;
+    }
+
+    /* Files are offered once the session is up, its handshake isn't part of the transfer. */
+    const uint64_t connecting = network.now();
+
+    while (!(senderTransport->isOnline(0) && receiverTransport->isOnline(0)) &&
+           network.now() - connecting < options->duration) {
+        network.advance(options->step);
+        state.sender->tick();
+        state.receiver->tick();
+    }
+
+    if (!(senderTransport->isOnline(0) && receiverTransport->isOnline(0))) {
+        fprintf(stderr, "The session between the nodes didn't come up\n");
+        return 1;
+    }
+
+    state.sender->setUserData(&state);
+    state.sender->setFileChunkRequestCallback(&onChunkRequest);
+    state.receiver->setUserData(&state);
+    state.receiver->setFileReceiveCallback(&onFileReceive);
+    state.receiver->setFileReceiveChunkCallback(&onChunkReceive);
+
+    const uint64_t start = network.now();
+
+    for (uint32_t i = 0; i < options->files; ++i) {
+        uint8_t fileId[FILE_ID_LENGTH];
+        memset(fileId, (int)i, sizeof(fileId));
+        char filename[32];
+        int filenameLength = snprintf(filename, sizeof(filename), "file-%u.bin", i);
+
+        int32_t fileNumber;
+
+        if (options->fromFile) {
+            std::string path = writeFile(i, options->fileSize);
+            fileNumber = path.empty() ? -1 : state.sender->fileSendPath(0, 0, path.c_str(), fileId, (const uint8_t *)filename,
+                                                                         filenameLength);
+
+            /* The library keeps its descriptor. */
+            if (!path.empty())
+                unlink(path.c_str());
+        } else {
+            fileNumber = state.sender->fileSend(0, 0, options->fileSize, fileId, (const uint8_t *)filename, filenameLength);
+        }
+
+        if (fileNumber != (int32_t)i) {
+            fprintf(stderr, "Failed to send file %u\n", i);
+            return 1;
+        }
+    }
+
+    std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+
+    while (state.filesDone < options->files && network.now() - start < options->duration) {
+        network.advance(options->step);
+        state.sender->tick();
+        state.receiver->tick();
+    }
+
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    const SimulatorStats& stats = network.getStats();
+    uint64_t elapsed = network.now() - start;
+    double goodput = elapsed ? state.received * 8.0 / elapsed : 0; /* kbit/s */
+
+    printf("link:                  latency %ums jitter %ums loss %.3f reorder %.3f bandwidth %u kbit/s queue %u\n",
+           options->link.latency, options->link.jitter, options->link.loss, options->link.reorder,
+           options->link.bandwidth, options->link.queue);
+    printf("files:                 %u x %llu bytes, %u complete, %llu corrupted chunks\n", options->files,
+           (unsigned long long)options->fileSize, state.filesDone, (unsigned long long)state.corrupted);
+    printf("virtual time:          %llu ms in %.3f s wall\n", (unsigned long long)elapsed, wall);
+    printf("datagrams:             %llu sent, %llu delivered, %llu dropped (%llu by the queue)\n",
+           (unsigned long long)stats.sent, (unsigned long long)stats.delivered, (unsigned long long)stats.dropped,
+           (unsigned long long)stats.queueDrops);
+
+    if (options->link.bandwidth > 0) {
+        printf("goodput:               %.0f kbit/s, %.1f%% of the link\n", goodput,
+               goodput * 100.0 / options->link.bandwidth);
+    } else {
+        printf("goodput:               %.0f kbit/s\n", goodput);
+    }
+
+    for (uint32_t i = 0; i < options->files; ++i) {
+        if (state.finished[i]) {
+            printf("file %u:                %llu ms\n", i, (unsigned long long)(state.finished[i] - start));
+        } else {
+            printf("file %u:                not finished\n", i);
+        }
+    }
+
+    delete senderTransport;
+    delete receiverTransport;
+    delete state.sender;
+    delete state.receiver;
+    network.uninstall();
+    return state.filesDone == options->files && state.corrupted == 0 ? 0 : 1;
+}
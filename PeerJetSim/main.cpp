@@ -0,0 +1,173 @@
+//
+//  main.cpp
+//  PeerJetSim
+//
+//  Created by Compy on 12/2/18.
+//  Copyright © 2018 peerjet. All rights reserved.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "Config.h"
+#include "Scenario.hpp"
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--scenario gossip|transfer|lan|nat|handshake|session|host] [--nodes N] [--latency ms] [--jitter ms] [--loss p]\n"
+            "          [--reorder p] [--bandwidth kbit/s] [--queue datagrams] [--step ms] [--duration ms]\n"
+            "          [--size bytes] [--files N] [--source callback|file] [--seed n]\n", name);
+}
+
+static bool parseOptions(int argc, const char * argv[], SimulatorOptions* options)
+{
+    for (int i = 1; i < argc; ++i) {
+        if (i + 1 >= argc)
+            return false;
+
+        const char *value = argv[i + 1];
+
+        if (strcmp(argv[i], "--scenario") == 0) {
+            /* Picked before the other options. */
+        } else if (strcmp(argv[i], "--nodes") == 0) {
+            options->nodes = (uint32_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--latency") == 0) {
+            options->link.latency = (uint32_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--jitter") == 0) {
+            options->link.jitter = (uint32_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--loss") == 0) {
+            options->link.loss = strtod(value, NULL);
+        } else if (strcmp(argv[i], "--reorder") == 0) {
+            options->link.reorder = strtod(value, NULL);
+        } else if (strcmp(argv[i], "--bandwidth") == 0) {
+            options->link.bandwidth = (uint32_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--queue") == 0) {
+            options->link.queue = (uint32_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--step") == 0) {
+            options->step = (uint32_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--duration") == 0) {
+            options->duration = strtoull(value, NULL, 10);
+        } else if (strcmp(argv[i], "--size") == 0) {
+            options->fileSize = strtoull(value, NULL, 10);
+        } else if (strcmp(argv[i], "--files") == 0) {
+            options->files = (uint32_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--source") == 0) {
+            if (strcmp(value, "file") == 0) {
+                options->fromFile = true;
+            } else if (strcmp(value, "callback") == 0) {
+                options->fromFile = false;
+            } else {
+                return false;
+            }
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            options->seed = strtoull(value, NULL, 10);
+        } else {
+            return false;
+        }
+
+        ++i;
+    }
+
+    return options->nodes >= 2 && options->step > 0 && options->files > 0 && options->files <= MAX_CONCURRENT_FILE_PIPES;
+}
+
+int main(int argc, const char * argv[]) {
+    const char *scenario = "gossip";
+
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (strcmp(argv[i], "--scenario") == 0)
+            scenario = argv[i + 1];
+    }
+
+    SimulatorOptions options;
+    memset(&options, 0, sizeof(options));
+    options.seed = 1;
+    options.files = 1;
+
+    if (strcmp(scenario, "gossip") == 0) {
+        options.nodes = 2000;
+        options.step = 5;
+        options.duration = 60000;
+        options.link.latency = 20;
+        options.link.jitter = 5;
+        options.link.loss = 0.01;
+        options.link.reorder = 0.01;
+    } else if (strcmp(scenario, "transfer") == 0) {
+        /* 50 ms round trip over a 10 Mbit/s bottleneck. */
+        options.nodes = 2;
+        options.step = 1;
+        options.duration = 120000;
+        options.link.latency = 25;
+        options.link.bandwidth = 10000;
+        options.link.queue = 128;
+        options.fileSize = 16 * 1024 * 1024;
+    } else if (strcmp(scenario, "lan") == 0) {
+        /* One switched segment, long enough for the announces to back off. */
+        options.nodes = 200;
+        options.step = 5;
+        options.duration = 300000;
+        options.link.latency = 1;
+        options.link.jitter = 1;
+    } else if (strcmp(scenario, "nat") == 0) {
+        /* Ten pairs for every combination of NATs. */
+        options.nodes = 2 * 10 * 36;
+        options.step = 10;
+        options.duration = 60000;
+        options.link.latency = 20;
+        options.link.jitter = 5;
+        options.link.loss = 0.01;
+    } else if (strcmp(scenario, "handshake") == 0) {
+        /* A public node and its friends, under a handshake flood. */
+        options.nodes = 200;
+        options.step = 10;
+        options.duration = 30000;
+        options.link.latency = 20;
+        options.link.jitter = 5;
+        options.link.loss = 0.01;
+    } else if (strcmp(scenario, "session") == 0) {
+        /* Ten thousand sessions to one hub, one of them bulk over a 10 Mbit/s uplink. */
+        options.nodes = 10000;
+        options.step = 5;
+        options.duration = 20000;
+        options.link.latency = 25;
+        options.link.loss = 0.001;
+        options.link.bandwidth = 10000;
+        options.link.queue = 128;
+    } else if (strcmp(scenario, "host") == 0) {
+        /* A thousand identities behind one socket. */
+        options.nodes = 1000;
+        options.step = 10;
+        options.duration = 20000;
+        options.link.latency = 20;
+        options.link.jitter = 5;
+        options.link.loss = 0.01;
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!parseOptions(argc, argv, &options)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (strcmp(scenario, "transfer") == 0)
+        return runTransferScenario(&options);
+
+    if (strcmp(scenario, "lan") == 0)
+        return runLanScenario(&options);
+
+    if (strcmp(scenario, "nat") == 0)
+        return runNatScenario(&options);
+
+    if (strcmp(scenario, "handshake") == 0)
+        return runHandshakeScenario(&options);
+
+    if (strcmp(scenario, "session") == 0)
+        return runSessionScenario(&options);
+
+    if (strcmp(scenario, "host") == 0)
+        return runHostScenario(&options);
+
+    return runGossipScenario(&options);
+}
@@ -0,0 +1,31 @@
+# Locate libsodium.
+#
+# Defines Sodium_FOUND, Sodium_INCLUDE_DIR, Sodium_LIBRARY and the imported
+# target Sodium::Sodium. Set Sodium_ROOT to point at a non standard prefix.
+
+find_package(PkgConfig QUIET)
+if(PKG_CONFIG_FOUND)
+    pkg_check_modules(PC_SODIUM QUIET libsodium)
+endif()
+
+find_path(Sodium_INCLUDE_DIR
+    NAMES sodium.h
+    HINTS ${PC_SODIUM_INCLUDEDIR} ${PC_SODIUM_INCLUDE_DIRS})
+
+find_library(Sodium_LIBRARY
+    NAMES sodium libsodium
+    HINTS ${PC_SODIUM_LIBDIR} ${PC_SODIUM_LIBRARY_DIRS})
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(Sodium
+    REQUIRED_VARS Sodium_LIBRARY Sodium_INCLUDE_DIR
+    VERSION_VAR PC_SODIUM_VERSION)
+
+if(Sodium_FOUND AND NOT TARGET Sodium::Sodium)
+    add_library(Sodium::Sodium UNKNOWN IMPORTED)
+    set_target_properties(Sodium::Sodium PROPERTIES
+        IMPORTED_LOCATION "${Sodium_LIBRARY}"
+        INTERFACE_INCLUDE_DIRECTORIES "${Sodium_INCLUDE_DIR}")
+endif()
+
+mark_as_advanced(Sodium_INCLUDE_DIR Sodium_LIBRARY)
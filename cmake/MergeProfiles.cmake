@@ -0,0 +1,17 @@
+# Merge the raw Clang profiles written by a PEERJET_PGO=GENERATE build into
+# peerjet.profdata. Invoked by the pgo-train target with LLVM_PROFDATA and
+# PGO_DIR set.
+
+file(GLOB RAW_PROFILES "${PGO_DIR}/*.profraw")
+
+if(NOT RAW_PROFILES)
+    message(FATAL_ERROR "No raw profiles found in ${PGO_DIR}")
+endif()
+
+execute_process(
+    COMMAND ${LLVM_PROFDATA} merge -output=${PGO_DIR}/peerjet.profdata ${RAW_PROFILES}
+    RESULT_VARIABLE MERGE_RESULT)
+
+if(NOT MERGE_RESULT EQUAL 0)
+    message(FATAL_ERROR "llvm-profdata merge failed")
+endif()
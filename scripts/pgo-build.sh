@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# Profile guided build of PeerJet:
+#   1. instrumented build (PEERJET_PGO=GENERATE)
+#   2. training run over the benchmarks and the simulator (pgo-train target)
+#   3. optimized build from the collected profiles (PEERJET_PGO=USE)
+# and finally the packet path benchmarks of a plain release build against
+# the PGO build.
+#
+# usage: scripts/pgo-build.sh [build directory] [extra cmake arguments...]
+#
+# Both PGO stages use the same build directory, GCC looks profiles up by
+# object file path. PEERJET_PGO_FILTER selects the compared benchmarks.
+# Configures from inside the build directories, cmake -S/-B needs CMake 3.13.
+
+set -e
+
+SOURCE_DIR=$(cd "$(dirname "$0")/.." && pwd)
+BUILD_DIR=${1:-$SOURCE_DIR/build-pgo}
+[ $# -gt 0 ] && shift
+mkdir -p "$BUILD_DIR"
+BUILD_DIR=$(cd "$BUILD_DIR" && pwd)
+PROFILE_DIR=$BUILD_DIR/profiles
+FILTER=${PEERJET_PGO_FILTER:-Packet}
+
+rm -rf "$PROFILE_DIR"
+
+# configure <build directory> [cmake arguments...]
+configure() {
+    mkdir -p "$1"
+    dir=$1
+    shift
+    (cd "$dir" && cmake "$SOURCE_DIR" "$@")
+}
+
+echo "== Stage 1: instrumented build"
+configure "$BUILD_DIR/pgo" -DCMAKE_BUILD_TYPE=Release \
+    -DPEERJET_PGO=GENERATE -DPEERJET_PGO_DIR="$PROFILE_DIR" "$@"
+cmake --build "$BUILD_DIR/pgo" --clean-first
+
+echo "== Stage 2: training run"
+cmake --build "$BUILD_DIR/pgo" --target pgo-train
+
+echo "== Stage 3: optimized build"
+configure "$BUILD_DIR/pgo" -DPEERJET_PGO=USE "$@"
+cmake --build "$BUILD_DIR/pgo" --clean-first
+
+echo "== Baseline build"
+configure "$BUILD_DIR/baseline" -DCMAKE_BUILD_TYPE=Release -DPEERJET_PGO=OFF "$@"
+cmake --build "$BUILD_DIR/baseline" --target peerjet_bench
+
+echo "== Baseline"
+"$BUILD_DIR/baseline/peerjet_bench" --filter "$FILTER"
+echo "== PGO"
+"$BUILD_DIR/pgo/peerjet_bench" --filter "$FILTER"